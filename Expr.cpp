@@ -10,6 +10,12 @@
 
 #include "Expr.hpp"
 #include "Val.hpp"
+#include "resolve.hpp"
+#include "optimize.hpp"
+#include "memo.hpp"
+#include "profile.hpp"
+#include "printer.hpp"
+#include "governor.hpp"
 
 //====================== Expr ======================//
 
@@ -23,6 +29,48 @@ string Expr::to_string(){
     return st.str();
 }
 
+/**
+ * \brief Interprets the expression.
+ * \param env The environment for free variables; the empty environment if nullptr.
+ * \return The value of the expression.
+ */
+PTR(Val) Expr::interp(PTR(Env) env){
+    if(env == nullptr) {
+        env = Env::empty;
+    }
+    return eval(env).to_val();
+}
+
+/**
+ * \brief Evaluates the expression in constant native stack for tail positions.
+ *
+ * Runs step() and, as long as the node hands back a subexpression in tail position
+ * through `next` (an if branch, a let body, the body of a called function), keeps
+ * going with that subexpression in the same loop instead of recursing. Every step
+ * counts against the Governor, if one is installed. With a Profiler or a Memo
+ * installed, its own copy of this loop runs instead.
+ * \param env The environment to evaluate in.
+ * \return The value of the expression.
+ */
+Value Expr::eval(PTR(Env) env){
+    if (Profiler::current != nullptr) {
+        return Profiler::current->eval(this, env);
+    }
+    if (Memo::current != nullptr) {
+        return Memo::current->eval(this, env);
+    }
+    PTR(Expr) next = nullptr;
+    governor_tick();
+    Value result = step(env, next);
+    while (next != nullptr) {
+        PTR(Expr) current = nullptr;
+        std::swap(current, next);
+        governor_tick();
+        result = current->step(env, next);
+    }
+    return result;
+}
+
 /**
  * \brief Pretty prints the expression at a given precedence.
  * \param ostream The output stream to print to.
@@ -34,11 +82,19 @@ void Expr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent,
 
 /**
  * \brief Pretty prints the expression.
+ *
+ * Goes through a PrintBuf, so indentation is computed the same way on any stream and
+ * from the start of this expression's output.
  * \param ostream The output stream.
  */
 void Expr::pretty_print(ostream &ostream){
+    PrintBuf buffer(ostream.rdbuf());
+    std::ostream counted(&buffer);
     streampos strmpos = 0;
-    pretty_print_at(ostream, prec_none, false, strmpos);
+    pretty_print_at(counted, prec_none, false, strmpos);
+    if (buffer.pubsync() < 0) {
+        ostream.setstate(ios::badbit);
+    }
 }
 
 /**
@@ -51,6 +107,136 @@ string Expr::to_pretty_string(){
     return st.str();
 }
 
+//======================  Operator chains  ======================//
+
+void copy_marks(AddExpr *from, AddExpr *to){
+    to->typed = from->typed;
+}
+
+void copy_marks(MultExpr *from, MultExpr *to){
+    to->typed = from->typed;
+}
+
+void copy_marks(EqExpr *from, EqExpr *to){
+}
+
+/**
+ * \brief Compares a chain of T with e one link at a time.
+ */
+template <class T> static bool chain_equals(T *node, PTR(Expr) e){
+    while (true) {
+        if (e == nullptr || e->hash != node->hash) {
+            return false;
+        }
+        if (&*e == node) {
+            return true;
+        }
+        if (e->kind != node->kind) {
+            return false;
+        }
+        T *other = static_cast<T *>(&*e);
+        if (!node->lhs->equals(other->lhs)) {
+            return false;
+        }
+        if (node->rhs->kind != node->kind) {
+            return node->rhs->equals(other->rhs);
+        }
+        node = static_cast<T *>(&*node->rhs);
+        e = other->rhs;
+    }
+}
+
+/**
+ * \brief Resolves the operands of a chain of T in source order.
+ */
+template <class T> static vector<PTR(Expr)> resolve_operands(T *first, ResolveScope *scope){
+    vector<T *> chain = rhs_chain(first);
+    vector<PTR(Expr)> operands;
+    operands.reserve(chain.size() + 1);
+    for (T *node : chain) {
+        operands.push_back(node->lhs->resolve(scope));
+    }
+    operands.push_back(chain.back()->rhs->resolve(scope));
+    return operands;
+}
+
+/**
+ * \brief Gives a rebuilt + or * what typecheck() proved of the node it replaces; an ==
+ * has nothing to keep.
+ */
+static void keep_typed(AddExpr *from, Expr *to){
+    static_cast<AddExpr *>(to)->typed = from->typed;
+}
+
+static void keep_typed(MultExpr *from, Expr *to){
+    static_cast<MultExpr *>(to)->typed = from->typed;
+}
+
+static void keep_typed(EqExpr *from, Expr *to){}
+
+/**
+ * \brief Builds the chain of T shaped like the one at `first` over new operands.
+ */
+template <class T> static PTR(Expr) rebuild_chain(T *first, const vector<PTR(Expr)> &operands){
+    vector<T *> chain = rhs_chain(first);
+    PTR(Expr) result = operands.back();
+    for (size_t i = chain.size(); i-- > 0;) {
+        PTR(Expr) node = located(NEW(T)(operands[i], result), chain[i]->position);
+        keep_typed(chain[i], &*node);
+        result = node;
+    }
+    return result;
+}
+
+/**
+ * \brief Optimizes the operands of a chain of T in source order and combines them
+ * from the right with `fold`, which stands for the optimize() of one node.
+ */
+template <class T> static PTR(Expr) optimize_chain(T *first, OptimizeScope *scope, PTR(Expr) (*fold)(PTR(Expr), PTR(Expr), int)){
+    vector<T *> chain = rhs_chain(first);
+    vector<PTR(Expr)> operands;
+    operands.reserve(chain.size());
+    for (T *node : chain) {
+        operands.push_back(node->lhs->optimize(scope));
+    }
+    PTR(Expr) result = chain.back()->rhs->optimize(scope);
+    for (size_t i = chain.size(); i-- > 0;) {
+        result = fold(operands[i], result, chain[i]->position);
+    }
+    return result;
+}
+
+/**
+ * \brief Prints a chain of T as (a op (b op c)) without recursing on rhs.
+ */
+template <class T> static void print_chain(T *first, ostream &ostream, const char *op){
+    vector<T *> chain = rhs_chain(first);
+    for (T *node : chain) {
+        ostream << "(";
+        node->lhs->print(ostream);
+        ostream << op;
+    }
+    chain.back()->rhs->print(ostream);
+    for (size_t i = 0; i < chain.size(); i++) {
+        ostream << ")";
+    }
+}
+
+/**
+ * \brief Called from the destructor of a T: frees the rest of a chain of T in a loop.
+ * Otherwise releasing a long chain would run one nested destructor per node.
+ */
+template <class T> static void unlink_chain(PTR(Expr) &rhs, expr_kind_t kind){
+#if USE_SHARED_POINTERS
+    PTR(Expr) rest = std::move(rhs);
+    while (rest.use_count() == 1 && rest->kind == kind) {
+        T *node = static_cast<T *>(rest.get());
+        PTR(Expr) next = std::move(node->rhs);
+        rest = std::move(next);
+    }
+#endif
+}
+
 //======================  AddExpr  ======================//
 
 /**
@@ -59,31 +245,66 @@ string Expr::to_pretty_string(){
  * \param rhs Right-hand side expression.
  */
 AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
+    this->kind = expr_add;
     this->lhs = lhs;
     this->rhs = rhs;
+    this->typed = false;
+    this->hash = hash_mix(hash_mix(1, lhs->hash), rhs->hash);
+}
+
+AddExpr::~AddExpr(){
+    unlink_chain<AddExpr>(rhs, kind);
 }
+
 /**
  * \brief Checks equality of this expression with another expression.
  * \param e The expression to compare with.
  * \return True if equal, false otherwise.
  */
 bool AddExpr::equals(PTR(Expr) e) {
-    PTR(AddExpr) addPtr = CAST(AddExpr)(e);
-    if (addPtr == nullptr) {
+    if (e == nullptr || e->hash != hash) {
         return false;
     }
-    return this->lhs->equals(addPtr->lhs) && this->rhs->equals(addPtr->rhs);
+    if (&*e == this) {
+        return true;
+    }
+    if (e->kind == expr_sum) {
+        return e->equals(THIS);
+    }
+    return chain_equals(this, e);
+}
+
+/**
+ * \brief lhs + rhs, without checking the operands when typecheck() proved them numbers.
+ */
+static inline Value add_values(bool typed, const Value &lhs, const Value &rhs){
+    if (typed) {
+        return Value::number((unsigned)lhs.num + (unsigned)rhs.num);
+    }
+    return lhs.add_to(rhs);
 }
 
 /**
- * \brief Interprets the addition of expressions.
+ * \brief Interprets the addition of expressions. A chain a + (b + ...) is evaluated
+ * in one loop: operands left to right, then added from the right.
  * \return The result of the addition.
  */
-PTR(Val) AddExpr::interp(PTR(Env) env){
-    if(env == nullptr) {
-        env = Env::empty;
+Value AddExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    if (rhs->kind != expr_add) {
+        Value lhs_val = this->lhs->eval(env);
+        return add_values(typed, lhs_val, this->rhs->eval(env));
+    }
+    vector<AddExpr *> chain = rhs_chain(this);
+    vector<Value> operands;
+    operands.reserve(chain.size());
+    for (AddExpr *node : chain) {
+        operands.push_back(node->lhs->eval(env));
     }
-    return this->lhs->interp(env)->add_to(this->rhs->interp(env));
+    Value result = chain.back()->rhs->eval(env);
+    for (size_t i = operands.size(); i-- > 0;) {
+        result = add_values(chain[i]->typed, operands[i], result);
+    }
+    return result;
 }
 
 /**
@@ -96,16 +317,45 @@ PTR(Val) AddExpr::interp(PTR(Env) env){
 //    return NEW(AddExpr) (this->lhs->subst(str, e), this->rhs->subst(str, e));
 //}
 
+/**
+ * \brief Resolves variables in both operands.
+ * \param scope The scope being resolved.
+ * \return The resolved expression.
+ */
+PTR(Expr) AddExpr::resolve(ResolveScope *scope){
+    vector<PTR(Expr)> operands = resolve_operands(this, scope);
+    if (operands.size() >= nary_min_operands) {
+        return located(NEW(SumExpr)(operands), position);
+    }
+    return rebuild_chain(this, operands);
+}
+
+static PTR(Expr) fold_add(PTR(Expr) new_lhs, PTR(Expr) new_rhs, int position){
+    if (is_constant(new_lhs) && is_constant(new_rhs)) {
+        Value lhs_val = new_lhs->eval(Env::empty);
+        Value rhs_val = new_rhs->eval(Env::empty);
+        if (lhs_val.is_num() && rhs_val.is_num()) {
+            return located(constant_expr(lhs_val.add_to(rhs_val)), position);
+        }
+    }
+    return located(NEW(AddExpr)(new_lhs, new_rhs), position);
+}
+
+/**
+ * \brief Folds the sum when both operands optimize to numbers.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) AddExpr::optimize(OptimizeScope *scope){
+    return optimize_chain(this, scope, fold_add);
+}
+
 /**
  * \brief Prints the addition expression.
  * \param ostream The output stream.
  */
 void AddExpr::print(ostream &ostream){
-    ostream << "(";
-    lhs->print(ostream);
-    ostream << "+";
-    rhs->print(ostream);
-    ostream << ")";
+    print_chain(this, ostream, "+");
 }
 
 /**
@@ -117,11 +367,13 @@ void AddExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_pare
     if(prec >= prec_add){
         ostream << "(";
     }
-    lhs->pretty_print_at(ostream, prec_add, true, strmpos);
-    
-    ostream << " + ";
-    
-    rhs->pretty_print_at(ostream, prec_none, let_parent, strmpos);
+    // the rhs of + is printed at prec_none, so a chain of + needs no inner parentheses
+    vector<AddExpr *> chain = rhs_chain(this);
+    for (AddExpr *node : chain) {
+        node->lhs->pretty_print_at(ostream, prec_add, true, strmpos);
+        ostream << " + ";
+    }
+    chain.back()->rhs->pretty_print_at(ostream, prec_none, let_parent, strmpos);
     
     if(prec >= prec_add){
         ostream << ")";
@@ -136,8 +388,15 @@ void AddExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_pare
  * \param rhs Right-hand side expression.
  */
 MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs){
+  this->kind = expr_mult;
   this->lhs = lhs;
   this->rhs = rhs;
+  this->typed = false;
+  this->hash = hash_mix(hash_mix(2, lhs->hash), rhs->hash);
+}
+
+MultExpr::~MultExpr(){
+    unlink_chain<MultExpr>(rhs, kind);
 }
 
 /**
@@ -146,22 +405,46 @@ MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs){
  * \return True if the expressions are equal, false otherwise.
  */
 bool MultExpr:: equals (PTR(Expr) e) {
-PTR(MultExpr) multPtr = CAST(MultExpr)(e);
-if(multPtr==nullptr){
-  return false;
+if (e == nullptr || e->hash != hash) {
+    return false;
 }
-  return this->lhs->equals(multPtr->lhs) && this->rhs->equals(multPtr->rhs);
+if (&*e == this) {
+    return true;
+}
+if (e->kind == expr_product) {
+    return e->equals(THIS);
+}
+  return chain_equals(this, e);
+}
+
+static inline Value mult_values(bool typed, const Value &lhs, const Value &rhs){
+    if (typed) {
+        return Value::number((unsigned)lhs.num * (unsigned)rhs.num);
+    }
+    return lhs.mult_with(rhs);
 }
 
 /**
- * \brief Evaluates the multiplication of the two expressions.
+ * \brief Evaluates the multiplication of the two expressions, looping over a chain
+ * a * (b * ...) like AddExpr::step().
  * \return The integer result of the multiplication.
  */
-PTR(Val) MultExpr::interp(PTR(Env) env){
-    if(env == nullptr) {
-        env = Env::empty;
+Value MultExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    if (rhs->kind != expr_mult) {
+        Value lhs_val = this->lhs->eval(env);
+        return mult_values(typed, lhs_val, this->rhs->eval(env));
     }
-    return this->lhs->interp(env)->mult_with(this->rhs->interp(env));
+    vector<MultExpr *> chain = rhs_chain(this);
+    vector<Value> operands;
+    operands.reserve(chain.size());
+    for (MultExpr *node : chain) {
+        operands.push_back(node->lhs->eval(env));
+    }
+    Value result = chain.back()->rhs->eval(env);
+    for (size_t i = operands.size(); i-- > 0;) {
+        result = mult_values(chain[i]->typed, operands[i], result);
+    }
+    return result;
 }
 
 /**
@@ -174,16 +457,45 @@ PTR(Val) MultExpr::interp(PTR(Env) env){
 //    return NEW(MultExpr) (this->lhs->subst(str, e), this->rhs->subst(str, e));
 //}
 
+/**
+ * \brief Resolves variables in both operands.
+ * \param scope The scope being resolved.
+ * \return The resolved expression.
+ */
+PTR(Expr) MultExpr::resolve(ResolveScope *scope){
+    vector<PTR(Expr)> operands = resolve_operands(this, scope);
+    if (operands.size() >= nary_min_operands) {
+        return located(NEW(ProductExpr)(operands), position);
+    }
+    return rebuild_chain(this, operands);
+}
+
+static PTR(Expr) fold_mult(PTR(Expr) new_lhs, PTR(Expr) new_rhs, int position){
+    if (is_constant(new_lhs) && is_constant(new_rhs)) {
+        Value lhs_val = new_lhs->eval(Env::empty);
+        Value rhs_val = new_rhs->eval(Env::empty);
+        if (lhs_val.is_num() && rhs_val.is_num()) {
+            return located(constant_expr(lhs_val.mult_with(rhs_val)), position);
+        }
+    }
+    return located(NEW(MultExpr)(new_lhs, new_rhs), position);
+}
+
+/**
+ * \brief Folds the product when both operands optimize to numbers.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) MultExpr::optimize(OptimizeScope *scope){
+    return optimize_chain(this, scope, fold_mult);
+}
+
 /**
  * \brief Prints the expression to the provided output stream.
  * \param ostream The output stream.
  */
 void MultExpr::print (ostream &ostream){
-    ostream << "(";
-    this->lhs->print(ostream);
-    ostream << "*";
-    this->rhs->print(ostream);
-    ostream << ")";
+    print_chain(this, ostream, "*");
 }
 
 /**
@@ -198,11 +510,14 @@ void MultExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_par
         parent = false;
     }
     
-    this->lhs->pretty_print_at(ostream, prec_mult, true, strmpos);
-    
-    ostream << " * ";
-    
-    this->rhs->pretty_print_at(ostream, prec_add, parent, strmpos);
+    // the rhs of * is printed at prec_add with the same let_parent, so a chain of *
+    // needs no inner parentheses either
+    vector<MultExpr *> chain = rhs_chain(this);
+    for (MultExpr *node : chain) {
+        node->lhs->pretty_print_at(ostream, prec_mult, true, strmpos);
+        ostream << " * ";
+    }
+    chain.back()->rhs->pretty_print_at(ostream, prec_add, parent, strmpos);
     
     if (prec >= prec_mult) {
         ostream << ")";
@@ -216,7 +531,9 @@ void MultExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_par
  * \param rep The numeric value of the expression.
  */
 NumExpr::NumExpr (int rep){
+  this->kind = expr_num;
   this->val = rep;
+  this->hash = hash_mix(3, rep);
 }
 /**
  * \brief Checks if this numeric constant is equal to another expression.
@@ -224,10 +541,16 @@ NumExpr::NumExpr (int rep){
  * \return True if the expressions are equal (i.e., if `e` is also a `Num` with the same value), false otherwise.
  */
 bool NumExpr::equals (PTR(Expr) e) {
-  PTR(NumExpr) numPtr = CAST(NumExpr)(e); // Check if 'e' is a 'Num' object
-  if (numPtr == nullptr) {
-      return false; // 'e' is not a 'Num' object
+  if (e == nullptr || e->hash != hash) {
+      return false;
+  }
+  if (&*e == this) {
+      return true;
   }
+  if (base_kind(e->kind) != expr_num) {
+      return false;
+  }
+  NumExpr *numPtr = static_cast<NumExpr *>(&*e);
   return this->val == numPtr->val;
 }
 
@@ -235,8 +558,8 @@ bool NumExpr::equals (PTR(Expr) e) {
  * \brief Evaluates to its numeric value.
  * \return The value of the numeric constant.
  */
-PTR(Val) NumExpr::interp(PTR(Env) env){
-    return NEW(NumVal)(val) ;
+Value NumExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    return Value::number(val);
 }
 
 /**
@@ -249,6 +572,17 @@ PTR(Val) NumExpr::interp(PTR(Env) env){
 //    return THIS;
 //}
 
+/**
+ * \brief Numbers contain no variables, so resolving returns the expression itself.
+ */
+PTR(Expr) NumExpr::resolve(ResolveScope *scope){
+    return THIS;
+}
+
+PTR(Expr) NumExpr::optimize(OptimizeScope *scope){
+    return THIS;
+}
+
 /**
  * \brief Prints the numeric value to the specified output stream.
  * \param ostream The output stream where the numeric value will be printed.
@@ -264,7 +598,9 @@ void NumExpr::print (ostream &ostream){
  * \param val The name of the variable.
  */
 VarExpr::VarExpr (string val){
+    this->kind = expr_var;
   this->val = val;
+  this->hash = hash_mix(4, std::hash<string>()(val));
 }
 
 /**
@@ -273,10 +609,16 @@ VarExpr::VarExpr (string val){
  * \return True if `e` is a `Var` object with the same variable name, false otherwise.
  */
 bool VarExpr::equals (PTR(Expr) e) {
-  PTR(VarExpr) varPtr = CAST(VarExpr)(e); // Check if 'e' is a 'VarExpr' object
-  if (varPtr == nullptr) {
-      return false; // 'e' is not a 'VarExpr' object
+  if (e == nullptr || e->hash != hash) {
+      return false;
+  }
+  if (&*e == this) {
+      return true;
   }
+  if (base_kind(e->kind) != expr_var) {
+      return false;
+  }
+  VarExpr *varPtr = static_cast<VarExpr *>(&*e);
   return this->val == varPtr->val;
 }
 
@@ -284,7 +626,7 @@ bool VarExpr::equals (PTR(Expr) e) {
  * \brief Throws an exception since variables cannot be directly interpreted.
  * \throws std::runtime_error when attempted to interpret a variable.
  */
-PTR(Val) VarExpr::interp(PTR(Env) env){
+Value VarExpr::step(PTR(Env) &env, PTR(Expr) &next){
     return env->lookup(this->val);
 }
 
@@ -303,6 +645,30 @@ PTR(Val) VarExpr::interp(PTR(Env) env){
 //    }
 //}
 
+/**
+ * \brief Resolves the variable to the slot of its innermost binding.
+ * \param scope The scope being resolved.
+ * \return A SlotVarExpr, or this expression when the variable is free.
+ */
+PTR(Expr) VarExpr::resolve(ResolveScope *scope){
+    int depth, slot;
+    if(scope->find(val, depth, slot)){
+        return located(NEW(SlotVarExpr)(val, depth, slot), position);
+    }
+    return THIS;
+}
+
+/**
+ * \brief Replaces the variable with its literal value when the binding has one.
+ */
+PTR(Expr) VarExpr::optimize(OptimizeScope *scope){
+    PTR(Expr) constant = OptimizeScope::find(scope, val);
+    if (constant != nullptr) {
+        return constant;
+    }
+    return THIS;
+}
+
 /**
  * \brief Prints the variable's name to the provided output stream.
  * \param ostream The output stream.
@@ -320,9 +686,11 @@ void VarExpr::print (ostream &ostream){
  * \param body The body of the Let expression where lhs may be used.
  */
 LetExpr::LetExpr(string lhs, PTR(Expr) rhs, PTR(Expr) body){
+    this->kind = expr_let;
     this->lhs = lhs;
     this->rhs = rhs;
     this->body = body;
+    this->hash = hash_mix(hash_mix(hash_mix(5, std::hash<string>()(lhs)), rhs->hash), body->hash);
 }
 
 /**
@@ -331,29 +699,31 @@ LetExpr::LetExpr(string lhs, PTR(Expr) rhs, PTR(Expr) body){
  * \return True if both expressions are Let expressions with equal lhs, rhs, and body; otherwise false.
  */
 bool LetExpr::equals(PTR(Expr) e){
-    PTR(LetExpr) _letPtr = CAST(LetExpr)(e);
-    
-    if(_letPtr==nullptr){
+    if (e == nullptr || e->hash != hash) {
+        return false;
+    }
+    if (&*e == this) {
+        return true;
+    }
+    if (base_kind(e->kind) != expr_let) {
         return false;
     }
+    LetExpr *_letPtr = static_cast<LetExpr *>(&*e);
     return this->lhs==(_letPtr->lhs) && this->rhs->equals(_letPtr->rhs) && this->body->equals(_letPtr->body);
 }
 
 /**
- * \brief Interprets the Let expression by evaluating rhs, substituting it into body, and then evaluating the result.
- * \return The integer result of interpreting the Let expression.
+ * \brief Interprets the Let expression by evaluating rhs, binding it, and continuing with the body in the extended environment.
+ * \return Nothing itself; the body is handed back through `next`.
  */
-PTR(Val) LetExpr::interp(PTR(Env) env){
+Value LetExpr::step(PTR(Env) &env, PTR(Expr) &next){
     
-    if(env == nullptr) {
-        env = Env::empty;
-    }
-    
-    PTR(Val) rhsValue = this->rhs->interp(env);
+    Value rhsValue = this->rhs->eval(env);
     
-    PTR(Env) new_env = NEW(ExtendedEnv)(lhs, rhsValue, env);
+    env = NEW(ExtendedEnv)(lhs, rhsValue, env);
     
-    return body->interp(new_env);
+    next = body;
+    return Value();
 }
 
 /**
@@ -374,12 +744,58 @@ PTR(Val) LetExpr::interp(PTR(Env) env){
 //       }
 //}
 
+/**
+ * \brief Gives the bound variable a fresh slot in the current frame.
+ * \param scope The scope being resolved.
+ * \return The resolved expression.
+ */
+PTR(Expr) LetExpr::resolve(ResolveScope *scope){
+    PTR(Expr) new_rhs = rhs->resolve(scope);
+    int slot = scope->new_slot();
+    scope->bind(lhs, slot);
+    PTR(Expr) new_body = body->resolve(scope);
+    scope->unbind();
+    return located(NEW(SlotLetExpr)(lhs, slot, new_rhs, new_body), position);
+}
+
+/**
+ * \brief Drops a binding whose value is a literal, substituting it into the body.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) LetExpr::optimize(OptimizeScope *scope){
+    PTR(Expr) new_rhs = rhs->optimize(scope);
+    if (is_constant(new_rhs)) {
+        OptimizeScope inner(scope, lhs, new_rhs);
+        return body->optimize(&inner);
+    }
+    OptimizeScope inner(scope, lhs, nullptr);
+    return located(NEW(LetExpr)(lhs, new_rhs, body->optimize(&inner)), position);
+}
+
+/**
+ * \brief Writes `width` spaces in blocks, without building a string of them.
+ */
+static void indent(ostream &ostream, streamoff width){
+    static const string spaces(1024, ' ');
+    const streamoff block = spaces.size();
+    while (width > 0) {
+        streamoff n = width < block ? width : block;
+        ostream.write(spaces.data(), n);
+        width -= n;
+    }
+}
+
 /**
  * \brief Prints the Let expression to the provided output stream in a specific format.
  * \param ostream The output stream to print to.
  */
 void LetExpr::print(ostream &ostream){
-    ostream << "(_let " << lhs << "=" << rhs->to_string() << " _in " << body->to_string() << ")";
+    ostream << "(_let " << lhs << "=";
+    rhs->print(ostream);
+    ostream << " _in ";
+    body->print(ostream);
+    ostream << ")";
 }
 
 /**
@@ -406,7 +822,8 @@ void LetExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_pare
     
     strmpos = ostream.tellp();
     
-    ostream << string(depth, ' ') << "_in  ";
+    indent(ostream, depth);
+    ostream << "_in  ";
    
     body->pretty_print_at(ostream, prec_none, false, strmpos);
 
@@ -418,26 +835,41 @@ void LetExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_pare
 //======================  BoolExpr  ======================//
 
 BoolExpr::BoolExpr(bool b){
+    this->kind = expr_bool;
     this->val = b;
+    this->hash = hash_mix(6, b);
 }
 
 bool BoolExpr::equals (PTR(Expr) e){
-    PTR(BoolExpr) boolPtr = CAST(BoolExpr)(e);
-    
-    if (boolPtr == nullptr) {
+    if (e == nullptr || e->hash != hash) {
+        return false;
+    }
+    if (&*e == this) {
+        return true;
+    }
+    if (base_kind(e->kind) != expr_bool) {
         return false;
     }
+    BoolExpr *boolPtr = static_cast<BoolExpr *>(&*e);
     return this->val == boolPtr->val;
 }
 
-PTR(Val) BoolExpr::interp(PTR(Env) env){
-    return NEW( BoolVal)(val) ;
+Value BoolExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    return Value::boolean(val);
 }
 
 //PTR(Expr) BoolExpr::subst(string str, PTR(Expr) e){
 //    return THIS;
 //}
 
+PTR(Expr) BoolExpr::resolve(ResolveScope *scope){
+    return THIS;
+}
+
+PTR(Expr) BoolExpr::optimize(OptimizeScope *scope){
+    return THIS;
+}
+
 void BoolExpr::print(ostream &ostream){
     if(val){
         ostream << "_true";
@@ -460,37 +892,65 @@ void BoolExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_par
 //======================  IfExpr  ======================//
 
 IfExpr::IfExpr(PTR(Expr) if_, PTR(Expr) then_, PTR(Expr) else_){
+    this->kind = expr_if;
     this->if_ = if_;
     this->then_ = then_;
     this->else_ = else_;
+    this->typed = false;
+    this->hash = hash_mix(hash_mix(hash_mix(7, if_->hash), then_->hash), else_->hash);
 }
 
 bool IfExpr::equals (PTR(Expr) e){
-    PTR(IfExpr) ifPtr = CAST(IfExpr)(e);
-    
-    if (ifPtr == nullptr) {
+    if (e == nullptr || e->hash != hash) {
+        return false;
+    }
+    if (&*e == this) {
+        return true;
+    }
+    if (base_kind(e->kind) != expr_if) {
         return false;
     }
+    IfExpr *ifPtr = static_cast<IfExpr *>(&*e);
     return this->if_->equals(ifPtr->if_) && this->then_->equals(ifPtr->then_) && this->else_->equals(ifPtr->else_);
 }
 
-PTR(Val) IfExpr::interp(PTR(Env) env){
-    if(env == nullptr) {
-        env = Env::empty;
-    }
-    PTR(Val) conditionValue = if_->interp(env);
-    PTR(BoolVal) boolCondition = CAST(BoolVal)(conditionValue);
-    if (boolCondition != nullptr && boolCondition->is_true()) {
-        return then_->interp(env);
+Value IfExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    Value conditionValue = if_->eval(env);
+    if (typed ? conditionValue.num : conditionValue.is_bool() && conditionValue.num) {
+        next = then_;
     } else {
-        return else_->interp(env);
+        next = else_;
     }
+    return Value();
 }
 
 //PTR(Expr) IfExpr::subst(string str, PTR(Expr) e){
 //    return NEW(IfExpr)(this->if_->subst(str, e),this->then_->subst(str, e), this->else_->subst(str, e)) ;
 //}
 
+PTR(Expr) IfExpr::resolve(ResolveScope *scope){
+    PTR(IfExpr) resolved = NEW(IfExpr)(if_->resolve(scope), then_->resolve(scope), else_->resolve(scope));
+    resolved->typed = typed;
+    return located(resolved, position);
+}
+
+/**
+ * \brief Keeps only the branch taken when the condition is a literal.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) IfExpr::optimize(OptimizeScope *scope){
+    PTR(Expr) new_if = if_->optimize(scope);
+    if (is_constant(new_if)) {
+        Value condition = new_if->eval(Env::empty);
+        if (condition.is_bool() && condition.num) {
+            return then_->optimize(scope);
+        }
+        return else_->optimize(scope);
+    }
+    return located(NEW(IfExpr)(new_if, then_->optimize(scope), else_->optimize(scope)), position);
+}
+
 void IfExpr::print(ostream &ostream){
     ostream << "(" << "_if";
     this->if_->print(ostream);
@@ -538,36 +998,81 @@ void IfExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_paren
 //======================  EqExpr  ======================//
 
 EqExpr::EqExpr(PTR(Expr) lhs, PTR(Expr) rhs){
+    this->kind = expr_eq;
     this->lhs = lhs;
     this->rhs = rhs;
+    this->hash = hash_mix(hash_mix(8, lhs->hash), rhs->hash);
+}
+
+EqExpr::~EqExpr(){
+    unlink_chain<EqExpr>(rhs, kind);
 }
 
 bool EqExpr::equals (PTR(Expr) e){
-    PTR(EqExpr) eqPtr = CAST(EqExpr)(e);
-    
-    if (eqPtr == nullptr) {
+    if (e == nullptr || e->hash != hash) {
         return false;
     }
-    return this->rhs->equals(eqPtr->rhs) && this->lhs->equals(eqPtr->lhs);
+    if (&*e == this) {
+        return true;
+    }
+    return chain_equals(this, e);
 }
 
-PTR(Val) EqExpr::interp(PTR(Env) env){
-    if(env == nullptr) {
-        env = Env::empty;
+/**
+ * \brief Compares rhs with lhs, evaluating rhs first. A chain a == (b == ...) is
+ * evaluated in one loop from its last operand back to its first.
+ */
+Value EqExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    if (rhs->kind != expr_eq) {
+        Value rhs_val = rhs->eval(env);
+        return Value::boolean(rhs_val.equals(lhs->eval(env)));
+    }
+    vector<EqExpr *> chain = rhs_chain(this);
+    Value result = chain.back()->rhs->eval(env);
+    for (size_t i = chain.size(); i-- > 0;) {
+        result = Value::boolean(result.equals(chain[i]->lhs->eval(env)));
     }
-   return NEW(BoolVal)(rhs->interp(env)->equals(lhs->interp(env)));
+    return result;
 }
 
 //PTR(Expr) EqExpr::subst(string str, PTR(Expr) e){
 //    return NEW(EqExpr)(this->rhs->subst(str, e), this->lhs->subst(str, e));
 //}
 
+PTR(Expr) EqExpr::resolve(ResolveScope *scope){
+    return rebuild_chain(this, resolve_operands(this, scope));
+}
+
+static PTR(Expr) fold_eq(PTR(Expr) new_lhs, PTR(Expr) new_rhs, int position){
+    if (is_constant(new_lhs) && is_constant(new_rhs)) {
+        return located(NEW(BoolExpr)(new_rhs->eval(Env::empty).equals(new_lhs->eval(Env::empty))), position);
+    }
+    return located(NEW(EqExpr)(new_lhs, new_rhs), position);
+}
+
+/**
+ * \brief Folds a comparison of two literals.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) EqExpr::optimize(OptimizeScope *scope){
+    return optimize_chain(this, scope, fold_eq);
+}
+
+/**
+ * \brief Prints (rhs==lhs); a chain a == (b == c) prints as ((c==b)==a).
+ */
 void EqExpr::print(ostream &ostream){
-    ostream << "(";
-    this->rhs->print(ostream);
-    ostream << "==";
-    this->lhs->print(ostream);
-    ostream << ")";
+    vector<EqExpr *> chain = rhs_chain(this);
+    for (size_t i = 0; i < chain.size(); i++) {
+        ostream << "(";
+    }
+    chain.back()->rhs->print(ostream);
+    for (size_t i = chain.size(); i-- > 0;) {
+        ostream << "==";
+        chain[i]->lhs->print(ostream);
+        ostream << ")";
+    }
 }
 
 void EqExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
@@ -576,11 +1081,12 @@ void EqExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_paren
             ostream << "(";
     }
     
-    lhs->pretty_print_at(ostream, prec_none, false, strmpos);
-    
-    ostream << "==";
-    
-    rhs->pretty_print_at(ostream, prec_none, false, strmpos);
+    vector<EqExpr *> chain = rhs_chain(this);
+    for (EqExpr *node : chain) {
+        node->lhs->pretty_print_at(ostream, prec_none, false, strmpos);
+        ostream << "==";
+    }
+    chain.back()->rhs->pretty_print_at(ostream, prec_none, false, strmpos);
     
     if (let_parent) {
         ostream << ")";
@@ -590,24 +1096,31 @@ void EqExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_paren
 //======================  FunExpr  ======================//
 
 FunExpr::FunExpr(string formal_arg, PTR(Expr) body){
+    this->kind = expr_fun;
     this->formal_arg = formal_arg;
     this->body = body;
+    this->arg_used = true;
+    this->hash = hash_mix(hash_mix(9, std::hash<string>()(formal_arg)), body->hash);
 }
 
 bool FunExpr::equals (PTR(Expr)e){
-    PTR(FunExpr) funPtr = CAST(FunExpr)(e);
-    
-    if (funPtr == nullptr) {
+    if (e == nullptr || e->hash != hash) {
+        return false;
+    }
+    if (&*e == this) {
+        return true;
+    }
+    if (base_kind(e->kind) != expr_fun) {
         return false;
     }
+    FunExpr *funPtr = static_cast<FunExpr *>(&*e);
     return this->formal_arg == funPtr->formal_arg && this->body->equals(funPtr->body);
 }
 
-PTR(Val) FunExpr::interp(PTR(Env) env){
-    if(env == nullptr) {
-        env = Env::empty;
-    }
-    return NEW( FunVal)(formal_arg, body, env);
+Value FunExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    PTR(FunVal) fun = NEW( FunVal)(formal_arg, body, env);
+    fun->arg_used = arg_used;
+    return Value(fun);
 }
 
 //PTR(Expr) FunExpr::subst(string str, PTR(Expr) e){
@@ -621,8 +1134,34 @@ PTR(Val) FunExpr::interp(PTR(Env) env){
 //    }
 //}
 
+/**
+ * \brief Resolves the body in a new frame whose slot 0 is the argument, collecting
+ * the outer variables it uses as the closure's captures.
+ * \param scope The scope being resolved.
+ * \return The resolved expression.
+ */
+PTR(Expr) FunExpr::resolve(ResolveScope *scope){
+    ResolveScope inner(scope);
+    inner.bind(formal_arg, inner.new_slot());
+    PTR(Expr) new_body = body->resolve(&inner);
+    PTR(SlotFunExpr) fun = NEW(SlotFunExpr)(formal_arg, new_body, inner.frame_size, inner.captures);
+    fun->arg_used = arg_used;
+    return located(fun, position);
+}
+
+/**
+ * \brief Optimizes the body, where the argument hides any outer binding of its name.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) FunExpr::optimize(OptimizeScope *scope){
+    OptimizeScope inner(scope, formal_arg, nullptr);
+    return located(NEW(FunExpr)(formal_arg, body->optimize(&inner)), position);
+}
+
 void FunExpr::print(ostream &ostream){
-    ostream << "_fun (" << this->formal_arg << ") " << this->body->to_string();
+    ostream << "_fun (" << this->formal_arg << ") ";
+    this->body->print(ostream);
 }
 
 void FunExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
@@ -632,34 +1171,433 @@ void FunExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_pare
 //======================  CallExpr  ======================//
 
 CallExpr::CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg){
+    this->kind = expr_call;
     this->to_be_called = to_be_called;
     this->actual_arg = actual_arg;
+    this->hash = hash_mix(hash_mix(10, to_be_called->hash), actual_arg->hash);
 }
 
 bool CallExpr::equals (PTR(Expr) e){
-    PTR(CallExpr) callPtr = CAST(CallExpr)(e);
-    
-    if (callPtr == nullptr) {
+    if (e == nullptr || e->hash != hash) {
+        return false;
+    }
+    if (&*e == this) {
+        return true;
+    }
+    if (base_kind(e->kind) != expr_call) {
         return false;
     }
+    CallExpr *callPtr = static_cast<CallExpr *>(&*e);
     return this->to_be_called->equals(callPtr->to_be_called) && this->actual_arg->equals(callPtr->actual_arg);
 }
 
-PTR(Val) CallExpr::interp(PTR(Env) env){
-    if(env == nullptr) {
-        env = Env::empty;
+Value CallExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    Value callee = this->to_be_called->eval(env);
+    Value arg = this->actual_arg->eval(env);
+    if (callee.tag == Value::boxed_tag) {
+        if (Memo::current != nullptr) {
+            return Memo::current->tail_call(callee, arg, env, next);
+        }
+        return callee.boxed->tail_call(arg, env, next);
     }
-    return this->to_be_called->interp(env)->call(this->actual_arg->interp(env));
+    return callee.call(arg);
 }
 
 //PTR(Expr) CallExpr::subst(string str, PTR(Expr) e){
 //    return NEW(CallExpr)(this->to_be_called->subst(str, e), this->actual_arg->subst(str, e));
 //}
 
+PTR(Expr) CallExpr::resolve(ResolveScope *scope){
+    return located(NEW(CallExpr)(to_be_called->resolve(scope), actual_arg->resolve(scope)), position);
+}
+
+/**
+ * \brief Turns a call of a _fun literal into a _let of its argument, which is then
+ * optimized like any other _let.
+ * \param scope The bindings with known values.
+ * \return The optimized expression.
+ */
+PTR(Expr) CallExpr::optimize(OptimizeScope *scope){
+    if (base_kind(to_be_called->kind) == expr_fun) {
+        FunExpr *fun = static_cast<FunExpr *>(&*to_be_called);
+        PTR(Expr) let = located(NEW(LetExpr)(fun->formal_arg, actual_arg, fun->body), position);
+        return let->optimize(scope);
+    }
+    return located(NEW(CallExpr)(to_be_called->optimize(scope), actual_arg->optimize(scope)), position);
+}
+
 void CallExpr::print(ostream &ostream){
-    ostream << "(" << this->to_be_called->to_string() << ") (" << this->actual_arg->to_string() << ")";
+    ostream << "(";
+    this->to_be_called->print(ostream);
+    ostream << ") (";
+    this->actual_arg->print(ostream);
+    ostream << ")";
 }
 
 void CallExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
     
 }
+
+//======================  Resolved forms  ======================//
+
+/**
+ * \brief Constructs a variable resolved to a frame slot.
+ * \param val The name of the variable.
+ * \param depth The number of frames between the use and the binding.
+ * \param slot The slot of the binding in its frame.
+ */
+SlotVarExpr::SlotVarExpr(string val, int depth, int slot) : VarExpr(val) {
+    this->kind = expr_slot_var;
+    this->depth = depth;
+    this->slot = slot;
+}
+
+/**
+ * \brief Loads the variable straight from its frame slot.
+ */
+Value SlotVarExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    return env->lookup_slot(depth, slot);
+}
+
+/**
+ * \brief Constructs a _let whose variable lives in a frame slot.
+ */
+SlotLetExpr::SlotLetExpr(string lhs, int slot, PTR(Expr) rhs, PTR(Expr) body) : LetExpr(lhs, rhs, body) {
+    this->kind = expr_slot_let;
+    this->slot = slot;
+}
+
+/**
+ * \brief Stores the value of rhs in the slot and continues with the body in the same frame.
+ */
+Value SlotLetExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    env->bind_slot(slot, rhs->eval(env));
+    next = body;
+    return Value();
+}
+
+/**
+ * \brief Constructs a _fun whose calls run in a fresh frame.
+ * \param captures The addresses in the defining frame of the variables the closure keeps.
+ */
+SlotFunExpr::SlotFunExpr(string formal_arg, PTR(Expr) body, int frame_size, const vector<pair<int, int> > &captures) : FunExpr(formal_arg, body) {
+    this->kind = expr_slot_fun;
+    this->frame_size = frame_size;
+    this->captures = captures;
+}
+
+/**
+ * \brief Makes a flat closure: the captured values are copied into a frame of their
+ * own, so the closure keeps neither the defining frame nor its other bindings alive.
+ */
+Value SlotFunExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    PTR(Env) names = env->names();
+    PTR(SlotFunVal) fun;
+    if (captures.empty()) {
+        fun = pool_new<SlotFunVal>(formal_arg, body, names, frame_size);
+    }
+    else {
+        PTR(FrameEnv) captured = pool_new<FrameEnv>((int)captures.size(), names);
+        for (size_t i = 0; i < captures.size(); i++) {
+            captured->slots[i] = env->lookup_slot(captures[i].first, captures[i].second);
+        }
+        fun = pool_new<SlotFunVal>(formal_arg, body, captured, frame_size);
+    }
+    fun->arg_used = arg_used;
+    return Value(fun);
+}
+
+/**
+ * \brief Constructs the root of a resolved program.
+ * \param frame_size The number of top-level _let slots.
+ * \param body The resolved program.
+ */
+ScopeExpr::ScopeExpr(int frame_size, PTR(Expr) body){
+    this->kind = expr_scope;
+    this->frame_size = frame_size;
+    this->body = body;
+    this->hash = body->hash;
+}
+
+/**
+ * \brief A scope is transparent: it equals whatever its body equals.
+ */
+bool ScopeExpr::equals(PTR(Expr) e){
+    if(e != nullptr && e->kind == expr_scope){
+        return body->equals(static_cast<ScopeExpr *>(&*e)->body);
+    }
+    return body->equals(e);
+}
+
+Value ScopeExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    env = pool_new<FrameEnv>(frame_size, env);
+    next = body;
+    return Value();
+}
+
+/**
+ * \brief Re-resolving drops the old frame; the caller allocates a new one.
+ */
+PTR(Expr) ScopeExpr::resolve(ResolveScope *scope){
+    return body->resolve(scope);
+}
+
+/**
+ * \brief Optimizing drops the frame along with the slots; resolve the result again.
+ */
+PTR(Expr) ScopeExpr::optimize(OptimizeScope *scope){
+    return body->optimize(scope);
+}
+
+void ScopeExpr::print(ostream &ostream){
+    body->print(ostream);
+}
+
+void ScopeExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    body->pretty_print_at(ostream, prec, let_parent, strmpos);
+}
+
+//======================  NaryExpr  ======================//
+
+/**
+ * \param identity The value of an empty chain: 0 for sums, 1 for products.
+ * \param seed The hash seed of the binary node the chain is made of.
+ */
+NaryExpr::NaryExpr(const vector<PTR(Expr)> &operands, unsigned identity, size_t seed){
+    this->operands = operands;
+    this->constant = identity;
+    // the same hash as the chain of binary nodes
+    this->hash = operands.back()->hash;
+    for (size_t i = operands.size() - 1; i-- > 0;) {
+        this->hash = hash_mix(hash_mix(seed, operands[i]->hash), this->hash);
+    }
+    bool product = identity == 1;
+    for (PTR(Expr) &operand : this->operands) {
+        if (operand->kind == expr_num) {
+            unsigned val = (unsigned)static_cast<NumExpr *>(&*operand)->val;
+            constant = product ? constant * val : constant + val;
+        }
+        else if (operand->kind == expr_slot_var) {
+            SlotVarExpr *slot = static_cast<SlotVarExpr *>(&*operand);
+            slots.push_back(make_pair(slot->depth, slot->slot));
+        }
+        else {
+            others.push_back(operand);
+        }
+    }
+}
+
+/**
+ * \brief Compares a flat node with another of its class or with a chain of Binary.
+ */
+template <class Nary, class Binary> static bool nary_equals(Nary *self, PTR(Expr) e, expr_kind_t binary_kind){
+    if (e == nullptr || e->hash != self->hash) {
+        return false;
+    }
+    if (&*e == self) {
+        return true;
+    }
+    vector<PTR(Expr)> &operands = self->operands;
+    if (e->kind == self->kind) {
+        Nary *other = static_cast<Nary *>(&*e);
+        if (other->operands.size() != operands.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < operands.size(); i++) {
+            if (!operands[i]->equals(other->operands[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (e->kind != binary_kind) {
+        return false;
+    }
+    vector<Binary *> chain = rhs_chain(static_cast<Binary *>(&*e));
+    if (chain.size() + 1 != operands.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < chain.size(); i++) {
+        if (!operands[i]->equals(chain[i]->lhs)) {
+            return false;
+        }
+    }
+    return operands.back()->equals(chain.back()->rhs);
+}
+
+/**
+ * \brief Evaluates every operand in order and combines them from the right with
+ * `combine`, exactly as the chain of binary nodes does. Used once an operand turns
+ * out not to be a number; the language has no side effects, so evaluating operands
+ * again gives the same values, and the same error as the chain.
+ */
+static Value nary_fold(NaryExpr *self, PTR(Env) env, Value (Value::*combine)(const Value &) const){
+    vector<Value> values;
+    values.reserve(self->operands.size());
+    for (PTR(Expr) &operand : self->operands) {
+        values.push_back(operand->eval(env));
+    }
+    Value result = values.back();
+    for (size_t i = values.size() - 1; i-- > 0;) {
+        result = (values[i].*combine)(result);
+    }
+    return result;
+}
+
+//======================  SumExpr  ======================//
+
+SumExpr::SumExpr(const vector<PTR(Expr)> &operands) : NaryExpr(operands, 0, 1) {
+    this->kind = expr_sum;
+}
+
+bool SumExpr::equals(PTR(Expr) e){
+    return nary_equals<SumExpr, AddExpr>(this, e, expr_add);
+}
+
+Value SumExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    unsigned total = constant;
+    for (PTR(Expr) &operand : others) {
+        Value value = operand->eval(env);
+        if (!value.is_num()) {
+            return nary_fold(this, env, &Value::add_to);
+        }
+        total += (unsigned)value.num;
+    }
+    for (const pair<int, int> &slot : slots) {
+        Value value = env->lookup_slot(slot.first, slot.second);
+        if (!value.is_num()) {
+            return nary_fold(this, env, &Value::add_to);
+        }
+        total += (unsigned)value.num;
+    }
+    return Value::number(total);
+}
+
+PTR(Expr) SumExpr::resolve(ResolveScope *scope){
+    vector<PTR(Expr)> resolved;
+    for (PTR(Expr) &operand : operands) {
+        resolved.push_back(operand->resolve(scope));
+    }
+    return located(NEW(SumExpr)(resolved), position);
+}
+
+/**
+ * \brief Optimizes back into a chain of AddExpr, like the other resolved forms.
+ */
+PTR(Expr) SumExpr::optimize(OptimizeScope *scope){
+    vector<PTR(Expr)> optimized;
+    for (PTR(Expr) &operand : operands) {
+        optimized.push_back(operand->optimize(scope));
+    }
+    PTR(Expr) result = optimized.back();
+    for (size_t i = optimized.size() - 1; i-- > 0;) {
+        result = fold_add(optimized[i], result, position);
+    }
+    return result;
+}
+
+void SumExpr::print(ostream &ostream){
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        ostream << "(";
+        operands[i]->print(ostream);
+        ostream << "+";
+    }
+    operands.back()->print(ostream);
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        ostream << ")";
+    }
+}
+
+void SumExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    if (prec >= prec_add) {
+        ostream << "(";
+    }
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        operands[i]->pretty_print_at(ostream, prec_add, true, strmpos);
+        ostream << " + ";
+    }
+    operands.back()->pretty_print_at(ostream, prec_none, let_parent, strmpos);
+    if (prec >= prec_add) {
+        ostream << ")";
+    }
+}
+
+//======================  ProductExpr  ======================//
+
+ProductExpr::ProductExpr(const vector<PTR(Expr)> &operands) : NaryExpr(operands, 1, 2) {
+    this->kind = expr_product;
+}
+
+bool ProductExpr::equals(PTR(Expr) e){
+    return nary_equals<ProductExpr, MultExpr>(this, e, expr_mult);
+}
+
+Value ProductExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    unsigned total = constant;
+    for (PTR(Expr) &operand : others) {
+        Value value = operand->eval(env);
+        if (!value.is_num()) {
+            return nary_fold(this, env, &Value::mult_with);
+        }
+        total *= (unsigned)value.num;
+    }
+    for (const pair<int, int> &slot : slots) {
+        Value value = env->lookup_slot(slot.first, slot.second);
+        if (!value.is_num()) {
+            return nary_fold(this, env, &Value::mult_with);
+        }
+        total *= (unsigned)value.num;
+    }
+    return Value::number(total);
+}
+
+PTR(Expr) ProductExpr::resolve(ResolveScope *scope){
+    vector<PTR(Expr)> resolved;
+    for (PTR(Expr) &operand : operands) {
+        resolved.push_back(operand->resolve(scope));
+    }
+    return located(NEW(ProductExpr)(resolved), position);
+}
+
+/**
+ * \brief Optimizes back into a chain of MultExpr, like the other resolved forms.
+ */
+PTR(Expr) ProductExpr::optimize(OptimizeScope *scope){
+    vector<PTR(Expr)> optimized;
+    for (PTR(Expr) &operand : operands) {
+        optimized.push_back(operand->optimize(scope));
+    }
+    PTR(Expr) result = optimized.back();
+    for (size_t i = optimized.size() - 1; i-- > 0;) {
+        result = fold_mult(optimized[i], result, position);
+    }
+    return result;
+}
+
+void ProductExpr::print(ostream &ostream){
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        ostream << "(";
+        operands[i]->print(ostream);
+        ostream << "*";
+    }
+    operands.back()->print(ostream);
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        ostream << ")";
+    }
+}
+
+void ProductExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    bool parent = let_parent;
+    if (prec >= prec_mult) {
+        ostream << "(";
+        parent = false;
+    }
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        operands[i]->pretty_print_at(ostream, prec_mult, true, strmpos);
+        ostream << " * ";
+    }
+    operands.back()->pretty_print_at(ostream, prec_add, parent, strmpos);
+    if (prec >= prec_mult) {
+        ostream << ")";
+    }
+}
@@ -17,11 +17,15 @@
 #include <string>
 #include <stdexcept>
 #include <sstream>
+#include <functional>
+#include <vector>
 #include "pointer.h"
 #include "env.hpp"
 
 using namespace std;
 class Val;
+class ResolveScope;
+class OptimizeScope;
 
 typedef enum {
   prec_none,      // = 0
@@ -29,11 +33,86 @@ typedef enum {
   prec_mult       // = 2
 } precedence_t;
 
+/**
+ * \brief The concrete class of an Expr, so that code can dispatch on it with a switch
+ * and a static cast instead of trying dynamic casts. Resolved forms have kinds of
+ * their own; base_kind() maps them to the kind of the node they were resolved from.
+ */
+typedef enum {
+  expr_add,
+  expr_mult,
+  expr_num,
+  expr_var,
+  expr_let,
+  expr_bool,
+  expr_if,
+  expr_eq,
+  expr_fun,
+  expr_call,
+  expr_slot_var,
+  expr_slot_let,
+  expr_slot_fun,
+  expr_scope,
+  expr_sum,
+  expr_product,
+  expr_cached,
+  expr_fork,
+  expr_force,
+  expr_delay,
+  expr_slot_delay,
+  expr_lazy_call
+} expr_kind_t;
+
+/**
+ * \brief The kind a resolved form stands for: a SlotVarExpr is a VarExpr, and so on.
+ */
+inline expr_kind_t base_kind(expr_kind_t kind){
+    switch (kind) {
+        case expr_slot_var:
+            return expr_var;
+        case expr_slot_let:
+            return expr_let;
+        case expr_slot_fun:
+            return expr_fun;
+        case expr_sum:
+            return expr_add;
+        case expr_product:
+            return expr_mult;
+        case expr_lazy_call:
+            return expr_call;
+        default:
+            return kind;
+    }
+}
+
+/**
+ * \brief Combines a value into a running hash.
+ */
+inline size_t hash_mix(size_t seed, size_t value){
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
 CLASS(Expr) {
 public:
+    // Structural hash, set by the constructor from the node's kind, fields and child
+    // hashes: equal trees always have equal hashes. Nodes are not changed once built.
+    size_t hash;
+    // Byte offset of the node in the parsed source, or -1 for nodes built in code.
+    // Nodes derived from a parsed node by resolve() and optimize() keep its offset.
+    int position;
+    // Set by the constructor of each concrete class.
+    expr_kind_t kind;
+
+    Expr() : hash(0), position(-1), kind(expr_num) {}
     virtual bool equals (PTR(Expr) e)=0;
-    virtual PTR(Val) interp(PTR(Env) env = nullptr)=0;
+    PTR(Val) interp(PTR(Env) env = nullptr);
+    Value eval(PTR(Env) env);
+    // Evaluates this node; a node whose value is a subexpression in tail position
+    // sets `next` (and `env`, if it changes) instead, and eval() continues with it.
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next)=0;
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e)=0;
+    virtual PTR(Expr) resolve(ResolveScope *scope)=0;
+    virtual PTR(Expr) optimize(OptimizeScope *scope)=0;
     virtual void print(ostream &ostream)=0;
     string to_string();
     
@@ -43,6 +122,14 @@ public:
     virtual ~Expr() {};
 };
 
+/**
+ * \brief Gives a newly built node the source position of the node it replaces.
+ */
+inline PTR(Expr) located(PTR(Expr) e, int position){
+    e->position = position;
+    return e;
+}
+
 //======================  ADD  ======================//
 
 class AddExpr : public Expr {
@@ -50,11 +137,15 @@ class AddExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    bool typed;   // set by typecheck() when both operands are proven numbers, which are then added unchecked
     
     AddExpr(PTR(Expr) lhs, PTR(Expr) rhs);
+    ~AddExpr();
     virtual bool equals(PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
 };
@@ -65,12 +156,16 @@ class MultExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    bool typed;   // like AddExpr::typed
 
     MultExpr(PTR(Expr) lhs, PTR(Expr) rhs);
+    ~MultExpr();
 
     virtual bool equals(PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print (ostream &ostream);
     void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
 };
@@ -83,8 +178,10 @@ public:
     
     NumExpr(int rep);
     virtual bool equals(PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print (ostream &ostream);
 };
 
@@ -97,8 +194,10 @@ public:
     
     VarExpr (string val);
     virtual bool equals(PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print (ostream &ostream);
 };
 
@@ -113,8 +212,10 @@ public:
     
     LetExpr(string lhs, PTR(Expr) rhs, PTR(Expr) body);
     virtual bool equals(PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
 };
@@ -127,8 +228,10 @@ public:
     
     BoolExpr(bool b);
     virtual bool equals (PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     
     virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
@@ -141,11 +244,14 @@ public:
     PTR(Expr) if_;
     PTR(Expr) then_;
     PTR(Expr) else_ ;
+    bool typed;   // set by typecheck() when the condition is a proven boolean, which is then tested unchecked
     
     IfExpr(PTR(Expr) if_, PTR(Expr) then_, PTR(Expr) else_);
     virtual bool equals (PTR(Expr)e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     
     virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
@@ -159,9 +265,12 @@ public:
     PTR(Expr) lhs;
     
     EqExpr(PTR(Expr) rhs, PTR(Expr) lhs);
+    ~EqExpr();
     virtual bool equals (PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     
     virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
@@ -173,11 +282,14 @@ class FunExpr : public Expr {
 public:
     string formal_arg;
     PTR(Expr)body;
+    bool arg_used;   // false when the body never reads the argument, which --lazy then skips
     
     FunExpr(string formal_arg, PTR(Expr)body);
     virtual bool equals (PTR(Expr)e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     
     virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
@@ -192,9 +304,148 @@ public:
     
     CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg);
     virtual bool equals (PTR(Expr) e);
-    virtual PTR(Val) interp(PTR(Env) env = nullptr);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
 //    virtual PTR(Expr) subst(string str, PTR(Expr) e);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
     virtual void print(ostream &ostream);
     
     virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
 };
+
+//======================  Resolved forms  ======================//
+
+/**
+ * \brief A variable resolved to a frame slot: `depth` is 0 for the frame of the
+ * enclosing function body (or of the top level) and 1 for its closure's captured values.
+ */
+class SlotVarExpr : public VarExpr {
+public:
+    int depth;
+    int slot;
+    
+    SlotVarExpr(string val, int depth, int slot);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+};
+
+/**
+ * \brief A _let whose variable lives in `slot` of the current frame.
+ */
+class SlotLetExpr : public LetExpr {
+public:
+    int slot;
+    
+    SlotLetExpr(string lhs, int slot, PTR(Expr) rhs, PTR(Expr) body);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+};
+
+/**
+ * \brief A _fun whose calls run in a fresh frame of `frame_size` slots, argument in slot 0.
+ * The closure keeps only the variables in `captures`, the (depth, slot) addresses in
+ * the defining frame of what the body uses from outside; the body reads capture i
+ * at depth 1, slot i.
+ */
+class SlotFunExpr : public FunExpr {
+public:
+    int frame_size;
+    vector<pair<int, int> > captures;
+    
+    SlotFunExpr(string formal_arg, PTR(Expr) body, int frame_size, const vector<pair<int, int> > &captures);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+};
+
+/**
+ * \brief Root of a resolved program: allocates the top-level frame.
+ */
+class ScopeExpr : public Expr {
+public:
+    int frame_size;
+    PTR(Expr) body;
+    
+    ScopeExpr(int frame_size, PTR(Expr) body);
+    virtual bool equals (PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+/**
+ * \brief Chains of + and * with at least this many operands resolve to flat nodes.
+ */
+const size_t nary_min_operands = 8;
+
+/**
+ * \brief Operands of a flattened chain, split by how they are evaluated.
+ *
+ * The numeric literals are combined into `constant` when the node is built and slot
+ * variables are read straight from their frames; only the other operands are
+ * evaluated as nodes, in their source order.
+ */
+class NaryExpr : public Expr {
+public:
+    vector<PTR(Expr)> operands;          // all of them, in source order
+    unsigned constant;                   // the literals, combined
+    vector<pair<int, int> > slots;       // (depth, slot) of the slot variables
+    vector<PTR(Expr)> others;            // everything else, in order
+
+    NaryExpr(const vector<PTR(Expr)> &operands, unsigned identity, size_t seed);
+};
+
+/**
+ * \brief A resolved a + (b + (c + ...)) of at least nary_min_operands operands.
+ *
+ * Addition wraps around like Value::add_to(), so it is associative and commutative
+ * and the operands can be summed in any order. When one of them is not a number the
+ * node falls back to evaluating them all in order and adding from the right like the
+ * chain of AddExpr it replaces, so errors are the same. Prints, hashes and compares
+ * equal to that chain.
+ */
+class SumExpr : public NaryExpr {
+public:
+    SumExpr(const vector<PTR(Expr)> &operands);
+    virtual bool equals(PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+/**
+ * \brief The product counterpart of SumExpr, for a chain of MultExpr.
+ */
+class ProductExpr : public NaryExpr {
+public:
+    ProductExpr(const vector<PTR(Expr)> &operands);
+    virtual bool equals(PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+/**
+ * \brief The nodes of a chain of T nested through rhs, such as the additions of
+ * a + (b + (c + d)) as the parser builds a + b + c + d, starting at `first`. The chain
+ * ends in the rhs of the last node. Traversals of +, * and == walk chains in a loop so
+ * that long generated expressions do not take one native stack frame per operator.
+ */
+template <class T> vector<T *> rhs_chain(T *first){
+    vector<T *> chain(1, first);
+    while (chain.back()->rhs->kind == first->kind) {
+        chain.push_back(static_cast<T *>(&*chain.back()->rhs));
+    }
+    return chain;
+}
+
+/**
+ * \brief Copies what earlier passes marked on a node of a chain, such as the typed
+ * flag typecheck() sets, to the node a pass rebuilds it as.
+ */
+void copy_marks(AddExpr *from, AddExpr *to);
+void copy_marks(MultExpr *from, MultExpr *to);
+void copy_marks(EqExpr *from, EqExpr *to);
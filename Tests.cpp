@@ -11,10 +11,31 @@
  */
 
 #include <stdio.h>
+#include <climits>
+#include <atomic>
 #include "Expr.hpp"
 #include "Val.hpp"
 #include "catch.h"
 #include "parse.hpp"
+#include "vm.hpp"
+#include "resolve.hpp"
+#include "batch.hpp"
+#include "pool.hpp"
+#include "optimize.hpp"
+#include "intern.hpp"
+#include "memo.hpp"
+#include "profile.hpp"
+#include "serialize.hpp"
+#include "serve.hpp"
+#include "incremental.hpp"
+#include "printer.hpp"
+#include "closure_compile.hpp"
+#include "parallel.hpp"
+#include "lazy.hpp"
+#include "governor.hpp"
+#include "typecheck.hpp"
+#include "flat.hpp"
+#include "script.hpp"
 
 
 TEST_CASE("NUM TESTS"){
@@ -757,3 +778,2097 @@ TEST_CASE("Testing CallExpr") {
 
 
 
+
+TEST_CASE("Testing vm") {
+
+    SECTION("arithmetic and comparison") {
+        CHECK( vm_run(vm_compile(parse_str("1 + 2 * 3")))->equals(NEW(NumVal)(7)) );
+        CHECK( vm_run(vm_compile(parse_str("2 == 2")))->equals(NEW(BoolVal)(true)) );
+        CHECK( vm_run(vm_compile(parse_str("_if 1 == 2 _then 3 _else 4")))->to_string() == "4" );
+        CHECK( vm_run(vm_compile(parse_str("_if 1 _then 3 _else 4")))->to_string() == "4" );
+    }
+
+    SECTION("let and closures") {
+        CHECK( vm_run(vm_compile(parse_str("_let x = 8 _in _let f = _fun (x) x*x _in f(2)")))->to_string() == "4" );
+        CHECK( vm_run(vm_compile(parse_str("_let y = 8 _in _let f = _fun (x) x*y _in f(2)")))->to_string() == "16" );
+        CHECK( vm_run(vm_compile(parse_str("_let add = _fun (x) _fun (y) x + y _in add(3)(4)")))->to_string() == "7" );
+        CHECK( vm_run(vm_compile(parse_str("_let factrl = _fun (factrl)"
+                                                           "_fun (x)"
+                                                               "_if x ==1"
+                                                               "_then 1"
+                                                               "_else x * factrl(factrl)(x + -1)"
+                                            "_in  factrl(factrl)(10)")))->to_string() == "3628800" );
+        CHECK( vm_run(vm_compile(parse_str("_fun (x) x + 1")))->to_string() == "_fun (x) (x+1)" );
+    }
+
+    SECTION("tail calls run in constant stack") {
+        CHECK( vm_run(vm_compile(parse_str("_let loop = _fun (loop) _fun (n)"
+                                                           "_if n == 0 _then 0 _else loop(loop)(n + -1)"
+                                            "_in loop(loop)(100000)")))->to_string() == "0" );
+    }
+
+    SECTION("nested _lets compile in constant native stack") {
+        string lets;
+        for (int i = 0; i < 10000; i++) {
+            lets += "_let x = x + 1 _in ";
+        }
+        CHECK( vm_run(vm_compile(parse_str("_let x = 0 _in " + lets + "x")))->to_string() == "10000" );
+    }
+
+    SECTION("errors match interp") {
+        CHECK_THROWS_WITH( vm_run(vm_compile(parse_str("x + 1"))), "free variable: x" );
+        CHECK_THROWS_WITH( vm_run(vm_compile(parse_str("_true + 1"))), "Bool cannot be added" );
+        CHECK_THROWS_WITH( vm_run(vm_compile(parse_str("1 * _true"))), "mult of a non-number" );
+        CHECK_THROWS_WITH( vm_run(vm_compile(parse_str("1(2)"))), "NumVal does not call()" );
+        CHECK( vm_run(vm_compile(parse_str("_if _true _then 1 _else x")))->to_string() == "1" );
+    }
+}
+
+TEST_CASE("Testing resolve") {
+
+    SECTION("variables get frame slots") {
+        PTR(ScopeExpr) scope = CAST(ScopeExpr)(resolve(parse_str("_let x = 1 _in _let y = 2 _in x + y")));
+        REQUIRE(scope != nullptr);
+        CHECK(scope->frame_size == 2);
+        PTR(SlotLetExpr) let = CAST(SlotLetExpr)(scope->body);
+        REQUIRE(let != nullptr);
+        CHECK(let->slot == 0);
+        PTR(SlotLetExpr) inner = CAST(SlotLetExpr)(let->body);
+        REQUIRE(inner != nullptr);
+        PTR(AddExpr) add = CAST(AddExpr)(inner->body);
+        REQUIRE(add != nullptr);
+        PTR(SlotVarExpr) y = CAST(SlotVarExpr)(add->rhs);
+        REQUIRE(y != nullptr);
+        CHECK(y->depth == 0);
+        CHECK(y->slot == 1);
+    }
+
+    SECTION("function bodies get their own frame") {
+        PTR(ScopeExpr) scope = CAST(ScopeExpr)(resolve(parse_str("_let y = 8 _in _fun (x) x * y")));
+        PTR(SlotFunExpr) fun = CAST(SlotFunExpr)(CAST(LetExpr)(scope->body)->body);
+        REQUIRE(fun != nullptr);
+        CHECK(fun->frame_size == 1);
+        PTR(MultExpr) mult = CAST(MultExpr)(fun->body);
+        CHECK(CAST(SlotVarExpr)(mult->lhs)->depth == 0);
+        CHECK(CAST(SlotVarExpr)(mult->rhs)->depth == 1);
+        CHECK(CAST(SlotVarExpr)(mult->rhs)->slot == 0);
+    }
+
+    SECTION("resolved programs interp the same") {
+        CHECK( resolve(parse_str("_let x = 8 _in _let f = _fun (x) x*x _in f(2)"))->interp()->to_string() == "4" );
+        CHECK( resolve(parse_str("_let x = 1 _in _let x = x + 1 _in x"))->interp()->to_string() == "2" );
+        CHECK( resolve(parse_str("_let factrl = _fun (factrl)"
+                                                 "_fun (x)"
+                                                     "_if x ==1"
+                                                     "_then 1"
+                                                     "_else x * factrl(factrl)(x + -1)"
+                                  "_in  factrl(factrl)(10)"))->interp()->to_string() == "3628800" );
+        CHECK_THROWS_WITH( resolve(parse_str("(_let x = 1 _in x) + x"))->interp(), "free variable: x" );
+        CHECK( resolve(parse_str("_let f = _fun (x) x + 1 _in f"))->to_string() == "(_let f=_fun (x) (x+1) _in f)" );
+    }
+
+    SECTION("free variables still come from the outer environment") {
+        PTR(Env) env = NEW(ExtendedEnv)("z", NEW(NumVal)(5), Env::empty);
+        CHECK( resolve(parse_str("_let x = 1 _in x + z"))->interp(env)->to_string() == "6" );
+    }
+}
+
+TEST_CASE("Testing Value") {
+
+    SECTION("numbers and booleans are immediates") {
+        CHECK( Value::number(3).add_to(Value::number(4)).equals(Value::number(7)) );
+        CHECK( Value::number(3).mult_with(Value::number(4)).num == 12 );
+        CHECK( Value::number(INT_MAX).add_to(Value::number(1)).num == INT_MIN );
+        CHECK( Value::boolean(true).equals(Value::boolean(true)) );
+        CHECK( !Value::boolean(true).equals(Value::number(1)) );
+        CHECK( (NEW(AddExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2)))->eval(Env::empty).boxed == nullptr );
+    }
+
+    SECTION("conversion to and from Val") {
+        CHECK( Value(NEW(NumVal)(5)).is_num() );
+        CHECK( Value(NEW(BoolVal)(false)).is_bool() );
+        CHECK( Value::number(5).to_val()->equals(NEW(NumVal)(5)) );
+        CHECK( Value::boolean(true).to_val()->equals(NEW(BoolVal)(true)) );
+        Value f = Value(NEW(FunVal)("x", NEW(VarExpr)("x")));
+        CHECK( f.tag == Value::boxed_tag );
+        CHECK( f.call(Value::number(9)).num == 9 );
+    }
+
+    SECTION("errors match Val") {
+        CHECK_THROWS_WITH( Value::number(1).add_to(Value::boolean(true)), "add of a non-number" );
+        CHECK_THROWS_WITH( Value::boolean(true).mult_with(Value::number(1)), "Bool cannot be multiplied" );
+        CHECK_THROWS_WITH( Value::number(1).is_true(), "number cannot be boolean" );
+        CHECK_THROWS_WITH( Value::boolean(true).call(Value::number(1)), "BoolVal does not call()" );
+        CHECK_THROWS_WITH( Value(NEW(FunVal)("x", NEW(VarExpr)("x"))).add_to(Value::number(1)), "Function cannot be added" );
+    }
+}
+
+TEST_CASE("Testing Arena") {
+
+    SECTION("allocations are aligned and counted") {
+        Arena arena(128);
+        void *a = arena.allocate(3, 1);
+        void *b = arena.allocate(8, 8);
+        CHECK( a != b );
+        CHECK( ((uintptr_t)b % 8) == 0 );
+        void *big = arena.allocate(1000, 16);
+        CHECK( ((uintptr_t)big % 16) == 0 );
+        CHECK( arena.bytes_used() == 1011 );
+        arena.reset();
+        CHECK( arena.bytes_used() == 0 );
+    }
+
+    SECTION("parsing into an arena") {
+        Arena arena;
+        {
+            PTR(Expr) e = parse_str("_let f = _fun (x) x * x _in f(3) + 1", &arena);
+            CHECK( arena.bytes_used() > 0 );
+            CHECK( e->equals(parse_str("_let f = _fun (x) x * x _in f(3) + 1")) );
+            CHECK( e->interp()->to_string() == "10" );
+            CHECK( resolve(e)->interp()->to_string() == "10" );
+        }
+        arena.reset();
+        PTR(Expr) again = parse_str("1 + 2", &arena);
+        CHECK( again->interp()->to_string() == "3" );
+    }
+}
+
+TEST_CASE("Testing Lexer") {
+
+    SECTION("characters and words") {
+        const char *text = "  _let xy= 3";
+        Lexer in(text, strlen(text));
+        in.skip_whitespace();
+        CHECK( in.offset() == 2 );
+        CHECK( in.get() == '_' );
+        Slice w = in.word();
+        CHECK( w == "let" );
+        CHECK( !(w == "le") );
+        in.skip_whitespace();
+        CHECK( in.word().str() == "xy" );
+        CHECK( in.word().empty() );
+        CHECK( in.peek() == '=' );
+        CHECK( in.get() == '=' );
+        in.skip_whitespace();
+        CHECK( in.get() == '3' );
+        CHECK( in.eof() );
+        CHECK( in.peek() == EOF );
+        CHECK( in.get() == EOF );
+    }
+
+    SECTION("buffers need no terminator") {
+        const char text[] = { '1', '+', '2', '*', 'x' };
+        CHECK( parse_buffer(text, 3)->interp()->to_string() == "3" );
+        CHECK_THROWS_WITH( parse_buffer(text, 4), "invalid input" );
+        CHECK( parse_buffer(text, 5)->to_string() == "(1+(2*x))" );
+        CHECK_THROWS_WITH( parse_buffer(text, 0), "invalid input" );
+    }
+
+    SECTION("streams are read whole") {
+        istringstream in("_if _true _then 1 _else 2  \n");
+        CHECK( parse(in)->interp()->to_string() == "1" );
+        istringstream bad("1 2");
+        CHECK_THROWS_WITH( parse(bad), "invalid input" );
+    }
+}
+
+TEST_CASE("Testing batch") {
+
+    SECTION("one line per program") {
+        istringstream in("1 + 2\n_let x = 3 _in x * x; 4 == 4\n\n  \n_true + 1;\nf(1)");
+        ostringstream out;
+        run_batch(in, out, do_interp);
+        CHECK( out.str() == "3\n9\n_true\nerror: Bool cannot be added\nerror: free variable: f\n" );
+    }
+
+    SECTION("parse errors stay on their line") {
+        istringstream in("(1 + 2\n1 2;5");
+        ostringstream out;
+        run_batch(in, out, do_vm);
+        CHECK( out.str() == "error: missing close parenthesis\nerror: invalid input\n5\n" );
+    }
+
+    SECTION("multi-line results are escaped") {
+        istringstream in("_let x = 1 _in x");
+        ostringstream out;
+        run_batch(in, out, do_pretty_print);
+        CHECK( out.str() == "_let x = 1\\n_in  x\n" );
+        CHECK( escape_line("a\\b") == "a\\\\b" );
+    }
+
+    SECTION("parallel batches keep input order") {
+        string programs;
+        string expected;
+        for (int i = 0; i < 500; i++) {
+            programs += "_let x = " + to_string(i) + " _in x * x" + (i % 3 == 0 ? ";" : "\n");
+            expected += to_string(i * i) + "\n";
+            if (i % 50 == 0) {
+                programs += "_false + 1\n";
+                expected += "error: Bool cannot be added\n";
+            }
+        }
+        istringstream in(programs);
+        ostringstream out;
+        run_options_t options;
+        options.jobs = 4;
+        run_batch(in, out, do_interp, options);
+        CHECK( out.str() == expected );
+    }
+}
+
+TEST_CASE("Testing WorkPool") {
+
+    SECTION("every task runs before the pool is destroyed") {
+        atomic<int> count(0);
+        {
+            WorkPool pool(4);
+            CHECK( pool.size() == 4 );
+            for (int i = 0; i < 1000; i++) {
+                pool.submit([&count]{ count++; });
+            }
+        }
+        CHECK( count == 1000 );
+    }
+
+    SECTION("tasks can spawn tasks") {
+        atomic<int> count(0);
+        {
+            WorkPool pool(3);
+            WorkPool *shared = &pool;
+            for (int i = 0; i < 10; i++) {
+                pool.submit([shared, &count]{
+                    for (int j = 0; j < 10; j++) {
+                        shared->submit([&count]{ count++; });
+                    }
+                });
+            }
+        }
+        CHECK( count == 100 );
+    }
+
+    SECTION("a waiting thread can help") {
+        atomic<int> count(0);
+        WorkPool pool(1);
+        for (int i = 0; i < 100; i++) {
+            pool.submit([&count]{ count++; });
+        }
+        while (pool.run_one()) {
+        }
+        while (count < 100) {
+            this_thread::yield();
+        }
+        CHECK( count == 100 );
+        CHECK( !pool.run_one() );
+    }
+}
+
+TEST_CASE("Testing optimize") {
+
+    SECTION("constant arithmetic folds") {
+        CHECK( optimize(parse_str("(3+4)*x"))->equals(parse_str("7*x")) );
+        CHECK( optimize(parse_str("1 + 2 == 3"))->equals(NEW(BoolExpr)(true)) );
+        CHECK( optimize(parse_str("2147483647 + 1"))->equals(NEW(NumExpr)(INT_MIN)) );
+        CHECK( optimize(parse_str("65536 * 65536"))->equals(NEW(NumExpr)(0)) );
+        CHECK( optimize(parse_str("1 == _true"))->equals(NEW(BoolExpr)(false)) );
+    }
+
+    SECTION("constant bindings propagate") {
+        CHECK( optimize(parse_str("_let a = 5 _in _let b = a*2 _in b + y"))->equals(parse_str("10 + y")) );
+        CHECK( optimize(parse_str("_let x = 5 _in _let x = y _in x"))->equals(parse_str("_let x = y _in x")) );
+        // into _fun bodies as well, which shows in how the function prints and compares
+        const string adder = "_let x = 5 _in _fun (y) x + y";
+        CHECK( optimize(parse_str(adder))->equals(parse_str("_fun (y) 5 + y")) );
+        CHECK( run_program(do_interp, parse_str(adder)) == "_fun (y) (x+y)" );
+        run_options_t options;
+        options.optimize = true;
+        CHECK( run_program(do_interp, parse_str(adder), options) == "_fun (y) (5+y)" );
+        CHECK( run_program(do_interp, parse_str("(" + adder + ") == _fun (y) 5 + y")) == "_false" );
+        CHECK( run_program(do_interp, parse_str("(" + adder + ") == _fun (y) 5 + y"), options) == "_true" );
+        CHECK( run_program(do_interp, parse_str("(" + adder + ")(2)"), options) == "7" );
+        CHECK( optimize(parse_str("_let x = 5 _in _fun (x) x + 1"))->equals(parse_str("_fun (x) x + 1")) );
+        CHECK( optimize(parse_str("(_fun (x) x * x)(3)"))->equals(NEW(NumExpr)(9)) );
+        CHECK( optimize(parse_str("_let f = _fun (x) x + 2*3 _in f(1)"))->equals(parse_str("_let f = _fun (x) x + 6 _in f(1)")) );
+    }
+
+    SECTION("literal conditions keep one branch") {
+        CHECK( optimize(parse_str("_if 1 == 1 _then x _else y"))->equals(NEW(VarExpr)("x")) );
+        CHECK( optimize(parse_str("_if _false _then _true + 1 _else 3"))->equals(NEW(NumExpr)(3)) );
+        CHECK( optimize(parse_str("_if 5 _then 1 _else 2"))->equals(NEW(NumExpr)(2)) );
+        CHECK( optimize(parse_str("_if b _then 1 + 1 _else 2"))->equals(parse_str("_if b _then 2 _else 2")) );
+    }
+
+    SECTION("errors are left for run time") {
+        CHECK( optimize(parse_str("_true + 1"))->equals(parse_str("_true + 1")) );
+        CHECK( optimize(parse_str("_let b = _false _in 2 * b"))->equals(parse_str("2 * _false")) );
+        CHECK_THROWS_WITH( resolve(optimize(parse_str("_false * 2")))->interp(), "Bool cannot be multiplied" );
+    }
+
+    SECTION("results do not change") {
+        string programs[] = {
+            "_let f = _fun (f) _fun (n) _if n == 0 _then 1 _else n * f(f)(n + -1) _in f(f)(10)",
+            "_let a = 3 _in _let g = _fun (x) x + a _in g(4) + g(a)",
+            "_let x = 2 _in (_fun (y) x * y)(x + 1)",
+            "_if (_fun (x) x)(_true) _then 1 _else 2",
+        };
+        for (string program : programs) {
+            PTR(Expr) e = parse_str(program);
+            string expected = resolve(e)->interp()->to_string();
+            CHECK( resolve(optimize(e))->interp()->to_string() == expected );
+            CHECK( resolve(optimize(resolve(e)))->interp()->to_string() == expected );
+            CHECK( vm_run(vm_compile(optimize(e)))->to_string() == expected );
+        }
+    }
+}
+
+TEST_CASE("Testing ExprTable") {
+
+    SECTION("structural hashes") {
+        CHECK( parse_str("_let x = 1 _in x + 2")->hash == parse_str("_let x = 1 _in x + 2")->hash );
+        CHECK( parse_str("1 + 2")->hash != parse_str("1 * 2")->hash );
+        CHECK( parse_str("1 + 2")->hash != parse_str("2 + 1")->hash );
+        CHECK( parse_str("_fun (x) x")->hash != parse_str("_fun (y) y")->hash );
+        CHECK( resolve(parse_str("_let x = 1 _in x"))->equals(parse_str("_let x = 1 _in x")) );
+    }
+
+    SECTION("identical subtrees are shared") {
+        ExprTable table;
+        PTR(MultExpr) e = CAST(MultExpr)(parse_str("(1 + y) * (1 + y)", nullptr, &table));
+        REQUIRE( e != nullptr );
+        CHECK( e->lhs == e->rhs );
+        CHECK( table.size() == 4 );
+        PTR(Expr) again = parse_str("(1+y)*(1+y)", nullptr, &table);
+        CHECK( again == e );
+        CHECK( table.size() == 4 );
+        PTR(AddExpr) other = CAST(AddExpr)(parse_str("(1 + y) + 3", nullptr, &table));
+        CHECK( other->lhs == e->lhs );
+        table.clear();
+        CHECK( table.size() == 0 );
+        CHECK( parse_str("(1 + y) * (1 + y)", nullptr, &table) != e );
+    }
+
+    SECTION("interned trees run like any other") {
+        ExprTable table;
+        Arena arena;
+        PTR(Expr) e = parse_str("_let f = _fun (x) x * x _in f(3) + f(3)", &arena, &table);
+        CHECK( arena.bytes_used() == 0 );
+        CHECK( e->interp()->to_string() == "18" );
+        CHECK( resolve(e)->interp()->to_string() == "18" );
+        CHECK( vm_run(vm_compile(e))->to_string() == "18" );
+    }
+
+    SECTION("batches can share one table") {
+        istringstream in("1 + 2 * 3\n1 + 2 * 3; _let x = 2 _in x * 3\n");
+        ostringstream out;
+        run_options_t options;
+        options.intern = true;
+        run_batch(in, out, do_interp, options);
+        CHECK( out.str() == "7\n7\n6\n" );
+    }
+
+    SECTION("a table with a capacity starts over when it is full") {
+        ExprTable table(5);
+        PTR(Expr) e = parse_str("(1 + y) * 2", nullptr, &table);
+        CHECK( table.size() == 5 );
+        CHECK( parse_str("(1 + y) * 2", nullptr, &table) == e );
+        PTR(Expr) other = parse_str("3", nullptr, &table);
+        CHECK( table.size() == 1 );
+        CHECK( parse_str("3", nullptr, &table) == other );
+        CHECK( parse_str("(1 + y) * 2", nullptr, &table) != e );
+        CHECK( parse_str("(1 + y) * 2", nullptr, &table)->equals(e) );
+        CHECK( e->interp(NEW(ExtendedEnv)("y", Value::number(1), Env::empty))->to_string() == "4" );
+    }
+}
+
+TEST_CASE("Testing memoize") {
+
+    SECTION("least recently used entries are evicted") {
+        LruCache<int, string> cache(2);
+        string v;
+        cache.put(1, "one");
+        cache.put(2, "two");
+        CHECK( cache.find(1, v) );
+        CHECK( v == "one" );
+        cache.put(3, "three");
+        CHECK( cache.size() == 2 );
+        CHECK( !cache.find(2, v) );
+        CHECK( cache.find(3, v) );
+        cache.put(3, "drei");
+        CHECK( cache.find(3, v) );
+        CHECK( v == "drei" );
+        cache.clear();
+        CHECK( !cache.find(1, v) );
+    }
+
+    SECTION("values hash consistently with equals") {
+        CHECK( Value::number(5).hash() == Value(NEW(NumVal)(5)).hash() );
+        CHECK( (NEW(NumVal)(5))->hash() == Value::number(5).hash() );
+        CHECK( (NEW(BoolVal)(true))->hash() == Value::boolean(true).hash() );
+        CHECK( Value::number(1).hash() != Value::boolean(true).hash() );
+        PTR(Val) f = parse_str("_fun (x) x + 1")->interp();
+        PTR(Val) g = parse_str("_let y = 2 _in _fun (x) x + 1")->interp();
+        CHECK( f->equals(g) );
+        CHECK( f->hash() == g->hash() );
+        CHECK( vm_run(vm_compile(parse_str("_fun (x) x + 1")))->hash() == f->hash() );
+    }
+
+    string fib = "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+                 "_else fib(fib)(n + -1) + fib(fib)(n + -2) _in fib(fib)(30)";
+
+    SECTION("repeated calls hit the cache") {
+        Memo memo;
+        MemoScope scope(&memo);
+        CHECK( resolve(parse_str(fib))->interp()->to_string() == "832040" );
+        CHECK( memo.misses < 100 );
+        CHECK( memo.hits > 0 );
+        unsigned long misses = memo.misses;
+        CHECK( parse_str(fib)->interp()->to_string() == "832040" );
+        CHECK( memo.misses < 2 * misses + 10 );
+    }
+
+    SECTION("closures over different values do not share entries") {
+        Memo memo;
+        MemoScope scope(&memo);
+        CHECK( parse_str("_let mk = _fun (a) _fun (x) x + a _in _let g = _fun (h) h(1) _in g(mk(1)) + g(mk(2))")->interp()->to_string() == "5" );
+        CHECK( resolve(parse_str("_let mk = _fun (a) _fun (x) x + a _in _let g = _fun (h) h(1) _in g(mk(1)) + g(mk(2))"))->interp()->to_string() == "5" );
+        CHECK( resolve(parse_str("_let a = 1 _in _let f = _fun (x) x + a _in _let a = 10 _in f(1) + (_fun (x) x + a)(1)"))->interp()->to_string() == "13" );
+    }
+
+    SECTION("errors are not cached") {
+        Memo memo;
+        MemoScope scope(&memo);
+        PTR(Expr) e = resolve(parse_str("_let f = _fun (x) _if x _then 1 _else y _in f(_true) + f(_true) + f(_false)"));
+        CHECK_THROWS_WITH( e->interp(), "free variable: y" );
+        CHECK( memo.hits == 1 );
+        CHECK( memo.size() == 1 );
+    }
+
+    SECTION("tail calls still run in constant native stack") {
+        Memo memo;
+        MemoScope scope(&memo);
+        string loop = "_let loop = _fun (loop) _fun (n)"
+                                    "_if n == 0 _then 7 _else loop(loop)(n + -1)"
+                      "_in loop(loop)(1000000)";
+        CHECK( resolve(parse_str(loop))->interp()->to_string() == "7" );
+        // every call the loop continued with is cached with the value of the loop
+        PTR(Expr) short_loop = resolve(parse_str("_let loop = _fun (loop) _fun (n)"
+                                                               "_if n == 0 _then 7 _else loop(loop)(n + -1)"
+                                                 "_in loop(loop)(20)"));
+        CHECK( short_loop->interp()->to_string() == "7" );
+        unsigned long misses = memo.misses;
+        CHECK( short_loop->interp()->to_string() == "7" );
+        CHECK( memo.misses == misses );
+    }
+
+    SECTION("a memo is only used while installed") {
+        Memo memo;
+        {
+            MemoScope scope(&memo);
+            parse_str("(_fun (x) x)(1)")->interp();
+        }
+        parse_str("(_fun (x) x)(1)")->interp();
+        CHECK( memo.misses == 1 );
+        CHECK( Memo::current == nullptr );
+    }
+}
+
+TEST_CASE("Testing profile") {
+
+    SECTION("the parser records where each node starts") {
+        PTR(Expr) e = parse_str("1 + _let x = 2\n  _in x * 3");
+        PTR(AddExpr) add = CAST(AddExpr)(e);
+        PTR(LetExpr) let = CAST(LetExpr)(add->rhs);
+        CHECK( add->position == 0 );
+        CHECK( add->lhs->position == 0 );
+        CHECK( let->position == 4 );
+        CHECK( let->rhs->position == 13 );
+        CHECK( let->body->position == 21 );
+        CHECK( CAST(MultExpr)(let->body)->rhs->position == 25 );
+        CHECK( resolve(e)->position == 0 );
+        CHECK( CAST(AddExpr)(CAST(ScopeExpr)(resolve(e))->body)->rhs->position == 4 );
+    }
+
+    SECTION("locations are line:column") {
+        string source = "1 +\n  2";
+        Profiler profiler(source.data(), source.size());
+        CHECK( profiler.location(0) == "1:1" );
+        CHECK( profiler.location(6) == "2:3" );
+        CHECK( profiler.location(-1) == "?" );
+    }
+
+    SECTION("nodes and closures are counted") {
+        string source = "_let f = _fun (f) _fun (n) _if n == 0 _then 0 _else n + f(f)(n + -1)\n_in f(f)(10)";
+        Profiler profiler(source.data(), source.size());
+        PTR(Expr) e = resolve(parse_str(source));
+        {
+            ProfileScope scope(&profiler);
+            CHECK( e->interp()->to_string() == "55" );
+        }
+        CHECK( Profiler::current == nullptr );
+        unsigned long if_calls = 0;
+        for (NodeProfile &node : profiler.nodes) {
+            if (node.label == "IfExpr@1:28") {
+                if_calls = node.calls;
+            }
+            CHECK( node.inclusive_ns >= node.exclusive_ns );
+        }
+        CHECK( if_calls == 11 );
+        stringstream summary;
+        profiler.print_summary(summary);
+        CHECK( summary.str().find("          11  _fun (n)@1:28\n") != string::npos );
+        CHECK( summary.str().find("lookup depth by slot:\n           0") != string::npos );
+    }
+
+    SECTION("collapsed stacks nest called bodies under the closure") {
+        stringstream report;
+        run_options_t options;
+        string source = "_let f = _fun (x) x + 1 _in 2 * f(3)";
+        CHECK( profile_program(source.data(), source.size(), options, report) == "8" );
+        string line;
+        bool nested = false;
+        while (getline(report, line)) {
+            size_t space = line.rfind(' ');
+            REQUIRE( space != string::npos );
+            CHECK( line.find_first_not_of("0123456789", space + 1) == string::npos );
+            if (line.find("MultExpr@1:29;_fun (x)@1:19;AddExpr@1:19") == 0) {
+                nested = true;
+            }
+        }
+        CHECK( nested );
+    }
+
+    SECTION("by-name lookups record how many bindings they pass") {
+        string source = "_let x = 1 _in _let y = 2 _in x + y";
+        Profiler profiler(source.data(), source.size());
+        ProfileScope scope(&profiler);
+        CHECK( parse_str(source)->interp()->to_string() == "3" );
+        REQUIRE( profiler.name_depths.size() == 2 );
+        CHECK( profiler.name_depths[0] == 1 );
+        CHECK( profiler.name_depths[1] == 1 );
+    }
+
+    SECTION("errors leave the profiler usable") {
+        string source = "1 + _true";
+        Profiler profiler(source.data(), source.size());
+        ProfileScope scope(&profiler);
+        CHECK_THROWS_WITH( parse_str(source)->interp(), "add of a non-number" );
+        CHECK( parse_str("2 + 3")->interp()->to_string() == "5" );
+        stringstream report;
+        profiler.print_collapsed(report);
+        CHECK( report.str().find("AddExpr@1:1 ") == 0 );
+    }
+}
+
+TEST_CASE("Testing long operator chains") {
+
+    // deep enough that one native frame per operator would overflow the stack
+    const int terms = 100000;
+    string sum = "1";
+    string product = "1";
+    string comparison = "_true";
+    for (int i = 1; i < terms; i++) {
+        sum += " + 1";
+        product += "*1";
+        comparison += "==_true";
+    }
+
+    SECTION("chains parse and evaluate") {
+        CHECK( parse_str(sum)->interp()->to_string() == "100000" );
+        CHECK( parse_str(product)->interp()->to_string() == "1" );
+        CHECK( parse_str(comparison)->interp()->to_string() == "_true" );
+        CHECK( resolve(parse_str("_let x = 2 _in x + " + sum))->interp()->to_string() == "100002" );
+        CHECK( vm_run(vm_compile(parse_str(sum)))->to_string() == "100000" );
+        CHECK( optimize(parse_str(sum))->to_string() == "100000" );
+        CHECK( resolve(make_lazy(parse_str(sum)))->interp()->to_string() == "100000" );
+        CHECK( resolve(make_lazy(parse_str(comparison)))->interp()->to_string() == "_true" );
+        CHECK( parallel_interp(parse_str(comparison), 4)->to_string() == "_true" );
+        CHECK( parallel_interp(parse_str(sum), 4)->to_string() == "100000" );
+    }
+
+    SECTION("chains print, compare and free") {
+        PTR(Expr) e = parse_str(sum);
+        CHECK( e->equals(parse_str(sum)) );
+        CHECK( !e->equals(parse_str(sum + " + 1")) );
+        string printed = e->to_string();
+        CHECK( printed.compare(0, 6, "(1+(1+") == 0 );
+        CHECK( printed.size() == 4 * (size_t)terms - 3 );
+        CHECK( e->to_pretty_string() == sum );
+        CHECK( parse_str(product)->to_pretty_string().compare(0, 9, "1 * 1 * 1") == 0 );
+        CHECK( parse_str(comparison)->to_pretty_string() == comparison );
+    }
+
+    SECTION("chains keep the binary semantics") {
+        CHECK( parse_str("1 + 2 + 3")->equals(NEW(AddExpr)(NEW(NumExpr)(1), NEW(AddExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3)))) );
+        CHECK( parse_str("1 == 1 == _true")->interp()->to_string() == "_false" );
+        CHECK( parse_str("_true == 1 == 1")->interp()->to_string() == "_true" );
+        CHECK( parse_str("1 == 2 == 3")->to_string() == "((3==2)==1)" );
+        CHECK( parse_str("2 * 3 * 4")->to_pretty_string() == "2 * 3 * 4" );
+        CHECK( parse_str("(1 + 2) + 3 + 4")->to_pretty_string() == "(1 + 2) + 3 + 4" );
+        CHECK_THROWS_WITH( parse_str("1 + _true + 2")->interp(), "Bool cannot be added" );
+        CHECK_THROWS_WITH( parse_str("1 = 2"), "need '==' to indicate equal check" );
+    }
+}
+
+TEST_CASE("Testing flat sums and products") {
+
+    string sum = "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10";
+    string product = "1 * 2 * 3 * 4 * 5 * 6 * 7 * 8 * 9 * 10";
+
+    SECTION("wide chains resolve to flat nodes that look like the chain") {
+        PTR(Expr) e = parse_str(sum);
+        PTR(Expr) resolved = CAST(ScopeExpr)(resolve(e))->body;
+        PTR(SumExpr) flat = CAST(SumExpr)(resolved);
+        REQUIRE( flat != nullptr );
+        CHECK( flat->operands.size() == 10 );
+        CHECK( flat->constant == 55 );
+        CHECK( flat->others.empty() );
+        CHECK( resolved->to_string() == e->to_string() );
+        CHECK( resolved->to_pretty_string() == e->to_pretty_string() );
+        CHECK( resolved->hash == e->hash );
+        CHECK( resolved->equals(e) );
+        CHECK( e->equals(resolved) );
+        CHECK( !resolved->equals(parse_str(sum + " + 11")) );
+        CHECK( resolved->interp()->to_string() == "55" );
+        PTR(Expr) p = CAST(ScopeExpr)(resolve(parse_str(product)))->body;
+        CHECK( CAST(ProductExpr)(p) != nullptr );
+        CHECK( p->interp()->to_string() == "3628800" );
+        CHECK( p->to_string() == parse_str(product)->to_string() );
+        CHECK( CAST(AddExpr)(CAST(ScopeExpr)(resolve(parse_str("1 + 2 + 3")))->body) != nullptr );
+        CHECK( parse_str("_let x = 1 _in 2 * (" + sum + ")")->to_pretty_string()
+              == resolve(parse_str("_let x = 1 _in 2 * (" + sum + ")"))->to_pretty_string() );
+    }
+
+    SECTION("slots and other operands are added in") {
+        string source = "_let x = 3 _in _let f = _fun (y) y * 2 _in x + 1 + f(2) + x + 4 + f(x) + 6 + x";
+        PTR(Expr) resolved = resolve(parse_str(source));
+        CHECK( resolved->interp()->to_string() == parse_str(source)->interp()->to_string() );
+        CHECK( resolved->interp()->to_string() == "30" );
+        CHECK( resolve(parse_str("_let x = 2 _in x * x * x * x * x * x * x * x * x * x"))->interp()->to_string() == "1024" );
+    }
+
+    SECTION("arithmetic wraps around like the binary nodes") {
+        string big = "2147483647 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1";
+        CHECK( resolve(parse_str(big))->interp()->to_string() == parse_str(big)->interp()->to_string() );
+        string squares = "65536 * 65536 * 3 * 3 * 3 * 3 * 3 * 3 * 3";
+        CHECK( resolve(parse_str(squares))->interp()->to_string() == "0" );
+    }
+
+    SECTION("non-numbers report the same error as the chain") {
+        const char *programs[] = {
+            "1 + 2 + 3 + 4 + 5 + 6 + 7 + _true",
+            "_true + 1 + 2 + 3 + 4 + 5 + 6 + 7",
+            "1 + 2 + 3 + _false + 4 + 5 + 6 + 7",
+            "1 + 2 + 3 + 4 + 5 + 6 + 7 + _fun (x) x",
+            "_let f = _fun (x) x _in f + 2 + 3 + 4 + 5 + 6 + 7 + 8",
+            "1 * 2 * 3 * 4 * 5 * 6 * 7 * _true",
+            "_true * 1 * 2 * 3 * 4 * 5 * 6 * 7",
+            "_let b = _true _in 1 * 2 * 3 * 4 * b * 5 * 6 * 7",
+        };
+        for (const char *program : programs) {
+            string expected;
+            try {
+                parse_str(program)->interp();
+            }
+            catch (runtime_error &e) {
+                expected = e.what();
+            }
+            REQUIRE( expected != "" );
+            CHECK_THROWS_WITH( resolve(parse_str(program))->interp(), expected );
+        }
+    }
+
+    SECTION("flat nodes optimize back into chains") {
+        string source = "_fun (y) y + 1 + 2 + 3 + 4 + 5 + 6 + 7";
+        PTR(Expr) e = optimize(resolve(parse_str(source)));
+        CHECK( e->equals(optimize(parse_str(source))) );
+        CHECK( CAST(AddExpr)(CAST(FunExpr)(e)->body) != nullptr );
+        CHECK( vm_run(vm_compile(NEW(CallExpr)(e, NEW(NumExpr)(2))))->to_string() == "30" );
+        run_options_t options;
+        options.memoize = true;
+        CHECK( run_program(do_interp, parse_str("_let x = 1 _in _let f = _fun (y) y + x + 1 + 1 + 1 + 1 + 1 + 1 + 1 _in f(1) + f(1)"), options) == "18" );
+    }
+}
+
+TEST_CASE("Testing kind tags") {
+
+    SECTION("every node carries the kind of its class") {
+        CHECK( parse_str("1")->kind == expr_num );
+        CHECK( parse_str("x")->kind == expr_var );
+        CHECK( parse_str("1 + 2")->kind == expr_add );
+        CHECK( parse_str("1 * 2")->kind == expr_mult );
+        CHECK( parse_str("1 == 2")->kind == expr_eq );
+        CHECK( parse_str("_true")->kind == expr_bool );
+        CHECK( parse_str("_if _true _then 1 _else 2")->kind == expr_if );
+        CHECK( parse_str("_let x = 1 _in x")->kind == expr_let );
+        CHECK( parse_str("_fun (x) x")->kind == expr_fun );
+        CHECK( parse_str("f(1)")->kind == expr_call );
+        PTR(Expr) scope = resolve(parse_str("_let x = 1 _in _fun (y) x + y"));
+        CHECK( scope->kind == expr_scope );
+        PTR(Expr) let = CAST(ScopeExpr)(scope)->body;
+        CHECK( let->kind == expr_slot_let );
+        CHECK( base_kind(let->kind) == expr_let );
+        PTR(Expr) fun = CAST(SlotLetExpr)(let)->body;
+        CHECK( fun->kind == expr_slot_fun );
+        CHECK( base_kind(fun->kind) == expr_fun );
+        CHECK( base_kind(CAST(AddExpr)(CAST(SlotFunExpr)(fun)->body)->lhs->kind) == expr_var );
+        CHECK( base_kind(CAST(ScopeExpr)(resolve(parse_str("1 + 2 + 3 + 4 + 5 + 6 + 7 + 8")))->body->kind) == expr_add );
+        CHECK( base_kind(CAST(ScopeExpr)(resolve(parse_str("1 * 2 * 3 * 4 * 5 * 6 * 7 * 8")))->body->kind) == expr_mult );
+    }
+
+    SECTION("values carry their kind through boxing") {
+        PTR(Val) three = NEW(NumVal)(3);
+        PTR(Val) yes = NEW(BoolVal)(true);
+        CHECK( three->kind == val_num );
+        CHECK( yes->kind == val_bool );
+        PTR(Val) fun = parse_str("_fun (x) x")->interp();
+        CHECK( fun->kind == val_fun );
+        CHECK( vm_run(vm_compile(parse_str("_fun (x) x")))->kind == val_closure );
+        CHECK( Value(NEW(NumVal)(3)).tag == Value::num_tag );
+        CHECK( Value(NEW(BoolVal)(false)).tag == Value::bool_tag );
+        CHECK( Value(fun).tag == Value::boxed_tag );
+        CHECK( fun->equals(parse_str("_fun (x) x")->interp()) );
+        CHECK( !fun->equals(three) );
+        CHECK( !three->equals(yes) );
+        CHECK( !yes->equals(NEW(NumVal)(1)) );
+    }
+}
+
+TEST_CASE("Testing msdb serialization") {
+
+    const char *programs[] = {
+        "1",
+        "-17",
+        "2147483647 + -2147483648",
+        "_true == _false",
+        "_let x = 5 _in _let y = x * 2 _in x + y",
+        "_if 1 == 2 _then _false _else x",
+        "_let f = _fun (x) _if x == 0 _then 1 _else x * f(x + -1) _in f(5)",
+        "_let fact = _fun (f) _fun (n) _if n == 0 _then 1 _else n * f(f)(n + -1) _in fact(fact)(10)",
+        "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10",
+        "_let x = 3 _in x * x * x * x * x * x * x * x * 2",
+    };
+
+    SECTION("parsed and resolved trees survive a round trip") {
+        for (const char *program : programs) {
+            PTR(Expr) e = parse_str(program);
+            for (int resolved = 0; resolved < 2; resolved++) {
+                PTR(Expr) stored = resolved ? resolve(e) : e;
+                ostringstream out;
+                write_msdb(stored, out);
+                string bytes = out.str();
+                CHECK( bytes.substr(0, 4) == "MSDB" );
+                PTR(Expr) loaded = read_msdb(bytes.data(), bytes.size());
+                CHECK( loaded->kind == stored->kind );
+                CHECK( loaded->hash == stored->hash );
+                CHECK( loaded->equals(stored) );
+                CHECK( loaded->to_string() == e->to_string() );
+                string expected;
+                try {
+                    expected = stored->interp()->to_string();
+                }
+                catch (runtime_error &exn) {
+                    CHECK_THROWS_WITH( loaded->interp(), exn.what() );
+                    continue;
+                }
+                CHECK( loaded->interp()->to_string() == expected );
+                CHECK( run_program(do_interp, loaded) == expected );
+                CHECK( run_program(do_vm, loaded) == expected );
+            }
+        }
+    }
+
+    SECTION("names are stored once") {
+        ostringstream one, many;
+        write_msdb(parse_str("_let variable = 1 _in variable"), one);
+        write_msdb(parse_str("_let variable = 1 _in variable + variable + variable + variable"), many);
+        CHECK( many.str().size() - one.str().size() < 3 * string("variable").size() );
+    }
+
+    SECTION("long chains are read and written without recursion") {
+        string sum = "1";
+        for (int i = 0; i < 100000; i++) {
+            sum += " + 1";
+        }
+        ostringstream out;
+        write_msdb(parse_str(sum), out);
+        string bytes = out.str();
+        Arena arena;
+        PTR(Expr) loaded = read_msdb(bytes.data(), bytes.size(), &arena);
+        CHECK( loaded->interp()->to_string() == "100001" );
+        loaded = nullptr;
+    }
+
+    SECTION("files written by save_program load back") {
+        string path = "/tmp/msdscript_test.msdb";
+        save_program(resolve(parse_str(programs[7])), path);
+        CHECK( load_program(path)->interp()->to_string() == "3628800" );
+        remove(path.c_str());
+        CHECK_THROWS_WITH( load_program(path), "cannot open " + path );
+    }
+
+    SECTION("damaged files are rejected") {
+        ostringstream out;
+        write_msdb(parse_str(programs[7]), out);
+        string bytes = out.str();
+        CHECK_THROWS_WITH( read_msdb("MSD", 3), "not an msdb file" );
+        CHECK_THROWS_WITH( read_msdb("(1 + 2)", 7), "not an msdb file" );
+        string old = bytes;
+        old[4] = 7;
+        CHECK_THROWS_WITH( read_msdb(old.data(), old.size()), "unsupported msdb version 7" );
+        for (size_t length = 8; length < bytes.size(); length++) {
+            CHECK_THROWS_WITH( read_msdb(bytes.data(), length), "malformed msdb file" );
+        }
+        string longer = bytes + "x";
+        CHECK_THROWS_WITH( read_msdb(longer.data(), longer.size()), "malformed msdb file" );
+        string bad_kind = string(bytes.data(), 8) + string(1, 0) + string(1, (char)99);
+        CHECK_THROWS_WITH( read_msdb(bad_kind.data(), bad_kind.size()), "malformed msdb file" );
+    }
+
+    SECTION("slots outside their frames are rejected") {
+        // ... slot_var x depth slot: the variable is the last node
+        ostringstream let_out;
+        write_msdb(resolve(parse_str("_let x = 5 _in x")), let_out);
+        string let_bytes = let_out.str();
+        CHECK( read_msdb(let_bytes.data(), let_bytes.size())->interp()->to_string() == "5" );
+        string bad_slot = let_bytes;
+        bad_slot[bad_slot.size() - 1] = 1;
+        CHECK_THROWS_WITH( read_msdb(bad_slot.data(), bad_slot.size()), "malformed msdb file" );
+        string bad_depth = let_bytes;
+        bad_depth[bad_depth.size() - 2] = 2;
+        CHECK_THROWS_WITH( read_msdb(bad_depth.data(), bad_depth.size()), "malformed msdb file" );
+        // magic, version, one string "x", then the scope and its frame size
+        string bad_frame = let_bytes;
+        bad_frame[12] = 0;
+        CHECK_THROWS_WITH( read_msdb(bad_frame.data(), bad_frame.size()), "malformed msdb file" );
+
+        // ... slot_fun y frame_size 1 capture (0, 0) slot_var x 1 0
+        ostringstream fun_out;
+        write_msdb(resolve(parse_str("_let x = 5 _in (_fun (y) x)(1)")), fun_out);
+        string fun_bytes = fun_out.str();
+        CHECK( read_msdb(fun_bytes.data(), fun_bytes.size())->interp()->to_string() == "5" );
+        size_t call_arg = 2;   // num 1
+        string bad_capture = fun_bytes;
+        bad_capture[bad_capture.size() - call_arg - 5] = 1;
+        CHECK_THROWS_WITH( read_msdb(bad_capture.data(), bad_capture.size()), "malformed msdb file" );
+        string bad_captured = fun_bytes;
+        bad_captured[bad_captured.size() - call_arg - 1] = 1;
+        CHECK_THROWS_WITH( read_msdb(bad_captured.data(), bad_captured.size()), "malformed msdb file" );
+    }
+}
+
+/**
+ * \brief The responses of a --serve session, with the timings taken out.
+ */
+static vector<string> serve_session(const string &requests, ProgramCache &cache, run_mode_t mode = do_interp,
+                                    const run_options_t &options = run_options_t()){
+    istringstream in(requests);
+    ostringstream out;
+    serve_stream(in, out, mode, options, cache);
+    vector<string> responses;
+    istringstream lines(out.str());
+    string line;
+    while (getline(lines, line)) {
+        istringstream words(line);
+        string status, cache_state, parse_ns, run_ns;
+        words >> status;
+        if (status == "ok" || status == "error" || status == "quota") {
+            words >> cache_state >> parse_ns >> run_ns;
+            CHECK( parse_ns.find_first_not_of("0123456789") == string::npos );
+            CHECK( run_ns.find_first_not_of("0123456789") == string::npos );
+            words.get();
+            string rest;
+            getline(words, rest);
+            line = status + (cache_state.empty() ? "" : " " + cache_state + " " + rest);
+        }
+        responses.push_back(line);
+    }
+    return responses;
+}
+
+TEST_CASE("Testing serve") {
+
+    SECTION("every request gets one response line") {
+        ProgramCache cache(16, false);
+        vector<string> responses = serve_session("1 + 2\n\n_true + 1\n(1\n_let x = 3 _in x * x\n", cache);
+        REQUIRE( responses.size() == 4 );
+        CHECK( responses[0] == "ok miss 3" );
+        CHECK( responses[1] == "error miss Bool cannot be added" );
+        CHECK( responses[2] == "error miss missing close parenthesis" );
+        CHECK( responses[3] == "ok miss 9" );
+    }
+
+    SECTION("repeated programs come from the cache") {
+        ProgramCache cache(16, false);
+        vector<string> responses = serve_session("1 + 2\n1 + 2\n:vm 1 + 2\n:print 1 + 2\n:stats\n", cache);
+        REQUIRE( responses.size() == 5 );
+        CHECK( responses[0] == "ok miss 3" );
+        CHECK( responses[1] == "ok hit 3" );
+        CHECK( responses[2] == "ok hit 3" );
+        CHECK( responses[3] == "ok hit (1+2)" );
+        CHECK( responses[4] == "stats entries=1 capacity=16 hits=3 misses=1" );
+        CHECK( serve_session("1 + 2\n", cache)[0] == "ok hit 3" );
+    }
+
+    SECTION("the least recently used program is evicted") {
+        ProgramCache cache(2, false);
+        vector<string> responses = serve_session("1\n2\n1\n3\n1\n2\n:stats\n", cache);
+        REQUIRE( responses.size() == 7 );
+        CHECK( responses[2] == "ok hit 1" );
+        CHECK( responses[3] == "ok miss 3" );
+        CHECK( responses[4] == "ok hit 1" );
+        CHECK( responses[5] == "ok miss 2" );
+        CHECK( responses[6] == "stats entries=2 capacity=2 hits=2 misses=4" );
+    }
+
+    SECTION("programs are cached optimized with --optimize") {
+        ProgramCache cache(4, true);
+        CHECK( serve_session(":print _let x = 2 _in x * 3\n", cache)[0] == "ok miss 6" );
+        CHECK( serve_session(":pretty-print _if _true _then 1 _else 2\n", cache, do_print)[0] == "ok miss 1" );
+    }
+
+    SECTION("commands") {
+        ProgramCache cache(4, false);
+        vector<string> responses = serve_session(":frobnicate 1\n:interp 4 * 5\n:quit\n1 + 1\n", cache, do_vm);
+        REQUIRE( responses.size() == 3 );
+        CHECK( responses[0] == "error miss unknown command :frobnicate" );
+        CHECK( responses[1] == "ok miss 20" );
+        CHECK( responses[2] == "ok" );
+        CHECK( serve_session("f(1)", cache)[0] == "error miss free variable: f" );
+    }
+}
+
+/**
+ * \brief True when two parsed trees have their nodes at the same source positions.
+ */
+static bool same_positions(PTR(Expr) a, PTR(Expr) b){
+    vector<pair<PTR(Expr), PTR(Expr)> > pending(1, make_pair(a, b));
+    while (!pending.empty()) {
+        pair<PTR(Expr), PTR(Expr)> top = pending.back();
+        pending.pop_back();
+        if (top.first->position != top.second->position) {
+            return false;
+        }
+        vector<PTR(Expr)> left = children_of(top.first);
+        vector<PTR(Expr)> right = children_of(top.second);
+        if (left.size() != right.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < left.size(); i++) {
+            pending.push_back(make_pair(left[i], right[i]));
+        }
+    }
+    return true;
+}
+
+/**
+ * \brief Checks a session against parsing and interpreting its source from scratch.
+ */
+static void check_session(IncrementalSession &session){
+    PTR(Expr) parsed = parse_str(session.source);
+    REQUIRE( session.tree != nullptr );
+    CHECK( session.tree->equals(parsed) );
+    CHECK( session.tree->hash == parsed->hash );
+    CHECK( session.tree->to_string() == parsed->to_string() );
+    CHECK( same_positions(session.tree, parsed) );
+    string expected;
+    try {
+        expected = parsed->interp()->to_string();
+    }
+    catch (runtime_error &exn) {
+        CHECK_THROWS_WITH( session.interp(), exn.what() );
+        return;
+    }
+    CHECK( session.interp()->to_string() == expected );
+}
+
+TEST_CASE("Testing incremental sessions") {
+
+    string script = "_let a = 2 * 3 _in _let f = _fun (x) x * (10 + 20) _in f(a) + (4 * 5) + 7";
+
+    SECTION("edits inside one token are spliced in") {
+        IncrementalSession session(script);
+        CHECK( session.interp()->to_string() == "207" );
+        session.edit(script.find("7"), 1, "8");
+        check_session(session);
+        CHECK( session.interp()->to_string() == "208" );
+        session.edit(session.source.find("20"), 2, "21");
+        check_session(session);
+        session.edit(session.source.find("4 *"), 0, "1");
+        check_session(session);
+        session.edit(session.source.find("f(a)") + 2, 1, "abc");
+        check_session(session);
+        session.edit(session.source.find("abc"), 3, "-12");
+        check_session(session);
+        session.edit(session.source.find("-12"), 1, "");
+        check_session(session);
+        CHECK( session.full_parses == 1 );
+        CHECK( session.spliced_edits == 6 );
+    }
+
+    SECTION("every digit edit matches a full parse") {
+        IncrementalSession session(script);
+        for (size_t i = 0; i < script.size(); i++) {
+            if (!isdigit((unsigned char)script[i])) {
+                continue;
+            }
+            session.edit(i, 1, "9");
+            check_session(session);
+            session.edit(i, 0, "3");
+            check_session(session);
+            session.edit(i, 1, "");
+            check_session(session);
+        }
+        CHECK( session.source == string(script).replace(script.find("2 *"), 1, "9").replace(script.find("3 _in"), 1, "9")
+               .replace(script.find("10"), 2, "99").replace(script.find("20"), 2, "99")
+               .replace(script.find("4 *"), 1, "9").replace(script.find("5)"), 1, "9").replace(script.size() - 1, 1, "9") );
+        CHECK( session.full_parses == 1 );
+    }
+
+    SECTION("other edits reparse") {
+        IncrementalSession session(script);
+        session.edit(script.size(), 0, " + 1");
+        check_session(session);
+        CHECK( session.full_parses == 2 );
+        session.edit(script.find("_fun"), 0, "(");
+        CHECK_THROWS_WITH( session.interp(), "missing close parenthesis" );
+        session.edit(script.find("_fun"), 1, "");
+        check_session(session);
+        session.edit(script.find("a ="), 1, "b");
+        check_session(session);
+        session.edit(0, 0, "xy");
+        CHECK( session.tree == nullptr );
+        CHECK_THROWS_WITH( session.edit(session.source.size() + 1, 0, "1"), "edit outside the source" );
+        CHECK( session.spliced_edits == 0 );
+        IncrementalSession joined("_let x = 1 _in x(2) + 3");
+        joined.edit(joined.source.find("x("), 1, "x5");
+        CHECK( joined.tree == nullptr );
+    }
+
+    SECTION("closed subtrees are evaluated once") {
+        IncrementalSession session(script);
+        session.interp();
+        unsigned long misses = session.cache_misses;
+        CHECK( misses > 0 );
+        session.interp();
+        CHECK( session.cache_misses == misses );
+        CHECK( session.cache_hits > 0 );
+        // only the whole program, on the edited spine, is closed and has to run again
+        unsigned long hits = session.cache_hits;
+        session.edit(script.size() - 1, 1, "8");
+        CHECK( session.interp()->to_string() == "208" );
+        CHECK( session.cache_misses == misses + 1 );
+        CHECK( session.cache_hits >= hits + 2 );
+        IncrementalSession failing("(_true + 1) * 2");
+        CHECK_THROWS_WITH( failing.interp(), "Bool cannot be added" );
+        CHECK_THROWS_WITH( failing.interp(), "Bool cannot be added" );
+    }
+
+    SECTION("long chains") {
+        string sum = "1";
+        for (int i = 0; i < 20000; i++) {
+            sum += " + 1";
+        }
+        IncrementalSession session(sum);
+        CHECK( session.interp()->to_string() == "20001" );
+        session.edit(sum.size() - 1, 1, "101");
+        CHECK( session.interp()->to_string() == "20101" );
+        session.edit(0, 1, "0");
+        CHECK( session.interp()->to_string() == "20100" );
+        CHECK( session.spliced_edits == 2 );
+        CHECK( session.tree->equals(parse_str(session.source)) );
+    }
+}
+
+TEST_CASE("Testing flat closures") {
+
+    SECTION("a function captures only the outer variables its body uses") {
+        PTR(ScopeExpr) scope = CAST(ScopeExpr)(resolve(parse_str("_let a = 1 _in _let b = 2 _in _fun (x) x + b")));
+        PTR(SlotLetExpr) inner = CAST(SlotLetExpr)(CAST(SlotLetExpr)(scope->body)->body);
+        PTR(SlotFunExpr) fun = CAST(SlotFunExpr)(inner->body);
+        REQUIRE(fun != nullptr);
+        REQUIRE(fun->captures.size() == 1);
+        CHECK(fun->captures[0] == make_pair(0, 1));
+        PTR(SlotVarExpr) b = CAST(SlotVarExpr)(CAST(AddExpr)(fun->body)->rhs);
+        REQUIRE(b != nullptr);
+        CHECK(b->depth == 1);
+        CHECK(b->slot == 0);
+    }
+
+    SECTION("nested functions capture through the functions around them") {
+        PTR(ScopeExpr) scope = CAST(ScopeExpr)(resolve(parse_str("_let a = 1 _in _fun (x) _fun (y) a + x + y")));
+        PTR(SlotFunExpr) outer = CAST(SlotFunExpr)(CAST(SlotLetExpr)(scope->body)->body);
+        REQUIRE(outer != nullptr);
+        REQUIRE(outer->captures.size() == 1);
+        CHECK(outer->captures[0] == make_pair(0, 0));
+        PTR(SlotFunExpr) inner = CAST(SlotFunExpr)(outer->body);
+        REQUIRE(inner != nullptr);
+        REQUIRE(inner->captures.size() == 2);
+        CHECK(inner->captures[0] == make_pair(1, 0));
+        CHECK(inner->captures[1] == make_pair(0, 0));
+        CHECK( resolve(parse_str("(_let a = 1 _in _fun (x) _fun (y) a + x + y)(10)(100)"))->interp()->to_string() == "111" );
+    }
+
+    SECTION("a variable used twice is captured once") {
+        PTR(ScopeExpr) scope = CAST(ScopeExpr)(resolve(parse_str("_let k = 3 _in _fun (x) k * x + k")));
+        PTR(SlotFunExpr) fun = CAST(SlotFunExpr)(CAST(SlotLetExpr)(scope->body)->body);
+        REQUIRE(fun != nullptr);
+        CHECK(fun->captures.size() == 1);
+    }
+
+    SECTION("closures keep only their captured values") {
+        PTR(FunVal) fun = CAST(FunVal)(resolve(parse_str("_let big = 5 _in _let k = 7 _in _fun (x) x + k"))->interp());
+        REQUIRE(fun != nullptr);
+        PTR(FrameEnv) captured = CAST(FrameEnv)(fun->env);
+        REQUIRE(captured != nullptr);
+        REQUIRE(captured->slots.size() == 1);
+        CHECK(captured->slots[0].equals(Value::number(7)));
+        PTR(FunVal) closed = CAST(FunVal)(resolve(parse_str("_let big = 5 _in _fun (x) x"))->interp());
+        REQUIRE(closed != nullptr);
+        CHECK(CAST(FrameEnv)(closed->env) == nullptr);
+    }
+
+    SECTION("captured values are the ones in scope where the function is made") {
+        CHECK( resolve(parse_str("_let x = 1 _in _let f = _fun (y) x + y _in _let x = 10 _in f(x)"))->interp()->to_string() == "11" );
+        CHECK( resolve(parse_str("_let x = 1 _in _fun (x) _fun (y) x + y"))->interp()->call(NEW(NumVal)(4))->call(NEW(NumVal)(5))->to_string() == "9" );
+        CHECK_THROWS_WITH( resolve(parse_str("_let f = _fun (y) y + z _in f(1)"))->interp(), "free variable: z" );
+        PTR(Env) env = NEW(ExtendedEnv)("z", NEW(NumVal)(5), Env::empty);
+        CHECK( resolve(parse_str("_let k = 1 _in (_fun (y) _fun (w) y + z + k)(2)(3)"))->interp(env)->to_string() == "8" );
+    }
+
+    SECTION("captures survive the msdb format") {
+        PTR(Expr) resolved = resolve(parse_str("_let a = 1 _in _let b = 2 _in (_fun (x) _fun (y) b + x + y)(10)(100)"));
+        ostringstream out;
+        write_msdb(resolved, out);
+        string bytes = out.str();
+        PTR(Expr) loaded = read_msdb(bytes.data(), bytes.size());
+        CHECK( loaded->interp()->to_string() == "112" );
+    }
+
+    SECTION("the frame pool reuses freed blocks") {
+        void *block = frame_allocate(40);
+        frame_deallocate(block, 40);
+        void *again = frame_allocate(48);
+        CHECK( again == block );
+        frame_deallocate(again, 48);
+        void *large = frame_allocate(4096);
+        CHECK( large != nullptr );
+        frame_deallocate(large, 4096);
+    }
+
+    SECTION("threads that exit release their pooled frames") {
+        PTR(Expr) fib = resolve(parse_str("_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+                                          "_else fib(fib)(n + -1) + fib(fib)(n + -2) _in fib(fib)(12)"));
+        string results[4];
+        vector<thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.push_back(thread([&results, fib, t]{ results[t] = fib->interp()->to_string(); }));
+        }
+        for (thread &worker : threads) {
+            worker.join();
+        }
+        for (int t = 0; t < 4; t++) {
+            CHECK( results[t] == "144" );
+        }
+    }
+}
+
+/**
+ * \brief An unbuffered sink that cannot report positions, like a pipe.
+ */
+class PipeBuf : public streambuf {
+public:
+    string text;
+
+protected:
+    int overflow(int c){
+        text += (char)c;
+        return c;
+    }
+};
+
+TEST_CASE("Testing streaming printer") {
+
+    SECTION("a PrintBuf reports the bytes written as its position") {
+        PipeBuf pipe;
+        ostream plain(&pipe);
+        CHECK( plain.tellp() == streampos(-1) );
+        {
+            PrintBuf buffer(&pipe);
+            ostream out(&buffer);
+            out << "abc";
+            CHECK( out.tellp() == streampos(3) );
+            out << string(40000, 'x');
+            CHECK( out.tellp() == streampos(40003) );
+        }
+        CHECK( pipe.text.size() == 40003 );
+        CHECK( pipe.text.compare(0, 4, "abcx") == 0 );
+    }
+
+    SECTION("pretty printing lines up the same on any stream") {
+        PTR(Expr) e = parse_str("_let x = 5 _in _if x == 5 _then _let y = 2 _in y * x _else 0");
+        string expected = e->to_pretty_string();
+        PipeBuf pipe;
+        ostream out(&pipe);
+        e->pretty_print(out);
+        CHECK( pipe.text == expected );
+        ostringstream prefixed;
+        prefixed << "xyz";
+        e->pretty_print(prefixed);
+        CHECK( prefixed.str() == "xyz" + expected );
+    }
+
+    SECTION("nested functions and calls print in one pass") {
+        string source, expected;
+        for (int i = 0; i < 2000; i++) {
+            source += "_fun (x) f(";
+            expected += "_fun (x) (f) (";
+        }
+        source += "1";
+        expected += "1";
+        for (int i = 0; i < 2000; i++) {
+            source += ")";
+            expected += ")";
+        }
+        CHECK( parse_str(source)->to_string() == expected );
+        PTR(Val) fun = parse_str("_fun (x) _fun (y) (_let z = x _in z + y)")->interp();
+        CHECK( fun->to_string() == "_fun (x) _fun (y) (_let z=x _in (z+y))" );
+    }
+
+    SECTION("write_program streams what run_program returns") {
+        const char *programs[] = {
+            "1 + 2 * 3",
+            "_let x = 1 _in _let y = x + 2 _in _if y == 3 _then x _else y",
+            "(_fun (x) x * 2)(21)",
+        };
+        run_mode_t modes[] = { do_print, do_pretty_print, do_interp, do_vm };
+        run_options_t optimized;
+        optimized.optimize = true;
+        for (const char *program : programs) {
+            for (run_mode_t mode : modes) {
+                ostringstream out, optimized_out;
+                write_program(mode, parse_str(program), run_options_t(), out);
+                CHECK( out.str() == run_program(mode, parse_str(program)) + "\n" );
+                write_program(mode, parse_str(program), optimized, optimized_out);
+                CHECK( optimized_out.str() == run_program(mode, parse_str(program), optimized) + "\n" );
+            }
+        }
+    }
+}
+
+TEST_CASE("Testing closure compiler") {
+
+    auto closures = [](const string &source){
+        return closure_run(closure_compile(parse_str(source)))->to_string();
+    };
+
+    SECTION("arithmetic, comparison and _if") {
+        CHECK( closures("1 + 2 * 3") == "7" );
+        CHECK( closures("2147483647 + 1") == "-2147483648" );
+        CHECK( closures("_if 1 == 2 _then 3 _else 4") == "4" );
+        CHECK( closures("_if 1 _then 3 _else 4") == "4" );
+        CHECK( closures("_if _true _then 1 _else x") == "1" );
+        CHECK( closures("_true == 1 == 1") == "_true" );
+        CHECK( closures("_true == _true") == "_true" );
+        CHECK( closures("(_fun (x) x) == (_fun (x) x)") == "_true" );
+    }
+
+    SECTION("every pair of operand kinds gives what interp gives") {
+        // a local slot, a captured slot, a number, a boolean, a function and a computed value
+        const char *operands[] = { "a", "b", "3", "_true", "(_fun (q) q)", "(b * 2)", "(_if a == 1 _then 5 _else b)" };
+        const char *ops[] = { "+", "*", "==" };
+        for (const char *op : ops) {
+            for (const char *lhs : operands) {
+                for (const char *rhs : operands) {
+                    string body = string(lhs) + " " + op + " " + rhs;
+                    string source = "_let b = 7 _in (_fun (a) " + body + ")(1)";
+                    string guarded = "_let b = 7 _in (_fun (a) _if " + body + " _then 10 _else 20)(1)";
+                    for (const string &program : { source, guarded }) {
+                        string expected;
+                        try {
+                            expected = resolve(parse_str(program))->interp()->to_string();
+                        }
+                        catch (runtime_error exn) {
+                            CHECK_THROWS_WITH( closures(program), exn.what() );
+                            continue;
+                        }
+                        CHECK( closures(program) == expected );
+                    }
+                }
+            }
+        }
+    }
+
+    SECTION("let, closures and chains") {
+        CHECK( closures("_let x = 8 _in _let f = _fun (x) x*x _in f(2)") == "4" );
+        CHECK( closures("_let y = 8 _in _let f = _fun (x) x*y _in f(2)") == "16" );
+        CHECK( closures("_let add = _fun (x) _fun (y) x + y _in add(3)(4)") == "7" );
+        CHECK( closures("_let a = 1 _in _let b = 2 _in (_fun (x) _fun (y) b + x + y)(10)(100)") == "112" );
+        CHECK( closures("_let factrl = _fun (factrl)"
+                                  "_fun (x)"
+                                      "_if x ==1"
+                                      "_then 1"
+                                      "_else x * factrl(factrl)(x + -1)"
+                        "_in  factrl(factrl)(10)") == "3628800" );
+        CHECK( closures("1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10") == "55" );
+        CHECK( closures("_let x = 2 _in 1 * x * 3 * x * 5 * x * 7 * x * 9") == "15120" );
+        CHECK( closures("1 == 2 == 3 == _false") == "_false" );
+    }
+
+    SECTION("functions print and compare like interp's") {
+        PTR(Val) fun = closure_run(closure_compile(parse_str("_let k = 1 _in _fun (x) x + k")));
+        CHECK( fun->kind == val_compiled );
+        CHECK( fun->to_string() == "_fun (x) (x+k)" );
+        PTR(Val) interpreted = resolve(parse_str("_let k = 1 _in _fun (x) x + k"))->interp();
+        CHECK( fun->equals(interpreted) );
+        CHECK( fun->hash() == interpreted->hash() );
+        CHECK( fun->call(NEW(NumVal)(4))->to_string() == "5" );
+    }
+
+    SECTION("functions of every evaluator compare the same way round") {
+        const string source = "_let k = 1 _in _fun (x) x + k";
+        vector<PTR(Val)> funs = {
+            parse_str(source)->interp(),
+            resolve(parse_str(source))->interp(),
+            vm_run(vm_compile(parse_str(source))),
+            closure_run(closure_compile(parse_str(source))),
+            flat_interp(flatten(parse_str(source))),
+        };
+        PTR(Val) other = closure_run(closure_compile(parse_str("_fun (y) y + 1")));
+        for (PTR(Val) &f : funs) {
+            for (PTR(Val) &g : funs) {
+                CHECK( f->equals(g) );
+                CHECK( f->hash() == g->hash() );
+            }
+            CHECK( !f->equals(other) );
+            CHECK( !other->equals(f) );
+            CHECK( !f->equals(NEW(NumVal)(1)) );
+        }
+    }
+
+    SECTION("tail calls run in constant stack") {
+        CHECK( closures("_let loop = _fun (loop) _fun (n)"
+                                  "_if n == 0 _then 0 _else loop(loop)(n + -1)"
+                        "_in loop(loop)(100000)") == "0" );
+        CHECK( closures("_let loop = _fun (loop) _fun (n)"
+                                  "_let m = n + -1 _in _if m == 0 _then 5 _else loop(loop)(m)"
+                        "_in loop(loop)(100000)") == "5" );
+    }
+
+    SECTION("errors match interp") {
+        CHECK_THROWS_WITH( closures("x + 1"), "free variable: x" );
+        CHECK_THROWS_WITH( closures("_true + 1"), "Bool cannot be added" );
+        CHECK_THROWS_WITH( closures("1 * _true"), "mult of a non-number" );
+        CHECK_THROWS_WITH( closures("1(2)"), "NumVal does not call()" );
+        CHECK_THROWS_WITH( closures("_false(2)"), "BoolVal does not call()" );
+        CHECK_THROWS_WITH( closures("1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + (_fun (x) x)"), "add of a non-number" );
+    }
+
+    SECTION("runs from the command line, batch and serve modes") {
+        istringstream in("1 + 2\n(_fun (x) x * 2)(21)\n_true + 1\n");
+        ostringstream out;
+        run_batch(in, out, do_closures);
+        CHECK( out.str() == "3\n42\nerror: Bool cannot be added\n" );
+        PTR(Expr) loaded = resolve(parse_str("_let x = 4 _in x * x"));
+        CHECK( run_program(do_closures, loaded) == "16" );
+        ProgramCache cache(16, false);
+        vector<string> responses = serve_session(":closures _let f = _fun (x) x + 1 _in f(2)\n:closures _let f = _fun (x) x + 1 _in f(2)\n", cache);
+        REQUIRE( responses.size() == 2 );
+        CHECK( responses[0] == "ok miss 3" );
+        CHECK( responses[1] == "ok hit 3" );
+    }
+}
+
+TEST_CASE("Testing parallel evaluation") {
+
+    ParallelEval *context = ParallelEval::with_workers(4);
+    // threshold 0 forks every +, *, == and call, so every node takes the parallel path
+    auto forked = [context](const string &source){
+        return add_forks(resolve(parse_str(source)), context, 0)->interp()->to_string();
+    };
+    const string fib = "_let fib = _fun (fib) _fun (x)"
+                           "_if x == 0 _then 1 _else _if x == 1 _then 1"
+                           "_else fib(fib)(x + -2) + fib(fib)(x + -1)";
+
+    SECTION("forks only where both operands are worth it") {
+        PTR(Expr) e = add_forks(resolve(parse_str("_let f = _fun (x) x _in f(1) + f(2)")), context);
+        PTR(SlotLetExpr) let = CAST(SlotLetExpr)(CAST(ScopeExpr)(e)->body);
+        REQUIRE(let != nullptr);
+        CHECK( let->body->kind == expr_fork );
+        CHECK( let->body->equals(parse_str("f(1) + f(2)")) );
+        CHECK( let->body->to_string() == "((f) (1)+(f) (2))" );
+        PTR(Expr) cheap = add_forks(resolve(parse_str("_let f = _fun (x) x _in f(1) + 2 * 3")), context);
+        CHECK( CAST(SlotLetExpr)(CAST(ScopeExpr)(cheap)->body)->body->kind == expr_add );
+    }
+
+    SECTION("results are the ones interp gives") {
+        const char *programs[] = {
+            "1 + 2 * 3",
+            "_let x = 5 _in _let y = x * x _in (x + y) * (y + x) == 900",
+            "_let add = _fun (x) _fun (y) x + y _in add(3)(4)",
+            "_let k = 2 _in (_fun (x) x * k)(21)",
+            "_if 1 == 1 _then (_let a = 3 _in a * a) + (_let b = 4 _in b * b) _else 0",
+            "(_fun (x) x) == (_fun (x) x)",
+            "(_fun (x) x + 1) == (_fun (x) x + 1)",
+            "_fun (x) x + 1",
+            "_if 1 _then 2 _else 3",
+        };
+        for (const char *program : programs) {
+            CHECK( forked(program) == resolve(parse_str(program))->interp()->to_string() );
+        }
+        CHECK( forked(fib + "_in fib(fib)(15)") == "987" );
+        CHECK( parallel_interp(parse_str(fib + "_in fib(fib)(15)"), 3)->to_string() == "987" );
+        CHECK( parallel_interp(parse_str("1 + 2"), 1)->to_string() == "3" );
+    }
+
+    SECTION("errors are the ones of the operand evaluated first") {
+        CHECK_THROWS_WITH( forked("x + y"), "free variable: x" );
+        CHECK_THROWS_WITH( forked("x == y"), "free variable: y" );
+        CHECK_THROWS_WITH( forked("f(y)"), "free variable: f" );
+        CHECK_THROWS_WITH( forked("1 + (2 * _true)"), "mult of a non-number" );
+        CHECK_THROWS_WITH( forked("_true + 1"), "Bool cannot be added" );
+        CHECK_THROWS_WITH( forked("(1 + 2)(3)"), "NumVal does not call()" );
+    }
+
+    SECTION("an error is not held back by an offered operand that never finishes") {
+        string program = "_let omega = _fun (w) w(w)"
+                         "_in _let loop = _fun (loop) _fun (n)"
+                                           "_if n == 0 _then _true _else loop(loop)(n + -1)"
+                         "_in _if omega(omega) == (loop(loop)(20000) + 1) _then 1 _else 2";
+        for (int i = 0; i < 3; i++) {
+            CHECK_THROWS_WITH( forked(program), "Bool cannot be added" );
+        }
+    }
+
+    SECTION("forked operands run on the pool") {
+        unsigned long before = context->forks;
+        CHECK( forked(fib + "_in fib(fib)(12)") == "233" );
+        CHECK( (context->forks > before || USE_GC_POINTERS) );
+    }
+
+    SECTION("tail calls still run in constant stack") {
+        CHECK( forked("_let loop = _fun (loop) _fun (n)"
+                           "_if n == 0 _then 0 _else loop(loop)(n + -1)"
+                      "_in loop(loop)(100000)") == "0" );
+    }
+
+    SECTION("returned functions can be called after the run") {
+        PTR(Val) fun = parallel_interp(parse_str(fib + "_in _fun (n) fib(fib)(n) + fib(fib)(n)"), 4);
+        CHECK( fun->call(NEW(NumVal)(10))->to_string() == "178" );
+    }
+
+    SECTION("run_program interprets in parallel with --parallel") {
+        run_options_t options;
+        options.parallel = 4;
+        CHECK( run_program(do_interp, parse_str(fib + "_in fib(fib)(10)"), options) == "89" );
+        istringstream in("1 + 2\n_true + 1\n" + fib + "_in fib(fib)(8)\n");
+        ostringstream out;
+        run_batch(in, out, do_interp, options);
+        CHECK( out.str() == "3\nerror: Bool cannot be added\n34\n" );
+    }
+}
+
+TEST_CASE("Testing tail calls") {
+
+    string loop = "_let loop = _fun (loop) _fun (n)"
+                                "_if n == 0 _then 0 _else loop(loop)(n + -1)"
+                  "_in loop(loop)(100000)";
+
+    SECTION("tail calls run in constant native stack") {
+        CHECK( parse_str(loop)->interp()->to_string() == "0" );
+        CHECK( resolve(parse_str(loop))->interp()->to_string() == "0" );
+    }
+
+    SECTION("let bodies and if branches are tail positions") {
+        string count = "_let count = _fun (count) _fun (n)"
+                                      "_if n == 0 _then _true"
+                                      "_else _let m = n + -1 _in count(count)(m)"
+                       "_in count(count)(100000)";
+        CHECK( parse_str(count)->interp()->to_string() == "_true" );
+        CHECK( resolve(parse_str(count))->interp()->to_string() == "_true" );
+    }
+
+    SECTION("non-tail calls still return to their caller") {
+        CHECK( parse_str("_let f = _fun (x) x + 1 _in f(f(1)) * 2")->interp()->to_string() == "6" );
+        CHECK( (NEW(FunVal)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(1))))->call(NEW(NumVal)(4))->to_string() == "5" );
+    }
+}
+
+TEST_CASE("Testing lazy evaluation") {
+
+    auto lazy = [](const string &source){
+        return resolve(make_lazy(parse_str(source)))->interp()->to_string();
+    };
+    const string fib = "_let fib = _fun (fib) _fun (x)"
+                           "_if x == 0 _then 1 _else _if x == 1 _then 1"
+                           "_else fib(fib)(x + -2) + fib(fib)(x + -1)";
+
+    SECTION("bindings and arguments nobody reads are never evaluated") {
+        CHECK( lazy("_let x = 1 + _true _in 5") == "5" );
+        CHECK( lazy("(_fun (y) 7)(_true + 1)") == "7" );
+        CHECK( lazy("_let f = _fun (y) 7 _in f(_true + 1) + f(x)") == "14" );
+        CHECK( lazy("_let x = 1 + _true _in _if _false _then x _else 3") == "3" );
+        CHECK( lazy("_let k = _fun (x) _fun (y) x _in k(2)(_true * 3)") == "2" );
+    }
+
+    SECTION("results are the ones interp gives") {
+        const char *programs[] = {
+            "1 + 2 * 3",
+            "_let x = 2 * 3 _in x + x",
+            "_let x = 5 _in _let y = x * x _in (x + y) * (y + x) == 900",
+            "_let add = _fun (x) _fun (y) x + y _in add(3)(4)",
+            "_let y = 2 _in _let x = y + 1 _in _let z = 5 _in x * z",
+            "_let x = 1 _in _let x = x + 1 _in _let y = x * 10 _in y + x",
+            "_let a = 1 + 1 _in _let f = _fun (b) a + b _in f(a) + f(3)",
+            "_fun (x) x + 1",
+        };
+        for (const char *program : programs) {
+            CHECK( lazy(program) == resolve(parse_str(program))->interp()->to_string() );
+            CHECK( make_lazy(parse_str(program))->interp()->to_string() == parse_str(program)->interp()->to_string() );
+        }
+        CHECK( lazy(fib + "_in fib(fib)(15)") == "987" );
+    }
+
+    SECTION("functions compare by their code, whether or not it was rewritten") {
+        CHECK( lazy("(_fun (x) x) == (_fun (x) x)") == "_true" );
+        CHECK( lazy("_let y = 1 + 2 _in (_fun (x) x + y) == (_fun (x) x + y)") == "_true" );
+        CHECK( lazy("(_fun (x) x) == (_fun (x) x + 1)") == "_false" );
+        run_options_t options;
+        options.lazy = true;
+        CHECK( run_program(do_interp, parse_str("(_fun (x) x) == (_fun (x) x)"), options) == "_true" );
+    }
+
+    SECTION("the use counts decide how each binding is made") {
+        // never used: dropped
+        CHECK( make_lazy(parse_str("_let x = 1 + 2 _in 5"))->kind == expr_num );
+        // used once: moved to the use
+        PTR(Expr) once = make_lazy(parse_str("_let x = 1 + 2 _in _if _true _then x _else 0"));
+        CHECK( once->kind == expr_if );
+        CHECK( once->equals(parse_str("_if _true _then 1 + 2 _else 0")) );
+        // used twice, or inside a _fun: delayed
+        PTR(Expr) twice = make_lazy(parse_str("_let x = 1 + 2 _in x * x"));
+        REQUIRE( twice->kind == expr_let );
+        CHECK( CAST(LetExpr)(twice)->rhs->kind == expr_delay );
+        PTR(Expr) in_fun = make_lazy(parse_str("_let x = 1 + 2 _in _fun (y) x"));
+        REQUIRE( in_fun->kind == expr_let );
+        CHECK( CAST(LetExpr)(in_fun)->rhs->kind == expr_delay );
+        // a literal is bound as it is
+        CHECK( CAST(LetExpr)(make_lazy(parse_str("_let x = 3 _in x * x")))->rhs->kind == expr_num );
+        // moving the rhs past a binder of one of its variables would capture it
+        PTR(Expr) captured = make_lazy(parse_str("_let x = y + 1 _in _let y = 5 _in x"));
+        CHECK( captured->kind == expr_let );
+        CHECK_THROWS_WITH( resolve(captured)->interp(), "free variable: y" );
+        // a _fun knows whether it reads its argument
+        CHECK( CAST(FunExpr)(make_lazy(parse_str("_fun (x) 1")))->arg_used == false );
+        CHECK( CAST(FunExpr)(make_lazy(parse_str("_fun (x) _fun (y) x")))->arg_used == true );
+    }
+
+    SECTION("thunks are forced once and then let go of their code") {
+        PTR(ThunkVal) thunk = NEW(ThunkVal)(parse_str("2 * 21"), Env::empty, -1);
+        CHECK( force(Value(thunk)).num == 42 );
+        CHECK( thunk->forced );
+        CHECK( thunk->body == nullptr );
+        CHECK( force(Value(thunk)).num == 42 );
+        CHECK( thunk->to_string() == "42" );
+        PTR(ThunkVal) failing = NEW(ThunkVal)(parse_str("_true + 1"), Env::empty, -1);
+        CHECK_THROWS_WITH( failing->force(), "Bool cannot be added" );
+        CHECK_FALSE( failing->forced );
+        CHECK_THROWS_WITH( failing->force(), "Bool cannot be added" );
+    }
+
+    SECTION("errors come from the bindings that are used") {
+        CHECK_THROWS_WITH( lazy("_let x = _true + 1 _in x * x"), "Bool cannot be added" );
+        CHECK_THROWS_WITH( lazy("(_fun (x) x + 1)(_false)"), "Bool cannot be added" );
+        CHECK_THROWS_WITH( lazy("1(2)"), "NumVal does not call()" );
+        CHECK_THROWS_WITH( lazy("x + 1"), "free variable: x" );
+        // operands are evaluated in interp's order, so the first error is the one it gives
+        CHECK_THROWS_WITH( parse_str("x == (1 + _true)")->interp(), "add of a non-number" );
+        CHECK_THROWS_WITH( lazy("x == (1 + _true)"), "add of a non-number" );
+        CHECK_THROWS_WITH( lazy("(1 + _true) == x"), "free variable: x" );
+    }
+
+    SECTION("tail calls still run in constant stack") {
+        CHECK( lazy("_let loop = _fun (loop) _fun (n)"
+                         "_if n == 0 _then 0 _else loop(loop)(n + -1)"
+                    "_in loop(loop)(100000)") == "0" );
+    }
+
+    SECTION("returned functions keep their thunks") {
+        PTR(Val) fun = resolve(make_lazy(parse_str("_let k = 20 + 1 _in _let f = _fun (x) x * k _in _fun (y) f(y) + k")))->interp();
+        CHECK( fun->call(NEW(NumVal)(2))->to_string() == "63" );
+    }
+
+    SECTION("run_program evaluates lazily with --lazy") {
+        run_options_t options;
+        options.lazy = true;
+        CHECK( run_program(do_interp, parse_str("_let x = _true + 1 _in 4"), options) == "4" );
+        CHECK( run_program(do_interp, resolve(parse_str("_let x = _true + 1 _in 4")), options) == "4" );
+        istringstream in("_let x = _true + 1 _in 4\n(_fun (x) x * 2)(21)\n_true + 1\n");
+        ostringstream out;
+        run_batch(in, out, do_interp, options);
+        CHECK( out.str() == "4\n42\nerror: Bool cannot be added\n" );
+    }
+}
+
+TEST_CASE("Testing quotas") {
+
+    const string forever = "_let loop = _fun (loop) _fun (n) loop(loop)(n + 1) _in loop(loop)(0)";
+    // each round makes a closure that keeps the previous one, so memory only grows
+    const string growing = "_let loop = _fun (loop) _fun (f) loop(loop)(_fun (x) f(x)) _in loop(loop)(_fun (x) x)";
+    auto governed = [](const Quota &quota, run_mode_t mode, const string &source){
+        run_options_t options;
+        options.quota = quota;
+        return run_program(mode, parse_str(source), options);
+    };
+
+    SECTION("the step limit stops runaway recursion in every evaluator") {
+        Quota quota;
+        quota.max_steps = 100000;
+        CHECK_THROWS_AS( governed(quota, do_interp, forever), quota_error );
+        CHECK_THROWS_WITH( governed(quota, do_interp, forever), "step limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_vm, forever), "step limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_closures, forever), "step limit exceeded" );
+        CHECK( governed(quota, do_interp, "_let f = _fun (x) x * 2 _in f(21)") == "42" );
+    }
+
+    SECTION("the step limit is exact") {
+        Quota quota;
+        quota.max_steps = 3;
+        Governor governor(quota);
+        GovernorScope scope(&governor);
+        // the add and its two operands
+        CHECK( parse_str("1 + 2")->interp()->to_string() == "3" );
+        CHECK_THROWS_WITH( parse_str("1")->interp(), "step limit exceeded" );
+    }
+
+    SECTION("the time limit stops a loop that takes no memory") {
+        Quota quota;
+        quota.time_limit_ms = 50;
+        CHECK_THROWS_WITH( governed(quota, do_interp, forever), "time limit exceeded" );
+    }
+
+    SECTION("the memory limit stops a growing chain of closures, which is freed") {
+        Quota quota;
+        quota.max_memory = 1 << 20;
+        CHECK_THROWS_WITH( governed(quota, do_interp, growing), "memory limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_vm, growing), "memory limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_closures, growing), "memory limit exceeded" );
+    }
+
+    SECTION("the memory limit counts recycled frames and closures on every backend") {
+        // fib keeps little, but every call allocates a frame and a closure
+        const string fib = "_let fib = _fun (fib) _fun (x)"
+                               "_if x == 0 _then 1 _else _if x == 1 _then 1"
+                               "_else fib(fib)(x + -2) + fib(fib)(x + -1)"
+                           "_in fib(fib)(25)";
+        Quota quota;
+        quota.max_memory = 1 << 20;
+        CHECK_THROWS_WITH( governed(quota, do_interp, fib), "memory limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_vm, fib), "memory limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_closures, fib), "memory limit exceeded" );
+        CHECK_THROWS_WITH( governed(quota, do_flat, fib), "memory limit exceeded" );
+        quota.max_memory = 1 << 30;
+        CHECK( governed(quota, do_interp, fib) == "121393" );
+    }
+
+    SECTION("without a quota nothing is counted") {
+        CHECK( Governor::current == nullptr );
+        CHECK( run_program(do_interp, parse_str("_let f = _fun (x) x * 2 _in f(21)")) == "42" );
+        CHECK( Governor::current == nullptr );
+    }
+
+    SECTION("a nested governor's steps count only against it") {
+        Quota outer_quota;
+        outer_quota.max_steps = 10;
+        Governor outer(outer_quota);
+        GovernorScope outer_scope(&outer);
+        CHECK( parse_str("1 + 2")->interp()->to_string() == "3" );
+        {
+            Quota inner_quota;
+            inner_quota.max_steps = 1000;
+            Governor inner(inner_quota);
+            GovernorScope inner_scope(&inner);
+            CHECK( parse_str("1 + 2 + 3 + 4 + 5")->interp()->to_string() == "15" );
+        }
+        CHECK( parse_str("1 + 2")->interp()->to_string() == "3" );
+        CHECK( outer.steps <= 6 );
+    }
+
+    SECTION("batch and serve report quota errors apart from other errors") {
+        run_options_t options;
+        options.quota.max_steps = 10000;
+        istringstream in("1 + 2\n" + forever + "\n_true + 1\n");
+        ostringstream out;
+        run_batch(in, out, do_interp, options);
+        CHECK( out.str() == "3\nquota: step limit exceeded\nerror: Bool cannot be added\n" );
+        ProgramCache cache(16, false);
+        CHECK( serve_session(forever + "\n1 + 2\n", cache, do_interp, options)
+               == vector<string>({"quota miss step limit exceeded", "ok miss 3"}) );
+    }
+
+    SECTION("long chains are freed without deep recursion") {
+        PTR(Val) chain = resolve(parse_str("_let loop = _fun (loop) _fun (f) _fun (n)"
+                                               "_if n == 0 _then f _else loop(loop)(_fun (x) f(x))(n + -1)"
+                                           "_in loop(loop)(_fun (x) x)(200000)"))->interp();
+        CHECK( chain->call(NEW(NumVal)(5))->to_string() == "5" );
+        chain = nullptr;
+    }
+}
+
+TEST_CASE("Testing typecheck") {
+
+    const string fib = "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+                       "_else fib(fib)(n + -1) + fib(fib)(n + -2) ";
+    auto typed = [](run_mode_t mode, const string &source){
+        run_options_t options;
+        options.typecheck = true;
+        return run_program(mode, parse_str(source), options);
+    };
+
+    SECTION("numbers, booleans and functions") {
+        CHECK( type_of(parse_str("1")) == "number" );
+        CHECK( type_of(parse_str("_true")) == "boolean" );
+        CHECK( type_of(parse_str("1 == _true")) == "boolean" );
+        CHECK( type_of(parse_str("_fun (x) x + 1")) == "(number -> number)" );
+        // a condition can be of any type, the else branch running for one that is not a boolean
+        CHECK( type_of(parse_str("_fun (x) _if x _then 1 _else 2")) == "(a -> number)" );
+        CHECK( type_of(parse_str("_fun (x) x")) == "(a -> a)" );
+        CHECK( type_of(parse_str("_fun (f) _fun (x) f(x)")) == "((a -> b) -> (a -> b))" );
+    }
+
+    SECTION("_let generalizes, and self-application has a recursive type") {
+        CHECK( type_of(parse_str("_let id = _fun (x) x _in _if id(_true) _then id(1) _else 2")) == "number" );
+        CHECK( type_of(parse_str(fib + "_in fib(fib)(10)")) == "number" );
+        CHECK( type_of(parse_str("_fun (x) x(x)")) == "((... -> a) -> a)" );
+    }
+
+    SECTION("ill-typed programs are rejected before they run") {
+        CHECK_THROWS_AS( typecheck(parse_str("_true + 1")), type_error );
+        CHECK_THROWS_WITH( typecheck(parse_str("_true + 1")), "type error: boolean used as number in (_true+1)" );
+        CHECK_THROWS_AS( typecheck(parse_str("1(2)")), type_error );
+        CHECK_THROWS_AS( typecheck(parse_str("_fun (f) f(1) + f(_true)")), type_error );
+        CHECK_THROWS_AS( typecheck(parse_str("_let f = _fun (x) x + 1 _in f(_true)")), type_error );
+        // the interpreter never reaches the bad add
+        CHECK( parse_str("_if _true _then 1 _else _true + 1")->interp()->to_string() == "1" );
+        CHECK_THROWS_AS( typecheck(parse_str("_if _true _then 1 _else _true + 1")), type_error );
+    }
+
+    SECTION("proven operations are marked, and branches that disagree keep their checks") {
+        PTR(Expr) e = typecheck(parse_str("_let f = _fun (x) x + 1 _in f(2)"));
+        PTR(FunExpr) f = CAST(FunExpr)(CAST(LetExpr)(e)->rhs);
+        CHECK( CAST(AddExpr)(f->body)->typed );
+        e = typecheck(parse_str("_let x = _if _true _then 1 _else _false _in x + 1"));
+        CHECK( !CAST(AddExpr)(CAST(LetExpr)(e)->body)->typed );
+        CHECK( CAST(IfExpr)(CAST(LetExpr)(e)->rhs)->typed );
+        CHECK( resolve(e)->interp()->to_string() == "2" );
+        CHECK_THROWS_WITH( resolve(typecheck(parse_str("_let x = _if _true _then _false _else 1 _in x + 1")))->interp(),
+                           "Bool cannot be added" );
+        // a condition that is not a boolean picks the else branch, as it does unchecked
+        CHECK( !CAST(IfExpr)(typecheck(parse_str("_if 1 _then 2 _else 3")))->typed );
+        CHECK( typed(do_interp, "_if 1 _then 2 _else 3") == "3" );
+        CHECK( typed(do_interp, "_let f = _fun (c) _if c _then 1 _else 2 _in f(5) + f(_true)") == "3" );
+        CHECK( !CAST(IfExpr)(CAST(FunExpr)(typecheck(parse_str("_fun (c) _if c _then 1 _else 2")))->body)->typed );
+        CHECK( CAST(IfExpr)(CAST(FunExpr)(typecheck(parse_str("_fun (n) _if n == 0 _then 1 _else 2")))->body)->typed );
+    }
+
+    SECTION("a free variable passes, and fails when read") {
+        CHECK( type_of(parse_str("x + 1")) == "number" );
+        CHECK_THROWS_WITH( typed(do_interp, "x + 1"), "free variable: x" );
+    }
+
+    SECTION("every evaluator runs typed programs to the same results") {
+        vector<string> programs = {
+            fib + "_in fib(fib)(15)",
+            "_let sum = _fun (sum) _fun (n) _if n == 0 _then 0 _else n + sum(sum)(n + -1) _in sum(sum)(100)",
+            "_let k = 2 _in (_fun (x) x * k * 3)(7)",
+            "_let x = _if _true _then 1 _else _false _in x + 1",
+            "(_fun (x) x) == (_fun (x) x)",
+            "_fun (x) x + 1",
+            "_if 1 _then 2 _else 3",
+        };
+        for (const string &program : programs) {
+            string expected = run_program(do_interp, parse_str(program));
+            CHECK( typed(do_interp, program) == expected );
+            CHECK( typed(do_vm, program) == expected );
+            CHECK( typed(do_closures, program) == expected );
+            run_options_t lazy;
+            lazy.lazy = true;
+            string lazy_expected = run_program(do_interp, parse_str(program), lazy);
+            lazy.typecheck = true;
+            CHECK( run_program(do_interp, parse_str(program), lazy) == lazy_expected );
+        }
+    }
+
+    SECTION("batch reports type errors like other errors") {
+        run_options_t options;
+        options.typecheck = true;
+        istringstream in("1 + 2\n_if _true _then 1 _else _true + 1\n");
+        ostringstream out;
+        run_batch(in, out, do_interp, options);
+        CHECK( out.str() == "3\nerror: type error: boolean used as number in (_true+1)\n" );
+        ProgramCache cache(16, false, true);
+        CHECK( serve_session("_true + 1\n3 * 4\n", cache, do_interp, options)
+               == vector<string>({"error miss type error: boolean used as number in (_true+1)", "ok miss 12"}) );
+    }
+}
+
+TEST_CASE("Testing FlatTree") {
+
+    const string fib = "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+                       "_else fib(fib)(n + -1) + fib(fib)(n + -2) _in fib(fib)(15)";
+    vector<string> programs = {
+        fib,
+        "1 + 2 * 3",
+        "_let x = 5 _in _let f = _fun (y) x * y + 1 _in f(3) + f(4)",
+        "1 == 2 == _false",
+        "_if 1 == 1 _then _true _else _false",
+        "(_fun (x) x) == (_fun (x) x)",
+        "_let k = 2 _in _fun (x) x * k",
+        "_let x = 1 _in _let x = x + 1 _in x * 10",
+    };
+
+    SECTION("nodes are laid out in post-order, names and numbers in tables") {
+        PTR(FlatTree) tree = flatten(parse_str("_let x = 1 _in x + x"));
+        CHECK( tree->size() == 5 );
+        CHECK( tree->kind(tree->root()) == expr_let );
+        CHECK( tree->kind(0) == expr_num );
+        CHECK( tree->start(tree->root()) == 0 );
+        CHECK( tree->start(3) == 1 );
+        CHECK( tree->symbols == vector<string>({"x"}) );
+        CHECK( tree->vars.size() == 2 );
+        CHECK( tree->numbers == vector<int>({1}) );
+        CHECK( tree->bytes() > 0 );
+    }
+
+    SECTION("parsed and resolved trees convert back to the parsed tree") {
+        for (const string &program : programs) {
+            PTR(Expr) e = parse_str(program);
+            CHECK( unflatten(*flatten(e))->equals(e) );
+            CHECK( unflatten(*flatten(resolve(e)))->equals(e) );
+            CHECK( unflatten(*flatten(e))->to_string() == e->to_string() );
+        }
+        PTR(Expr) sum = parse_str("1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + x");
+        CHECK( resolve(sum)->kind == expr_scope );
+        CHECK( unflatten(*flatten(resolve(sum)))->equals(sum) );
+        CHECK_THROWS_WITH( flatten(make_lazy(parse_str("_let x = 1 _in x"))), Catch::Contains("cannot flatten expression") );
+    }
+
+    SECTION("resolve() gives the slots and captures resolve() gives an Expr tree") {
+        PTR(FlatTree) tree = flatten(parse_str("_let x = 1 _in _fun (y) x + y + z"));
+        resolve(*tree);
+        CHECK( tree->resolved );
+        CHECK( tree->frame_size == 1 );
+        CHECK( tree->lets[0].slot == 0 );
+        CHECK( tree->funs[0].frame_size == 1 );
+        CHECK( tree->funs[0].capture_count == 1 );
+        CHECK( tree->captures[tree->funs[0].first_capture] == make_pair(0, 0) );
+        CHECK( (tree->vars[0].depth == 1 && tree->vars[0].slot == 0) );
+        CHECK( (tree->vars[1].depth == 0 && tree->vars[1].slot == 0) );
+        CHECK( tree->vars[2].depth == -1 );
+        resolve(*tree);
+        CHECK( tree->captures.size() == 1 );
+    }
+
+    SECTION("optimize() folds what optimize() folds") {
+        vector<string> foldable = {
+            "1 + 2 * 3",
+            "_let x = 5 _in x * x + y",
+            "_if 1 == 1 _then 2 + 3 _else x",
+            "(_fun (x) x + 1)(2)",
+            "_fun (x) _let y = 2 _in x + y * 3",
+            "_true + 1 + 2",
+            "1 == _true == _false",
+            "_let x = 1 _in _fun (x) x + 1",
+            fib,
+        };
+        for (const string &program : foldable) {
+            PTR(Expr) e = parse_str(program);
+            PTR(FlatTree) optimized = optimize(*flatten(e));
+            CHECK( unflatten(*optimized)->to_string() == optimize(e)->to_string() );
+            CHECK( !optimized->resolved );
+        }
+        CHECK( optimize(*flatten(parse_str("_let x = 5 _in x * x + 1")))->size() == 1 );
+    }
+
+    SECTION("flat_interp() runs programs to the results of interp()") {
+        for (const string &program : programs) {
+            CHECK( flat_interp(flatten(parse_str(program)))->to_string() == parse_str(program)->interp()->to_string() );
+            CHECK( run_program(do_flat, parse_str(program)) == run_program(do_interp, parse_str(program)) );
+        }
+        PTR(Val) f = flat_interp(flatten(parse_str("_let k = 2 _in _fun (x) x * k")));
+        CHECK( f->kind == val_flat );
+        CHECK( f->call(NEW(NumVal)(21))->to_string() == "42" );
+        CHECK( f->to_string() == "_fun (x) (x*k)" );
+        CHECK( f->equals(parse_str("_let k = 3 _in _fun (x) x * k")->interp()) );
+        CHECK( f->hash() == flat_interp(flatten(parse_str("_fun (x) x * k")))->hash() );
+        CHECK( flat_interp(optimize(*flatten(parse_str(fib))))->to_string() == "610" );
+    }
+
+    SECTION("errors are the ones of interp()") {
+        CHECK_THROWS_WITH( flat_interp(flatten(parse_str("x + y"))), "free variable: x" );
+        CHECK_THROWS_WITH( flat_interp(flatten(parse_str("x == y"))), "free variable: y" );
+        CHECK_THROWS_WITH( flat_interp(flatten(parse_str("1 + (2 * _true)"))), "mult of a non-number" );
+        CHECK_THROWS_WITH( flat_interp(flatten(parse_str("_true + 1"))), "Bool cannot be added" );
+        CHECK_THROWS_WITH( flat_interp(flatten(parse_str("(1 + 2)(3)"))), "NumVal does not call()" );
+        Quota quota;
+        quota.max_steps = 100000;
+        run_options_t options;
+        options.quota = quota;
+        CHECK_THROWS_WITH( run_program(do_flat, parse_str("_let loop = _fun (loop) _fun (n) loop(loop)(n + 1) _in loop(loop)(0)"), options),
+                           "step limit exceeded" );
+    }
+
+    SECTION("long chains and loops take no native stack per node") {
+        string sum = "1";
+        for (int i = 1; i < 100000; i++) {
+            sum += " + 1";
+        }
+        PTR(FlatTree) tree = flatten(parse_str(sum));
+        CHECK( flat_interp(tree)->to_string() == "100000" );
+        CHECK( unflatten(*tree)->equals(parse_str(sum)) );
+        CHECK( unflatten(*optimize(*tree))->to_string() == "100000" );
+        CHECK( flat_interp(flatten(parse_str("_let loop = _fun (loop) _fun (n)"
+                                                 "_if n == 0 _then 0 _else loop(loop)(n + -1)"
+                                             "_in loop(loop)(1000000)")))->to_string() == "0" );
+    }
+}
+
+TEST_CASE("Testing scripts") {
+
+    const string fib = "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+                       "_else fib(fib)(n + -1) + fib(fib)(n + -2) ";
+
+    SECTION("inputs are named at compile time and given by position at run time") {
+        PTR(Script) rule = compile_script("_if age == 0 _then limit _else limit * 2", {"age", "limit"});
+        CHECK( rule->input("age") == 0 );
+        CHECK( rule->input("limit") == 1 );
+        Value inputs[2] = {Value::number(3), Value::number(100)};
+        CHECK( ScriptContext::local().run(*rule, inputs, 2).to_string() == "200" );
+        inputs[0] = Value::number(0);
+        CHECK( ScriptContext::local().run(*rule, inputs, 2).to_string() == "100" );
+        CHECK( compile_script("7", {})->inputs.empty() );
+        CHECK( ScriptContext::local().run(*compile_script("7", {}), vector<Value>()).to_string() == "7" );
+    }
+
+    SECTION("one script runs many times in one context") {
+        PTR(Script) script = compile_script(fib + "_in fib(fib)(n) + _let k = n _in k", {"n"});
+        ScriptContext context;
+        for (int n = 0; n < 15; n++) {
+            vector<Value> inputs(1, Value::number(n));
+            CHECK( context.run(*script, inputs).to_string() == run_program(do_interp, parse_str(fib + "_in fib(fib)(" + to_string(n) + ") + " + to_string(n))) );
+        }
+        CHECK( context.runs == 15 );
+    }
+
+    SECTION("inputs and results can be functions") {
+        PTR(Script) apply = compile_script("f(x)", {"f", "x"});
+        vector<Value> inputs;
+        inputs.push_back(Value(closure_run(closure_compile(parse_str("_fun (y) y * 3")))));
+        inputs.push_back(Value::number(5));
+        CHECK( ScriptContext::local().run(*apply, inputs).to_string() == "15" );
+
+        PTR(Script) adder = compile_script("_fun (y) x + y", {"x"});
+        Value add2 = ScriptContext::local().run(*adder, vector<Value>(1, Value::number(2)));
+        Value add10 = ScriptContext::local().run(*adder, vector<Value>(1, Value::number(10)));
+        // each closure keeps its own x, though the runs shared the context's slots
+        CHECK( add2.to_val()->call(NEW(NumVal)(1))->to_string() == "3" );
+        CHECK( add10.to_val()->call(NEW(NumVal)(1))->to_string() == "11" );
+    }
+
+    SECTION("a run lets go of its inputs") {
+#if USE_SHARED_POINTERS
+        PTR(Val) f = closure_run(closure_compile(parse_str("_fun (y) y")));
+        weak_ptr<Val> watch = f;
+        Value inputs[1] = {Value(f)};
+        f = nullptr;
+        CHECK( ScriptContext::local().run(*compile_script("g(1)", {"g"}), inputs, 1).to_string() == "1" );
+        inputs[0] = Value();
+        CHECK( watch.expired() );
+#endif
+    }
+
+    SECTION("errors") {
+        PTR(Script) script = compile_script("x + y", {"x", "y"});
+        CHECK_THROWS_WITH( script->input("z"), "no input named z" );
+        CHECK_THROWS_WITH( ScriptContext::local().run(*script, vector<Value>(1, Value::number(1))), "script takes 2 inputs, not 1" );
+        CHECK_THROWS_WITH( compile_script("x", {"x", "x"}), "duplicate input x" );
+        vector<Value> unset(2);
+        unset[0] = Value::number(1);
+        CHECK_THROWS_WITH( ScriptContext::local().run(*script, unset), "no value for input y" );
+        CHECK_THROWS( compile_script("1 +", {}) );
+        CHECK_THROWS_WITH( ScriptContext::local().run(*compile_script("x + y", {"x"}), vector<Value>(1, Value::number(1))), "free variable: y" );
+        Value bad[2] = {Value::boolean(true), Value::number(1)};
+        CHECK_THROWS_WITH( ScriptContext::local().run(*script, bad, 2), "Bool cannot be added" );
+        // the context is still good after a run has thrown
+        Value good[2] = {Value::number(1), Value::number(2)};
+        CHECK( ScriptContext::local().run(*script, good, 2).to_string() == "3" );
+    }
+
+    SECTION("under --typecheck, inputs are checked when the script runs") {
+        run_options_t options;
+        options.typecheck = true;
+        PTR(Script) script = compile_script("_let inc = _fun (v) v + 1 _in inc(x) + inc(2)", {"x"}, options);
+        CHECK( ScriptContext::local().run(*script, vector<Value>(1, Value::number(4))).to_string() == "8" );
+        CHECK_THROWS_WITH( ScriptContext::local().run(*script, vector<Value>(1, Value::boolean(true))), "Bool cannot be added" );
+        CHECK_THROWS_AS( compile_script("x + _true", {"x"}, options), type_error );
+    }
+
+    SECTION("every run gets the quota") {
+        run_options_t options;
+        options.quota.max_steps = 10000;
+        PTR(Script) loop = compile_script("_let loop = _fun (loop) _fun (n) _if n == 0 _then 0 _else loop(loop)(n + -1) "
+                                          "_in loop(loop)(n)", {"n"}, options);
+        CHECK( ScriptContext::local().run(*loop, vector<Value>(1, Value::number(100))).to_string() == "0" );
+        CHECK_THROWS_AS( ScriptContext::local().run(*loop, vector<Value>(1, Value::number(1000000))), quota_error );
+        CHECK( ScriptContext::local().run(*loop, vector<Value>(1, Value::number(100))).to_string() == "0" );
+    }
+
+    SECTION("calls in tail position run in constant stack") {
+        PTR(Script) loop = compile_script("_let loop = _fun (loop) _fun (n) _if n == 0 _then 0 _else loop(loop)(n + -1) "
+                                          "_in loop(loop)(n)", {"n"});
+        CHECK( ScriptContext::local().run(*loop, vector<Value>(1, Value::number(1000000))).to_string() == "0" );
+    }
+
+    SECTION("each thread has its own context for one shared script") {
+        PTR(Script) script = compile_script(fib + "_in fib(fib)(n)", {"n"});
+        vector<string> results(4);
+        vector<ScriptContext *> contexts(4);
+        vector<thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.push_back(thread([&results, &contexts, script, t]{
+                contexts[t] = &ScriptContext::local();
+                results[t] = contexts[t]->run(*script, vector<Value>(1, Value::number(10 + t))).to_string();
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+        CHECK( results[0] == "55" );
+        CHECK( results[3] == "233" );
+        CHECK( contexts[0] != contexts[1] );
+        CHECK( contexts[0] != &ScriptContext::local() );
+    }
+}
+
+TEST_CASE("Testing command line modes") {
+
+    auto mode_of = [](vector<string> args){
+        vector<char *> argv;
+        for (string &arg : args) {
+            argv.push_back(&arg[0]);
+        }
+        run_options_t options;
+        return use_arguments((int)argv.size(), argv.data(), options);
+    };
+
+    SECTION("a flag that changes how programs run interprets them when no mode is given") {
+        CHECK( mode_of({"msdscript"}) == do_nothing );
+        CHECK( mode_of({"msdscript", "--optimize"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--intern"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--memoize"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--resolve"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--typecheck"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--max-steps", "100"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--lazy"}) == do_interp );
+        CHECK( mode_of({"msdscript", "--optimize", "--print"}) == do_print );
+        CHECK( mode_of({"msdscript", "--vm", "--typecheck"}) == do_vm );
+    }
+}
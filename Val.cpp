@@ -6,8 +6,140 @@
 //
 
 #include "Val.hpp"
+#include "profile.hpp"
 
-//======================  NumVal  ======================//
+//======================  Value  ======================//
+
+Value::Value(){
+    tag = boxed_tag;
+    num = 0;
+    boxed = nullptr;
+}
+
+/**
+ * \brief Wraps a Val, unboxing numbers and booleans into immediates.
+ */
+Value::Value(PTR(Val) v){
+    num = 0;
+    boxed = nullptr;
+    if (v != nullptr && v->kind == val_num) {
+        tag = num_tag;
+        num = static_cast<NumVal *>(&*v)->val;
+    }
+    else if (v != nullptr && v->kind == val_bool) {
+        tag = bool_tag;
+        num = static_cast<BoolVal *>(&*v)->val;
+    }
+    else {
+        tag = boxed_tag;
+        boxed = v;
+    }
+}
+
+/**
+ * \brief Boxes the value as a Val for callers outside the interpreter.
+ */
+PTR(Val) Value::to_val() const{
+    switch (tag) {
+        case num_tag:
+            return NEW(NumVal)(num);
+        case bool_tag:
+            return NEW(BoolVal)(num != 0);
+        default:
+            return boxed;
+    }
+}
+
+bool Value::equals(const Value &other) const{
+    switch (tag) {
+        case num_tag:
+        case bool_tag:
+            return other.tag == tag && other.num == num;
+        default:
+            return other.tag == boxed_tag && boxed->equals(other.boxed);
+    }
+}
+
+/**
+ * \brief Hash consistent with equals(); numbers and booleans hash like their Val boxes.
+ */
+size_t Value::hash() const{
+    switch (tag) {
+        case num_tag:
+            return hash_mix(3, num);
+        case bool_tag:
+            return hash_mix(6, num);
+        default:
+            return boxed == nullptr ? 0 : boxed->hash();
+    }
+}
+
+Value Value::add_to(const Value &other) const{
+    switch (tag) {
+        case num_tag:
+            if(other.tag != num_tag) throw runtime_error("add of a non-number");
+            return number((unsigned)num + (unsigned)other.num);
+        case bool_tag:
+            throw runtime_error("Bool cannot be added");
+        default:
+            return Value(boxed->add_to(other.to_val()));
+    }
+}
+
+Value Value::mult_with(const Value &other) const{
+    switch (tag) {
+        case num_tag:
+            if(other.tag != num_tag) throw runtime_error("mult of a non-number");
+            return number((unsigned)num * (unsigned)other.num);
+        case bool_tag:
+            throw runtime_error("Bool cannot be multiplied");
+        default:
+            return Value(boxed->mult_with(other.to_val()));
+    }
+}
+
+bool Value::is_true() const{
+    switch (tag) {
+        case num_tag:
+            throw runtime_error("number cannot be boolean");
+        case bool_tag:
+            return num != 0;
+        default:
+            return boxed->is_true();
+    }
+}
+
+Value Value::call(const Value &actual_arg) const{
+    switch (tag) {
+        case num_tag:
+            throw runtime_error("NumVal does not call()");
+        case bool_tag:
+            throw runtime_error("BoolVal does not call()");
+        default:
+            return boxed->apply(actual_arg);
+    }
+}
+
+void Value::print(ostream &ostream) const{
+    switch (tag) {
+        case num_tag:
+            ostream << ::to_string(num);
+            break;
+        case bool_tag:
+            ostream << (num ? "_true" : "_false");
+            break;
+        default:
+            boxed->print(ostream);
+    }
+}
+
+string Value::to_string() const{
+    stringstream st("");
+    this->print(st);
+    return st.str();
+}
+
+//======================  Val  ======================//
 
 string Val::to_string(){
     stringstream st("");
@@ -15,7 +147,26 @@ string Val::to_string(){
     return st.str();
 }
 
+/**
+ * \brief Calls the value with an interpreter value; boxes the argument by default.
+ */
+Value Val::apply(const Value &actual_arg){
+    return Value(call(actual_arg.to_val()));
+}
+
+/**
+ * \brief Calls the value from a tail position. Functions that run an Expr body set
+ * `env` and `next` so Expr::eval() continues with the body instead of recursing;
+ * everything else just returns the result of apply().
+ */
+Value Val::tail_call(const Value &actual_arg, PTR(Env) &env, PTR(Expr) &next){
+    return apply(actual_arg);
+}
+
+//======================  NumVal  ======================//
+
 NumVal::NumVal(int val){
+    this->kind = val_num;
     this->val = val;
 }
 
@@ -24,24 +175,24 @@ PTR(Expr) NumVal::to_expr(){
 }
 
 bool NumVal::equals (PTR(Val) v){
-    PTR(NumVal) numPtr = CAST(NumVal)(v);
-    
-    if (numPtr == nullptr){
+    if (v == nullptr || v->kind != val_num){
         return false;
     }
-    return this->val == numPtr->val;
+    return this->val == static_cast<NumVal *>(&*v)->val;
+}
+
+size_t NumVal::hash(){
+    return hash_mix(3, val);
 }
 
 PTR(Val) NumVal::add_to(PTR(Val) other_val){
-    PTR(NumVal) other_num = CAST(NumVal)(other_val);
-    if(other_num == NULL) throw runtime_error("add of a non-number");
-    return NEW( NumVal)((unsigned)this->val + (unsigned)other_num->val);
+    if(other_val == NULL || other_val->kind != val_num) throw runtime_error("add of a non-number");
+    return NEW( NumVal)((unsigned)this->val + (unsigned)static_cast<NumVal *>(&*other_val)->val);
 }
 
 PTR(Val) NumVal::mult_with(PTR(Val) other_val){
-    PTR(NumVal) other_num = CAST(NumVal)(other_val);
-    if(other_num == NULL) throw runtime_error("mult of a non-number");
-    return NEW( NumVal)((unsigned)this->val * (unsigned)other_num->val);
+    if(other_val == NULL || other_val->kind != val_num) throw runtime_error("mult of a non-number");
+    return NEW( NumVal)((unsigned)this->val * (unsigned)static_cast<NumVal *>(&*other_val)->val);
 }
 
 void NumVal::print (ostream &ostream){
@@ -59,6 +210,7 @@ PTR(Val) NumVal::call(PTR(Val) actual_arg){
 //======================  BoolVal  ======================//
 
 BoolVal::BoolVal(bool b){
+    kind = val_bool;
     val = b;
 }
 
@@ -67,12 +219,14 @@ PTR(Expr) BoolVal::to_expr(){
 }
 
 bool BoolVal::equals (PTR(Val) v){
-    PTR(BoolVal) boolPtr = CAST(BoolVal)(v);
-    
-    if (boolPtr == nullptr){
+    if (v == nullptr || v->kind != val_bool){
         return false;
     }
-    return this->val == boolPtr->val;
+    return this->val == static_cast<BoolVal *>(&*v)->val;
+}
+
+size_t BoolVal::hash(){
+    return hash_mix(6, val);
 }
 
 PTR(Val) BoolVal::add_to(PTR(Val) other_val){
@@ -103,12 +257,14 @@ PTR(Val) BoolVal::call(PTR(Val) actual_arg){
 //======================  FunVal  ======================//
 
 FunVal::FunVal(string formal_arg, PTR(Expr) body, PTR(Env) env){
+    this->kind = val_fun;
     if(env == nullptr) {
            env = Env::empty;
        }
     this->formal_arg = formal_arg;
         this->body = body;
         this->env = env;
+    this->arg_used = true;
 }
 
 PTR(Expr) FunVal::to_expr(){
@@ -116,14 +272,41 @@ PTR(Expr) FunVal::to_expr(){
 }
 
 bool FunVal::equals (PTR(Val) v){
-    PTR(FunVal) funPtr = CAST(FunVal)(v);
-    
-    if (funPtr == nullptr){
-        return false;
+    if (v == nullptr || v->kind != val_fun){
+        return function_equals(this, v);
     }
+    FunVal *funPtr = static_cast<FunVal *>(&*v);
     return this->formal_arg == funPtr->formal_arg && this->body->equals(funPtr->body);
 }
 
+/**
+ * \brief Compares a function with a value of another kind, by the same rule for every
+ * kind of function: the same argument and an equal body, whatever they captured. Each
+ * kind compares with its own kind directly and leaves the rest to this, so
+ * f.equals(g) is always g.equals(f).
+ */
+bool function_equals(Val *f, PTR(Val) v){
+    if (v == nullptr) {
+        return false;
+    }
+    switch (v->kind) {
+        case val_fun:
+        case val_closure:
+        case val_compiled:
+        case val_flat:
+            return f->to_expr()->equals(v->to_expr());
+        default:
+            return false;
+    }
+}
+
+/**
+ * \brief Like equals(), depends only on the code, not on the captured environment.
+ */
+size_t FunVal::hash(){
+    return hash_mix(hash_mix(9, std::hash<string>()(formal_arg)), body->hash);
+}
+
 PTR(Val) FunVal::add_to(PTR(Val) other_val){
     throw runtime_error("Function cannot be added");
 }
@@ -133,7 +316,8 @@ PTR(Val) FunVal::mult_with(PTR(Val) other_val){
 }
 
 void FunVal::print(ostream &ostream){
-    ostream << "_fun (" << this->formal_arg << ") " << this->body->to_string();
+    ostream << "_fun (" << this->formal_arg << ") ";
+    this->body->print(ostream);
 }
 
 bool FunVal::is_true(){
@@ -141,7 +325,38 @@ bool FunVal::is_true(){
 }
 
 PTR(Val) FunVal::call(PTR(Val) actual_arg){
+    return apply(Value(actual_arg)).to_val();
+}
+
+Value FunVal::apply(const Value &actual_arg){
+    PTR(Env) body_env = nullptr;
+    PTR(Expr) next = nullptr;
+    tail_call(actual_arg, body_env, next);
+    return next->eval(body_env);
+}
+
+Value FunVal::tail_call(const Value &actual_arg, PTR(Env) &env, PTR(Expr) &next){
+    if (Profiler::current != nullptr) {
+        Profiler::current->count_call(this);
+    }
+    env = NEW(ExtendedEnv)(this->formal_arg, actual_arg, this->env);
+    next = this->body;
+    return Value();
+}
 
-    return this->body->interp(NEW(ExtendedEnv)(this->formal_arg, actual_arg, this->env));
-    
+//======================  SlotFunVal  ======================//
+
+SlotFunVal::SlotFunVal(string formal_arg, PTR(Expr) body, PTR(Env) env, int frame_size) : FunVal(formal_arg, body, env) {
+    this->frame_size = frame_size;
+}
+
+Value SlotFunVal::tail_call(const Value &actual_arg, PTR(Env) &env, PTR(Expr) &next){
+    if (Profiler::current != nullptr) {
+        Profiler::current->count_call(this);
+    }
+    PTR(FrameEnv) frame = pool_new<FrameEnv>(frame_size, this->env);
+    frame->slots[0] = actual_arg;
+    env = frame;
+    next = this->body;
+    return Value();
 }
@@ -17,9 +17,29 @@ class Expr;
 
 //======================  Val  ======================//
 
+/**
+ * \brief The concrete class of a Val, for dispatch without dynamic casts. A
+ * SlotFunVal is a val_fun: it only differs from FunVal in how calls bind the argument.
+ * ClosureVal and CompiledFunVal are the functions of the VM and of --compile-closures.
+ * A ThunkVal is a delayed value of --lazy, and a FlatFunVal a function of --flat.
+ */
+typedef enum {
+    val_num,
+    val_bool,
+    val_fun,
+    val_closure,
+    val_compiled,
+    val_thunk,
+    val_flat
+} val_kind_t;
+
 CLASS( Val ){
 public:
+    // Set by the constructor of each concrete class.
+    val_kind_t kind;
+
     virtual bool equals (PTR(Val) v)=0;
+    virtual size_t hash()=0;
     virtual PTR(Expr) to_expr()=0;
     virtual PTR(Val) add_to(PTR(Val) other_val)=0;
     virtual PTR(Val) mult_with(PTR(Val) other_val)=0;
@@ -29,6 +49,8 @@ public:
     string to_string();
     
     virtual PTR(Val) call(PTR(Val) actual_arg) = 0;
+    virtual Value apply(const Value &actual_arg);
+    virtual Value tail_call(const Value &actual_arg, PTR(Env) &env, PTR(Expr) &next);
     
     virtual ~Val() {};
 };
@@ -42,6 +64,7 @@ public:
     
     virtual PTR(Expr) to_expr();
     virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
     virtual PTR(Val) add_to(PTR(Val) other_val);
     virtual PTR(Val) mult_with(PTR(Val) other_val);
     virtual void print(ostream &ostream);
@@ -59,6 +82,7 @@ public:
     
     virtual PTR(Expr) to_expr();
     virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
     virtual PTR(Val) add_to(PTR(Val) other_val);
     virtual PTR(Val) mult_with(PTR(Val) other_val);
     virtual void print(ostream &ostream);
@@ -74,15 +98,36 @@ public:
     string formal_arg;
     PTR(Expr) body;
     PTR(Env) env;
+    bool arg_used;   // copied from the FunExpr
     
     FunVal(string formal_arg, PTR(Expr) body, PTR(Env) env = nullptr);
     
     virtual PTR(Expr) to_expr();
     virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
     virtual PTR(Val) add_to(PTR(Val) other_val);
     virtual PTR(Val) mult_with(PTR(Val) other_val);
     virtual void print(ostream &ostream);
     virtual bool is_true();
     
     virtual PTR(Val) call(PTR(Val) actual_arg);
+    virtual Value apply(const Value &actual_arg);
+    virtual Value tail_call(const Value &actual_arg, PTR(Env) &env, PTR(Expr) &next);
+};
+
+bool function_equals(Val *f, PTR(Val) v);
+
+//======================  SlotFunVal  ======================//
+
+/**
+ * \brief A closure over a resolved _fun: each call gets a FrameEnv instead of an ExtendedEnv.
+ * `env` holds only the values the body captures, as a frame of their own.
+ */
+class SlotFunVal : public FunVal {
+public:
+    int frame_size;
+    
+    SlotFunVal(string formal_arg, PTR(Expr) body, PTR(Env) env, int frame_size);
+    
+    virtual Value tail_call(const Value &actual_arg, PTR(Env) &env, PTR(Expr) &next);
 };
@@ -0,0 +1,40 @@
+/**
+ * \file alloc.cpp
+ * \brief Replacement global operator new that counts allocations per thread.
+ */
+
+#include "alloc.hpp"
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+static thread_local unsigned long allocations = 0;
+static thread_local unsigned long allocated_bytes = 0;
+thread_local unsigned long pooled_bytes = 0;
+
+unsigned long thread_allocations(){
+    return allocations;
+}
+
+unsigned long thread_allocated_bytes(){
+    return allocated_bytes;
+}
+
+unsigned long thread_pooled_bytes(){
+    return pooled_bytes;
+}
+
+void *operator new(size_t size){
+    allocations++;
+    allocated_bytes += size;
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
@@ -0,0 +1,38 @@
+/**
+ * \file alloc.hpp
+ * \brief Heap allocation counting for the profiler and the benchmarks.
+ *
+ * alloc.cpp replaces the global operator new so every heap allocation made by the
+ * calling thread bumps thread-local counters of allocations and bytes. Linking it in
+ * costs two additions per allocation; callers take the difference of two readings.
+ * Memory the program hands out without operator new, such as a block the frame pool
+ * or the collector gives out again, or an arena chunk, is counted apart as pooled
+ * bytes, so the heap counts stay what they say.
+ */
+#pragma once
+
+#include <cstddef>
+
+extern thread_local unsigned long pooled_bytes;
+
+/**
+ * \brief The number of heap allocations the calling thread has made so far.
+ */
+unsigned long thread_allocations();
+
+/**
+ * \brief The number of bytes the calling thread has allocated so far, freed or not.
+ */
+unsigned long thread_allocated_bytes();
+
+/**
+ * \brief The number of bytes the calling thread has been handed without operator new.
+ */
+unsigned long thread_pooled_bytes();
+
+/**
+ * \brief Counts `size` bytes handed out without operator new.
+ */
+inline void count_pooled_bytes(size_t size){
+    pooled_bytes += size;
+}
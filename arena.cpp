@@ -0,0 +1,92 @@
+/**
+ * \file arena.cpp
+ * \brief Implementation of the bump allocator.
+ */
+
+#include "arena.hpp"
+#include "alloc.hpp"
+#include <cstdlib>
+#include <cstdint>
+
+Arena::Arena(size_t chunk_size){
+    this->chunk_size = chunk_size;
+    this->used = 0;
+    this->next = nullptr;
+    this->end = nullptr;
+}
+
+Arena::~Arena(){
+    reset();
+    for (char *chunk : chunks) {
+        free(chunk);
+    }
+}
+
+static char *align_up(char *p, size_t align){
+    return (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+static char *new_chunk(size_t size){
+    char *chunk = (char *)malloc(size);
+    if (chunk == nullptr) {
+        throw bad_alloc();
+    }
+    count_pooled_bytes(size);
+    return chunk;
+}
+
+/**
+ * \brief Bumps the allocation pointer, starting a new chunk when the current one is full.
+ * \param size The number of bytes needed.
+ * \param align The required alignment, a power of two.
+ * \return Memory that stays valid until reset().
+ */
+void *Arena::allocate(size_t size, size_t align){
+    char *p = align_up(next, align);
+    if (next == nullptr || p + size > end) {
+        if (size + align > chunk_size) {
+            // oversized requests get their own chunk, kept in front so the current chunk stays last
+            char *chunk = new_chunk(size + align);
+            chunks.insert(chunks.begin(), chunk);
+            used += size;
+            return align_up(chunk, align);
+        }
+        char *chunk = new_chunk(chunk_size);
+        chunks.push_back(chunk);
+        next = chunk;
+        end = chunk + chunk_size;
+        p = align_up(next, align);
+    }
+    next = p + size;
+    used += size;
+    return p;
+}
+
+/**
+ * \brief Releases everything allocated so far, keeping one chunk for reuse.
+ */
+void Arena::reset(){
+    for (size_t i = destructors.size(); i > 0; i--) {
+        destructors[i - 1].second(destructors[i - 1].first);
+    }
+    destructors.clear();
+    while (chunks.size() > 1) {
+        free(chunks.front());
+        chunks.erase(chunks.begin());
+    }
+    used = 0;
+    if (chunks.empty()) {
+        next = end = nullptr;
+    }
+    else {
+        next = chunks.back();
+        end = next + chunk_size;
+    }
+}
+
+/**
+ * \brief Bytes handed out since the last reset.
+ */
+size_t Arena::bytes_used() const{
+    return used;
+}
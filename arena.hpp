@@ -0,0 +1,112 @@
+/**
+ * \file arena.hpp
+ * \brief Bump allocator for expression trees that share one lifetime.
+ *
+ * Nodes allocated with ANEW(arena, T)(args...) live in large chunks owned by the arena
+ * instead of one heap block per node. With shared pointers the control block sits in
+ * the arena next to the node, and releasing it gives nothing back to the heap. The
+ * memory is reclaimed all at once by reset() or by destroying the arena. The arena has
+ * to outlive every node allocated in it, including closure bodies held by values.
+ */
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include "pointer.h"
+
+using namespace std;
+
+class Arena {
+public:
+    Arena(size_t chunk_size = 64 * 1024);
+    ~Arena();
+
+    void *allocate(size_t size, size_t align);
+    void reset();
+    size_t bytes_used() const;
+
+    /**
+     * \brief Registers an object whose destructor has to run on reset().
+     * Only used with plain and collected pointers, where nothing else destroys arena
+     * objects.
+     */
+    template <class T> void own(T *p){
+        destructors.push_back(make_pair((void *)p, &destroy<T>));
+    }
+
+private:
+    template <class T> static void destroy(void *p){
+        static_cast<T *>(p)->~T();
+    }
+
+    vector<char *> chunks;
+    vector<pair<void *, void (*)(void *)> > destructors;
+    size_t chunk_size;
+    size_t used;
+    char *next;
+    char *end;
+
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+};
+
+/**
+ * \brief Standard allocator handing out arena memory, for std::allocate_shared.
+ */
+template <class T> class ArenaAllocator {
+public:
+    typedef T value_type;
+    Arena *arena;
+
+    ArenaAllocator(Arena *arena) : arena(arena) {}
+    template <class U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n){
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *p, size_t n){
+        // released by Arena::reset()
+    }
+
+    template <class U> bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+    template <class U> bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+};
+
+/**
+ * \brief Factory behind ANEW: allocates in the arena, or on the heap like NEW when
+ * the arena is nullptr.
+ */
+template <class T> class ArenaNew {
+public:
+    Arena *arena;
+
+    ArenaNew(Arena *arena) : arena(arena) {}
+
+    template <class... Args> PTR(T) operator()(Args&&... args){
+#if USE_PLAIN_POINTERS
+        if (arena == nullptr) {
+            return new T(std::forward<Args>(args)...);
+        }
+        T *p = new (arena->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        arena->own(p);
+        return p;
+#elif USE_GC_POINTERS
+        if (arena == nullptr) {
+            return gc_new<T>(std::forward<Args>(args)...);
+        }
+        // outside the collected heap, so its pointers to collected objects are roots
+        T *p = new (arena->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        arena->own(p);
+        return gc_ptr<T>(p);
+#else
+        if (arena == nullptr) {
+            return std::make_shared<T>(std::forward<Args>(args)...);
+        }
+        return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+#endif
+    }
+};
+
+# define ANEW(A, T) ArenaNew<T>(A)
@@ -0,0 +1,283 @@
+/**
+ * \file batch.cpp
+ * \brief Implementation of single-program and batch execution.
+ */
+
+#include "batch.hpp"
+#include <cctype>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include "arena.hpp"
+#include "closure_compile.hpp"
+#include "flat.hpp"
+#include "governor.hpp"
+#include "intern.hpp"
+#include "lazy.hpp"
+#include "memo.hpp"
+#include "optimize.hpp"
+#include "parallel.hpp"
+#include "parse.hpp"
+#include "pool.hpp"
+#include "printer.hpp"
+#include "resolve.hpp"
+#include "typecheck.hpp"
+#include "Val.hpp"
+#include "vm.hpp"
+
+/**
+ * \brief Runs one parsed program the way the given mode does.
+ * \param mode One of do_interp, do_print, do_pretty_print, do_vm, do_closures or do_flat. do_profile
+ * interprets like do_interp: profiles are only taken of whole programs.
+ * \param e The program.
+ * \param options Modifiers such as --optimize and --memoize, and the quota the
+ * evaluation runs under.
+ * \return The text the mode prints for the program, without a trailing newline.
+ * \throws quota_error when the evaluation goes over its quota.
+ * \throws type_error with --typecheck, before running a program that is not well typed.
+ */
+string run_program(run_mode_t mode, PTR(Expr) e, const run_options_t &options){
+    if (options.optimize) {
+        e = optimize(e);
+    }
+    if (options.typecheck && mode != do_print && mode != do_pretty_print) {
+        e = typecheck(e);
+    }
+    Governor governor(options.quota);
+    GovernorScope governed(options.quota.limited() ? &governor : nullptr);
+    switch (mode) {
+        case do_interp:
+        case do_profile: {
+            Memo memo;
+            MemoScope scope(options.memoize ? &memo : nullptr);
+            // programs loaded already resolved run as they are, unless made lazy
+            if (options.lazy) {
+                e = resolve(make_lazy(e));
+            }
+            else if (e->kind != expr_scope) {
+                e = resolve(e);
+            }
+            if (mode == do_interp && options.parallel > 1) {
+                return parallel_interp(e, options.parallel)->to_string();
+            }
+            return e->interp()->to_string();
+        }
+        case do_print:
+            return e->to_string();
+        case do_pretty_print:
+            return e->to_pretty_string();
+        case do_vm:
+            return vm_run(vm_compile(e))->to_string();
+        case do_closures:
+            return closure_run(closure_compile(e))->to_string();
+        case do_flat:
+            return flat_interp(flatten(e))->to_string();
+        default:
+            return "";
+    }
+}
+
+/**
+ * \brief Like run_program(), but writes the result and a newline to `out`. --print and
+ * --pretty-print stream the tree through a PrintBuf as it is printed, so the text of
+ * a large program is never held in memory.
+ */
+void write_program(run_mode_t mode, PTR(Expr) e, const run_options_t &options, ostream &out){
+    if (mode != do_print && mode != do_pretty_print) {
+        out << run_program(mode, e, options) << "\n";
+        return;
+    }
+    if (options.optimize) {
+        e = optimize(e);
+    }
+    PrintBuf buffer(out.rdbuf());
+    ostream streamed(&buffer);
+    if (mode == do_print) {
+        e->print(streamed);
+    }
+    else {
+        e->pretty_print(streamed);
+    }
+    streamed << "\n";
+    if (buffer.pubsync() < 0) {
+        out.setstate(ios::badbit);
+    }
+}
+
+/**
+ * \brief Escapes a result so that it fits on one output line.
+ * \return text with backslashes doubled and newlines written as "\n".
+ */
+string escape_line(const string &text){
+    string escaped;
+    escaped.reserve(text.size());
+    for (char c : text) {
+        if (c == '\\') {
+            escaped += "\\\\";
+        }
+        else if (c == '\n') {
+            escaped += "\\n";
+        }
+        else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * \brief True when the bytes hold nothing but whitespace.
+ */
+static bool is_blank(const char *data, size_t length){
+    for (size_t i = 0; i < length; i++) {
+        if (!isspace((unsigned char)data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * \brief Runs one program of a batch and produces its output line, without the newline.
+ *
+ * The nodes go in an arena of the calling thread, so programs running on different
+ * threads never share a tree or contend on its reference counts. With a table the
+ * nodes are interned there instead and shared with the rest of the batch.
+ */
+static string run_batch_program(run_mode_t mode, const run_options_t &options, ExprTable *table, const char *program, size_t length){
+    static thread_local Arena arena;
+    string line;
+    try {
+        line = escape_line(run_program(mode, parse_buffer(program, length, &arena, table), options));
+    }
+    catch (quota_error exn) {
+        line = "quota: " + escape_line(exn.what());
+    }
+    catch (runtime_error exn) {
+        line = "error: " + escape_line(exn.what());
+    }
+    arena.reset();
+    return line;
+}
+
+/**
+ * \brief Calls visit on every non-blank ';'-separated program of a line.
+ */
+template <class Visit> static void for_each_program(const string &line, Visit visit){
+    size_t start = 0;
+    while (start <= line.size()) {
+        size_t stop = line.find(';', start);
+        if (stop == string::npos) {
+            stop = line.size();
+        }
+        if (!is_blank(line.data() + start, stop - start)) {
+            visit(line.data() + start, stop - start);
+        }
+        start = stop + 1;
+    }
+}
+
+/**
+ * \brief Writes the lines of a parallel batch in input order as they complete.
+ *
+ * Whichever worker finishes the next line due writes it, along with any later lines
+ * already waiting. Output is flushed when it has caught up with everything read so
+ * far. The reader is held back once too many lines are unfinished, bounding memory.
+ */
+class BatchResults {
+public:
+    ostream &out;
+    size_t limit;
+    size_t submitted;
+    size_t written;
+    map<size_t, string> done;
+    mutex lock;
+    condition_variable progress;
+
+    BatchResults(ostream &out, size_t limit) : out(out), limit(limit), submitted(0), written(0) {}
+
+    size_t reserve(){
+        unique_lock<mutex> guard(lock);
+        progress.wait(guard, [this]{ return submitted - written < limit; });
+        return submitted++;
+    }
+
+    void finish(size_t seq, const string &line){
+        lock_guard<mutex> guard(lock);
+        done[seq] = line;
+        bool wrote = false;
+        map<size_t, string>::iterator next;
+        while ((next = done.find(written)) != done.end()) {
+            out << next->second << "\n";
+            done.erase(next);
+            written++;
+            wrote = true;
+        }
+        if (wrote) {
+            if (written == submitted) {
+                out.flush();
+            }
+            progress.notify_all();
+        }
+    }
+
+    void wait_all(){
+        unique_lock<mutex> guard(lock);
+        progress.wait(guard, [this]{ return written == submitted; });
+        out.flush();
+    }
+};
+
+/**
+ * \brief Reads programs until the end of the input and writes one line for each.
+ *
+ * Input is handled a line at a time, so a program is answered as soon as the line
+ * holding it arrives. Output is flushed whenever no more input is already buffered,
+ * keeping a writer that waits for each answer from stalling while a large batch still
+ * goes out in big writes. Blank programs are skipped without output.
+ *
+ * With more than one job the programs run on a work-stealing pool and the output is
+ * put back in input order.
+ *
+ * \param in The stream of programs.
+ * \param out Where the result lines go.
+ * \param mode How each program is run.
+ * \param options Modifiers; jobs is the number of threads to run programs on.
+ */
+void run_batch(istream &in, ostream &out, run_mode_t mode, const run_options_t &options){
+    // collected heaps are per thread, and an interned tree would be shared
+    int jobs = USE_GC_POINTERS ? 1 : options.jobs;
+    ExprTable batch_table(batch_intern_capacity);
+    ExprTable *table = options.intern ? &batch_table : nullptr;
+    string line;
+    if (jobs <= 1) {
+        while (getline(in, line)) {
+            for_each_program(line, [&](const char *program, size_t length){
+                out << run_batch_program(mode, options, table, program, length) << "\n";
+            });
+            if (in.rdbuf()->in_avail() <= 0) {
+                out.flush();
+            }
+        }
+        out.flush();
+        return;
+    }
+    // reading a tied stream flushes out from this thread while workers write to it
+    ostream *tied = in.tie(nullptr);
+    BatchResults results(out, 64 * (size_t)jobs);
+    WorkPool pool(jobs);
+    while (getline(in, line)) {
+        for_each_program(line, [&](const char *program, size_t length){
+            size_t seq = results.reserve();
+            string text(program, length);
+            BatchResults *shared = &results;
+            const run_options_t *run_options = &options;
+            pool.submit([=]{
+                shared->finish(seq, run_batch_program(mode, *run_options, table, text.data(), text.size()));
+            });
+        });
+    }
+    results.wait_all();
+    in.tie(tied);
+}
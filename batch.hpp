@@ -0,0 +1,31 @@
+/**
+ * \file batch.hpp
+ * \brief Running programs in one of the command line modes, singly or as a stream.
+ *
+ * In batch mode stdin carries many programs, each ended by a newline or a ';'. Every
+ * program is parsed and run on its own, and exactly one line is written for it: the
+ * result, "error: " and the message, or "quota: " and the limit when the program ran
+ * over its quota. Newlines inside a result (from --pretty-print) are written as "\n"
+ * so the framing of the output matches the input.
+ *
+ * With --jobs N the programs of a batch are run on N threads. Each program is parsed
+ * into its own tree on the thread that runs it, so threads share no nodes.
+ */
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include "cmdline.hpp"
+#include "Expr.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+string run_program(run_mode_t mode, PTR(Expr) e, const run_options_t &options = run_options_t());
+
+void write_program(run_mode_t mode, PTR(Expr) e, const run_options_t &options, ostream &out);
+
+string escape_line(const string &text);
+
+void run_batch(istream &in, ostream &out, run_mode_t mode, const run_options_t &options = run_options_t());
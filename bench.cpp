@@ -0,0 +1,436 @@
+/**
+ * \file bench.cpp
+ * \brief Microbenchmarks for the parse, load, interp, incremental and print hot paths.
+ *
+ * Each benchmark repeats one operation for a fixed time and reports nanoseconds per
+ * operation, heap allocations per operation (counted by the operator new in alloc.cpp)
+ * and the peak resident set size of the process so far. Built with optimization by
+ * 'make bench'. 'make bench-gc' builds and runs them with the tracing collector of
+ * gc.hpp instead of reference counts, for comparison. Pass a word to run only the
+ * benchmarks whose name contains it.
+ *
+ * Usage:
+ *  ./msdscript_bench           Runs every benchmark.
+ *  ./msdscript_bench interp    Runs the benchmarks with "interp" in their name.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "Expr.hpp"
+#include "alloc.hpp"
+#include "closure_compile.hpp"
+#include "flat.hpp"
+#include "governor.hpp"
+#include "incremental.hpp"
+#include "lazy.hpp"
+#include "parallel.hpp"
+#include "Val.hpp"
+#include "parse.hpp"
+#include "random_expr.hpp"
+#include "resolve.hpp"
+#include "script.hpp"
+#include "serialize.hpp"
+#include "typecheck.hpp"
+#include "vm.hpp"
+
+using namespace std;
+
+// results are accumulated here so the compiler cannot drop the work
+static volatile size_t sink = 0;
+
+static const double min_seconds = 0.25;
+static string filter;
+
+/**
+ * \brief Peak resident set size of the process in kilobytes.
+ */
+static long peak_rss_kb(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/**
+ * \brief Times op, which is called with the iteration number and returns any size.
+ */
+template <class Op> static void bench(const string &name, Op op){
+    if (name.find(filter) == string::npos) {
+        return;
+    }
+    sink = sink + op(0);
+    unsigned long count = 0;
+    unsigned long allocations_before = thread_allocations();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double elapsed = 0;
+    while (elapsed < min_seconds) {
+        sink = sink + op(count);
+        count++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    double allocs = (double)(thread_allocations() - allocations_before) / count;
+    printf("%-32s %14.0f ns/op %12.1f allocs/op %10ld KB peak RSS\n",
+           name.c_str(), elapsed * 1e9 / count, allocs, peak_rss_kb());
+    fflush(stdout);
+}
+
+/**
+ * \brief A distinct variable name for each number: variables are letters only.
+ */
+static string name(int i){
+    string s = "v";
+    do {
+        s += (char)('a' + i % 26);
+        i /= 26;
+    } while (i > 0);
+    return s;
+}
+
+/**
+ * \brief _let va = 1 _in _let vb = va + 1 _in ... with n bindings
+ */
+static string let_chain(int n){
+    string s;
+    for (int i = 0; i < n; i++) {
+        s += "_let " + name(i) + " = " + (i == 0 ? string("1") : name(i - 1) + " + 1") + " _in ";
+    }
+    return s + name(n - 1);
+}
+
+/**
+ * \brief 1 + 2 + ... + n
+ */
+static string wide_sum(int n){
+    string s = "1";
+    for (int i = 2; i <= n; i++) {
+        s += " + " + to_string(i);
+    }
+    return s;
+}
+
+/**
+ * \brief _let x = 1 _in _let y = 2 _in x + y + x + y + ... with n operands
+ */
+static string wide_slot_sum(int n){
+    string s = "_let x = 1 _in _let y = 2 _in x";
+    for (int i = 1; i < n; i++) {
+        s += i % 2 == 0 ? " + x" : " + y";
+    }
+    return s;
+}
+
+/**
+ * \brief Naive Fibonacci through self-application, since _let is not recursive.
+ */
+static string fib_program(const string &n){
+    return "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+           "_else fib(fib)(n + -1) + fib(fib)(n + -2) _in fib(fib)(" + n + ")";
+}
+
+/**
+ * \brief A function whose expensive binding is only used on one path, called on
+ * the other paths.
+ */
+static string guarded_binding(int n){
+    return "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+           "_else fib(fib)(n + -1) + fib(fib)(n + -2) _in "
+           "_let g = _fun (n) _let big = fib(fib)(" + to_string(n) + ") _in _if n == 0 _then big _else n "
+           "_in g(1) + g(2) + g(3)";
+}
+
+/**
+ * \brief Nested _if and _let, which pretty-print across many lines.
+ */
+static string nested_ifs(int n){
+    string s;
+    for (int i = 0; i < n; i++) {
+        s += "_let " + name(i) + " = _if " + to_string(i) + " == 3 _then _true _else _false _in ";
+    }
+    return s + name(0);
+}
+
+/**
+ * \brief _fun (x) f(_fun (x) f(... 1 ...)), n functions deep
+ */
+static string nested_funs(int n){
+    string s;
+    for (int i = 0; i < n; i++) {
+        s += "_fun (x) f(";
+    }
+    s += "1";
+    for (int i = 0; i < n; i++) {
+        s += ")";
+    }
+    return s;
+}
+
+int main(int argc, char **argv){
+    if (argc > 1) {
+        filter = argv[1];
+    }
+
+    srand(12345);
+    vector<string> random_sources;
+    vector<PTR(Expr)> random_exprs;
+    vector<PTR(Expr)> random_copies;  // parsed again, equal but not shared
+    vector<PTR(Expr)> random_closed;
+    while (random_sources.size() < 200) {
+        string source = random_expr_string();
+        PTR(Expr) e;
+        try {
+            e = parse_str(source);
+        }
+        catch (runtime_error exn) {
+            // the generator can nest a _let where the grammar does not allow one
+            continue;
+        }
+        random_sources.push_back(source);
+        random_exprs.push_back(e);
+        random_copies.push_back(parse_str(source));
+        try {
+            e->interp();
+            random_closed.push_back(e);
+        }
+        catch (runtime_error exn) {
+            // free variables; left out of the interp benchmark
+        }
+    }
+
+    string let_source = let_chain(1000);
+    string sum_source = wide_sum(2000);
+    string fib_source = fib_program("18");
+    string ifs_source = nested_ifs(300);
+    PTR(Expr) let_expr = parse_str(let_source);
+    PTR(Expr) sum_expr = parse_str(sum_source);
+    PTR(Expr) fib_expr = parse_str(fib_source);
+    PTR(Expr) fib_copy = parse_str(fib_source);
+    PTR(Expr) let_copy = parse_str(let_source);
+    PTR(Expr) ifs_expr = parse_str(ifs_source);
+    PTR(Expr) funs_expr = parse_str(nested_funs(1000));
+    PTR(Expr) let_resolved = resolve(let_expr);
+    PTR(Expr) sum_resolved = resolve(sum_expr);
+    PTR(Expr) slot_sum_resolved = resolve(parse_str(wide_slot_sum(2000)));
+    PTR(Expr) fib_resolved = resolve(fib_expr);
+    PTR(Expr) fib_lazy = resolve(make_lazy(fib_expr));
+    PTR(Expr) guarded_expr = parse_str(guarded_binding(15));
+    PTR(Expr) guarded_resolved = resolve(guarded_expr);
+    PTR(Expr) guarded_lazy = resolve(make_lazy(guarded_expr));
+    PTR(VmFunction) fib_code = vm_compile(fib_expr);
+    PTR(CompiledFunction) fib_closures = closure_compile(fib_expr);
+    PTR(Expr) fib_typed = typecheck(fib_expr);
+    PTR(Expr) fib_typed_resolved = resolve(fib_typed);
+    PTR(FlatTree) let_flat = flatten(let_expr);
+    PTR(FlatTree) sum_flat = flatten(sum_expr);
+    PTR(FlatTree) fib_flat = flatten(fib_expr);
+    resolve(*let_flat);
+    resolve(*sum_flat);
+    resolve(*fib_flat);
+    PTR(VmFunction) fib_typed_code = vm_compile(fib_typed);
+    PTR(CompiledFunction) fib_typed_closures = closure_compile(fib_typed);
+    ostringstream let_msdb, sum_msdb, fib_msdb;
+    write_msdb(let_expr, let_msdb);
+    write_msdb(sum_expr, sum_msdb);
+    write_msdb(fib_resolved, fib_msdb);
+    string let_bytes = let_msdb.str();
+    string sum_bytes = sum_msdb.str();
+    string fib_bytes = fib_msdb.str();
+
+    printf("%zu random programs, %zu of them closed\n", random_exprs.size(), random_closed.size());
+    // what the nodes of a tree take on the heap, without the table unflatten() builds them in
+    unsigned long before = thread_allocated_bytes();
+    PTR(Expr) sum_tree = unflatten(*sum_flat);
+    unsigned long tree_bytes = thread_allocated_bytes() - before - sum_flat->size() * sizeof(PTR(Expr));
+    printf("wide-sum-2000: %lu bytes as Expr nodes, %zu bytes as a FlatTree\n", tree_bytes, sum_flat->bytes());
+
+    bench("parse_str/random", [&](unsigned long i){
+        return parse_str(random_sources[i % random_sources.size()])->hash;
+    });
+    bench("parse_str/let-chain-1000", [&](unsigned long i){
+        return parse_str(let_source)->hash;
+    });
+    bench("parse_str/wide-sum-2000", [&](unsigned long i){
+        return parse_str(sum_source)->hash;
+    });
+    bench("read_msdb/let-chain-1000", [&](unsigned long i){
+        return read_msdb(let_bytes.data(), let_bytes.size())->hash;
+    });
+    bench("read_msdb/wide-sum-2000", [&](unsigned long i){
+        return read_msdb(sum_bytes.data(), sum_bytes.size())->hash;
+    });
+    bench("read_msdb/fib-18-resolved", [&](unsigned long i){
+        return read_msdb(fib_bytes.data(), fib_bytes.size())->hash;
+    });
+    bench("flatten/let-chain-1000", [&](unsigned long i){
+        return flatten(let_expr)->size();
+    });
+    bench("flatten/wide-sum-2000", [&](unsigned long i){
+        return flatten(sum_expr)->size();
+    });
+    bench("unflatten/wide-sum-2000", [&](unsigned long i){
+        return unflatten(*sum_flat)->hash;
+    });
+
+    bench("interp/random", [&](unsigned long i){
+        if (random_closed.empty()) {
+            return (size_t)0;
+        }
+        return random_closed[i % random_closed.size()]->interp()->hash();
+    });
+    bench("interp/let-chain-1000", [&](unsigned long i){
+        return let_expr->interp()->hash();
+    });
+    bench("interp/let-chain-1000-resolved", [&](unsigned long i){
+        return let_resolved->interp()->hash();
+    });
+    bench("flat/let-chain-1000", [&](unsigned long i){
+        return flat_interp(let_flat)->hash();
+    });
+    bench("interp/wide-sum-2000", [&](unsigned long i){
+        return sum_expr->interp()->hash();
+    });
+    bench("interp/wide-sum-2000-resolved", [&](unsigned long i){
+        return sum_resolved->interp()->hash();
+    });
+    bench("interp/slot-sum-2000-resolved", [&](unsigned long i){
+        return slot_sum_resolved->interp()->hash();
+    });
+    bench("flat/wide-sum-2000", [&](unsigned long i){
+        return flat_interp(sum_flat)->hash();
+    });
+    bench("interp/fib-18", [&](unsigned long i){
+        return fib_expr->interp()->hash();
+    });
+    bench("interp/fib-18-resolved", [&](unsigned long i){
+        return fib_resolved->interp()->hash();
+    });
+    bench("interp/fib-18-typed", [&](unsigned long i){
+        return fib_typed_resolved->interp()->hash();
+    });
+    Quota quota;
+    quota.max_steps = 1UL << 40;
+    quota.time_limit_ms = 1000000;
+    quota.max_memory = 1UL << 40;
+    bench("interp/fib-18-resolved-governed", [&](unsigned long i){
+        Governor governor(quota);
+        GovernorScope governed(&governor);
+        return fib_resolved->interp()->hash();
+    });
+    bench("lazy/fib-18", [&](unsigned long i){
+        return fib_lazy->interp()->hash();
+    });
+    bench("interp/guarded-binding-resolved", [&](unsigned long i){
+        return guarded_resolved->interp()->hash();
+    });
+    bench("lazy/guarded-binding", [&](unsigned long i){
+        return guarded_lazy->interp()->hash();
+    });
+    // a script where one literal next to a large closed subtree is edited over and over
+    string edited_source = "(" + fib_source + ") + 1";
+    bench("reparse/edit-beside-fib-18", [&](unsigned long i){
+        edited_source[edited_source.size() - 1] = (char)('0' + i % 10);
+        return (size_t)parse_str(edited_source)->interp()->to_string().size();
+    });
+    IncrementalSession session(edited_source);
+    bench("incremental/edit-beside-fib-18", [&](unsigned long i){
+        session.edit(session.source.size() - 1, 1, string(1, (char)('0' + i % 10)));
+        return (size_t)session.interp()->to_string().size();
+    });
+    bench("vm/fib-18", [&](unsigned long i){
+        return vm_run(fib_code)->hash();
+    });
+    bench("vm/fib-18-typed", [&](unsigned long i){
+        return vm_run(fib_typed_code)->hash();
+    });
+    bench("closures/fib-18", [&](unsigned long i){
+        return closure_run(fib_closures)->hash();
+    });
+    bench("closures/fib-18-typed", [&](unsigned long i){
+        return closure_run(fib_typed_closures)->hash();
+    });
+    bench("flat/fib-18", [&](unsigned long i){
+        return flat_interp(fib_flat)->hash();
+    });
+
+    // one small rule per request, with its inputs: without the Script API a host
+    // splices them into the source and parses and runs it every time
+    const string rule = "_if age == 0 _then limit _else _let scaled = limit * age _in _if scaled == limit _then limit _else scaled + 1";
+    bench("parse+interp/rule", [&](unsigned long i){
+        string source = "_let age = " + to_string(i % 7) + " _in _let limit = " + to_string(100 + i % 13) + " _in " + rule;
+        return parse_str(source)->interp()->hash();
+    });
+    PTR(Script) rule_script = compile_script(rule, {"age", "limit"});
+    bench("script/rule", [&](unsigned long i){
+        Value inputs[2] = {Value::number(i % 7), Value::number(100 + i % 13)};
+        return (size_t)ScriptContext::local().run(*rule_script, inputs, 2).num;
+    });
+    PTR(Script) fib_script = compile_script(fib_program("count"), {"count"});
+    bench("script/fib-18", [&](unsigned long i){
+        Value inputs[1] = {Value::number(18)};
+        return (size_t)ScriptContext::local().run(*fib_script, inputs, 1).num;
+    });
+
+    bench("equals/random", [&](unsigned long i){
+        size_t k = i % random_exprs.size();
+        return (size_t)random_exprs[k]->equals(random_copies[k]);
+    });
+    bench("equals/fib-18", [&](unsigned long i){
+        return (size_t)fib_expr->equals(fib_copy);
+    });
+    bench("equals/let-chain-1000", [&](unsigned long i){
+        return (size_t)let_expr->equals(let_copy);
+    });
+    bench("equals/values", [&](unsigned long i){
+        Value a = Value(NEW(NumVal)((int)i));
+        return (size_t)a.to_val()->equals(NEW(NumVal)((int)i)) + (size_t)NEW(BoolVal)(true)->equals(a.to_val());
+    });
+
+    bench("to_string/random", [&](unsigned long i){
+        return random_exprs[i % random_exprs.size()]->to_string().size();
+    });
+    bench("to_string/let-chain-1000", [&](unsigned long i){
+        return let_expr->to_string().size();
+    });
+    bench("to_string/wide-sum-2000", [&](unsigned long i){
+        return sum_expr->to_string().size();
+    });
+    bench("to_string/nested-funs-1000", [&](unsigned long i){
+        return funs_expr->to_string().size();
+    });
+    bench("to_pretty_string/random", [&](unsigned long i){
+        return random_exprs[i % random_exprs.size()]->to_pretty_string().size();
+    });
+    bench("to_pretty_string/let-chain-1000", [&](unsigned long i){
+        return let_expr->to_pretty_string().size();
+    });
+    bench("to_pretty_string/nested-ifs-300", [&](unsigned long i){
+        return ifs_expr->to_pretty_string().size();
+    });
+
+#if USE_GC_POINTERS
+    bench("gc/collect", [&](unsigned long i){
+        gc_collect();
+        return gc_stats().live_bytes;
+    });
+#endif
+
+    // last: once the pool has started threads, reference counts are atomic for
+    // every benchmark; with fewer cores than workers this only shows the cost
+    int parallel_workers = thread::hardware_concurrency() > 1 ? (int)thread::hardware_concurrency() : 2;
+    PTR(Expr) fib_forked = add_forks(fib_resolved, ParallelEval::with_workers(parallel_workers));
+    bench("parallel/fib-18-resolved", [&](unsigned long i){
+        return fib_forked->interp()->hash();
+    });
+    bench("interp/fib-18-resolved-atomic-refcounts", [&](unsigned long i){
+        return fib_resolved->interp()->hash();
+    });
+    return 0;
+}
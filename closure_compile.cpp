@@ -0,0 +1,672 @@
+/**
+ * \file closure_compile.cpp
+ * \brief Implementation of the closure compiler.
+ *
+ * compile() turns each node into a ClosureCode. Operands that are slots or literals
+ * are not compiled into calls of their own: they become the operand readers
+ * LocalSlot, CapturedSlot and Constant, and the templates of the binary nodes are
+ * instantiated for each combination. Everything else is read through Computed. Each
+ * node evaluates its operands in the order Expr::step() does and fails with the same
+ * errors.
+ */
+
+#include "closure_compile.hpp"
+#include <new>
+#include <stdexcept>
+#include "governor.hpp"
+#include "resolve.hpp"
+
+//======================  ClosureFrame  ======================//
+
+/**
+ * \brief A frame of `frame_size` empty slots from the frame pool.
+ */
+ClosureFrame::ClosureFrame(int frame_size, const Value *captures){
+    this->frame_size = frame_size;
+    this->captures = captures;
+    this->tail_fun = nullptr;
+    this->owned = true;
+    slots = static_cast<Value *>(frame_allocate(frame_size * sizeof(Value)));
+    for (int i = 0; i < frame_size; i++) {
+        new (&slots[i]) Value();
+    }
+}
+
+/**
+ * \brief A top-level frame over slots the caller keeps, and clears, itself.
+ */
+ClosureFrame::ClosureFrame(Value *slots, int frame_size){
+    this->frame_size = frame_size;
+    this->captures = nullptr;
+    this->tail_fun = nullptr;
+    this->owned = false;
+    this->slots = slots;
+}
+
+ClosureFrame::~ClosureFrame(){
+    if (!owned) {
+        return;
+    }
+    for (int i = 0; i < frame_size; i++) {
+        slots[i].~Value();
+    }
+    frame_deallocate(slots, frame_size * sizeof(Value));
+}
+
+CompiledFunction::CompiledFunction(string formal_arg, PTR(Expr) body, int frame_size){
+    this->formal_arg = formal_arg;
+    this->body = body;
+    this->frame_size = frame_size;
+}
+
+//======================  Operand readers  ======================//
+
+class LocalSlot {
+public:
+    int slot;
+
+    LocalSlot(int slot) : slot(slot) {}
+    Value operator()(ClosureFrame &frame) const { return frame.slots[slot]; }
+};
+
+class CapturedSlot {
+public:
+    int slot;
+
+    CapturedSlot(int slot) : slot(slot) {}
+    Value operator()(ClosureFrame &frame) const { return frame.captures[slot]; }
+};
+
+class Constant {
+public:
+    Value value;
+
+    Constant(const Value &value) : value(value) {}
+    Value operator()(ClosureFrame &frame) const { return value; }
+};
+
+class Computed {
+public:
+    ClosureCode code;
+
+    Computed(const ClosureCode &code) : code(code) {}
+    Value operator()(ClosureFrame &frame) const { return code(frame); }
+};
+
+//======================  Specialized nodes  ======================//
+
+/**
+ * \brief lhs + rhs: lhs first, numbers added inline, anything else through add_to().
+ * When `typed`, typecheck() proved both operands numbers and they are not checked.
+ */
+template <class L, class R, bool typed> class AddCode {
+public:
+    L lhs;
+    R rhs;
+
+    AddCode(const L &lhs, const R &rhs) : lhs(lhs), rhs(rhs) {}
+    Value operator()(ClosureFrame &frame) const {
+        Value l = lhs(frame);
+        Value r = rhs(frame);
+        if (typed || (l.tag == Value::num_tag && r.tag == Value::num_tag)) {
+            return Value::number((unsigned)l.num + (unsigned)r.num);
+        }
+        return l.add_to(r);
+    }
+};
+
+template <class L, class R, bool typed> class MultCode {
+public:
+    L lhs;
+    R rhs;
+
+    MultCode(const L &lhs, const R &rhs) : lhs(lhs), rhs(rhs) {}
+    Value operator()(ClosureFrame &frame) const {
+        Value l = lhs(frame);
+        Value r = rhs(frame);
+        if (typed || (l.tag == Value::num_tag && r.tag == Value::num_tag)) {
+            return Value::number((unsigned)l.num * (unsigned)r.num);
+        }
+        return l.mult_with(r);
+    }
+};
+
+/**
+ * \brief rhs == lhs, rhs first like EqExpr; numbers and booleans compared inline.
+ */
+template <class L, class R> static bool equal_operands(const L &lhs, const R &rhs, ClosureFrame &frame){
+    Value r = rhs(frame);
+    Value l = lhs(frame);
+    if (r.tag != Value::boxed_tag) {
+        return l.tag == r.tag && l.num == r.num;
+    }
+    return r.equals(l);
+}
+
+template <class L, class R> class EqCode {
+public:
+    L lhs;
+    R rhs;
+
+    EqCode(const L &lhs, const R &rhs) : lhs(lhs), rhs(rhs) {}
+    Value operator()(ClosureFrame &frame) const {
+        return Value::boolean(equal_operands(lhs, rhs, frame));
+    }
+};
+
+/**
+ * \brief _if lhs == rhs _then ... _else ..., without making the boolean.
+ */
+template <class L, class R> class IfEqCode {
+public:
+    L lhs;
+    R rhs;
+    ClosureCode then_;
+    ClosureCode else_;
+
+    IfEqCode(const L &lhs, const R &rhs, const ClosureCode &then_, const ClosureCode &else_)
+        : lhs(lhs), rhs(rhs), then_(then_), else_(else_) {}
+    Value operator()(ClosureFrame &frame) const {
+        return equal_operands(lhs, rhs, frame) ? then_(frame) : else_(frame);
+    }
+};
+
+template <bool typed> class MakeAdd {
+public:
+    template <class L, class R> ClosureCode operator()(const L &lhs, const R &rhs) const {
+        return AddCode<L, R, typed>(lhs, rhs);
+    }
+};
+
+template <bool typed> class MakeMult {
+public:
+    template <class L, class R> ClosureCode operator()(const L &lhs, const R &rhs) const {
+        return MultCode<L, R, typed>(lhs, rhs);
+    }
+};
+
+class MakeEq {
+public:
+    template <class L, class R> ClosureCode operator()(const L &lhs, const R &rhs) const {
+        return EqCode<L, R>(lhs, rhs);
+    }
+};
+
+class MakeIfEq {
+public:
+    ClosureCode then_;
+    ClosureCode else_;
+
+    MakeIfEq(const ClosureCode &then_, const ClosureCode &else_) : then_(then_), else_(else_) {}
+    template <class L, class R> ClosureCode operator()(const L &lhs, const R &rhs) const {
+        return IfEqCode<L, R>(lhs, rhs, then_, else_);
+    }
+};
+
+/**
+ * \brief A call; in tail position a call of a compiled function is left to the caller.
+ */
+template <class F, bool tail> class CallCode {
+public:
+    F callee;
+    ClosureCode arg;
+
+    CallCode(const F &callee, const ClosureCode &arg) : callee(callee), arg(arg) {}
+    Value operator()(ClosureFrame &frame) const {
+        Value fun = callee(frame);
+        Value actual = arg(frame);
+        if (tail && fun.tag == Value::boxed_tag && fun.boxed->kind == val_compiled) {
+            frame.tail_fun = STATIC_CAST(CompiledFunVal)(fun.boxed);
+            frame.tail_arg = actual;
+            return Value();
+        }
+        return fun.call(actual);
+    }
+};
+
+//======================  Generic nodes  ======================//
+
+/**
+ * \brief An _if; when `typed`, the condition is a proven boolean and is not checked.
+ */
+template <bool typed> class IfCode {
+public:
+    ClosureCode if_;
+    ClosureCode then_;
+    ClosureCode else_;
+
+    IfCode(const ClosureCode &if_, const ClosureCode &then_, const ClosureCode &else_)
+        : if_(if_), then_(then_), else_(else_) {}
+    Value operator()(ClosureFrame &frame) const {
+        Value condition = if_(frame);
+        return (typed || condition.is_bool()) && condition.num ? then_(frame) : else_(frame);
+    }
+};
+
+/**
+ * \brief A run of nested _let: fills the slots in order, then runs the body.
+ */
+class LetsCode {
+public:
+    vector<pair<int, ClosureCode> > bindings;
+    ClosureCode body;
+
+    Value operator()(ClosureFrame &frame) const {
+        for (const pair<int, ClosureCode> &binding : bindings) {
+            frame.slots[binding.first] = binding.second(frame);
+        }
+        return body(frame);
+    }
+};
+
+/**
+ * \brief A sum or product of many operands, the way SumExpr and ProductExpr run:
+ * wrapping arithmetic while every operand is a number, and otherwise every operand
+ * again in order, combined from the right like the chain of binary nodes.
+ */
+template <bool product> class NaryCode {
+public:
+    unsigned constant;
+    vector<ClosureCode> others;
+    vector<pair<int, int> > slots;
+    vector<ClosureCode> operands;
+
+    Value operator()(ClosureFrame &frame) const {
+        unsigned total = constant;
+        for (const ClosureCode &code : others) {
+            Value value = code(frame);
+            if (!value.is_num()) {
+                return fold(frame);
+            }
+            total = product ? total * (unsigned)value.num : total + (unsigned)value.num;
+        }
+        for (const pair<int, int> &slot : slots) {
+            const Value &value = slot.first == 0 ? frame.slots[slot.second] : frame.captures[slot.second];
+            if (!value.is_num()) {
+                return fold(frame);
+            }
+            total = product ? total * (unsigned)value.num : total + (unsigned)value.num;
+        }
+        return Value::number(total);
+    }
+
+    Value fold(ClosureFrame &frame) const {
+        vector<Value> values;
+        values.reserve(operands.size());
+        for (const ClosureCode &code : operands) {
+            values.push_back(code(frame));
+        }
+        Value result = values.back();
+        for (size_t i = values.size() - 1; i-- > 0;) {
+            result = product ? values[i].mult_with(result) : values[i].add_to(result);
+        }
+        return result;
+    }
+};
+
+/**
+ * \brief a == (b == (c == ...)): from the last operand back, like EqExpr.
+ */
+class EqChainCode {
+public:
+    vector<ClosureCode> lhs;
+    ClosureCode last;
+
+    Value operator()(ClosureFrame &frame) const {
+        Value result = last(frame);
+        for (size_t i = lhs.size(); i-- > 0;) {
+            result = Value::boolean(result.equals(lhs[i](frame)));
+        }
+        return result;
+    }
+};
+
+/**
+ * \brief Makes a closure, copying its captures from the frame that defines it.
+ */
+class MakeClosureCode {
+public:
+    PTR(CompiledFunction) function;
+    vector<pair<int, int> > captures;
+
+    MakeClosureCode(PTR(CompiledFunction) function, const vector<pair<int, int> > &captures)
+        : function(function), captures(captures) {}
+    Value operator()(ClosureFrame &frame) const {
+        PTR(CompiledFunVal) closure = pool_new<CompiledFunVal>(function);
+        closure->captures.reserve(captures.size());
+        for (const pair<int, int> &capture : captures) {
+            closure->captures.push_back(capture.first == 0 ? frame.slots[capture.second] : frame.captures[capture.second]);
+        }
+        return Value(closure);
+    }
+};
+
+class FreeVarCode {
+public:
+    string name;
+
+    FreeVarCode(const string &name) : name(name) {}
+    Value operator()(ClosureFrame &frame) const {
+        throw runtime_error("free variable: " + name);
+    }
+};
+
+//======================  Compiler  ======================//
+
+typedef enum {
+    operand_local,
+    operand_captured,
+    operand_constant,
+    operand_computed
+} operand_kind_t;
+
+static ClosureCode compile(PTR(Expr) e, bool tail);
+
+static operand_kind_t operand_kind(PTR(Expr) e){
+    switch (e->kind) {
+        case expr_slot_var:
+            return static_cast<SlotVarExpr *>(&*e)->depth == 0 ? operand_local : operand_captured;
+        case expr_num:
+        case expr_bool:
+            return operand_constant;
+        default:
+            return operand_computed;
+    }
+}
+
+static Value literal(PTR(Expr) e){
+    if (e->kind == expr_num) {
+        return Value::number(static_cast<NumExpr *>(&*e)->val);
+    }
+    return Value::boolean(static_cast<BoolExpr *>(&*e)->val);
+}
+
+/**
+ * \brief Instantiates `make` for a reader of lhs that is already chosen and the
+ * reader that fits rhs.
+ */
+template <class Make, class L> static ClosureCode with_rhs(const Make &make, const L &lhs, PTR(Expr) rhs){
+    switch (operand_kind(rhs)) {
+        case operand_local:
+            return make(lhs, LocalSlot(static_cast<SlotVarExpr *>(&*rhs)->slot));
+        case operand_captured:
+            return make(lhs, CapturedSlot(static_cast<SlotVarExpr *>(&*rhs)->slot));
+        case operand_constant:
+            return make(lhs, Constant(literal(rhs)));
+        default:
+            return make(lhs, Computed(compile(rhs, false)));
+    }
+}
+
+/**
+ * \brief Instantiates `make` for the readers that fit both operands.
+ */
+template <class Make> static ClosureCode binary(const Make &make, PTR(Expr) lhs, PTR(Expr) rhs){
+    switch (operand_kind(lhs)) {
+        case operand_local:
+            return with_rhs(make, LocalSlot(static_cast<SlotVarExpr *>(&*lhs)->slot), rhs);
+        case operand_captured:
+            return with_rhs(make, CapturedSlot(static_cast<SlotVarExpr *>(&*lhs)->slot), rhs);
+        case operand_constant:
+            return with_rhs(make, Constant(literal(lhs)), rhs);
+        default:
+            return with_rhs(make, Computed(compile(lhs, false)), rhs);
+    }
+}
+
+/**
+ * \brief A chain of binary + or * of any length, as a NaryCode over all its operands.
+ */
+template <bool product, class T> static ClosureCode binary_chain(T *first){
+    vector<T *> chain = rhs_chain(first);
+    if (chain.size() == 1) {
+        if (product) {
+            return first->typed ? binary(MakeMult<true>(), first->lhs, first->rhs) : binary(MakeMult<false>(), first->lhs, first->rhs);
+        }
+        return first->typed ? binary(MakeAdd<true>(), first->lhs, first->rhs) : binary(MakeAdd<false>(), first->lhs, first->rhs);
+    }
+    NaryCode<product> code;
+    code.constant = product ? 1 : 0;
+    for (T *node : chain) {
+        code.operands.push_back(compile(node->lhs, false));
+    }
+    code.operands.push_back(compile(chain.back()->rhs, false));
+    code.others = code.operands;
+    return code;
+}
+
+template <bool product> static ClosureCode nary(NaryExpr *e){
+    NaryCode<product> code;
+    code.constant = e->constant;
+    code.slots = e->slots;
+    for (PTR(Expr) &operand : e->operands) {
+        code.operands.push_back(compile(operand, false));
+        if (operand->kind != expr_num && operand->kind != expr_slot_var) {
+            code.others.push_back(code.operands.back());
+        }
+    }
+    return code;
+}
+
+template <bool tail> static ClosureCode call(CallExpr *e){
+    ClosureCode arg = compile(e->actual_arg, false);
+    switch (operand_kind(e->to_be_called)) {
+        case operand_local:
+            return CallCode<LocalSlot, tail>(LocalSlot(static_cast<SlotVarExpr *>(&*e->to_be_called)->slot), arg);
+        case operand_captured:
+            return CallCode<CapturedSlot, tail>(CapturedSlot(static_cast<SlotVarExpr *>(&*e->to_be_called)->slot), arg);
+        default:
+            return CallCode<Computed, tail>(Computed(compile(e->to_be_called, false)), arg);
+    }
+}
+
+static ClosureCode if_code(IfExpr *e, bool tail){
+    ClosureCode then_ = compile(e->then_, tail);
+    ClosureCode else_ = compile(e->else_, tail);
+    if (e->if_->kind == expr_eq) {
+        EqExpr *eq = static_cast<EqExpr *>(&*e->if_);
+        if (eq->rhs->kind != expr_eq) {
+            return binary(MakeIfEq(then_, else_), eq->lhs, eq->rhs);
+        }
+    }
+    if (e->typed) {
+        return IfCode<true>(compile(e->if_, false), then_, else_);
+    }
+    return IfCode<false>(compile(e->if_, false), then_, else_);
+}
+
+static ClosureCode eq_code(EqExpr *e){
+    if (e->rhs->kind != expr_eq) {
+        return binary(MakeEq(), e->lhs, e->rhs);
+    }
+    vector<EqExpr *> chain = rhs_chain(e);
+    EqChainCode code;
+    for (EqExpr *node : chain) {
+        code.lhs.push_back(compile(node->lhs, false));
+    }
+    code.last = compile(chain.back()->rhs, false);
+    return code;
+}
+
+/**
+ * \brief _let x = a _in _let y = b _in ... as one loop over the bindings.
+ */
+static ClosureCode lets_code(SlotLetExpr *e, bool tail){
+    LetsCode code;
+    PTR(Expr) body;
+    while (true) {
+        code.bindings.push_back(make_pair(e->slot, compile(e->rhs, false)));
+        body = e->body;
+        if (body->kind != expr_slot_let) {
+            break;
+        }
+        e = static_cast<SlotLetExpr *>(&*body);
+    }
+    code.body = compile(body, tail);
+    return code;
+}
+
+static ClosureCode fun_code(SlotFunExpr *e){
+    for (const pair<int, int> &capture : e->captures) {
+        if (capture.first > 1) {
+            throw runtime_error("cannot compile a closure over an outer environment");
+        }
+    }
+    PTR(CompiledFunction) function = NEW(CompiledFunction)(e->formal_arg, e->body, e->frame_size);
+    function->code = compile(e->body, true);
+    return MakeClosureCode(function, e->captures);
+}
+
+/**
+ * \brief The code of a resolved node.
+ * \param tail True if the node's value is the value of the enclosing function.
+ * \throws runtime_error for nodes that only appear in unresolved trees.
+ */
+static ClosureCode compile(PTR(Expr) e, bool tail){
+    switch (e->kind) {
+        case expr_num:
+        case expr_bool:
+            return Constant(literal(e));
+        case expr_slot_var: {
+            SlotVarExpr *var = static_cast<SlotVarExpr *>(&*e);
+            if (var->depth == 0) {
+                return LocalSlot(var->slot);
+            }
+            if (var->depth == 1) {
+                return CapturedSlot(var->slot);
+            }
+            throw runtime_error("cannot compile a variable of an outer environment");
+        }
+        case expr_var:
+            // resolve() leaves only the free variables as names
+            return FreeVarCode(static_cast<VarExpr *>(&*e)->val);
+        case expr_add:
+            return binary_chain<false>(static_cast<AddExpr *>(&*e));
+        case expr_mult:
+            return binary_chain<true>(static_cast<MultExpr *>(&*e));
+        case expr_sum:
+            return nary<false>(static_cast<NaryExpr *>(&*e));
+        case expr_product:
+            return nary<true>(static_cast<NaryExpr *>(&*e));
+        case expr_eq:
+            return eq_code(static_cast<EqExpr *>(&*e));
+        case expr_if:
+            return if_code(static_cast<IfExpr *>(&*e), tail);
+        case expr_slot_let:
+            return lets_code(static_cast<SlotLetExpr *>(&*e), tail);
+        case expr_slot_fun:
+            return fun_code(static_cast<SlotFunExpr *>(&*e));
+        case expr_call:
+            if (tail) {
+                return call<true>(static_cast<CallExpr *>(&*e));
+            }
+            return call<false>(static_cast<CallExpr *>(&*e));
+        default:
+            throw runtime_error("cannot compile expression: " + e->to_string());
+    }
+}
+
+/**
+ * \brief Compiles a program, resolving it first unless it already is.
+ */
+PTR(CompiledFunction) closure_compile(PTR(Expr) e){
+    if (e->kind != expr_scope) {
+        e = resolve(e);
+    }
+    ScopeExpr *scope = static_cast<ScopeExpr *>(&*e);
+    PTR(CompiledFunction) program = NEW(CompiledFunction)("", scope->body, scope->frame_size);
+    program->code = compile(scope->body, true);
+    return program;
+}
+
+PTR(Val) closure_run(PTR(CompiledFunction) program){
+    ClosureFrame frame(program->frame_size, nullptr);
+    Value result = program->code(frame);
+    if (frame.tail_fun != nullptr) {
+        result = frame.tail_fun->apply(frame.tail_arg);
+    }
+    return result.to_val();
+}
+
+//======================  CompiledFunVal  ======================//
+
+CompiledFunVal::CompiledFunVal(PTR(CompiledFunction) function){
+    this->kind = val_compiled;
+    this->function = function;
+}
+
+/**
+ * \brief Lets go of the captured values through a DeferredRelease, so a long chain of
+ * closures is freed in a loop.
+ */
+CompiledFunVal::~CompiledFunVal(){
+    DeferredRelease release;
+    for (Value &captured : captures) {
+        release.value(captured);
+    }
+}
+
+PTR(Expr) CompiledFunVal::to_expr(){
+    return NEW(FunExpr)(function->formal_arg, function->body);
+}
+
+bool CompiledFunVal::equals (PTR(Val) v){
+    if (v == nullptr) {
+        return false;
+    }
+    if (v->kind == val_compiled) {
+        CompiledFunVal *compiledPtr = static_cast<CompiledFunVal *>(&*v);
+        return function->formal_arg == compiledPtr->function->formal_arg && function->body->equals(compiledPtr->function->body);
+    }
+    return function_equals(this, v);
+}
+
+/**
+ * \brief Hashes like the equal FunVal.
+ */
+size_t CompiledFunVal::hash(){
+    return hash_mix(hash_mix(9, std::hash<string>()(function->formal_arg)), function->body->hash);
+}
+
+PTR(Val) CompiledFunVal::add_to(PTR(Val) other_val){
+    throw runtime_error("Function cannot be added");
+}
+
+PTR(Val) CompiledFunVal::mult_with(PTR(Val) other_val){
+    throw runtime_error("Function cannot be multiplied");
+}
+
+void CompiledFunVal::print(ostream &ostream){
+    ostream << "_fun (" << function->formal_arg << ") ";
+    function->body->print(ostream);
+}
+
+bool CompiledFunVal::is_true(){
+    throw runtime_error("function cannot be boolean");
+}
+
+PTR(Val) CompiledFunVal::call(PTR(Val) actual_arg){
+    return apply(Value(actual_arg)).to_val();
+}
+
+/**
+ * \brief Runs the body in a fresh frame, then every call it left in tail position,
+ * one after the other in this loop.
+ */
+Value CompiledFunVal::apply(const Value &actual_arg){
+    PTR(CompiledFunVal) callee;   // keeps the function of a tail call alive
+    CompiledFunVal *fun = this;
+    Value arg = actual_arg;
+    while (true) {
+        governor_tick();
+        ClosureFrame frame(fun->function->frame_size, fun->captures.data());
+        frame.slots[0] = arg;
+        Value result = fun->function->code(frame);
+        if (frame.tail_fun == nullptr) {
+            return result;
+        }
+        callee = frame.tail_fun;
+        arg = frame.tail_arg;
+        fun = &*callee;
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * \file closure_compile.hpp
+ * \brief Closure-compilation backend (--compile-closures): every node of a resolved
+ * tree becomes a C++ function object once, with its children bound in.
+ *
+ * Running a compiled program calls those objects directly, with no walk over the
+ * tree and no virtual step() per node. The common shapes get classes of their own
+ * from templates. For example, an add of a slot and a literal reads them in place
+ * and adds inline, and an _if on an == compares without making a boolean first. The
+ * rest of the language is covered more generically. Like the VM, calls in tail
+ * position do not grow the C++ stack.
+ */
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "env.hpp"
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+class CompiledFunVal;
+
+/**
+ * \brief The frame one call of a compiled function runs in. The body reads the
+ * argument and its _let variables from `slots` (argument in slot 0) and what the
+ * function captured from `captures`. A call in tail position stores the callee and
+ * argument here instead of calling, and the caller's loop makes the call.
+ */
+class ClosureFrame {
+public:
+    Value *slots;
+    const Value *captures;
+    PTR(CompiledFunVal) tail_fun;
+    Value tail_arg;
+
+    ClosureFrame(int frame_size, const Value *captures);
+    ClosureFrame(Value *slots, int frame_size);
+    ~ClosureFrame();
+
+private:
+    int frame_size;
+    bool owned;   // false when the slots belong to the caller, as a ScriptContext's do
+
+    ClosureFrame(const ClosureFrame &other);
+    ClosureFrame &operator=(const ClosureFrame &other);
+};
+
+typedef function<Value(ClosureFrame &)> ClosureCode;
+
+/**
+ * \brief One compiled function body, or the top-level program.
+ */
+class CompiledFunction {
+public:
+    string formal_arg;
+    PTR(Expr) body;     // for printing and comparing the functions it makes
+    int frame_size;
+    ClosureCode code;
+
+    CompiledFunction(string formal_arg, PTR(Expr) body, int frame_size);
+};
+
+//======================  CompiledFunVal  ======================//
+
+/**
+ * \brief A function value made by compiled code. Prints, hashes and compares like
+ * the FunVal of the same _fun.
+ */
+class CompiledFunVal : public Val {
+public:
+    PTR(CompiledFunction) function;
+    vector<Value, FrameAllocator<Value> > captures;
+
+    CompiledFunVal(PTR(CompiledFunction) function);
+    ~CompiledFunVal();
+
+    virtual PTR(Expr) to_expr();
+    virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
+    virtual PTR(Val) add_to(PTR(Val) other_val);
+    virtual PTR(Val) mult_with(PTR(Val) other_val);
+    virtual void print(ostream &ostream);
+    virtual bool is_true();
+
+    virtual PTR(Val) call(PTR(Val) actual_arg);
+    virtual Value apply(const Value &actual_arg);
+};
+
+PTR(CompiledFunction) closure_compile(PTR(Expr) e);
+
+PTR(Val) closure_run(PTR(CompiledFunction) program);
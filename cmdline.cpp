@@ -16,16 +16,42 @@
 #define CATCH_CONFIG_RUNNER
 #include "catch.h"
 #include "cmdline.hpp"
+#include <cstdlib>
+#include <thread>
 
-run_mode_t use_arguments(int argc, char **argv){
+run_mode_t use_arguments(int argc, char **argv, run_options_t &options){
   string helpTg = "--help";
   string testTg = "--test";
   string interpTg = "--interp";
   string printTg = "--print";
   string prettyPrintTg = "--pretty-print";
-  string tags[5]={helpTg, testTg, interpTg, printTg, prettyPrintTg};
+  string vmTg = "--vm";
+  string closuresTg = "--compile-closures";
+  string batchTg = "--batch";
+  string jobsTg = "--jobs";
+  string optimizeTg = "--optimize";
+  string internTg = "--intern";
+  string memoizeTg = "--memoize";
+  string profileTg = "--profile";
+  string profileSummaryTg = "--profile-summary";
+  string compileTg = "--compile";
+  string loadTg = "--load";
+  string resolveTg = "--resolve";
+  string serveTg = "--serve";
+  string socketTg = "--socket";
+  string cacheTg = "--cache";
+  string parallelTg = "--parallel";
+  string lazyTg = "--lazy";
+  string maxStepsTg = "--max-steps";
+  string timeLimitTg = "--time-limit";
+  string maxMemoryTg = "--max-memory";
+  string typecheckTg = "--typecheck";
+  string flatTg = "--flat";
+  string tags[27]={helpTg, testTg, interpTg, printTg, prettyPrintTg, vmTg, closuresTg, flatTg, batchTg, jobsTg, optimizeTg, internTg, memoizeTg, profileTg, profileSummaryTg, compileTg, loadTg, resolveTg, serveTg, socketTg, cacheTg, parallelTg, lazyTg, maxStepsTg, timeLimitTg, maxMemoryTg, typecheckTg};
     
   int length = argc;
+  run_mode_t mode = do_nothing;
+  bool parallel = false;
 
   for (int i=1; i<length; i++){
       
@@ -49,19 +75,120 @@ run_mode_t use_arguments(int argc, char **argv){
           }
     }
     else if(s==interpTg){
-        return do_interp;
+        mode = do_interp;
     }
     else if(s==printTg){
-        return do_print;
+        mode = do_print;
     }
     else if(s==prettyPrintTg){
-        return do_pretty_print;
+        mode = do_pretty_print;
+    }
+    else if(s==vmTg){
+        mode = do_vm;
+    }
+    else if(s==closuresTg){
+        mode = do_closures;
+    }
+    else if(s==flatTg){
+        mode = do_flat;
+    }
+    else if(s==profileTg){
+        mode = do_profile;
+    }
+    else if(s==profileSummaryTg){
+        mode = do_profile;
+        options.profile_summary = true;
+    }
+    else if(s==batchTg){
+        options.batch = true;
+    }
+    else if(s==optimizeTg){
+        options.optimize = true;
+    }
+    else if(s==internTg){
+        options.intern = true;
+    }
+    else if(s==memoizeTg){
+        options.memoize = true;
+    }
+    else if(s==lazyTg){
+        options.lazy = true;
+    }
+    else if(s==typecheckTg){
+        options.typecheck = true;
+    }
+    else if(s==resolveTg){
+        options.resolve = true;
+    }
+    else if(s==compileTg && i+1<length){
+        // --compile FILE writes the program on stdin to FILE instead of running it
+        mode = do_compile;
+        options.compile_file = argv[++i];
+    }
+    else if(s==loadTg && i+1<length){
+        // --load FILE runs a program written by --compile
+        options.load_file = argv[++i];
+    }
+    else if(s==serveTg){
+        options.serve = true;
+    }
+    else if(s==socketTg && i+1<length){
+        // --socket PATH serves on a Unix socket
+        options.serve = true;
+        options.socket_path = argv[++i];
+    }
+    else if(s==cacheTg && i+1<length){
+        int size = atoi(argv[++i]);
+        options.cache_size = size > 0 ? size : 1;
+    }
+    else if(s==parallelTg && i+1<length){
+        // --parallel N interprets each program on N threads, --parallel 0 on one per core
+        int threads = atoi(argv[++i]);
+        if (threads <= 0) {
+            threads = thread::hardware_concurrency();
+        }
+        options.parallel = threads > 0 ? threads : 1;
+        parallel = true;
+    }
+    else if(s==maxStepsTg && i+1<length){
+        // --max-steps N stops an evaluation after N steps of the interpreter
+        options.quota.max_steps = strtoul(argv[++i], nullptr, 10);
+    }
+    else if(s==timeLimitTg && i+1<length){
+        // --time-limit MS stops an evaluation after MS milliseconds
+        options.quota.time_limit_ms = strtoul(argv[++i], nullptr, 10);
+    }
+    else if(s==maxMemoryTg && i+1<length){
+        // --max-memory MB stops an evaluation that has allocated MB megabytes
+        options.quota.max_memory = strtoul(argv[++i], nullptr, 10) << 20;
+    }
+    else if(s==jobsTg && i+1<length){
+        // --jobs N runs a batch on N threads, --jobs 0 on one per core
+        int jobs = atoi(argv[++i]);
+        if (jobs <= 0) {
+            jobs = thread::hardware_concurrency();
+        }
+        options.batch = true;
+        options.jobs = jobs > 0 ? jobs : 1;
     }
     else {
       cout << "Invalid argument provided" << endl;
       return do_nothing;
     }
   }
-    return do_nothing;
+    // --batch on its own evaluates each program
+    if (options.batch && mode == do_nothing) {
+        mode = do_interp;
+    }
+    // and so do --load, --serve, --parallel and --lazy
+    if ((!options.load_file.empty() || options.serve || parallel || options.lazy) && mode == do_nothing) {
+        mode = do_interp;
+    }
+    // as do the flags that change how a program is interpreted, or limit it
+    if ((options.optimize || options.intern || options.memoize || options.resolve || options.typecheck
+         || options.quota.limited()) && mode == do_nothing) {
+        mode = do_interp;
+    }
+    return mode;
 };
 
@@ -17,6 +17,7 @@
 #include <string>
 #include "Expr.hpp"
 #include "parse.hpp"
+#include "governor.hpp"
 
 using namespace std;
 
@@ -26,9 +27,42 @@ typedef enum {
   do_interp,
   do_print,
   do_pretty_print,
+  do_vm,
+  do_closures,
+  do_flat,
+  do_profile,
+  do_compile,
 
 } run_mode_t;
 
-run_mode_t use_arguments(int argc, char **argv);
+/**
+ * \brief Flags that change how the selected run mode processes its input.
+ */
+class run_options_t {
+public:
+    bool batch;   // read many programs from stdin, one result line per program
+    int jobs;     // threads for batch mode
+    bool optimize;  // fold constants before running or printing; functions print with
+                    // the literals substituted into their bodies
+    bool intern;    // share identical subtrees, across the batch in batch mode, up to
+                    // batch_intern_capacity nodes at a time
+    bool memoize;   // cache the results of function calls in --interp
+    bool profile_summary;  // --profile prints tables instead of collapsed stacks
+    bool resolve;   // --compile stores the resolved tree
+    string compile_file;   // where --compile writes the program
+    string load_file;      // precompiled program to run instead of parsing stdin
+    bool serve;     // answer requests until the input ends instead of running one program
+    string socket_path;    // --serve listens here instead of on stdin
+    size_t cache_size;     // programs the server keeps parsed
+    int parallel;   // threads --interp evaluates one program on; 1 for sequential
+    bool lazy;      // --interp evaluates _let bindings and call arguments by need
+    bool typecheck; // check types before running, and run proven operations unchecked
+    Quota quota;    // limits of each evaluation
+
+    run_options_t() : batch(false), jobs(1), optimize(false), intern(false), memoize(false), profile_summary(false), resolve(false),
+                      serve(false), cache_size(256), parallel(1), lazy(false), typecheck(false) {}
+};
+
+run_mode_t use_arguments(int argc, char **argv, run_options_t &options);
 
 
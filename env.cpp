@@ -6,19 +6,43 @@
 //
 
 #include "env.hpp"
+#include "alloc.hpp"
+#include <stdexcept>
 
-PTR(Env) Env::empty = NEW(EmptyEnv)();
+thread_local PTR(Env) Env::empty = NEW(EmptyEnv)();
 
-PTR(Val) EmptyEnv::lookup(string find_name) {
+Value Env::lookup_slot(int depth, int slot) {
+    throw runtime_error("unresolved variable access");
+}
+
+void Env::bind_slot(int slot, const Value &val) {
+    throw runtime_error("unresolved variable access");
+}
+
+/**
+ * \brief The environment a by-name lookup searches, which is all of it unless
+ * frames come first.
+ */
+PTR(Env) Env::names() {
+    return THIS;
+}
+
+Value EmptyEnv::lookup(const string &find_name) {
     throw runtime_error("free variable: " + find_name);
 }
 
-ExtendedEnv::ExtendedEnv(string name, PTR(Val) val, PTR(Env) rest){
+ExtendedEnv::ExtendedEnv(string name, Value val, PTR(Env) rest){
     this->name = name;
     this->val = val;
     this->rest = rest;
 }
-PTR(Val) ExtendedEnv::lookup(string find_name){
+ExtendedEnv::~ExtendedEnv(){
+    DeferredRelease release;
+    release.value(val);
+    release.env(rest);
+}
+
+Value ExtendedEnv::lookup(const string &find_name){
     if(find_name == name){
         return val;
     }
@@ -26,3 +50,206 @@ PTR(Val) ExtendedEnv::lookup(string find_name){
         return rest->lookup(find_name);
     }
 }
+
+FrameEnv::FrameEnv(int size, PTR(Env) rest){
+    this->slots.resize(size);
+    this->rest = rest;
+}
+
+FrameEnv::~FrameEnv(){
+    DeferredRelease release;
+    for (Value &slot : slots) {
+        release.value(slot);
+    }
+    release.env(rest);
+}
+
+Value FrameEnv::lookup(const string &find_name){
+    return rest->lookup(find_name);
+}
+
+Value FrameEnv::lookup_slot(int depth, int slot){
+    if(depth == 0){
+        return slots[slot];
+    }
+    else {
+        return rest->lookup_slot(depth - 1, slot);
+    }
+}
+
+void FrameEnv::bind_slot(int slot, const Value &val){
+    slots[slot] = val;
+}
+
+/**
+ * \brief The environment under the frames, which a closure keeps for the names its
+ * body does not bind.
+ */
+PTR(Env) FrameEnv::names(){
+    return rest->names();
+}
+
+//======================  Deferred release  ======================//
+
+#if USE_SHARED_POINTERS
+
+namespace {
+
+const int release_max_depth = 64;   // nested releases before references are queued
+
+thread_local int release_depth = 0;
+// the queue of the outermost DeferredRelease on the thread
+thread_local vector<shared_ptr<void> > *release_queue = nullptr;
+
+}
+
+DeferredRelease::DeferredRelease(){
+    owner = release_depth++ == 0;
+    if (owner) {
+        release_queue = &queue;
+    }
+}
+
+/**
+ * \brief The outermost one frees the queued objects, and what they queue, in a loop.
+ */
+DeferredRelease::~DeferredRelease(){
+    if (owner) {
+        while (!queue.empty()) {
+            shared_ptr<void> last = std::move(queue.back());
+            queue.pop_back();
+            last.reset();
+        }
+        release_queue = nullptr;
+    }
+    release_depth--;
+}
+
+/**
+ * \brief Drops a value's reference. Near the top of the destructor chain the object
+ * is freed straight away; deeper down, a last reference is queued.
+ */
+void DeferredRelease::value(Value &v){
+    if (release_depth > release_max_depth && v.boxed != nullptr && v.boxed.use_count() == 1) {
+        release_queue->push_back(std::move(v.boxed));
+    }
+    v.boxed = nullptr;
+}
+
+void DeferredRelease::env(PTR(Env) &e){
+    if (release_depth > release_max_depth && e != nullptr && e.use_count() == 1) {
+        release_queue->push_back(std::move(e));
+    }
+    e = nullptr;
+}
+
+#else
+
+// plain pointers are never freed, and the collector frees chains without recursing
+DeferredRelease::DeferredRelease() {}
+DeferredRelease::~DeferredRelease() {}
+void DeferredRelease::value(Value &v) {}
+void DeferredRelease::env(PTR(Env) &e) {}
+
+#endif
+
+//======================  Frame pool  ======================//
+
+#if USE_GC_POINTERS
+
+/**
+ * \brief A block of at least `size` bytes from the collected heap, found by the
+ * collector through the frame or closure holding it.
+ */
+void *frame_allocate(size_t size){
+    return gc_allocate(size);
+}
+
+void frame_deallocate(void *p, size_t size){
+    gc_free(p);
+}
+
+#else
+
+namespace {
+
+const size_t frame_granule = 16;
+const size_t frame_classes = 16;          // blocks of up to 256 bytes are pooled
+const size_t frame_pool_limit = 4096;     // free blocks kept per class and thread
+
+class FreeBlock {
+public:
+    FreeBlock *next;
+};
+
+// plain thread-locals, so that they still work while other thread-locals are destroyed
+thread_local FreeBlock *free_blocks[frame_classes];
+thread_local size_t free_counts[frame_classes];
+thread_local bool pool_closed;
+
+/**
+ * \brief Returns a thread's free blocks to the heap when the thread exits. After
+ * that, blocks are freed straight away.
+ */
+class FramePoolReaper {
+public:
+    ~FramePoolReaper(){
+        for (size_t c = 0; c < frame_classes; c++) {
+            while (free_blocks[c] != nullptr) {
+                FreeBlock *block = free_blocks[c];
+                free_blocks[c] = block->next;
+                ::operator delete(block);
+            }
+            free_counts[c] = 0;
+        }
+        pool_closed = true;
+    }
+};
+
+thread_local FramePoolReaper reaper;
+
+}
+
+/**
+ * \brief A block of at least `size` bytes, from the calling thread's free list when
+ * it has one of that size class.
+ */
+void *frame_allocate(size_t size){
+    size_t c = (size + frame_granule - 1) / frame_granule;
+    if (c == 0 || c > frame_classes) {
+        return ::operator new(size);
+    }
+    c--;
+    FreeBlock *block = free_blocks[c];
+    if (block != nullptr) {
+        free_blocks[c] = block->next;
+        free_counts[c]--;
+        count_pooled_bytes((c + 1) * frame_granule);
+        return block;
+    }
+    return ::operator new((c + 1) * frame_granule);
+}
+
+/**
+ * \brief Keeps a block from frame_allocate() on the calling thread's free list,
+ * or frees it if the list is full.
+ */
+void frame_deallocate(void *p, size_t size){
+    size_t c = (size + frame_granule - 1) / frame_granule;
+    if (c == 0 || c > frame_classes || pool_closed) {
+        ::operator delete(p);
+        return;
+    }
+    c--;
+    if (free_counts[c] >= frame_pool_limit) {
+        ::operator delete(p);
+        return;
+    }
+    (void)&reaper;   // makes sure the thread frees its lists when it exits
+    FreeBlock *block = static_cast<FreeBlock *>(p);
+    block->next = free_blocks[c];
+    free_blocks[c] = block;
+    free_counts[c]++;
+}
+
+#endif
@@ -8,15 +8,22 @@
 #pragma once
 #include <stdio.h>
 #include "pointer.h"
+#include "value.hpp"
+#include <cstddef>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace std;
 class Val;
 
 CLASS(Env) {
 public:
-    static PTR(Env) empty;
-    virtual PTR(Val) lookup (string find_name) = 0;
+    static thread_local PTR(Env) empty;   // one per thread, so evaluation on different threads shares no refcount
+    virtual Value lookup (const string &find_name) = 0;
+    virtual Value lookup_slot (int depth, int slot);
+    virtual void bind_slot (int slot, const Value &val);
+    virtual PTR(Env) names ();
     virtual ~Env() {};
 };
 
@@ -24,16 +31,116 @@ class EmptyEnv : public Env {
 public:
     EmptyEnv() = default;
     
-    virtual PTR(Val) lookup(string find_name);
+    virtual Value lookup(const string &find_name);
 };
 
 class ExtendedEnv : public Env {
 public:
     string name;
-    PTR(Val) val;
+    Value val;
     PTR(Env) rest;
     
-    ExtendedEnv(string name, PTR(Val) val, PTR(Env) rest);
+    ExtendedEnv(string name, Value val, PTR(Env) rest);
+    ~ExtendedEnv();
     
-    virtual PTR(Val) lookup(string find_name);
+    virtual Value lookup(const string &find_name);
+};
+
+//======================  Frame pool  ======================//
+
+void *frame_allocate(size_t size);
+void frame_deallocate(void *p, size_t size);
+
+/**
+ * \brief Standard allocator over the frame pool: small blocks are recycled through
+ * per-thread free lists instead of going back to the heap, so a call in a loop
+ * reuses the memory of the frame the previous call released. With collected
+ * pointers the blocks come from the collected heap, so a container using it has to
+ * live in a collected object or on the stack.
+ */
+template <class T> class FrameAllocator {
+public:
+    typedef T value_type;
+
+    FrameAllocator() {}
+    template <class U> FrameAllocator(const FrameAllocator<U> &other) {}
+
+    T *allocate(size_t n){
+        return static_cast<T *>(frame_allocate(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t n){
+        frame_deallocate(p, n * sizeof(T));
+    }
+
+    template <class U> bool operator==(const FrameAllocator<U> &other) const { return true; }
+    template <class U> bool operator!=(const FrameAllocator<U> &other) const { return false; }
+};
+
+/**
+ * \brief Like NEW, but takes the object, and with shared pointers its control block,
+ * from the frame pool. Collected objects come from the collected heap, which pools
+ * freed memory by itself.
+ */
+template <class T, class... Args> PTR(T) pool_new(Args&&... args){
+#if USE_PLAIN_POINTERS
+    return new T(std::forward<Args>(args)...);
+#elif USE_GC_POINTERS
+    return gc_new<T>(std::forward<Args>(args)...);
+#else
+    return std::allocate_shared<T>(FrameAllocator<T>(), std::forward<Args>(args)...);
+#endif
+}
+
+/**
+ * \brief An array-backed frame used by resolved expressions.
+ *
+ * Holds the argument and `_let` bindings of one function body (or of the top level)
+ * in slots chosen by the resolver, so a variable access is an indexed load. A
+ * closure's captured values are a frame too, the `rest` of every frame its calls
+ * make. Names are not kept: a by-name lookup skips the frame and goes to the
+ * enclosing environment. Frames and their slots come from the frame pool.
+ */
+class FrameEnv : public Env {
+public:
+    vector<Value, FrameAllocator<Value> > slots;
+    PTR(Env) rest;
+    
+    FrameEnv(int size, PTR(Env) rest);
+    ~FrameEnv();
+    
+    virtual Value lookup(const string &find_name);
+    virtual Value lookup_slot(int depth, int slot);
+    virtual void bind_slot(int slot, const Value &val);
+    virtual PTR(Env) names();
+};
+
+//======================  Deferred release  ======================//
+
+/**
+ * \brief Drops the references an environment or closure holds without freeing what
+ * they point to from inside its destructor.
+ *
+ * A closure keeps a frame, whose slots can keep another closure, and so on, so a
+ * long chain built by a loop would otherwise be freed by one nested destructor per
+ * link and overflow the native stack. Once releases nest deeply, last references
+ * are queued instead, and the outermost DeferredRelease on the thread frees the
+ * queue in a loop, queueing whatever those objects release in turn. Shallow chains,
+ * the usual case, are freed on the spot without touching the queue.
+ */
+class DeferredRelease {
+public:
+    DeferredRelease();
+    ~DeferredRelease();
+
+    void value(Value &v);
+    void env(PTR(Env) &e);
+
+private:
+#if USE_SHARED_POINTERS
+    vector<shared_ptr<void> > queue;   // used by the outermost one only
+    bool owner;
+#endif
+
+    DeferredRelease(const DeferredRelease &);
+    DeferredRelease &operator=(const DeferredRelease &);
 };
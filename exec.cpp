@@ -1,11 +1,16 @@
 #include <string>
 #include <iostream>
 #include <cassert>
+#include <mutex>
+#include <stdexcept>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
 
 #include "exec.hpp"
 
@@ -24,6 +29,11 @@ static void wait_until_one_ready(int wr_fd, bool wr_done,
 static void pump_to(std::string &str, int fd, bool &done);
 static void pump_from(int fd, std::string &str, bool &done);
 static void wait_child(pid_t pid, int &exit_code);
+static void close_on_exec(int fd);
+
+// Held while a thread's pipes exist without FD_CLOEXEC or are being forked, so a
+// child started by another thread cannot inherit them and keep them open
+static std::mutex spawn_lock;
 
 // Run the program in command[0], where `command` must be a NULL-terminated
 // array (like `execv` expects). Supply the given string as stdin to the
@@ -42,6 +52,7 @@ ExecResult exec_program(int argc, const char * const *argv, std::string input) {
 
   signal(SIGPIPE, SIG_IGN);
   
+  std::unique_lock<std::mutex> spawning(spawn_lock);
   int in[2];
   if (pipe(in) != 0)
     throw std::runtime_error("stdin pipe failed");
@@ -54,6 +65,9 @@ ExecResult exec_program(int argc, const char * const *argv, std::string input) {
   if (pipe(err) != 0)
     throw std::runtime_error("stdout pipe failed");
 
+  for (int fd : { in[READ_END], in[WRITE_END], out[READ_END], out[WRITE_END], err[READ_END], err[WRITE_END] })
+    close_on_exec(fd);
+
   pid_t pid = fork();
   if (pid == -1)
     throw std::runtime_error("fork failed");
@@ -80,6 +94,7 @@ ExecResult exec_program(int argc, const char * const *argv, std::string input) {
     }
   } else {
     // parent
+    spawning.unlock();
     bool in_done = false, out_done = false, err_done = false;
     ExecResult r;
 
@@ -102,6 +117,12 @@ ExecResult exec_program(int argc, const char * const *argv, std::string input) {
   }
 }
 
+// Keep a file descriptor from being inherited past `execv`; the child's
+// stdin, stdout and stderr are copies made by `dup2`, which does not copy the flag
+static void close_on_exec(int fd) {
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+}
+
 // Enable/disable nonblocking mode for a file descriptor
 static void nonblocking(int fd, bool enabled) {
   int old_flags = fcntl(fd, F_GETFL, 0);
@@ -0,0 +1,840 @@
+/**
+ * \file flat.cpp
+ * \brief Implementation of the flat program layout and of the passes that walk it.
+ *
+ * Like the passes over Expr trees, these recurse on all but one child and loop on
+ * the last, so a chain of +, * or ==, a run of _let and the else branches of nested
+ * _ifs take no native stack frame per node.
+ */
+
+#include "flat.hpp"
+#include <climits>
+#include <stdexcept>
+#include "governor.hpp"
+#include "resolve.hpp"
+
+//======================  FlatTree  ======================//
+
+FlatTree::FlatTree(){
+    this->resolved = false;
+    this->frame_size = 0;
+}
+
+/**
+ * \brief The symbol of a name, added to the table the first time it is seen.
+ */
+flat_symbol FlatTree::intern(const string &name){
+    unordered_map<string, flat_symbol>::iterator found = symbol_ids.find(name);
+    if (found != symbol_ids.end()) {
+        return found->second;
+    }
+    symbols.push_back(name);
+    flat_symbol id = (flat_symbol)symbols.size() - 1;
+    symbol_ids.insert(make_pair(name, id));
+    return id;
+}
+
+flat_node FlatTree::add_node(expr_kind_t kind, size_t index){
+    if (kinds.size() >= UINT32_MAX) {
+        throw runtime_error("program too large to flatten");
+    }
+    kinds.push_back((uint8_t)kind);
+    this->index.push_back((uint32_t)index);
+    return root();
+}
+
+flat_node FlatTree::number(int val){
+    numbers.push_back(val);
+    return add_node(expr_num, numbers.size() - 1);
+}
+
+flat_node FlatTree::boolean(bool val){
+    return add_node(expr_bool, val);
+}
+
+flat_node FlatTree::var(flat_symbol name){
+    FlatVar var = {name, -1, 0};
+    vars.push_back(var);
+    return add_node(expr_var, vars.size() - 1);
+}
+
+/**
+ * \brief Appends a +, *, == or call of two nodes already in the tree.
+ */
+flat_node FlatTree::binary(expr_kind_t kind, flat_node lhs, flat_node rhs){
+    FlatBinary binary = {lhs, rhs};
+    binaries.push_back(binary);
+    return add_node(kind, binaries.size() - 1);
+}
+
+flat_node FlatTree::if_(flat_node if_, flat_node then_, flat_node else_){
+    FlatIf node = {if_, then_, else_};
+    ifs.push_back(node);
+    return add_node(expr_if, ifs.size() - 1);
+}
+
+flat_node FlatTree::let(flat_symbol name, flat_node rhs, flat_node body){
+    FlatLet let = {name, 0, rhs, body};
+    lets.push_back(let);
+    return add_node(expr_let, lets.size() - 1);
+}
+
+flat_node FlatTree::fun(flat_symbol formal_arg, flat_node body){
+    FlatFun fun = {formal_arg, 0, 0, 0, body};
+    funs.push_back(fun);
+    return add_node(expr_fun, funs.size() - 1);
+}
+
+/**
+ * \brief The first node of the subtree rooted at `n`, which ends at `n`: the leaf
+ * reached by always taking the first child.
+ */
+flat_node FlatTree::start(flat_node n) const{
+    while (true) {
+        uint32_t i = index[n];
+        switch (kind(n)) {
+            case expr_add:
+            case expr_mult:
+            case expr_eq:
+            case expr_call:
+                n = binaries[i].lhs;
+                break;
+            case expr_if:
+                n = ifs[i].if_;
+                break;
+            case expr_let:
+                n = lets[i].rhs;
+                break;
+            case expr_fun:
+                n = funs[i].body;
+                break;
+            default:
+                return n;
+        }
+    }
+}
+
+/**
+ * \brief Drops the last nodes until `size` are left. Every kind's entries are in node
+ * order too, so the entry of the last node is the last of its array. Only for trees
+ * that are not resolved yet, whose captures are empty.
+ */
+void FlatTree::truncate(size_t size){
+    while (kinds.size() > size) {
+        switch (kind(root())) {
+            case expr_num:
+                numbers.pop_back();
+                break;
+            case expr_var:
+                vars.pop_back();
+                break;
+            case expr_add:
+            case expr_mult:
+            case expr_eq:
+            case expr_call:
+                binaries.pop_back();
+                break;
+            case expr_if:
+                ifs.pop_back();
+                break;
+            case expr_let:
+                lets.pop_back();
+                break;
+            case expr_fun:
+                funs.pop_back();
+                break;
+            default:
+                break;
+        }
+        kinds.pop_back();
+        index.pop_back();
+    }
+}
+
+/**
+ * \brief The memory the arrays and names hold, not counting the index used to
+ * intern names.
+ */
+size_t FlatTree::bytes() const{
+    size_t total = kinds.capacity() * sizeof(uint8_t) + index.capacity() * sizeof(uint32_t)
+        + numbers.capacity() * sizeof(int) + vars.capacity() * sizeof(FlatVar)
+        + binaries.capacity() * sizeof(FlatBinary) + ifs.capacity() * sizeof(FlatIf)
+        + lets.capacity() * sizeof(FlatLet) + funs.capacity() * sizeof(FlatFun)
+        + captures.capacity() * sizeof(pair<int, int>) + symbols.capacity() * sizeof(string);
+    for (const string &symbol : symbols) {
+        total += symbol.capacity();
+    }
+    return total;
+}
+
+//======================  Conversion  ======================//
+
+static flat_node flatten_node(FlatTree &tree, Expr *e);
+
+/**
+ * \brief Appends the nodes joining already flattened operands into a chain of
+ * `kind` nested through rhs, from the right.
+ */
+static flat_node flatten_operands(FlatTree &tree, expr_kind_t kind, const vector<flat_node> &operands){
+    flat_node result = operands.back();
+    for (size_t i = operands.size() - 1; i-- > 0;) {
+        result = tree.binary(kind, operands[i], result);
+    }
+    return result;
+}
+
+/**
+ * \brief Flattens a chain of T: its operands in source order, then its nodes.
+ */
+template <class T> static flat_node flatten_chain(FlatTree &tree, T *first){
+    vector<T *> chain = rhs_chain(first);
+    vector<flat_node> operands;
+    operands.reserve(chain.size() + 1);
+    for (T *link : chain) {
+        operands.push_back(flatten_node(tree, &*link->lhs));
+    }
+    operands.push_back(flatten_node(tree, &*chain.back()->rhs));
+    return flatten_operands(tree, first->kind, operands);
+}
+
+static flat_node flatten_node(FlatTree &tree, Expr *e){
+    switch (e->kind) {
+        case expr_num:
+            return tree.number(static_cast<NumExpr *>(e)->val);
+        case expr_bool:
+            return tree.boolean(static_cast<BoolExpr *>(e)->val);
+        case expr_var:
+        case expr_slot_var:
+            return tree.var(tree.intern(static_cast<VarExpr *>(e)->val));
+        case expr_add:
+            return flatten_chain(tree, static_cast<AddExpr *>(e));
+        case expr_mult:
+            return flatten_chain(tree, static_cast<MultExpr *>(e));
+        case expr_eq:
+            return flatten_chain(tree, static_cast<EqExpr *>(e));
+        case expr_sum:
+        case expr_product: {
+            vector<flat_node> operands;
+            for (PTR(Expr) &operand : static_cast<NaryExpr *>(e)->operands) {
+                operands.push_back(flatten_node(tree, &*operand));
+            }
+            return flatten_operands(tree, base_kind(e->kind), operands);
+        }
+        case expr_let:
+        case expr_slot_let: {
+            LetExpr *let = static_cast<LetExpr *>(e);
+            flat_symbol name = tree.intern(let->lhs);
+            flat_node rhs = flatten_node(tree, &*let->rhs);
+            return tree.let(name, rhs, flatten_node(tree, &*let->body));
+        }
+        case expr_if: {
+            IfExpr *if_expr = static_cast<IfExpr *>(e);
+            flat_node if_ = flatten_node(tree, &*if_expr->if_);
+            flat_node then_ = flatten_node(tree, &*if_expr->then_);
+            return tree.if_(if_, then_, flatten_node(tree, &*if_expr->else_));
+        }
+        case expr_fun:
+        case expr_slot_fun: {
+            FunExpr *fun = static_cast<FunExpr *>(e);
+            flat_symbol formal_arg = tree.intern(fun->formal_arg);
+            return tree.fun(formal_arg, flatten_node(tree, &*fun->body));
+        }
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(e);
+            flat_node to_be_called = flatten_node(tree, &*call->to_be_called);
+            return tree.binary(expr_call, to_be_called, flatten_node(tree, &*call->actual_arg));
+        }
+        case expr_scope:
+            return flatten_node(tree, &*static_cast<ScopeExpr *>(e)->body);
+        default:
+            throw runtime_error("cannot flatten expression: " + e->to_string());
+    }
+}
+
+/**
+ * \brief Lays a program out flat.
+ * \param e A parsed or resolved program; addresses of resolved forms are dropped.
+ * \return An unresolved FlatTree of the program.
+ */
+PTR(FlatTree) flatten(PTR(Expr) e){
+    PTR(FlatTree) tree = NEW(FlatTree)();
+    flatten_node(*tree, &*e);
+    return tree;
+}
+
+/**
+ * \brief Rebuilds the subtree rooted at `n` as a parsed Expr tree. Its nodes are
+ * visited in order, so every child is built before its parent needs it.
+ */
+PTR(Expr) unflatten(const FlatTree &tree, flat_node n){
+    flat_node first = tree.start(n);
+    vector<PTR(Expr)> built(n - first + 1);
+    // each node is the child of one parent, which takes it over
+    auto take = [&](flat_node child) -> PTR(Expr) {
+        return std::move(built[child - first]);
+    };
+    for (flat_node i = first; i <= n; i++) {
+        uint32_t k = tree.index[i];
+        PTR(Expr) e;
+        switch (tree.kind(i)) {
+            case expr_num:
+                e = NEW(NumExpr)(tree.numbers[k]);
+                break;
+            case expr_bool:
+                e = NEW(BoolExpr)(k != 0);
+                break;
+            case expr_var:
+                e = NEW(VarExpr)(tree.symbols[tree.vars[k].name]);
+                break;
+            case expr_add: {
+                PTR(Expr) lhs = take(tree.binaries[k].lhs);
+                e = NEW(AddExpr)(lhs, take(tree.binaries[k].rhs));
+                break;
+            }
+            case expr_mult: {
+                PTR(Expr) lhs = take(tree.binaries[k].lhs);
+                e = NEW(MultExpr)(lhs, take(tree.binaries[k].rhs));
+                break;
+            }
+            case expr_eq: {
+                PTR(Expr) lhs = take(tree.binaries[k].lhs);
+                e = NEW(EqExpr)(lhs, take(tree.binaries[k].rhs));
+                break;
+            }
+            case expr_call: {
+                PTR(Expr) to_be_called = take(tree.binaries[k].lhs);
+                e = NEW(CallExpr)(to_be_called, take(tree.binaries[k].rhs));
+                break;
+            }
+            case expr_if: {
+                const FlatIf &if_expr = tree.ifs[k];
+                PTR(Expr) if_ = take(if_expr.if_);
+                PTR(Expr) then_ = take(if_expr.then_);
+                e = NEW(IfExpr)(if_, then_, take(if_expr.else_));
+                break;
+            }
+            case expr_let: {
+                const FlatLet &let = tree.lets[k];
+                PTR(Expr) rhs = take(let.rhs);
+                e = NEW(LetExpr)(tree.symbols[let.name], rhs, take(let.body));
+                break;
+            }
+            case expr_fun: {
+                const FlatFun &fun = tree.funs[k];
+                e = NEW(FunExpr)(tree.symbols[fun.formal_arg], take(fun.body));
+                break;
+            }
+            default:
+                throw runtime_error("malformed flat tree");
+        }
+        built[i - first] = e;
+    }
+    return built.back();
+}
+
+/**
+ * \brief Rebuilds the whole program as a parsed Expr tree.
+ */
+PTR(Expr) unflatten(const FlatTree &tree){
+    return unflatten(tree, tree.root());
+}
+
+//======================  Resolving  ======================//
+
+/**
+ * \brief Resolves the subtree at `n` in `scope`, writing the addresses into the tree.
+ * The _let variables bound on the way down stay bound until the whole subtree is
+ * done, since the body of a _let is its last child.
+ */
+static void resolve_node(FlatTree &tree, flat_node n, ResolveScope *scope){
+    int bound = 0;
+    while (true) {
+        uint32_t i = tree.index[n];
+        switch (tree.kind(n)) {
+            case expr_var: {
+                FlatVar &var = tree.vars[i];
+                if (!scope->find(tree.symbols[var.name], var.depth, var.slot)) {
+                    var.depth = -1;
+                }
+                break;
+            }
+            case expr_add:
+            case expr_mult:
+            case expr_eq:
+            case expr_call:
+                resolve_node(tree, tree.binaries[i].lhs, scope);
+                n = tree.binaries[i].rhs;
+                continue;
+            case expr_if:
+                resolve_node(tree, tree.ifs[i].if_, scope);
+                resolve_node(tree, tree.ifs[i].then_, scope);
+                n = tree.ifs[i].else_;
+                continue;
+            case expr_let: {
+                resolve_node(tree, tree.lets[i].rhs, scope);
+                FlatLet &let = tree.lets[i];
+                let.slot = scope->new_slot();
+                scope->bind(tree.symbols[let.name], let.slot);
+                bound++;
+                n = let.body;
+                continue;
+            }
+            case expr_fun: {
+                ResolveScope inner(scope);
+                inner.bind(tree.symbols[tree.funs[i].formal_arg], inner.new_slot());
+                resolve_node(tree, tree.funs[i].body, &inner);
+                FlatFun &fun = tree.funs[i];
+                fun.frame_size = inner.frame_size;
+                fun.first_capture = (uint32_t)tree.captures.size();
+                fun.capture_count = (uint32_t)inner.captures.size();
+                tree.captures.insert(tree.captures.end(), inner.captures.begin(), inner.captures.end());
+                break;
+            }
+            default:
+                break;
+        }
+        break;
+    }
+    for (; bound > 0; bound--) {
+        scope->unbind();
+    }
+}
+
+/**
+ * \brief Gives every variable, _let and _fun of the tree its frame slot, with the
+ * same frames and captures as resolve() gives the Expr tree. Does nothing to a tree
+ * that is already resolved.
+ */
+void resolve(FlatTree &tree){
+    if (tree.resolved) {
+        return;
+    }
+    ResolveScope scope(nullptr);
+    resolve_node(tree, tree.root(), &scope);
+    tree.frame_size = scope.frame_size;
+    tree.resolved = true;
+}
+
+//======================  Optimizing  ======================//
+
+/**
+ * \brief A variable binding visible while optimizing a flat tree, and its literal
+ * value when it has one, as in OptimizeScope.
+ */
+class FlatConstant {
+public:
+    flat_symbol name;
+    bool known;
+    Value value;
+};
+
+/**
+ * \brief Writes the optimized program into a new tree, node after node. A subtree is
+ * written before it is known whether its parent folds, and taken back out with
+ * truncate() if it does, which works because it is always the last thing written.
+ */
+class FlatOptimizer {
+public:
+    const FlatTree &in;
+    PTR(FlatTree) out;
+    vector<FlatConstant> scope;   // innermost last
+
+    FlatOptimizer(const FlatTree &in) : in(in), out(NEW(FlatTree)()) {
+        out->symbols = in.symbols;
+        out->symbol_ids = in.symbol_ids;
+    }
+
+    flat_node node(flat_node n);
+    flat_node let(flat_symbol name, flat_node rhs, flat_node body);
+    flat_node chain(flat_node first);
+
+    void bind(flat_symbol name, bool known, const Value &value){
+        FlatConstant binding = {name, known, value};
+        scope.push_back(binding);
+    }
+
+    /**
+     * \brief True if the output node `n` is a literal, whose value is then in `value`.
+     */
+    bool literal(flat_node n, Value &value){
+        if (out->kind(n) == expr_num) {
+            value = Value::number(out->numbers[out->index[n]]);
+            return true;
+        }
+        if (out->kind(n) == expr_bool) {
+            value = Value::boolean(out->index[n] != 0);
+            return true;
+        }
+        return false;
+    }
+
+    flat_node constant(const Value &value){
+        if (value.is_bool()) {
+            return out->boolean(value.num != 0);
+        }
+        return out->number(value.num);
+    }
+};
+
+/**
+ * \brief Drops a binding whose value is a literal, substituting it into the body.
+ */
+flat_node FlatOptimizer::let(flat_symbol name, flat_node rhs, flat_node body){
+    size_t mark = out->size();
+    flat_node new_rhs = node(rhs);
+    Value value;
+    bool known = literal(new_rhs, value);
+    if (known) {
+        out->truncate(mark);
+    }
+    bind(name, known, value);
+    flat_node new_body = node(body);
+    scope.pop_back();
+    return known ? new_body : out->let(name, new_rhs, new_body);
+}
+
+/**
+ * \brief Optimizes the operands of a chain of +, * or == in source order and combines
+ * them from the right, folding where both sides are literals that fold, like
+ * fold_add(), fold_mult() and fold_eq() do for Expr trees.
+ */
+flat_node FlatOptimizer::chain(flat_node first){
+    expr_kind_t kind = in.kind(first);
+    vector<flat_node> links(1, first);
+    while (in.kind(in.binaries[in.index[links.back()]].rhs) == kind) {
+        links.push_back(in.binaries[in.index[links.back()]].rhs);
+    }
+    vector<size_t> starts;
+    vector<flat_node> operands;
+    for (flat_node link : links) {
+        starts.push_back(out->size());
+        operands.push_back(node(in.binaries[in.index[link]].lhs));
+    }
+    flat_node result = node(in.binaries[in.index[links.back()]].rhs);
+    for (size_t i = links.size(); i-- > 0;) {
+        Value lhs, rhs;
+        if (literal(operands[i], lhs) && literal(result, rhs)) {
+            if (kind == expr_eq) {
+                out->truncate(starts[i]);
+                result = out->boolean(rhs.equals(lhs));
+                continue;
+            }
+            if (lhs.is_num() && rhs.is_num()) {
+                out->truncate(starts[i]);
+                result = constant(kind == expr_add ? lhs.add_to(rhs) : lhs.mult_with(rhs));
+                continue;
+            }
+        }
+        result = out->binary(kind, operands[i], result);
+    }
+    return result;
+}
+
+flat_node FlatOptimizer::node(flat_node n){
+    uint32_t i = in.index[n];
+    switch (in.kind(n)) {
+        case expr_num:
+            return out->number(in.numbers[i]);
+        case expr_bool:
+            return out->boolean(i != 0);
+        case expr_var: {
+            flat_symbol name = in.vars[i].name;
+            for (size_t j = scope.size(); j-- > 0;) {
+                if (scope[j].name == name) {
+                    if (scope[j].known) {
+                        return constant(scope[j].value);
+                    }
+                    break;
+                }
+            }
+            return out->var(name);
+        }
+        case expr_add:
+        case expr_mult:
+        case expr_eq:
+            return chain(n);
+        case expr_if: {
+            const FlatIf &if_expr = in.ifs[i];
+            size_t mark = out->size();
+            flat_node if_ = node(if_expr.if_);
+            Value condition;
+            if (literal(if_, condition)) {
+                out->truncate(mark);
+                return node(condition.is_bool() && condition.num ? if_expr.then_ : if_expr.else_);
+            }
+            flat_node then_ = node(if_expr.then_);
+            return out->if_(if_, then_, node(if_expr.else_));
+        }
+        case expr_let:
+            return let(in.lets[i].name, in.lets[i].rhs, in.lets[i].body);
+        case expr_fun: {
+            bind(in.funs[i].formal_arg, false, Value());
+            flat_node body = node(in.funs[i].body);
+            scope.pop_back();
+            return out->fun(in.funs[i].formal_arg, body);
+        }
+        case expr_call: {
+            const FlatBinary &call = in.binaries[i];
+            // a call of a _fun literal is a _let of its argument
+            if (in.kind(call.lhs) == expr_fun) {
+                const FlatFun &fun = in.funs[in.index[call.lhs]];
+                return let(fun.formal_arg, call.rhs, fun.body);
+            }
+            flat_node to_be_called = node(call.lhs);
+            return out->binary(expr_call, to_be_called, node(call.rhs));
+        }
+        default:
+            throw runtime_error("malformed flat tree");
+    }
+}
+
+/**
+ * \brief The flat counterpart of optimize(): folds the same constants, going by the
+ * same rules.
+ * \param tree A flat program, resolved or not.
+ * \return A new, unresolved tree of the optimized program.
+ */
+PTR(FlatTree) optimize(const FlatTree &tree){
+    FlatOptimizer optimizer(tree);
+    optimizer.node(tree.root());
+    return optimizer.out;
+}
+
+//======================  Evaluation  ======================//
+
+/**
+ * \brief The frame one call of a flat function runs in, as ClosureFrame is for
+ * compiled code: slots of the body, the closure's captures, and the call the body
+ * left in tail position.
+ */
+class FlatFrame {
+public:
+    vector<Value, FrameAllocator<Value> > slots;
+    const Value *captures;
+    PTR(FlatFunVal) tail_fun;
+    Value tail_arg;
+
+    FlatFrame(int frame_size, const Value *captures) : slots(frame_size), captures(captures), tail_fun(nullptr) {}
+};
+
+static Value flat_eval(const FlatTreePtr &tree, flat_node n, FlatFrame &frame, bool tail);
+
+/**
+ * \brief Evaluates a chain of + or * in one loop: operands left to right, then
+ * combined from the right, like AddExpr::step().
+ */
+static Value flat_arithmetic(const FlatTreePtr &tree, flat_node first, FlatFrame &frame){
+    const FlatTree &t = *tree;
+    expr_kind_t kind = t.kind(first);
+    const FlatBinary *link = &t.binaries[t.index[first]];
+    if (t.kind(link->rhs) != kind) {
+        Value lhs = flat_eval(tree, link->lhs, frame, false);
+        Value rhs = flat_eval(tree, link->rhs, frame, false);
+        return kind == expr_add ? lhs.add_to(rhs) : lhs.mult_with(rhs);
+    }
+    vector<Value> operands;
+    flat_node n = first;
+    while (t.kind(n) == kind) {
+        link = &t.binaries[t.index[n]];
+        operands.push_back(flat_eval(tree, link->lhs, frame, false));
+        n = link->rhs;
+    }
+    Value result = flat_eval(tree, n, frame, false);
+    for (size_t i = operands.size(); i-- > 0;) {
+        result = kind == expr_add ? operands[i].add_to(result) : operands[i].mult_with(result);
+    }
+    return result;
+}
+
+/**
+ * \brief Evaluates a chain of == from its last operand back to its first, like
+ * EqExpr::step().
+ */
+static Value flat_equals(const FlatTreePtr &tree, flat_node first, FlatFrame &frame){
+    const FlatTree &t = *tree;
+    const FlatBinary &link = t.binaries[t.index[first]];
+    if (t.kind(link.rhs) != expr_eq) {
+        Value rhs = flat_eval(tree, link.rhs, frame, false);
+        return Value::boolean(rhs.equals(flat_eval(tree, link.lhs, frame, false)));
+    }
+    vector<flat_node> chain(1, first);
+    while (t.kind(t.binaries[t.index[chain.back()]].rhs) == expr_eq) {
+        chain.push_back(t.binaries[t.index[chain.back()]].rhs);
+    }
+    Value result = flat_eval(tree, t.binaries[t.index[chain.back()]].rhs, frame, false);
+    for (size_t i = chain.size(); i-- > 0;) {
+        result = Value::boolean(result.equals(flat_eval(tree, t.binaries[t.index[chain[i]]].lhs, frame, false)));
+    }
+    return result;
+}
+
+/**
+ * \brief Evaluates the node `n` of a resolved tree in `frame`. The branches of an
+ * _if and the body of a _let continue in this loop; `tail` is true when `n` is in
+ * tail position of the frame's body, where a call of a flat function is left to the
+ * caller's loop.
+ */
+static Value flat_eval(const FlatTreePtr &tree, flat_node n, FlatFrame &frame, bool tail){
+    const FlatTree &t = *tree;
+    while (true) {
+        governor_tick();
+        uint32_t i = t.index[n];
+        switch (t.kind(n)) {
+            case expr_num:
+                return Value::number(t.numbers[i]);
+            case expr_bool:
+                return Value::boolean(i != 0);
+            case expr_var: {
+                const FlatVar &var = t.vars[i];
+                if (var.depth == 0) {
+                    return frame.slots[var.slot];
+                }
+                if (var.depth == 1) {
+                    return frame.captures[var.slot];
+                }
+                throw runtime_error("free variable: " + t.symbols[var.name]);
+            }
+            case expr_add:
+            case expr_mult:
+                return flat_arithmetic(tree, n, frame);
+            case expr_eq:
+                return flat_equals(tree, n, frame);
+            case expr_if: {
+                const FlatIf &if_expr = t.ifs[i];
+                Value condition = flat_eval(tree, if_expr.if_, frame, false);
+                n = condition.is_bool() && condition.num ? if_expr.then_ : if_expr.else_;
+                continue;
+            }
+            case expr_let: {
+                const FlatLet &let = t.lets[i];
+                frame.slots[let.slot] = flat_eval(tree, let.rhs, frame, false);
+                n = let.body;
+                continue;
+            }
+            case expr_fun: {
+                const FlatFun &fun = t.funs[i];
+                PTR(FlatFunVal) closure = pool_new<FlatFunVal>(tree, n);
+                closure->captures.reserve(fun.capture_count);
+                for (uint32_t c = fun.first_capture; c < fun.first_capture + fun.capture_count; c++) {
+                    const pair<int, int> &capture = t.captures[c];
+                    closure->captures.push_back(capture.first == 0 ? frame.slots[capture.second] : frame.captures[capture.second]);
+                }
+                return Value(closure);
+            }
+            case expr_call: {
+                const FlatBinary &call = t.binaries[i];
+                Value fun = flat_eval(tree, call.lhs, frame, false);
+                Value actual = flat_eval(tree, call.rhs, frame, false);
+                if (tail && fun.tag == Value::boxed_tag && fun.boxed->kind == val_flat) {
+                    frame.tail_fun = STATIC_CAST(FlatFunVal)(fun.boxed);
+                    frame.tail_arg = actual;
+                    return Value();
+                }
+                return fun.call(actual);
+            }
+            default:
+                throw runtime_error("malformed flat tree");
+        }
+    }
+}
+
+/**
+ * \brief Runs a flat program, resolving it first if it is not resolved yet, so a tree
+ * shared between threads has to be resolved before they run it.
+ * \return The value of the program.
+ */
+PTR(Val) flat_interp(PTR(FlatTree) tree){
+    resolve(*tree);
+    FlatFrame frame(tree->frame_size, nullptr);
+    Value result = flat_eval(tree, tree->root(), frame, true);
+    if (frame.tail_fun != nullptr) {
+        result = frame.tail_fun->apply(frame.tail_arg);
+    }
+    return result.to_val();
+}
+
+//======================  FlatFunVal  ======================//
+
+FlatFunVal::FlatFunVal(PTR(FlatTree) tree, flat_node fun){
+    this->kind = val_flat;
+    this->tree = tree;
+    this->fun = fun;
+}
+
+/**
+ * \brief Lets go of the captured values through a DeferredRelease, so a long chain of
+ * closures is freed in a loop.
+ */
+FlatFunVal::~FlatFunVal(){
+    DeferredRelease release;
+    for (Value &captured : captures) {
+        release.value(captured);
+    }
+}
+
+PTR(Expr) FlatFunVal::to_expr(){
+    const FlatFun &code = tree->funs[tree->index[fun]];
+    return NEW(FunExpr)(tree->symbols[code.formal_arg], unflatten(*tree, code.body));
+}
+
+/**
+ * \brief Like FunVal::equals(), compares the code of the functions, without the
+ * values they captured.
+ */
+bool FlatFunVal::equals (PTR(Val) v){
+    if (v != nullptr && v->kind == val_flat) {
+        FlatFunVal *other = static_cast<FlatFunVal *>(&*v);
+        if (&*other->tree == &*tree && other->fun == fun) {
+            return true;
+        }
+    }
+    return function_equals(this, v);
+}
+
+size_t FlatFunVal::hash(){
+    const FlatFun &code = tree->funs[tree->index[fun]];
+    return hash_mix(hash_mix(9, std::hash<string>()(tree->symbols[code.formal_arg])), unflatten(*tree, code.body)->hash);
+}
+
+PTR(Val) FlatFunVal::add_to(PTR(Val) other_val){
+    throw runtime_error("Function cannot be added");
+}
+
+PTR(Val) FlatFunVal::mult_with(PTR(Val) other_val){
+    throw runtime_error("Function cannot be multiplied");
+}
+
+void FlatFunVal::print(ostream &ostream){
+    to_expr()->print(ostream);
+}
+
+bool FlatFunVal::is_true(){
+    throw runtime_error("function cannot be boolean");
+}
+
+PTR(Val) FlatFunVal::call(PTR(Val) actual_arg){
+    return apply(Value(actual_arg)).to_val();
+}
+
+/**
+ * \brief Runs the body in a fresh frame, then every call it left in tail position,
+ * one after the other in this loop.
+ */
+Value FlatFunVal::apply(const Value &actual_arg){
+    PTR(FlatFunVal) callee;   // keeps the function of a tail call alive
+    FlatFunVal *current = this;
+    Value arg = actual_arg;
+    while (true) {
+        governor_tick();
+        const FlatFun &code = current->tree->funs[current->tree->index[current->fun]];
+        FlatFrame frame(code.frame_size, current->captures.data());
+        frame.slots[0] = arg;
+        Value result = flat_eval(current->tree, code.body, frame, true);
+        if (frame.tail_fun == nullptr) {
+            return result;
+        }
+        callee = frame.tail_fun;
+        arg = frame.tail_arg;
+        current = &*callee;
+    }
+}
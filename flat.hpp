@@ -0,0 +1,179 @@
+/**
+ * \file flat.hpp
+ * \brief Compact, index-based layout of a program (--flat), with conversion to and
+ * from Expr trees and a resolver, optimizer and interpreter that walk it in place.
+ *
+ * Every Expr node is a heap object of its own, with a vtable pointer, a shared_ptr
+ * control block and 16-byte pointers to its children, and every name is a string in
+ * the node that uses it, so a walk over a large tree chases pointers all over the
+ * heap. A FlatTree keeps the same program in a few contiguous arrays. Each node is a
+ * kind byte and a 32-bit index into the array of its kind: the two children of a +,
+ * *, == or call, the three of an _if, the symbol and children of a _let or _fun, the
+ * symbol of a variable. Names are interned into one symbol table and number literals
+ * live in a side table.
+ *
+ * Nodes are numbered in post-order: children come before their parent, in order, and
+ * the root is the last node. The nodes of any subtree are one contiguous range, so
+ * unflatten() rebuilds an Expr tree in a single forward loop, and the optimizer, which
+ * appends its output in the same order, can drop a subtree it has just written by
+ * truncating the arrays.
+ *
+ * flatten() takes parsed or resolved trees and gives an unresolved FlatTree; resolve()
+ * fills in the frame slot of every variable, _let and _fun in place, with the same
+ * ResolveScope as the resolver of Expr trees, and flat_interp() runs the resolved
+ * tree. Source positions and the marks of typecheck() are not kept.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "env.hpp"
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+typedef uint32_t flat_node;     // a node: its position in FlatTree::kinds
+typedef uint32_t flat_symbol;   // a name: its position in FlatTree::symbols
+
+/**
+ * \brief The operands of a +, * or ==, or the function and argument of a call.
+ */
+class FlatBinary {
+public:
+    flat_node lhs;
+    flat_node rhs;
+};
+
+class FlatIf {
+public:
+    flat_node if_;
+    flat_node then_;
+    flat_node else_;
+};
+
+/**
+ * \brief A variable; `depth` and `slot` address its binding as in SlotVarExpr once
+ * the tree is resolved, and `depth` is -1 before that and for a free variable.
+ */
+class FlatVar {
+public:
+    flat_symbol name;
+    int depth;
+    int slot;
+};
+
+/**
+ * \brief A _let; `slot` is set by resolve().
+ */
+class FlatLet {
+public:
+    flat_symbol name;
+    int slot;
+    flat_node rhs;
+    flat_node body;
+};
+
+/**
+ * \brief A _fun; resolve() sets its frame size and the range of FlatTree::captures
+ * that holds the addresses, as in SlotFunExpr, of what its body captures.
+ */
+class FlatFun {
+public:
+    flat_symbol formal_arg;
+    int frame_size;
+    uint32_t first_capture;
+    uint32_t capture_count;
+    flat_node body;
+};
+
+/**
+ * \brief A program as arrays of nodes by kind. Nodes are only appended, children
+ * before parents, and the last one is the root.
+ */
+class FlatTree {
+public:
+    vector<uint8_t> kinds;       // the expr_kind_t of every node: no resolved forms
+    vector<uint32_t> index;      // of every node, into the array of its kind; a
+                                 // boolean's value
+    vector<int> numbers;         // one per number literal
+    vector<FlatVar> vars;
+    vector<FlatBinary> binaries; // +, *, == and calls
+    vector<FlatIf> ifs;
+    vector<FlatLet> lets;
+    vector<FlatFun> funs;
+    vector<pair<int, int> > captures;
+    vector<string> symbols;
+    unordered_map<string, flat_symbol> symbol_ids;
+    bool resolved;
+    int frame_size;              // of the top-level frame, once resolved
+
+    FlatTree();
+
+    size_t size() const { return kinds.size(); }
+    flat_node root() const { return (flat_node)kinds.size() - 1; }
+    expr_kind_t kind(flat_node n) const { return (expr_kind_t)kinds[n]; }
+
+    flat_symbol intern(const string &name);
+    flat_node number(int val);
+    flat_node boolean(bool val);
+    flat_node var(flat_symbol name);
+    flat_node binary(expr_kind_t kind, flat_node lhs, flat_node rhs);
+    flat_node if_(flat_node if_, flat_node then_, flat_node else_);
+    flat_node let(flat_symbol name, flat_node rhs, flat_node body);
+    flat_node fun(flat_symbol formal_arg, flat_node body);
+
+    flat_node start(flat_node n) const;
+    void truncate(size_t size);
+    size_t bytes() const;
+
+private:
+    flat_node add_node(expr_kind_t kind, size_t index);
+};
+
+// for const references to the tree, since with plain pointers const PTR(FlatTree) &
+// is a reference to a pointer to const rather than a const pointer
+typedef PTR(FlatTree) FlatTreePtr;
+
+//======================  FlatFunVal  ======================//
+
+/**
+ * \brief A function value made by flat_interp(): the _fun node of its tree and the
+ * values it captured. Prints, hashes and compares like the FunVal of the same _fun.
+ */
+class FlatFunVal : public Val {
+public:
+    PTR(FlatTree) tree;
+    flat_node fun;
+    vector<Value, FrameAllocator<Value> > captures;
+
+    FlatFunVal(PTR(FlatTree) tree, flat_node fun);
+    ~FlatFunVal();
+
+    virtual PTR(Expr) to_expr();
+    virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
+    virtual PTR(Val) add_to(PTR(Val) other_val);
+    virtual PTR(Val) mult_with(PTR(Val) other_val);
+    virtual void print(ostream &ostream);
+    virtual bool is_true();
+
+    virtual PTR(Val) call(PTR(Val) actual_arg);
+    virtual Value apply(const Value &actual_arg);
+};
+
+PTR(FlatTree) flatten(PTR(Expr) e);
+
+PTR(Expr) unflatten(const FlatTree &tree, flat_node n);
+PTR(Expr) unflatten(const FlatTree &tree);
+
+void resolve(FlatTree &tree);
+
+PTR(FlatTree) optimize(const FlatTree &tree);
+
+PTR(Val) flat_interp(PTR(FlatTree) tree);
@@ -0,0 +1,699 @@
+/**
+ * \file gc.cpp
+ * \brief Implementation of the tracing collector.
+ *
+ * Every slot starts with a Header: the destructor to run on the object, if any, and
+ * whether the slot is free, allocated or marked. A table per thread maps the address
+ * of each 64 KB block to its Block, which is how a word found while scanning is
+ * checked for pointing into an object. Freed slots are zeroed, so the part of a slot
+ * an object does not use holds no stale pointers for the scan to follow.
+ *
+ * A sweep runs the destructors of everything unmarked before it frees any of it, so
+ * a destructor can still read the other objects dying with it, such as the buffer of
+ * a vector member.
+ */
+
+#include "pointer.h"
+
+#if USE_GC_POINTERS
+
+#include "gc.hpp"
+#include "alloc.hpp"
+#include <algorithm>
+#include <csetjmp>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+
+gc_root_entry gc_unrooted(nullptr);
+thread_local uintptr_t gc_stack_low = 0;
+thread_local uintptr_t gc_stack_size = 0;
+
+namespace {
+
+const size_t block_size = 64 * 1024;
+const uintptr_t block_mask = ~(uintptr_t)(block_size - 1);
+const size_t blocks_per_chunk = 16;
+const size_t granule = 16;
+const size_t min_threshold = 8 << 20;   // bytes allocated between collections, at least
+
+const uintptr_t slot_free = 0;
+const uintptr_t slot_allocated = 1;
+const uintptr_t slot_marked = 2;
+
+class Header {
+public:
+    void (*destroy)(void *);
+    uintptr_t state;
+};
+
+const size_t header_size = sizeof(Header);
+
+// slot sizes, headers included; anything bigger is a large object
+const size_t slot_sizes[] = {32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+                             640, 768, 1024, 1280, 1536, 2048, 3072, 4096, 6144, 8192};
+const int size_classes = sizeof(slot_sizes) / sizeof(slot_sizes[0]);
+const size_t max_small = 8192;
+const int large_class = -1;
+
+class Block {
+public:
+    char *start;
+    size_t slot_size;
+    size_t slots;     // that fit in the block
+    size_t bumped;    // handed out so far; the slots after them have never been used
+    int size_class;   // or large_class
+    void *raw;        // the memory of a large object
+    Block *next;
+};
+
+class Chunk {
+public:
+    void *raw;
+    Chunk *next;
+};
+
+class TableEntry {
+public:
+    uintptr_t base;   // 0 when empty
+    Block *block;     // nullptr for a removed entry
+};
+
+/**
+ * \brief A chunk of root entries, aligned so that clearing an entry needs nothing
+ * but the entry. A free entry holds the next free one with the low bit set.
+ */
+const size_t root_chunk_size = 4096;
+const size_t root_chunk_entries = root_chunk_size / sizeof(gc_root_entry) - 1;
+
+class RootChunk {
+public:
+    gc_root_entry entries[root_chunk_entries];
+    RootChunk *next;
+};
+
+/**
+ * \brief One thread's registered roots. Handles can be destroyed on another thread,
+ * which only clears their entry, so cleared entries are collected again by
+ * reclaim_entries() when the free list runs out. The chunks are never freed, since
+ * a handle can outlive the thread that registered it.
+ */
+class Registry {
+public:
+    RootChunk *chunks;
+    size_t capacity;
+    gc_handle *free_entries;   // tagged: the entry address with the low bit set
+};
+
+/**
+ * \brief One thread's heap: plain data, so it is zero before its first use and still
+ * works while other thread-locals are destroyed.
+ */
+class Heap {
+public:
+    bool open;
+    bool collecting;
+    unsigned char classes[max_small / granule + 1];   // size class by granules
+    Block *blocks;
+    Block *current[size_classes];
+    Header *free_lists[size_classes];
+    Chunk *chunks;
+    char *spare;           // unused blocks of the last chunk
+    size_t spare_blocks;
+    TableEntry *table;
+    size_t table_capacity;
+    size_t table_used;     // entries, removed ones included
+    uintptr_t low;
+    uintptr_t high;
+    pair<Header *, size_t> *mark_stack;
+    size_t mark_count;
+    size_t mark_capacity;
+    size_t heap_bytes;
+    size_t live_bytes;
+    size_t allocated_since;
+    size_t threshold;
+    unsigned long collections;
+};
+
+thread_local Heap heap;
+thread_local Registry registry;
+
+void *checked_malloc(size_t size){
+    void *p = malloc(size);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+//----------------------  Block table  ----------------------//
+
+size_t table_slot(uintptr_t base, size_t capacity){
+    return (size_t)(((uint64_t)(base >> 16) * 0x9E3779B97F4A7C15ULL) >> 24) & (capacity - 1);
+}
+
+Block *find_block(const Heap &h, uintptr_t address){
+    if (address < h.low || address >= h.high) {
+        return nullptr;
+    }
+    uintptr_t base = address & block_mask;
+    for (size_t i = table_slot(base, h.table_capacity); ; i = (i + 1) & (h.table_capacity - 1)) {
+        const TableEntry &entry = h.table[i];
+        if (entry.base == base) {
+            return entry.block;
+        }
+        if (entry.base == 0) {
+            return nullptr;
+        }
+    }
+}
+
+void table_insert(Heap &h, uintptr_t base, Block *block);
+
+void table_grow(Heap &h){
+    TableEntry *old = h.table;
+    size_t old_capacity = h.table_capacity;
+    h.table_capacity = old_capacity == 0 ? 256 : old_capacity * 2;
+    h.table = static_cast<TableEntry *>(checked_malloc(h.table_capacity * sizeof(TableEntry)));
+    memset(h.table, 0, h.table_capacity * sizeof(TableEntry));
+    h.table_used = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].block != nullptr) {
+            table_insert(h, old[i].base, old[i].block);
+        }
+    }
+    free(old);
+}
+
+void table_insert(Heap &h, uintptr_t base, Block *block){
+    if ((h.table_used + 1) * 2 > h.table_capacity) {
+        table_grow(h);
+    }
+    size_t i = table_slot(base, h.table_capacity);
+    while (h.table[i].base != 0 && h.table[i].base != base) {
+        i = (i + 1) & (h.table_capacity - 1);
+    }
+    if (h.table[i].base == 0) {
+        h.table[i].base = base;
+        h.table_used++;
+    }
+    h.table[i].block = block;
+    h.low = h.low == 0 ? base : min(h.low, base);
+    h.high = max(h.high, base + block_size);
+}
+
+/**
+ * \brief Keeps the entry, so probing goes past it, but lets it match nothing until
+ * the block is added again.
+ */
+void table_remove(Heap &h, uintptr_t base){
+    for (size_t i = table_slot(base, h.table_capacity); h.table[i].base != 0; i = (i + 1) & (h.table_capacity - 1)) {
+        if (h.table[i].base == base) {
+            h.table[i].block = nullptr;
+            return;
+        }
+    }
+}
+
+//----------------------  Blocks  ----------------------//
+
+void open_heap(Heap &h);
+
+/**
+ * \brief Aligned memory for `count` blocks from operator new, so the blocks count as
+ * the thread's allocations in alloc.cpp and against a memory quota.
+ */
+char *new_blocks(Heap &h, size_t count){
+    void *raw = ::operator new((count + 1) * block_size);
+    Chunk *chunk = static_cast<Chunk *>(checked_malloc(sizeof(Chunk)));
+    chunk->raw = raw;
+    chunk->next = h.chunks;
+    h.chunks = chunk;
+    h.heap_bytes += count * block_size;
+    return (char *)(((uintptr_t)raw + block_size - 1) & block_mask);
+}
+
+Block *add_block(Heap &h, char *start, size_t slot_size, int size_class, void *raw){
+    Block *b = static_cast<Block *>(checked_malloc(sizeof(Block)));
+    b->start = start;
+    b->slot_size = slot_size;
+    b->slots = size_class == large_class ? 1 : block_size / slot_size;
+    b->bumped = 0;
+    b->size_class = size_class;
+    b->raw = raw;
+    b->next = h.blocks;
+    h.blocks = b;
+    for (size_t offset = 0; offset < slot_size || offset == 0; offset += block_size) {
+        table_insert(h, (uintptr_t)start + offset, b);
+    }
+    return b;
+}
+
+Header *slot_at(Block *b, size_t i){
+    return reinterpret_cast<Header *>(b->start + i * b->slot_size);
+}
+
+Header *bump(Heap &h, int c){
+    Block *b = h.current[c];
+    if (b == nullptr || b->bumped == b->slots) {
+        if (h.spare_blocks == 0) {
+            h.spare = new_blocks(h, blocks_per_chunk);
+            h.spare_blocks = blocks_per_chunk;
+        }
+        char *start = h.spare;
+        h.spare += block_size;
+        h.spare_blocks--;
+        memset(start, 0, block_size);
+        b = add_block(h, start, slot_sizes[c], c, nullptr);
+        h.current[c] = b;
+    }
+    return slot_at(b, b->bumped++);
+}
+
+void collect(Heap &h);
+
+Header *allocate_large(Heap &h, size_t needed){
+    size_t span = (needed + block_size - 1) / block_size;
+    h.allocated_since += span * block_size;
+    if (h.allocated_since > h.threshold && !h.collecting) {
+        collect(h);
+    }
+    void *raw = ::operator new((span + 1) * block_size);
+    char *start = (char *)(((uintptr_t)raw + block_size - 1) & block_mask);
+    memset(start, 0, span * block_size);
+    h.heap_bytes += span * block_size;
+    Block *b = add_block(h, start, span * block_size, large_class, raw);
+    b->bumped = 1;
+    return slot_at(b, 0);
+}
+
+void release_large(Heap &h, Block *b){
+    for (size_t offset = 0; offset < b->slot_size; offset += block_size) {
+        table_remove(h, (uintptr_t)b->start + offset);
+    }
+    h.heap_bytes -= b->slot_size;
+    ::operator delete(b->raw);
+    b->raw = nullptr;
+}
+
+//----------------------  Thread exit  ----------------------//
+
+/**
+ * \brief Runs the destructors of a thread's remaining objects and gives its blocks
+ * back when the thread exits. A later allocation on the thread starts a new heap,
+ * which is not freed.
+ */
+class HeapReaper {
+public:
+    ~HeapReaper(){
+        Heap &h = heap;
+        if (!h.open) {
+            return;
+        }
+        h.collecting = true;
+        for (Block *b = h.blocks; b != nullptr; b = b->next) {
+            for (size_t i = 0; i < b->bumped; i++) {
+                Header *slot = slot_at(b, i);
+                if (slot->state != slot_free && slot->destroy != nullptr) {
+                    void (*destroy)(void *) = slot->destroy;
+                    slot->destroy = nullptr;
+                    destroy(slot + 1);
+                }
+            }
+        }
+        while (h.blocks != nullptr) {
+            Block *b = h.blocks;
+            h.blocks = b->next;
+            if (b->raw != nullptr) {
+                ::operator delete(b->raw);
+            }
+            free(b);
+        }
+        while (h.chunks != nullptr) {
+            Chunk *chunk = h.chunks;
+            h.chunks = chunk->next;
+            if (chunk->raw != nullptr) {
+                ::operator delete(chunk->raw);
+            }
+            free(chunk);
+        }
+        free(h.table);
+        free(h.mark_stack);
+        memset(&h, 0, sizeof(Heap));
+    }
+};
+
+thread_local HeapReaper reaper;
+
+void open_heap(Heap &h){
+    int c = 0;
+    for (size_t g = 0; g <= max_small / granule; g++) {
+        while (slot_sizes[c] < g * granule) {
+            c++;
+        }
+        h.classes[g] = (unsigned char)c;
+    }
+    h.threshold = min_threshold;
+    h.open = true;
+    (void)&reaper;   // makes sure the thread frees its heap when it exits
+}
+
+//----------------------  Roots  ----------------------//
+
+/**
+ * \brief Finds the bounds of the calling thread's stack.
+ */
+void find_stack(){
+    char *low;
+    size_t size;
+#ifdef __APPLE__
+    pthread_t self = pthread_self();
+    size = pthread_get_stacksize_np(self);
+    low = (char *)pthread_get_stackaddr_np(self) - size;
+#else
+    pthread_attr_t attr;
+    void *addr;
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    low = (char *)addr;
+#endif
+    gc_stack_low = (uintptr_t)low;
+    gc_stack_size = size;
+}
+
+bool is_free_entry(gc_handle *value){
+    return ((uintptr_t)value & 1) != 0;
+}
+
+void push_free_entry(Registry &r, gc_root_entry *entry){
+    entry->store(r.free_entries, memory_order_relaxed);
+    r.free_entries = reinterpret_cast<gc_handle *>((uintptr_t)entry | 1);
+}
+
+/**
+ * \brief Puts entries cleared by other threads back on the free list, and adds
+ * chunks when fewer than a quarter of the entries came back.
+ */
+void reclaim_entries(Registry &r){
+    size_t reclaimed = 0;
+    for (RootChunk *chunk = r.chunks; chunk != nullptr; chunk = chunk->next) {
+        for (size_t i = 0; i < root_chunk_entries; i++) {
+            if (chunk->entries[i].load(memory_order_relaxed) == nullptr) {
+                push_free_entry(r, &chunk->entries[i]);
+                reclaimed++;
+            }
+        }
+    }
+    if (reclaimed * 4 >= r.capacity && reclaimed > 0) {
+        return;
+    }
+    size_t added = 0;
+    do {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, root_chunk_size, sizeof(RootChunk)) != 0) {
+            throw bad_alloc();
+        }
+        RootChunk *chunk = static_cast<RootChunk *>(memory);
+        for (size_t i = 0; i < root_chunk_entries; i++) {
+            new (&chunk->entries[i]) gc_root_entry(nullptr);
+            push_free_entry(r, &chunk->entries[i]);
+        }
+        chunk->next = r.chunks;
+        r.chunks = chunk;
+        added += root_chunk_entries;
+    } while (added * 2 < r.capacity);
+    r.capacity += added;
+}
+
+gc_root_entry *register_root(gc_handle *handle){
+    Registry &r = registry;
+    if (r.free_entries == nullptr) {
+        reclaim_entries(r);
+    }
+    gc_root_entry *entry = reinterpret_cast<gc_root_entry *>((uintptr_t)r.free_entries & ~(uintptr_t)1);
+    r.free_entries = entry->load(memory_order_relaxed);
+    entry->store(handle, memory_order_relaxed);
+    return entry;
+}
+
+//----------------------  Marking  ----------------------//
+
+void push_mark(Heap &h, Header *slot, size_t size){
+    if (h.mark_count == h.mark_capacity) {
+        h.mark_capacity = h.mark_capacity == 0 ? 1024 : h.mark_capacity * 2;
+        void *grown = realloc(h.mark_stack, h.mark_capacity * sizeof(pair<Header *, size_t>));
+        if (grown == nullptr) {
+            throw bad_alloc();
+        }
+        h.mark_stack = static_cast<pair<Header *, size_t> *>(grown);
+    }
+    h.mark_stack[h.mark_count++] = make_pair(slot, size);
+}
+
+/**
+ * \brief Marks the object `word` points into, if it is one.
+ */
+void mark_word(Heap &h, uintptr_t word){
+    Block *b = find_block(h, word);
+    if (b == nullptr) {
+        return;
+    }
+    size_t i = (word - (uintptr_t)b->start) / b->slot_size;
+    if (i >= b->bumped) {
+        return;
+    }
+    Header *slot = slot_at(b, i);
+    if (slot->state == slot_allocated) {
+        slot->state |= slot_marked;
+        push_mark(h, slot, b->slot_size);
+    }
+}
+
+__attribute__((no_sanitize_address)) void mark_range(Heap &h, const char *from, const char *to){
+    const uintptr_t *word = reinterpret_cast<const uintptr_t *>(((uintptr_t)from + sizeof(uintptr_t) - 1) & ~(uintptr_t)(sizeof(uintptr_t) - 1));
+    const uintptr_t *end = reinterpret_cast<const uintptr_t *>(to);
+    for (; word < end; word++) {
+        mark_word(h, *word);
+    }
+}
+
+/**
+ * \brief Scans the stack from the frame of this call up, which lies below the
+ * registers the caller spilled.
+ */
+__attribute__((noinline)) void mark_stack_from_here(Heap &h){
+    volatile char here = 0;
+    mark_range(h, (const char *)&here, (const char *)(gc_stack_low + gc_stack_size));
+}
+
+__attribute__((noinline)) void mark_stack(Heap &h){
+    jmp_buf registers;
+    setjmp(registers);
+    __builtin_unwind_init();
+    mark_stack_from_here(h);
+}
+
+void mark_roots(Heap &h){
+    for (RootChunk *chunk = registry.chunks; chunk != nullptr; chunk = chunk->next) {
+        for (size_t i = 0; i < root_chunk_entries; i++) {
+            gc_handle *handle = chunk->entries[i].load(memory_order_relaxed);
+            if (handle != nullptr && !is_free_entry(handle)) {
+                mark_word(h, (uintptr_t)handle->target);
+            }
+        }
+    }
+    if (gc_stack_size == 0) {
+        find_stack();
+    }
+    mark_stack(h);
+}
+
+void drain(Heap &h){
+    while (h.mark_count > 0) {
+        pair<Header *, size_t> next = h.mark_stack[--h.mark_count];
+        mark_range(h, (const char *)(next.first + 1), (const char *)next.first + next.second);
+    }
+}
+
+//----------------------  Sweeping  ----------------------//
+
+/**
+ * \brief Puts a zeroed slot on its free list.
+ */
+void push_free(Heap &h, Block *b, Header *slot){
+    *reinterpret_cast<Header **>(slot + 1) = h.free_lists[b->size_class];
+    h.free_lists[b->size_class] = slot;
+}
+
+void sweep(Heap &h){
+    for (Block *b = h.blocks; b != nullptr; b = b->next) {
+        for (size_t i = 0; i < b->bumped; i++) {
+            Header *slot = slot_at(b, i);
+            if (slot->state == slot_allocated && slot->destroy != nullptr) {
+                void (*destroy)(void *) = slot->destroy;
+                slot->destroy = nullptr;
+                destroy(slot + 1);
+            }
+        }
+    }
+    for (int c = 0; c < size_classes; c++) {
+        h.free_lists[c] = nullptr;
+    }
+    h.live_bytes = 0;
+    Block **link = &h.blocks;
+    while (*link != nullptr) {
+        Block *b = *link;
+        if (b->size_class == large_class) {
+            Header *slot = slot_at(b, 0);
+            if (slot->state != (slot_allocated | slot_marked)) {
+                release_large(h, b);
+                *link = b->next;
+                free(b);
+                continue;
+            }
+            slot->state = slot_allocated;
+            h.live_bytes += b->slot_size;
+        }
+        else {
+            for (size_t i = b->bumped; i-- > 0; ) {
+                Header *slot = slot_at(b, i);
+                if (slot->state == (slot_allocated | slot_marked)) {
+                    slot->state = slot_allocated;
+                    h.live_bytes += b->slot_size;
+                }
+                else {
+                    if (slot->state != slot_free) {
+                        memset(slot, 0, b->slot_size);
+                    }
+                    push_free(h, b, slot);
+                }
+            }
+        }
+        link = &b->next;
+    }
+}
+
+void collect(Heap &h){
+    h.collecting = true;
+    mark_roots(h);
+    drain(h);
+    sweep(h);
+    h.collections++;
+    h.allocated_since = 0;
+    h.threshold = max(min_threshold, h.live_bytes);
+    h.collecting = false;
+}
+
+}
+
+//======================  Interface  ======================//
+
+/**
+ * \brief Where a handle that has just been set lives: on the stack or in the heap,
+ * where the collector finds it by scanning, or anywhere else, where it is registered.
+ */
+gc_root_entry *gc_place(gc_handle *handle){
+    if (gc_stack_size == 0) {
+        find_stack();
+        if ((uintptr_t)handle - gc_stack_low < gc_stack_size) {
+            return &gc_unrooted;
+        }
+    }
+    if (find_block(heap, (uintptr_t)handle) != nullptr) {
+        return &gc_unrooted;
+    }
+    return register_root(handle);
+}
+
+/**
+ * \brief Clears a root entry, which may belong to another thread.
+ */
+void gc_unregister(gc_root_entry *entry){
+    entry->store(nullptr, memory_order_relaxed);
+}
+
+/**
+ * \brief Memory of at least `size` bytes, 16-byte aligned and zeroed, which a
+ * collection frees once no root or reached object points into it. May collect first.
+ */
+void *gc_allocate(size_t size){
+    Heap &h = heap;
+    if (!h.open) {
+        open_heap(h);
+    }
+    size_t needed = size + header_size;
+    Header *slot;
+    if (needed > max_small) {
+        slot = allocate_large(h, needed);
+    }
+    else {
+        int c = h.classes[(needed + granule - 1) / granule];
+        h.allocated_since += slot_sizes[c];
+        if (h.allocated_since > h.threshold && !h.collecting) {
+            collect(h);
+        }
+        slot = h.free_lists[c];
+        if (slot != nullptr) {
+            Header **link = reinterpret_cast<Header **>(slot + 1);
+            h.free_lists[c] = *link;
+            *link = nullptr;
+            count_pooled_bytes(slot_sizes[c]);
+        }
+        else {
+            slot = bump(h, c);
+        }
+    }
+    // allocated by a destructor during a sweep: kept by it
+    slot->state = h.collecting ? slot_allocated | slot_marked : slot_allocated;
+    slot->destroy = nullptr;
+    return slot + 1;
+}
+
+/**
+ * \brief Frees memory from gc_allocate() right away, without running a destructor.
+ */
+void gc_free(void *p){
+    Heap &h = heap;
+    Header *slot = static_cast<Header *>(p) - 1;
+    Block *b = find_block(h, (uintptr_t)slot);
+    if (b == nullptr) {
+        return;
+    }
+    if (b->size_class == large_class) {
+        // given back by the next sweep
+        slot->state = slot_free;
+        return;
+    }
+    memset(slot, 0, b->slot_size);
+    if (!h.collecting) {
+        // during a sweep, a destructor's; the sweep rebuilds the free lists
+        push_free(h, b, slot);
+    }
+}
+
+void gc_set_destructor(void *p, void (*destroy)(void *)){
+    (static_cast<Header *>(p) - 1)->destroy = destroy;
+}
+
+/**
+ * \brief Collects the calling thread's heap now.
+ */
+void gc_collect(){
+    Heap &h = heap;
+    if (h.open && !h.collecting) {
+        collect(h);
+    }
+}
+
+GcStats gc_stats(){
+    const Heap &h = heap;
+    GcStats stats;
+    stats.collections = h.collections;
+    stats.heap_bytes = h.heap_bytes;
+    stats.live_bytes = h.live_bytes;
+    stats.allocated_bytes = h.allocated_since;
+    return stats;
+}
+
+#endif
@@ -0,0 +1,211 @@
+/**
+ * \file gc.hpp
+ * \brief Tracing collector behind PTR and NEW, for builds with -DUSE_GC_POINTERS=1.
+ *
+ * In this mode PTR(T) is a gc_ptr<T> and NEW(T) allocates in the calling thread's
+ * collected heap. Copying a gc_ptr touches no count, so passing values and
+ * environments around costs what passing a raw pointer does, plus a check of where
+ * the copy lives. Once enough has been allocated since the last collection, the next
+ * allocation marks everything reachable and sweeps the rest, running destructors,
+ * so chains and cycles of closures and frames go away without nested destructor
+ * calls.
+ *
+ * Roots come from two places. The native stack and registers of the collecting
+ * thread, where the evaluators keep their state, are scanned conservatively: any
+ * word that points into an allocated object keeps it. Every other gc_ptr that lives
+ * neither on a stack nor inside the heap, such as one in a std::vector, a hash table
+ * or a thread_local, registers itself as a root when it is first set to an object.
+ * Inside the heap every word of a reached object is scanned, so its gc_ptr members
+ * need no registration, and neither do the buffers it gets from gc_allocate(), which
+ * frame_allocate() and FrameAllocator hand out in this mode. Those buffers have to be
+ * referenced from a collected object or from the stack.
+ *
+ * Objects never move: the code takes raw pointers to them everywhere, from `this` to
+ * &*p. Small objects sit in 64 KB blocks of one size class, which are bump allocated
+ * when fresh and reuse their freed slots after a sweep. Large ones get blocks of their
+ * own.
+ *
+ * Each thread collects its own heap and sees only its own stack and roots, so an
+ * object may be read from another thread while its thread keeps it, like a program
+ * tree shared by workers, but values are not handed between threads. The collected
+ * build therefore runs --parallel forks and --batch jobs on the calling thread.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+class gc_handle;
+
+typedef atomic<gc_handle *> gc_root_entry;
+
+extern gc_root_entry gc_unrooted;   // the entry of a handle on a stack or in the heap
+
+// the calling thread's stack, 0 in size until its first handle is placed
+extern thread_local uintptr_t gc_stack_low;
+extern thread_local uintptr_t gc_stack_size;
+
+gc_root_entry *gc_place(gc_handle *handle);
+void gc_unregister(gc_root_entry *entry);
+
+/**
+ * \brief The part of gc_ptr that does not depend on the type: the object and, once
+ * it has been set, whether the handle is a root.
+ */
+class gc_handle {
+public:
+    void *target;
+    gc_root_entry *root;   // nullptr until first set, &gc_unrooted, or its registry entry
+
+protected:
+    gc_handle(void *target) : target(target), root(nullptr) {
+        if (target != nullptr) {
+            place();
+        }
+    }
+
+    ~gc_handle(){
+        if (root != nullptr && root != &gc_unrooted) {
+            gc_unregister(root);
+        }
+    }
+
+    void place(){
+        root = (uintptr_t)this - gc_stack_low < gc_stack_size ? &gc_unrooted : gc_place(this);
+    }
+
+    void set(void *object){
+        target = object;
+        if (root == nullptr && object != nullptr) {
+            place();
+        }
+    }
+};
+
+/**
+ * \brief A pointer to a collected object, with the operations of shared_ptr that the
+ * code uses.
+ */
+template <class T> class gc_ptr : public gc_handle {
+public:
+    gc_ptr() : gc_handle(nullptr) {}
+    gc_ptr(nullptr_t) : gc_handle(nullptr) {}
+    explicit gc_ptr(T *object) : gc_handle(object) {}
+    gc_ptr(const gc_ptr &other) : gc_handle(other.target) {}
+    gc_ptr(gc_ptr &&other) : gc_handle(other.target) {
+        other.target = nullptr;
+    }
+
+    template <class U, class = typename enable_if<is_convertible<U *, T *>::value>::type>
+    gc_ptr(const gc_ptr<U> &other) : gc_handle(static_cast<T *>(other.get())) {}
+
+    gc_ptr &operator=(const gc_ptr &other){
+        set(other.target);
+        return *this;
+    }
+
+    gc_ptr &operator=(gc_ptr &&other){
+        set(other.target);
+        if (&other != this) {
+            other.target = nullptr;
+        }
+        return *this;
+    }
+
+    template <class U, class = typename enable_if<is_convertible<U *, T *>::value>::type>
+    gc_ptr &operator=(const gc_ptr<U> &other){
+        set(static_cast<T *>(other.get()));
+        return *this;
+    }
+
+    gc_ptr &operator=(nullptr_t){
+        target = nullptr;
+        return *this;
+    }
+
+    T *get() const { return static_cast<T *>(target); }
+    T &operator*() const { return *get(); }
+    T *operator->() const { return get(); }
+    explicit operator bool() const { return target != nullptr; }
+};
+
+template <class T, class U> bool operator==(const gc_ptr<T> &a, const gc_ptr<U> &b){ return a.get() == b.get(); }
+template <class T, class U> bool operator!=(const gc_ptr<T> &a, const gc_ptr<U> &b){ return a.get() != b.get(); }
+template <class T> bool operator==(const gc_ptr<T> &a, nullptr_t){ return a.get() == nullptr; }
+template <class T> bool operator==(nullptr_t, const gc_ptr<T> &a){ return a.get() == nullptr; }
+template <class T> bool operator!=(const gc_ptr<T> &a, nullptr_t){ return a.get() != nullptr; }
+template <class T> bool operator!=(nullptr_t, const gc_ptr<T> &a){ return a.get() != nullptr; }
+
+namespace std {
+    template <class T> struct hash<gc_ptr<T> > {
+        size_t operator()(const gc_ptr<T> &p) const { return hash<T *>()(p.get()); }
+    };
+}
+
+template <class T, class U> gc_ptr<T> gc_dynamic_cast(const gc_ptr<U> &p){
+    return gc_ptr<T>(dynamic_cast<T *>(p.get()));
+}
+
+template <class T, class U> gc_ptr<T> gc_static_cast(const gc_ptr<U> &p){
+    return gc_ptr<T>(static_cast<T *>(p.get()));
+}
+
+template <class T> gc_ptr<T> gc_this(T *self){
+    return gc_ptr<T>(self);
+}
+
+//======================  Allocation  ======================//
+
+void *gc_allocate(size_t size);
+void gc_free(void *p);
+void gc_set_destructor(void *p, void (*destroy)(void *));
+
+template <class T> void gc_destroy(void *p){
+    static_cast<T *>(p)->~T();
+}
+
+/**
+ * \brief Makes a T in the collected heap. Its destructor runs when a sweep finds it
+ * unreachable. The object is scanned while its constructor runs, and a constructor
+ * that throws gives the memory back.
+ */
+template <class T, class... Args> gc_ptr<T> gc_new(Args&&... args){
+    static_assert(alignof(T) <= 16, "collected objects are 16-byte aligned");
+    void *memory = gc_allocate(sizeof(T));
+    T *object;
+    try {
+        object = new (memory) T(std::forward<Args>(args)...);
+    }
+    catch (...) {
+        gc_free(memory);
+        throw;
+    }
+    if (!is_trivially_destructible<T>::value) {
+        gc_set_destructor(memory, &gc_destroy<T>);
+    }
+    return gc_ptr<T>(object);
+}
+
+//======================  Collection  ======================//
+
+/**
+ * \brief Counters of the calling thread's heap.
+ */
+class GcStats {
+public:
+    unsigned long collections;
+    size_t heap_bytes;       // in blocks
+    size_t live_bytes;       // reached by the last collection
+    size_t allocated_bytes;  // since the last collection
+};
+
+void gc_collect();
+
+GcStats gc_stats();
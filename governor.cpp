@@ -0,0 +1,115 @@
+/**
+ * \file governor.cpp
+ * \brief Implementation of evaluation quotas.
+ */
+
+#include "governor.hpp"
+#include "alloc.hpp"
+
+thread_local Governor *Governor::current = nullptr;
+thread_local long governor_countdown = 0;
+thread_local const atomic<bool> *governor_cancel = nullptr;
+
+namespace {
+
+const long governor_chunk = 1024;          // steps between checks
+const long ungoverned_chunk = 1L << 30;    // steps between refills without a governor
+
+}
+
+Governor::Governor(const Quota &quota){
+    this->quota = quota;
+    this->steps = 0;
+    this->granted = 0;
+    this->deadline = clock::now() + chrono::milliseconds(quota.time_limit_ms);
+    this->start_bytes = thread_allocated_bytes() + thread_pooled_bytes();
+}
+
+/**
+ * \brief Counts the steps taken since the last refill, checks every limit, and sets
+ * the countdown to the next check. The countdown never runs past the step limit, so
+ * the step that goes over it is the one that throws.
+ * \throws quota_error when the evaluation is over its quota.
+ */
+void Governor::refill(){
+    steps += granted - governor_countdown;
+    granted = 0;
+    governor_countdown = 0;
+    if (quota.max_steps != 0 && steps > quota.max_steps) {
+        throw quota_error("step limit exceeded");
+    }
+    if (quota.time_limit_ms != 0 && clock::now() >= deadline) {
+        throw quota_error("time limit exceeded");
+    }
+    if (quota.max_memory != 0 && thread_allocated_bytes() + thread_pooled_bytes() - start_bytes > quota.max_memory) {
+        throw quota_error("memory limit exceeded");
+    }
+    long chunk = governor_chunk;
+    if (quota.max_steps != 0 && quota.max_steps - steps + 1 < (unsigned long)chunk) {
+        chunk = (long)(quota.max_steps - steps + 1);
+    }
+    granted = chunk;
+    governor_countdown = chunk;
+}
+
+/**
+ * \brief Counts the steps taken since the last refill, before another governor takes
+ * over the countdown. The next tick under this governor refills it.
+ */
+void Governor::charge(){
+    steps += granted - governor_countdown;
+    granted = 0;
+    governor_countdown = 0;
+}
+
+/**
+ * \brief The slow path of governor_tick().
+ */
+void governor_refill(){
+    governor_poll_cancel();
+    if (Governor::current != nullptr) {
+        Governor::current->refill();
+    }
+    else {
+        governor_countdown = governor_cancel != nullptr ? governor_chunk : ungoverned_chunk;
+    }
+}
+
+/**
+ * \brief Throws a cancelled_error if the current thread's evaluation is cancelled.
+ */
+void governor_poll_cancel(){
+    if (governor_cancel != nullptr && governor_cancel->load()) {
+        throw cancelled_error("evaluation cancelled");
+    }
+}
+
+GovernorScope::GovernorScope(Governor *governor){
+    if (Governor::current != nullptr) {
+        Governor::current->charge();
+    }
+    saved = Governor::current;
+    Governor::current = governor;
+    governor_countdown = 0;
+}
+
+GovernorScope::~GovernorScope(){
+    if (Governor::current != nullptr) {
+        Governor::current->charge();
+    }
+    Governor::current = saved;
+    governor_countdown = 0;
+}
+
+CancelScope::CancelScope(const atomic<bool> *flag){
+    saved = governor_cancel;
+    governor_cancel = flag;
+    // a governor checks every chunk already; without one, shorten the long countdown
+    if (Governor::current == nullptr && governor_countdown > governor_chunk) {
+        governor_countdown = governor_chunk;
+    }
+}
+
+CancelScope::~CancelScope(){
+    governor_cancel = saved;
+}
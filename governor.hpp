@@ -0,0 +1,127 @@
+/**
+ * \file governor.hpp
+ * \brief Step, time and memory quotas for one evaluation.
+ *
+ * With a Governor installed, the tree walker counts every step() it runs, and the
+ * VM and closure compiler count every call, so a runaway recursive _fun is stopped
+ * instead of stalling its worker. The count lives in a thread-local countdown: the
+ * fast path is one decrement and test, and only when a chunk of steps is used up
+ * does the governor add it to the total and check the step limit, the clock and the
+ * bytes the thread has taken from the heap since the evaluation started. An
+ * evaluation over its quota throws a quota_error, which the command line reports with
+ * its own exit status, batch mode as a "quota: " line and --serve as a "quota"
+ * response. Without a governor the countdown is refilled with a large chunk and
+ * nothing is checked.
+ *
+ * The countdown is also where an evaluation notices that it has been cancelled, as the
+ * offered operand of a fork is when the other operand fails: under a CancelScope the
+ * countdown is refilled at least every chunk of steps, and the refill that finds the
+ * flag set throws a cancelled_error.
+ *
+ * Memory is counted as the bytes the evaluation is handed, freed or not: heap
+ * allocations, and the blocks the frame pool or the collector hands out again. The
+ * tree walker, the closure compiler and the flat evaluator take their frames and
+ * closures from the pool where the VM takes some of its closures from the heap, so
+ * counting both makes the limit mean the same on every backend: how much the
+ * evaluation allocates in all rather than how much it keeps.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+/**
+ * \brief Exit status of the command line when the evaluation went over a quota.
+ */
+const int quota_exit_status = 2;
+
+/**
+ * \brief Limits of one evaluation; 0 is no limit.
+ */
+class Quota {
+public:
+    unsigned long max_steps;
+    unsigned long time_limit_ms;
+    unsigned long max_memory;   // bytes
+
+    Quota() : max_steps(0), time_limit_ms(0), max_memory(0) {}
+
+    bool limited() const { return max_steps != 0 || time_limit_ms != 0 || max_memory != 0; }
+};
+
+/**
+ * \brief The error of an evaluation stopped by its Governor.
+ */
+class quota_error : public runtime_error {
+public:
+    quota_error(const string &what) : runtime_error(what) {}
+};
+
+/**
+ * \brief The error of an evaluation whose result is no longer wanted.
+ */
+class cancelled_error : public runtime_error {
+public:
+    cancelled_error(const string &what) : runtime_error(what) {}
+};
+
+class Governor {
+public:
+    static thread_local Governor *current;   // the governor of this thread's evaluation, or nullptr
+
+    typedef chrono::steady_clock clock;
+
+    Quota quota;
+    unsigned long steps;     // counted so far, up to the last refill
+    long granted;            // the countdown the last refill set
+    clock::time_point deadline;
+    unsigned long start_bytes;
+
+    Governor(const Quota &quota);
+
+    void refill();
+    void charge();
+};
+
+extern thread_local long governor_countdown;
+extern thread_local const atomic<bool> *governor_cancel;   // the flag of this thread's evaluation, or nullptr
+
+void governor_refill();
+void governor_poll_cancel();
+
+/**
+ * \brief Counts one step against the current governor, if there is one.
+ */
+inline void governor_tick(){
+    if (--governor_countdown <= 0) {
+        governor_refill();
+    }
+}
+
+/**
+ * \brief Installs a Governor for the current thread while in scope. The steps taken
+ * under it count only against it.
+ */
+class GovernorScope {
+public:
+    Governor *saved;
+
+    GovernorScope(Governor *governor);
+    ~GovernorScope();
+};
+
+/**
+ * \brief Makes the current thread's evaluation stop with a cancelled_error, within a
+ * chunk of steps, once `flag` is set, while in scope.
+ */
+class CancelScope {
+public:
+    const atomic<bool> *saved;
+
+    CancelScope(const atomic<bool> *flag);
+    ~CancelScope();
+};
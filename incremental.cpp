@@ -0,0 +1,404 @@
+/**
+ * \file incremental.cpp
+ * \brief Implementation of incremental sessions.
+ */
+
+#include "incremental.hpp"
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include "parse.hpp"
+
+//======================  CachedExpr  ======================//
+
+CachedExpr::CachedExpr(PTR(Expr) inner, unsigned long *hits, unsigned long *misses){
+    this->kind = expr_cached;
+    this->inner = inner;
+    this->cached = false;
+    this->hits = hits;
+    this->misses = misses;
+    this->hash = inner->hash;
+    this->position = inner->position;
+}
+
+bool CachedExpr::equals(PTR(Expr) e){
+    return inner->equals(e);
+}
+
+/**
+ * \brief The stored value, or the value of the subtree, stored if it has one.
+ * The subtree has no free variables, so its value does not depend on env.
+ */
+Value CachedExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    if (cached) {
+        (*hits)++;
+        return value;
+    }
+    (*misses)++;
+    value = inner->eval(env);
+    cached = true;
+    return value;
+}
+
+PTR(Expr) CachedExpr::resolve(ResolveScope *scope){
+    return inner->resolve(scope);
+}
+
+PTR(Expr) CachedExpr::optimize(OptimizeScope *scope){
+    return inner->optimize(scope);
+}
+
+void CachedExpr::print(ostream &ostream){
+    inner->print(ostream);
+}
+
+void CachedExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    inner->pretty_print_at(ostream, prec, let_parent, strmpos);
+}
+
+//======================  Tree structure  ======================//
+
+/**
+ * \brief The children of a parsed node, in source order.
+ */
+vector<PTR(Expr)> children_of(PTR(Expr) e){
+    vector<PTR(Expr)> children;
+    switch (e->kind) {
+        case expr_add: {
+            AddExpr *add = static_cast<AddExpr *>(&*e);
+            children.push_back(add->lhs);
+            children.push_back(add->rhs);
+            break;
+        }
+        case expr_mult: {
+            MultExpr *mult = static_cast<MultExpr *>(&*e);
+            children.push_back(mult->lhs);
+            children.push_back(mult->rhs);
+            break;
+        }
+        case expr_eq: {
+            EqExpr *eq = static_cast<EqExpr *>(&*e);
+            children.push_back(eq->lhs);
+            children.push_back(eq->rhs);
+            break;
+        }
+        case expr_let: {
+            LetExpr *let = static_cast<LetExpr *>(&*e);
+            children.push_back(let->rhs);
+            children.push_back(let->body);
+            break;
+        }
+        case expr_if: {
+            IfExpr *if_expr = static_cast<IfExpr *>(&*e);
+            children.push_back(if_expr->if_);
+            children.push_back(if_expr->then_);
+            children.push_back(if_expr->else_);
+            break;
+        }
+        case expr_fun:
+            children.push_back(static_cast<FunExpr *>(&*e)->body);
+            break;
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(&*e);
+            children.push_back(call->to_be_called);
+            children.push_back(call->actual_arg);
+            break;
+        }
+        default:
+            break;
+    }
+    return children;
+}
+
+/**
+ * \brief A copy of a parsed node with other children, at the same position.
+ */
+static PTR(Expr) with_children(PTR(Expr) e, const vector<PTR(Expr)> &children){
+    PTR(Expr) copy;
+    switch (e->kind) {
+        case expr_add:
+            copy = NEW(AddExpr)(children[0], children[1]);
+            break;
+        case expr_mult:
+            copy = NEW(MultExpr)(children[0], children[1]);
+            break;
+        case expr_eq:
+            copy = NEW(EqExpr)(children[0], children[1]);
+            break;
+        case expr_let:
+            copy = NEW(LetExpr)(static_cast<LetExpr *>(&*e)->lhs, children[0], children[1]);
+            break;
+        case expr_if:
+            copy = NEW(IfExpr)(children[0], children[1], children[2]);
+            break;
+        case expr_fun:
+            copy = NEW(FunExpr)(static_cast<FunExpr *>(&*e)->formal_arg, children[0]);
+            break;
+        case expr_call:
+            copy = NEW(CallExpr)(children[0], children[1]);
+            break;
+        default:
+            throw runtime_error("cannot rebuild expression");
+    }
+    return located(copy, e->position);
+}
+
+/**
+ * \brief The name a node binds in its child `index`, or nullptr.
+ */
+static const string *bound_in(Expr *e, size_t index){
+    if (e->kind == expr_let && index == 1) {
+        return &static_cast<LetExpr *>(e)->lhs;
+    }
+    if (e->kind == expr_fun) {
+        return &static_cast<FunExpr *>(e)->formal_arg;
+    }
+    return nullptr;
+}
+
+/**
+ * \brief True for the rhs of a +, * or == that continues its chain. Chains are
+ * evaluated in a loop, so they are only wrapped as a whole.
+ */
+static bool continues_chain(Expr *parent, size_t index, Expr *child){
+    return index == 1 && child->kind == parent->kind
+        && (parent->kind == expr_add || parent->kind == expr_mult || parent->kind == expr_eq);
+}
+
+//======================  IncrementalSession  ======================//
+
+/**
+ * \param source The script; it need not parse, in which case interp() reports why.
+ */
+IncrementalSession::IncrementalSession(const string &source) : source(source) {
+    full_parses = 0;
+    spliced_edits = 0;
+    cache_hits = 0;
+    cache_misses = 0;
+    reparse();
+}
+
+/**
+ * \brief Records a node whose children have been recorded already.
+ */
+void IncrementalSession::add_info(PTR(Expr) e){
+    vector<PTR(Expr)> children = children_of(e);
+    NodeInfo info;
+    if (children.empty()) {
+        info.plain = e;
+        info.eval = e;
+        if (e->kind == expr_var) {
+            info.free.push_back(static_cast<VarExpr *>(&*e)->val);
+        }
+        infos[&*e] = info;
+        return;
+    }
+    vector<PTR(Expr)> evals;
+    bool same = true;
+    for (size_t i = 0; i < children.size(); i++) {
+        NodeInfo &child = infos[&*children[i]];
+        PTR(Expr) eval = continues_chain(&*e, i, &*children[i]) ? child.plain : child.eval;
+        same = same && eval == children[i];
+        evals.push_back(eval);
+        const string *bound = bound_in(&*e, i);
+        for (const string &name : child.free) {
+            if (bound == nullptr || name != *bound) {
+                info.free.push_back(name);
+            }
+        }
+    }
+    sort(info.free.begin(), info.free.end());
+    info.free.erase(unique(info.free.begin(), info.free.end()), info.free.end());
+    info.plain = same ? e : with_children(e, evals);
+    // a _fun evaluates to a closure straight away, so only its body is worth caching
+    if (info.free.empty() && e->kind != expr_fun) {
+        info.eval = NEW(CachedExpr)(info.plain, &cache_hits, &cache_misses);
+    }
+    else {
+        info.eval = info.plain;
+    }
+    infos[&*e] = info;
+}
+
+/**
+ * \brief Records every node of the tree, children first, without recursing.
+ */
+void IncrementalSession::add_all_infos(){
+    vector<pair<PTR(Expr), bool> > stack(1, make_pair(tree, false));
+    while (!stack.empty()) {
+        pair<PTR(Expr), bool> top = stack.back();
+        stack.pop_back();
+        if (top.second) {
+            add_info(top.first);
+            continue;
+        }
+        stack.push_back(make_pair(top.first, true));
+        vector<PTR(Expr)> children = children_of(top.first);
+        for (size_t i = children.size(); i-- > 0;) {
+            stack.push_back(make_pair(children[i], false));
+        }
+    }
+}
+
+void IncrementalSession::reparse(){
+    full_parses++;
+    infos.clear();
+    tree = nullptr;
+    error = "";
+    try {
+        tree = parse_buffer(source.data(), source.size());
+    }
+    catch (runtime_error exn) {
+        error = exn.what();
+        return;
+    }
+    add_all_infos();
+}
+
+/**
+ * \brief The length of the token of a leaf starting at `start`.
+ */
+static size_t token_length(const string &source, size_t start, expr_kind_t kind){
+    size_t end = start;
+    if (kind == expr_num) {
+        if (end < source.size() && source[end] == '-') {
+            end++;
+        }
+        while (end < source.size() && isdigit((unsigned char)source[end])) {
+            end++;
+        }
+    }
+    else {
+        if (kind == expr_bool) {
+            end++;
+        }
+        while (end < source.size() && isalpha((unsigned char)source[end])) {
+            end++;
+        }
+    }
+    return end - start;
+}
+
+static bool all_of_class(const string &text, size_t from, int (*is_class)(int)){
+    if (from >= text.size()) {
+        return false;
+    }
+    for (size_t i = from; i < text.size(); i++) {
+        if (!is_class((unsigned char)text[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * \brief The leaf a token stands for on its own, or nullptr if it is not one token.
+ */
+static PTR(Expr) leaf_of(const string &token){
+    bool number = all_of_class(token, !token.empty() && token[0] == '-' ? 1 : 0, isdigit);
+    bool name = all_of_class(token, 0, isalpha);
+    if (!number && !name && token != "_true" && token != "_false") {
+        return nullptr;
+    }
+    return parse_buffer(token.data(), token.size());
+}
+
+/**
+ * \brief Applies an edit that stays inside one leaf token, rebuilding only the nodes
+ * from the root down to that leaf.
+ * \return False, with nothing changed, if the edit cannot be spliced in.
+ */
+bool IncrementalSession::splice(size_t offset, size_t removed, const string &inserted){
+    // the path down to the node the edit starts in: the last child starting at or
+    // before it at each level
+    vector<PTR(Expr)> spine(1, tree);
+    vector<size_t> indices;
+    vector<PTR(Expr)> after;   // subtrees that start after the edit
+    while (true) {
+        vector<PTR(Expr)> children = children_of(spine.back());
+        if (children.empty()) {
+            break;
+        }
+        size_t i = children.size();
+        while (i > 0 && children[i - 1]->position > (int)offset) {
+            i--;
+        }
+        if (i == 0) {
+            return false;
+        }
+        after.insert(after.end(), children.begin() + i, children.end());
+        indices.push_back(i - 1);
+        spine.push_back(children[i - 1]);
+    }
+    PTR(Expr) leaf = spine.back();
+    size_t start = leaf->position;
+    size_t end = start + token_length(source, start, leaf->kind);
+    if (offset < start || offset + removed > end) {
+        return false;
+    }
+    string token = source.substr(start, offset - start) + inserted + source.substr(offset + removed, end - offset - removed);
+    string edited = source;
+    edited.replace(offset, removed, inserted);
+    // the new token has to end where the old one did and not run into its neighbours
+    size_t stop = start + token.size();
+    if ((start > 0 && (isalnum((unsigned char)edited[start - 1]) || edited[start - 1] == '_'))
+        || (stop < edited.size() && isalnum((unsigned char)edited[stop]))) {
+        return false;
+    }
+    PTR(Expr) node = leaf_of(token);
+    if (node == nullptr) {
+        return false;
+    }
+    node->position = (int)start;
+
+    vector<PTR(Expr)> built(1, node);
+    for (size_t k = indices.size(); k-- > 0;) {
+        vector<PTR(Expr)> children = children_of(spine[k]);
+        children[indices[k]] = node;
+        node = with_children(spine[k], children);
+        built.push_back(node);
+    }
+    long delta = (long)inserted.size() - (long)removed;
+    while (!after.empty()) {
+        PTR(Expr) e = after.back();
+        after.pop_back();
+        e->position += delta;
+        vector<PTR(Expr)> children = children_of(e);
+        after.insert(after.end(), children.begin(), children.end());
+    }
+    for (PTR(Expr) &old : spine) {
+        infos.erase(&*old);
+    }
+    for (PTR(Expr) &e : built) {
+        add_info(e);
+    }
+    tree = node;
+    source = edited;
+    return true;
+}
+
+/**
+ * \brief Replaces `removed` bytes at `offset` with `inserted`.
+ */
+void IncrementalSession::edit(size_t offset, size_t removed, const string &inserted){
+    if (offset > source.size() || removed > source.size() - offset) {
+        throw runtime_error("edit outside the source");
+    }
+    if (tree != nullptr && splice(offset, removed, inserted)) {
+        spliced_edits++;
+        return;
+    }
+    source.replace(offset, removed, inserted);
+    reparse();
+}
+
+/**
+ * \brief Runs the script, reusing the values of closed subtrees the edits left alone.
+ * \throws runtime_error with the parse error if the source does not parse.
+ */
+PTR(Val) IncrementalSession::interp(){
+    if (tree == nullptr) {
+        throw runtime_error(error);
+    }
+    return infos[&*tree].eval->interp();
+}
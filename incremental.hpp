@@ -0,0 +1,85 @@
+/**
+ * \file incremental.hpp
+ * \brief Re-running a script after small edits without reparsing or re-evaluating
+ * all of it, for editor integrations.
+ *
+ * An IncrementalSession keeps the source, its tree and an evaluation copy of the
+ * tree. Nodes are located by the byte offsets the parser records in
+ * Expr::position. An edit that stays inside one literal or variable token, the
+ * common "tweak a number" case, is spliced in. The token is re-lexed and only the
+ * spine of nodes from the root down to it is rebuilt. Positions after the edit are
+ * shifted, and anything else falls back to a full parse.
+ *
+ * In the evaluation copy every compound subtree without free variables is wrapped
+ * in a CachedExpr, which keeps the subtree's value after it first succeeds. The
+ * wrappers of subtrees off the edited spine carry over to the rebuilt tree, so
+ * running the script again evaluates only the spine and what depends on variables.
+ */
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+/**
+ * \brief A closed subtree that evaluates once and then returns its value. Prints,
+ * hashes and compares like the subtree it wraps.
+ */
+class CachedExpr : public Expr {
+public:
+    PTR(Expr) inner;
+    bool cached;
+    Value value;
+    unsigned long *hits;     // counters of the owning session
+    unsigned long *misses;
+
+    CachedExpr(PTR(Expr) inner, unsigned long *hits, unsigned long *misses);
+    virtual bool equals(PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+vector<PTR(Expr)> children_of(PTR(Expr) e);
+
+class IncrementalSession {
+public:
+    string source;
+    PTR(Expr) tree;           // as parse() would build it from source; nullptr if it does not parse
+    unsigned long full_parses;
+    unsigned long spliced_edits;
+    unsigned long cache_hits;     // closed subtrees whose value was reused
+    unsigned long cache_misses;   // closed subtrees that were evaluated
+
+    IncrementalSession(const string &source);
+
+    void edit(size_t offset, size_t removed, const string &inserted);
+    PTR(Val) interp();
+
+private:
+    /**
+     * \brief What the session knows about a node of the tree.
+     */
+    class NodeInfo {
+    public:
+        PTR(Expr) plain;          // the evaluation copy without a wrapper of its own
+        PTR(Expr) eval;           // plain, or plain wrapped in a CachedExpr
+        vector<string> free;      // free variable names, sorted
+    };
+
+    unordered_map<Expr *, NodeInfo> infos;
+    string error;                 // why source does not parse
+
+    void reparse();
+    bool splice(size_t offset, size_t removed, const string &inserted);
+    void add_info(PTR(Expr) e);
+    void add_all_infos();
+};
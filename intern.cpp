@@ -0,0 +1,41 @@
+/**
+ * \file intern.cpp
+ * \brief Implementation of the hash-consing table.
+ */
+
+#include "intern.hpp"
+
+ExprTable::ExprTable(size_t capacity){
+    this->capacity = capacity;
+}
+
+/**
+ * \brief Returns the shared node equal to e, adding e if there is none yet.
+ * \param e A node whose children were interned in this table.
+ * \return The canonical node.
+ */
+PTR(Expr) ExprTable::intern(PTR(Expr) e){
+    lock_guard<mutex> guard(lock);
+    auto range = nodes.equal_range(e->hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        // the children are shared already, so this compares them by pointer
+        if (it->second->equals(e)) {
+            return it->second;
+        }
+    }
+    if (capacity != 0 && nodes.size() >= capacity) {
+        nodes.clear();
+    }
+    nodes.insert(make_pair(e->hash, e));
+    return e;
+}
+
+size_t ExprTable::size(){
+    lock_guard<mutex> guard(lock);
+    return nodes.size();
+}
+
+void ExprTable::clear(){
+    lock_guard<mutex> guard(lock);
+    nodes.clear();
+}
@@ -0,0 +1,42 @@
+/**
+ * \file intern.hpp
+ * \brief Hash-consing table that shares structurally identical expression nodes.
+ *
+ * A node built from children that are already in the table is looked up by its
+ * precomputed hash. If an equal node is there, that node is used instead, so every
+ * distinct subtree exists once and equals() on two interned trees stops at the first
+ * pointer comparison. The parser interns each node as it builds it when given a
+ * table. The table keeps its nodes alive, so they must not live in an Arena that is
+ * reset while the table is in use.
+ *
+ * A table with a capacity starts over empty when it is full, so a long batch does not
+ * keep every program it has read. Trees interned before that stay valid and keep
+ * their own sharing, but are no longer shared with later ones.
+ */
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include "Expr.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+// nodes a --batch --intern table holds before it starts over
+const size_t batch_intern_capacity = 1 << 18;
+
+class ExprTable {
+public:
+    size_t capacity;   // nodes held at most; 0 for no limit
+
+    ExprTable(size_t capacity = 0);
+
+    PTR(Expr) intern(PTR(Expr) e);
+    size_t size();
+    void clear();
+
+private:
+    unordered_multimap<size_t, PTR(Expr)> nodes;
+    mutex lock;   // one table can serve parsers on several threads
+};
@@ -0,0 +1,568 @@
+/**
+ * \file lazy.cpp
+ * \brief Implementation of call-by-need evaluation.
+ */
+
+#include "lazy.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include "resolve.hpp"
+
+//======================  ThunkVal  ======================//
+
+/**
+ * \param frame_size Slots of the frame the resolved body runs in, or -1 to evaluate
+ * the body in `env`.
+ */
+ThunkVal::ThunkVal(PTR(Expr) body, PTR(Env) env, int frame_size){
+    this->kind = val_thunk;
+    this->body = body;
+    this->env = env;
+    this->frame_size = frame_size;
+    this->forced = false;
+}
+
+/**
+ * \brief Evaluates the body the first time, and returns the kept value after that.
+ */
+Value ThunkVal::force(){
+    if (!forced) {
+        PTR(Env) frame = frame_size < 0 ? env : pool_new<FrameEnv>(frame_size, env);
+        value = body->eval(frame);
+        forced = true;
+        body = nullptr;
+        env = nullptr;
+    }
+    return value;
+}
+
+PTR(Expr) ThunkVal::to_expr(){
+    return force().to_val()->to_expr();
+}
+
+bool ThunkVal::equals(PTR(Val) v){
+    return force().equals(Value(v));
+}
+
+size_t ThunkVal::hash(){
+    return force().hash();
+}
+
+PTR(Val) ThunkVal::add_to(PTR(Val) other_val){
+    return force().add_to(Value(other_val)).to_val();
+}
+
+PTR(Val) ThunkVal::mult_with(PTR(Val) other_val){
+    return force().mult_with(Value(other_val)).to_val();
+}
+
+void ThunkVal::print(ostream &ostream){
+    force().print(ostream);
+}
+
+bool ThunkVal::is_true(){
+    return force().is_true();
+}
+
+PTR(Val) ThunkVal::call(PTR(Val) actual_arg){
+    return force().call(Value(actual_arg)).to_val();
+}
+
+//======================  ForceExpr  ======================//
+
+ForceExpr::ForceExpr(PTR(Expr) var){
+    this->kind = expr_force;
+    this->var = var;
+    this->hash = var->hash;
+    this->position = var->position;
+}
+
+/**
+ * \brief Compares like the variable it wraps, whether or not `e` is wrapped too.
+ */
+bool ForceExpr::equals(PTR(Expr) e){
+    if(e != nullptr && e->kind == expr_force){
+        return var->equals(static_cast<ForceExpr *>(&*e)->var);
+    }
+    return var->equals(e);
+}
+
+/**
+ * \brief Reads the variable and forces it if it is bound to a thunk.
+ */
+Value ForceExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    return force(var->step(env, next));
+}
+
+PTR(Expr) ForceExpr::resolve(ResolveScope *scope){
+    return NEW(ForceExpr)(var->resolve(scope));
+}
+
+PTR(Expr) ForceExpr::optimize(OptimizeScope *scope){
+    return var->optimize(scope);
+}
+
+void ForceExpr::print(ostream &ostream){
+    var->print(ostream);
+}
+
+void ForceExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    var->pretty_print_at(ostream, prec, let_parent, strmpos);
+}
+
+//======================  DelayExpr  ======================//
+
+DelayExpr::DelayExpr(PTR(Expr) body){
+    this->kind = expr_delay;
+    this->body = body;
+    this->hash = body->hash;
+    this->position = body->position;
+}
+
+/**
+ * \brief Compares like the expression it delays, whether or not `e` is delayed too.
+ */
+bool DelayExpr::equals(PTR(Expr) e){
+    if(e != nullptr && e->kind == expr_delay){
+        return body->equals(static_cast<DelayExpr *>(&*e)->body);
+    }
+    return body->equals(e);
+}
+
+/**
+ * \brief A thunk of the body over the whole environment, which is immutable before
+ * resolve(), so the thunk cannot end up inside what it keeps alive.
+ */
+Value DelayExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    return Value(pool_new<ThunkVal>(body, env, -1));
+}
+
+/**
+ * \brief Resolves the body like the body of a function without an argument, so that
+ * its thunks capture only the variables it uses.
+ */
+PTR(Expr) DelayExpr::resolve(ResolveScope *scope){
+    ResolveScope inner(scope);
+    PTR(Expr) new_body = body->resolve(&inner);
+    return located(NEW(SlotDelayExpr)(new_body, inner.frame_size, inner.captures), position);
+}
+
+PTR(Expr) DelayExpr::optimize(OptimizeScope *scope){
+    return body->optimize(scope);
+}
+
+void DelayExpr::print(ostream &ostream){
+    body->print(ostream);
+}
+
+void DelayExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    body->pretty_print_at(ostream, prec, let_parent, strmpos);
+}
+
+SlotDelayExpr::SlotDelayExpr(PTR(Expr) body, int frame_size, const vector<pair<int, int> > &captures) : DelayExpr(body) {
+    this->kind = expr_slot_delay;
+    this->frame_size = frame_size;
+    this->captures = captures;
+}
+
+/**
+ * \brief A thunk over a frame of the captured values, copied like SlotFunExpr::step()
+ * copies them. Captured thunks are copied unforced.
+ */
+Value SlotDelayExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    PTR(Env) names = env->names();
+    if (captures.empty()) {
+        return Value(pool_new<ThunkVal>(body, names, frame_size));
+    }
+    PTR(FrameEnv) captured = pool_new<FrameEnv>((int)captures.size(), names);
+    for (size_t i = 0; i < captures.size(); i++) {
+        captured->slots[i] = env->lookup_slot(captures[i].first, captures[i].second);
+    }
+    return Value(pool_new<ThunkVal>(body, captured, frame_size));
+}
+
+//======================  LazyCallExpr  ======================//
+
+LazyCallExpr::LazyCallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg) : CallExpr(to_be_called, actual_arg) {
+    this->kind = expr_lazy_call;
+}
+
+/**
+ * \brief Evaluates the callee, then the argument unless the callee ignores it, and
+ * continues with the body like CallExpr::step().
+ */
+Value LazyCallExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    Value callee = this->to_be_called->eval(env);
+    if (callee.tag == Value::boxed_tag) {
+        Value arg;
+        if (callee.boxed->kind != val_fun || static_cast<FunVal *>(&*callee.boxed)->arg_used) {
+            arg = this->actual_arg->eval(env);
+        }
+        return callee.boxed->tail_call(arg, env, next);
+    }
+    return callee.call(this->actual_arg->eval(env));
+}
+
+PTR(Expr) LazyCallExpr::resolve(ResolveScope *scope){
+    return located(NEW(LazyCallExpr)(to_be_called->resolve(scope), actual_arg->resolve(scope)), position);
+}
+
+//======================  Making programs lazy  ======================//
+
+namespace {
+
+const int used_many = 2;   // use counts stop here
+
+/**
+ * \brief What the use counts found for one _let or _fun.
+ */
+class BindingUse {
+public:
+    int uses;                    // of the bound name in the body, up to used_many
+    vector<string> rhs_names;    // for a _let, the free variables of its rhs
+};
+
+typedef unordered_map<string, int> UseCounts;
+
+/**
+ * \brief A variable in scope in the lazy program: bound to a value or thunk, or, when
+ * `replacement` is set, not bound at all and replaced at its use.
+ */
+class LazyBinding {
+public:
+    string name;
+    PTR(Expr) replacement;
+
+    LazyBinding(const string &name, PTR(Expr) replacement = nullptr) : name(name), replacement(replacement) {}
+};
+
+class LazyPass {
+public:
+    UseCounts binders;                            // how many _let and _fun bind each name
+    unordered_map<Expr *, BindingUse> bindings;   // for each _let and _fun node
+    vector<LazyBinding> scope;
+    UseCounts in_scope;                           // binders of each name around the node
+
+    void count_binders(Expr *e);
+    void count_uses(Expr *e, UseCounts &uses);
+    PTR(Expr) transform(PTR(Expr) e);
+
+private:
+    UseCounts body_uses(Expr *binder, const string &name, Expr *body);
+    bool can_inline(const BindingUse &use);
+    PTR(Expr) bind(const LazyBinding &binding, PTR(Expr) body);
+    PTR(Expr) transform_let(LetExpr *let);
+    template <class T> PTR(Expr) transform_chain(T *first);
+};
+
+void add_uses(UseCounts &uses, const string &name, int count){
+    int &total = uses[name];
+    total = min(used_many, total + count);
+}
+
+/**
+ * \brief Adds the operands of the chain of T at `first` to `children`, in order, so
+ * a long chain is one step of the walks rather than one step per operator.
+ */
+template <class T> void add_chain_operands(vector<Expr *> &children, T *first){
+    vector<T *> chain = rhs_chain(first);
+    for (T *link : chain) {
+        children.push_back(&*link->lhs);
+    }
+    children.push_back(&*chain.back()->rhs);
+}
+
+/**
+ * \brief The children of any node the pass accepts other than _let and _fun, for the
+ * walks that treat them all alike; for +, * and ==, the operands of the whole chain.
+ */
+vector<Expr *> children_of(Expr *e){
+    vector<Expr *> children;
+    switch (e->kind) {
+        case expr_add:
+            add_chain_operands(children, static_cast<AddExpr *>(e));
+            break;
+        case expr_mult:
+            add_chain_operands(children, static_cast<MultExpr *>(e));
+            break;
+        case expr_eq:
+            add_chain_operands(children, static_cast<EqExpr *>(e));
+            break;
+        case expr_if:
+            children.push_back(&*static_cast<IfExpr *>(e)->if_);
+            children.push_back(&*static_cast<IfExpr *>(e)->then_);
+            children.push_back(&*static_cast<IfExpr *>(e)->else_);
+            break;
+        case expr_call:
+            children.push_back(&*static_cast<CallExpr *>(e)->to_be_called);
+            children.push_back(&*static_cast<CallExpr *>(e)->actual_arg);
+            break;
+        case expr_sum:
+        case expr_product:
+            for (PTR(Expr) &operand : static_cast<NaryExpr *>(e)->operands) {
+                children.push_back(&*operand);
+            }
+            break;
+        case expr_scope:
+            children.push_back(&*static_cast<ScopeExpr *>(e)->body);
+            break;
+        default:
+            break;
+    }
+    return children;
+}
+
+void LazyPass::count_binders(Expr *e){
+    switch (base_kind(e->kind)) {
+        case expr_let: {
+            LetExpr *let = static_cast<LetExpr *>(e);
+            binders[let->lhs]++;
+            count_binders(&*let->rhs);
+            count_binders(&*let->body);
+            return;
+        }
+        case expr_fun: {
+            FunExpr *fun = static_cast<FunExpr *>(e);
+            binders[fun->formal_arg]++;
+            count_binders(&*fun->body);
+            return;
+        }
+        default:
+            for (Expr *child : children_of(e)) {
+                count_binders(child);
+            }
+    }
+}
+
+/**
+ * \brief Records the uses of `name` in `body` for `binder`.
+ * \return The other free variables of the body.
+ */
+UseCounts LazyPass::body_uses(Expr *binder, const string &name, Expr *body){
+    UseCounts inner;
+    count_uses(body, inner);
+    UseCounts::iterator found = inner.find(name);
+    bindings[binder].uses = found == inner.end() ? 0 : found->second;
+    if (found != inner.end()) {
+        inner.erase(found);
+    }
+    return inner;
+}
+
+/**
+ * \brief Adds the free variables `e` uses to `uses`, and records the uses of each
+ * name a _let or _fun in it binds. Uses in both branches of an _if add up, and a use
+ * inside a _fun counts as many, since the function can be called any number of times.
+ */
+void LazyPass::count_uses(Expr *e, UseCounts &uses){
+    switch (base_kind(e->kind)) {
+        case expr_num:
+        case expr_bool:
+            return;
+        case expr_var:
+            add_uses(uses, static_cast<VarExpr *>(e)->val, 1);
+            return;
+        case expr_let: {
+            LetExpr *let = static_cast<LetExpr *>(e);
+            UseCounts rhs_uses;
+            count_uses(&*let->rhs, rhs_uses);
+            UseCounts inner = body_uses(e, let->lhs, &*let->body);
+            vector<string> &rhs_names = bindings[e].rhs_names;
+            for (UseCounts::value_type &use : rhs_uses) {
+                rhs_names.push_back(use.first);
+                add_uses(uses, use.first, use.second);
+            }
+            for (UseCounts::value_type &use : inner) {
+                add_uses(uses, use.first, use.second);
+            }
+            return;
+        }
+        case expr_fun: {
+            FunExpr *fun = static_cast<FunExpr *>(e);
+            UseCounts inner = body_uses(e, fun->formal_arg, &*fun->body);
+            for (UseCounts::value_type &use : inner) {
+                add_uses(uses, use.first, used_many);
+            }
+            return;
+        }
+        default:
+            for (Expr *child : children_of(e)) {
+                count_uses(child, uses);
+            }
+    }
+}
+
+/**
+ * \brief Whether an expression of the lazy program is cheaper to evaluate than to
+ * delay, and cannot fail: a literal, a _fun or a bound variable.
+ */
+bool is_immediate(PTR(Expr) e){
+    switch (e->kind) {
+        case expr_num:
+        case expr_bool:
+        case expr_fun:
+        case expr_force:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * \brief The expression a binding or argument is bound to: an immediate one as it
+ * is, a variable read without forcing it, so the binding shares its thunk, and
+ * anything else delayed.
+ */
+PTR(Expr) delayed(PTR(Expr) e){
+    if (e->kind == expr_force) {
+        return static_cast<ForceExpr *>(&*e)->var;
+    }
+    if (is_immediate(e)) {
+        return e;
+    }
+    return NEW(DelayExpr)(e);
+}
+
+/**
+ * \brief Whether the rhs of a _let can be moved to the use of its variable: every
+ * variable it reads has no binder in the program other than the ones around the
+ * _let, so nothing between the _let and the use can capture it.
+ */
+bool LazyPass::can_inline(const BindingUse &use){
+    for (const string &name : use.rhs_names) {
+        if (binders[name] != in_scope[name]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * \brief Transforms `body` with `binding` in scope.
+ */
+PTR(Expr) LazyPass::bind(const LazyBinding &binding, PTR(Expr) body){
+    scope.push_back(binding);
+    in_scope[binding.name]++;
+    PTR(Expr) result = transform(body);
+    in_scope[binding.name]--;
+    scope.pop_back();
+    return result;
+}
+
+PTR(Expr) LazyPass::transform_let(LetExpr *let){
+    const BindingUse &use = bindings[let];
+    if (use.uses == 0) {
+        // nothing in the body refers to the variable, so no use needs it hidden either
+        return transform(let->body);
+    }
+    PTR(Expr) rhs = transform(let->rhs);
+    if (use.uses == 1 && !is_immediate(rhs) && can_inline(use)) {
+        return bind(LazyBinding(let->lhs, rhs), let->body);
+    }
+    PTR(Expr) body = bind(LazyBinding(let->lhs), let->body);
+    return located(NEW(LetExpr)(let->lhs, delayed(rhs), body), let->position);
+}
+
+/**
+ * \brief Transforms the operands of the chain of T at `first` in order and in a
+ * loop, and rebuilds the chain over them from the right.
+ */
+template <class T> PTR(Expr) LazyPass::transform_chain(T *first){
+    vector<T *> chain = rhs_chain(first);
+    vector<PTR(Expr)> operands;
+    operands.reserve(chain.size());
+    for (T *link : chain) {
+        operands.push_back(transform(link->lhs));
+    }
+    PTR(Expr) result = transform(chain.back()->rhs);
+    for (size_t i = chain.size(); i-- > 0;) {
+        PTR(T) copy = NEW(T)(operands[i], result);
+        // operands are forced, so typecheck()'s proofs still hold
+        copy_marks(chain[i], &*copy);
+        result = located(copy, chain[i]->position);
+    }
+    return result;
+}
+
+/**
+ * \brief Rebuilds an expression as unresolved nodes with delayed bindings, forced
+ * variable reads and lazy calls.
+ */
+PTR(Expr) LazyPass::transform(PTR(Expr) e){
+    switch (base_kind(e->kind)) {
+        case expr_num:
+        case expr_bool:
+            return e;
+        case expr_var: {
+            const string &name = static_cast<VarExpr *>(&*e)->val;
+            for (size_t i = scope.size(); i-- > 0;) {
+                if (scope[i].name == name) {
+                    if (scope[i].replacement != nullptr) {
+                        return scope[i].replacement;
+                    }
+                    break;
+                }
+            }
+            // every read is forced; a variable bound to a plain value costs a tag test
+            return NEW(ForceExpr)(located(NEW(VarExpr)(name), e->position));
+        }
+        case expr_add:
+            return transform_chain(static_cast<AddExpr *>(&*e));
+        case expr_mult:
+            return transform_chain(static_cast<MultExpr *>(&*e));
+        case expr_eq:
+            return transform_chain(static_cast<EqExpr *>(&*e));
+        case expr_if: {
+            IfExpr *if_expr = static_cast<IfExpr *>(&*e);
+            PTR(Expr) condition = transform(if_expr->if_);
+            PTR(Expr) then_ = transform(if_expr->then_);
+            PTR(IfExpr) copy = NEW(IfExpr)(condition, then_, transform(if_expr->else_));
+            copy->typed = if_expr->typed;
+            return located(copy, e->position);
+        }
+        case expr_let:
+            return transform_let(static_cast<LetExpr *>(&*e));
+        case expr_fun: {
+            FunExpr *fun = static_cast<FunExpr *>(&*e);
+            PTR(FunExpr) copy = NEW(FunExpr)(fun->formal_arg, bind(LazyBinding(fun->formal_arg), fun->body));
+            copy->arg_used = bindings[&*e].uses > 0;
+            return located(copy, e->position);
+        }
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(&*e);
+            PTR(Expr) callee = transform(call->to_be_called);
+            return located(NEW(LazyCallExpr)(callee, delayed(transform(call->actual_arg))), e->position);
+        }
+        case expr_scope:
+            return transform(static_cast<ScopeExpr *>(&*e)->body);
+        case expr_sum:
+        case expr_product: {
+            vector<PTR(Expr)> operands;
+            for (PTR(Expr) &operand : static_cast<NaryExpr *>(&*e)->operands) {
+                operands.push_back(transform(operand));
+            }
+            if (e->kind == expr_sum) {
+                return located(NEW(SumExpr)(operands), e->position);
+            }
+            return located(NEW(ProductExpr)(operands), e->position);
+        }
+        default:
+            throw runtime_error("cannot evaluate expression lazily");
+    }
+}
+
+}
+
+/**
+ * \brief A copy of a program that evaluates bindings and arguments by need. The
+ * copy is unresolved; resolve() it to run it in frames.
+ * \param e A parsed, optimized or resolved program.
+ */
+PTR(Expr) make_lazy(PTR(Expr) e){
+    LazyPass pass;
+    pass.count_binders(&*e);
+    UseCounts free_uses;
+    pass.count_uses(&*e, free_uses);
+    return pass.transform(e);
+}
@@ -0,0 +1,144 @@
+/**
+ * \file lazy.hpp
+ * \brief Call-by-need evaluation of _let bindings and call arguments (--lazy).
+ *
+ * make_lazy() rewrites a program so that the right-hand side of a _let and the
+ * argument of a call are evaluated only when the variable is first read. A delayed
+ * expression becomes a DelayExpr, whose value is a ThunkVal holding the expression
+ * and the variables it needs; reading the variable goes through a ForceExpr, which
+ * evaluates the thunk the first time and keeps the value for later reads. Thunks sit
+ * in environments like any other value, in an ExtendedEnv before resolve() and in
+ * a frame slot after.
+ *
+ * A static count of how often each binding is used decides how it is bound:
+ *  - never used: a _let is dropped and its right-hand side is never built, and
+ *    calls to a _fun that ignores its argument skip evaluating it;
+ *  - used at most once, and not inside a _fun that could run it many times: the
+ *    right-hand side is substituted at the use, which evaluates it there exactly as
+ *    forcing a thunk would, without making one;
+ *  - a number, a boolean, a _fun or a variable: bound as is, since evaluating it
+ *    cannot fail and costs less than a thunk;
+ *  - anything else is delayed.
+ *
+ * Delayed subexpressions capture only the variables they use, like flat closures, so
+ * a thunk never keeps the frame it is stored in alive. Forcing runs on the native
+ * stack, so a loop that builds a long chain of unforced thunks (an accumulator
+ * argument that is only read at the end) takes one native frame per link when the
+ * chain is finally forced.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+//======================  ThunkVal  ======================//
+
+/**
+ * \brief A delayed value: `body` evaluated in `env`, at most once.
+ *
+ * With `frame_size` of -1 the body is evaluated in `env` itself. Otherwise it is a
+ * resolved body that runs in a fresh frame of that many slots over `env`, which holds
+ * the values it captured. Once forced, the body and environment are dropped and only
+ * the value is kept. An evaluation that throws leaves the thunk unforced, so forcing
+ * it again throws the same error. The Val operations force the thunk and act on its
+ * value, in case one ever escapes the interpreter.
+ */
+class ThunkVal : public Val {
+public:
+    PTR(Expr) body;
+    PTR(Env) env;
+    int frame_size;
+    bool forced;
+    Value value;
+
+    ThunkVal(PTR(Expr) body, PTR(Env) env, int frame_size);
+
+    Value force();
+
+    virtual PTR(Expr) to_expr();
+    virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
+    virtual PTR(Val) add_to(PTR(Val) other_val);
+    virtual PTR(Val) mult_with(PTR(Val) other_val);
+    virtual void print(ostream &ostream);
+    virtual bool is_true();
+
+    virtual PTR(Val) call(PTR(Val) actual_arg);
+};
+
+/**
+ * \brief The value of a thunk, or the value itself when it is not one.
+ */
+inline Value force(const Value &v){
+    if (v.tag == Value::boxed_tag && v.boxed->kind == val_thunk) {
+        return static_cast<ThunkVal *>(&*v.boxed)->force();
+    }
+    return v;
+}
+
+//======================  Lazy forms  ======================//
+
+/**
+ * \brief A read of a variable that may be bound to a thunk. Prints, hashes and
+ * compares like the variable.
+ */
+class ForceExpr : public Expr {
+public:
+    PTR(Expr) var;   // a VarExpr or SlotVarExpr
+
+    ForceExpr(PTR(Expr) var);
+    virtual bool equals(PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+/**
+ * \brief An expression whose value is a thunk of `body`. Prints, hashes and compares
+ * like the body.
+ */
+class DelayExpr : public Expr {
+public:
+    PTR(Expr) body;
+
+    DelayExpr(PTR(Expr) body);
+    virtual bool equals(PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+/**
+ * \brief A resolved DelayExpr. Like SlotFunExpr, its body runs in a frame of its own
+ * of `frame_size` slots, and reads capture i of `captures` at depth 1, slot i.
+ */
+class SlotDelayExpr : public DelayExpr {
+public:
+    int frame_size;
+    vector<pair<int, int> > captures;
+
+    SlotDelayExpr(PTR(Expr) body, int frame_size, const vector<pair<int, int> > &captures);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+};
+
+/**
+ * \brief A call that evaluates its (usually delayed) argument only when the callee
+ * reads it.
+ */
+class LazyCallExpr : public CallExpr {
+public:
+    LazyCallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+};
+
+PTR(Expr) make_lazy(PTR(Expr) e);
@@ -0,0 +1,91 @@
+/**
+ * \file lexer.cpp
+ * \brief Implementation of the buffer-backed lexer and source loading.
+ */
+
+#include "lexer.hpp"
+#include <cctype>
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \brief Consumes spaces, tabs and newlines.
+ */
+void Lexer::skip_whitespace(){
+    while (pos < end && isspace((unsigned char)*pos)) {
+        pos++;
+    }
+}
+
+/**
+ * \brief Consumes a run of letters.
+ * \return The letters, possibly none, as a view into the buffer.
+ */
+Slice Lexer::word(){
+    const char *first = pos;
+    while (pos < end && isalpha((unsigned char)*pos)) {
+        pos++;
+    }
+    return Slice(first, pos - first);
+}
+
+/**
+ * \brief Loads everything readable from a file descriptor.
+ * \param fd The descriptor, e.g. 0 for stdin.
+ */
+SourceBuffer::SourceBuffer(int fd){
+    mapped = nullptr;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        off_t here = lseek(fd, 0, SEEK_CUR);
+        if (here >= 0 && here < info.st_size) {
+            void *p = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                data = (const char *)p + here;
+                length = info.st_size - here;
+                return;
+            }
+        }
+    }
+    char block[64 * 1024];
+    while (true) {
+        ssize_t n = read(fd, block, sizeof(block));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw runtime_error("read failed");
+        }
+        if (n == 0) {
+            break;
+        }
+        storage.append(block, n);
+    }
+    data = storage.data();
+    length = storage.size();
+}
+
+/**
+ * \brief Loads the rest of a stream.
+ */
+SourceBuffer::SourceBuffer(istream &in){
+    mapped = nullptr;
+    stringstream st;
+    if (in.peek() != EOF) {
+        st << in.rdbuf();
+    }
+    storage = st.str();
+    data = storage.data();
+    length = storage.size();
+}
+
+SourceBuffer::~SourceBuffer(){
+    if (mapped != nullptr) {
+        munmap(mapped, (data - (const char *)mapped) + length);
+    }
+}
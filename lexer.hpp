@@ -0,0 +1,80 @@
+/**
+ * \file lexer.hpp
+ * \brief Character and token access over a contiguous source buffer for the parser.
+ *
+ * The parser used to read through istream::peek()/get(), a virtual streambuf call per
+ * character. The Lexer reads straight from memory instead: the bytes of an mmap'd file,
+ * of the whole of stdin read in one go, or of a string. Words come back as Slices that
+ * point into the buffer, so the only copies made are the names stored in the tree.
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <string>
+
+using namespace std;
+
+/**
+ * \brief A non-owning view of part of the source buffer.
+ */
+class Slice {
+public:
+    const char *data;
+    size_t length;
+
+    Slice(const char *data, size_t length) : data(data), length(length) {}
+
+    bool empty() const { return length == 0; }
+    string str() const { return string(data, length); }
+    bool operator==(const char *word) const {
+        return strlen(word) == length && memcmp(data, word, length) == 0;
+    }
+};
+
+class Lexer {
+public:
+    const char *start;
+    const char *pos;
+    const char *end;
+
+    Lexer(const char *data, size_t length) : start(data), pos(data), end(data + length) {}
+
+    /**
+     * \brief The next character without consuming it, or EOF at the end of the buffer.
+     */
+    int peek() const { return pos < end ? (unsigned char)*pos : EOF; }
+
+    /**
+     * \brief Consumes and returns the next character, or EOF at the end of the buffer.
+     */
+    int get() { return pos < end ? (unsigned char)*pos++ : EOF; }
+
+    bool eof() const { return pos >= end; }
+    size_t offset() const { return pos - start; }
+
+    void skip_whitespace();
+    Slice word();
+};
+
+/**
+ * \brief Owns the bytes of a whole program: mmap'd when the input is a regular file,
+ * read in large blocks otherwise.
+ */
+class SourceBuffer {
+public:
+    const char *data;
+    size_t length;
+
+    SourceBuffer(int fd);
+    SourceBuffer(istream &in);
+    ~SourceBuffer();
+
+private:
+    string storage;
+    void *mapped;
+
+    SourceBuffer(const SourceBuffer &);
+    SourceBuffer &operator=(const SourceBuffer &);
+};
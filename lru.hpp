@@ -0,0 +1,68 @@
+/**
+ * \file lru.hpp
+ * \brief Fixed-capacity map that evicts the least recently used entry.
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+template <class K, class V, class H = std::hash<K> > class LruCache {
+public:
+    LruCache(size_t capacity) : limit(capacity > 0 ? capacity : 1) {}
+
+    /**
+     * \brief Looks a key up, marking it as the most recently used.
+     * \param key The key.
+     * \param value Set to the stored value when the key is present.
+     * \return True if the key was present.
+     */
+    bool find(const K &key, V &value){
+        typename index_t::iterator found = index.find(key);
+        if (found == index.end()) {
+            return false;
+        }
+        entries.splice(entries.begin(), entries, found->second);
+        value = found->second->second;
+        return true;
+    }
+
+    /**
+     * \brief Stores a value, evicting the least recently used entry when full.
+     */
+    void put(const K &key, const V &value){
+        typename index_t::iterator found = index.find(key);
+        if (found != index.end()) {
+            found->second->second = value;
+            entries.splice(entries.begin(), entries, found->second);
+            return;
+        }
+        if (index.size() >= limit) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.push_front(make_pair(key, value));
+        index[key] = entries.begin();
+    }
+
+    size_t size() const { return index.size(); }
+    size_t capacity() const { return limit; }
+
+    void clear(){
+        index.clear();
+        entries.clear();
+    }
+
+private:
+    typedef list<pair<K, V> > entries_t;
+    typedef unordered_map<K, typename entries_t::iterator, H> index_t;
+
+    entries_t entries;   // most recently used first
+    index_t index;
+    size_t limit;
+};
@@ -9,39 +9,96 @@
 #include "Expr.hpp"
 #include "Val.hpp"
 #include "parse.hpp"
+#include "batch.hpp"
+#include "intern.hpp"
+#include "memo.hpp"
+#include "optimize.hpp"
+#include "profile.hpp"
+#include "resolve.hpp"
+#include "serialize.hpp"
+#include "serve.hpp"
 #include <string>
 #include <cstdlib>
 
+/**
+ * \brief Parses the program on stdin, mapping it into memory when stdin is a file.
+ */
+static PTR(Expr) parse_stdin(Arena *arena, ExprTable *table){
+    SourceBuffer source(0);
+    return parse_buffer(source.data, source.length, arena, table);
+}
+
 int main(int argc, char **argv) {
 
     try{
-        run_mode_t type = use_arguments(argc, argv);
-        
-        switch(type) {
-            case do_nothing:
-                break;
-            case do_interp: {
-                PTR(Expr) e = parse(cin);
-                PTR(Val) i = e->interp();
-                cout << i->to_string() << "\n";
-                break;
+        run_options_t options;
+        run_mode_t type = use_arguments(argc, argv, options);
+        if (type == do_nothing) {
+            return 0;
+        }
+        if (!options.load_file.empty() && (options.batch || type == do_profile || type == do_compile)) {
+            throw runtime_error("--load runs one program with --interp, --vm, --compile-closures, --print or --pretty-print");
+        }
+        if (options.lazy && ((type != do_interp && type != do_profile) || options.serve || options.memoize || options.parallel > 1)) {
+            // thunks are forced in place, so they are neither shared between threads nor keys of memoized calls
+            throw runtime_error("--lazy runs with --interp or --profile, without --serve, --memoize or --parallel");
+        }
+        if (options.memoize && type != do_interp && type != do_profile) {
+            // only the interpreter's calls go through the memo
+            throw runtime_error("--memoize runs with --interp or --profile");
+        }
+        if (options.quota.limited() && options.parallel > 1) {
+            // the quota is counted on the thread running the program, not on the workers
+            throw runtime_error("--max-steps, --time-limit and --max-memory do not combine with --parallel");
+        }
+        if (options.serve) {
+            if (options.batch || type == do_profile || type == do_compile || !options.load_file.empty()) {
+                throw runtime_error("--serve runs programs with --interp, --vm, --compile-closures, --print or --pretty-print");
             }
-            case do_print: {
-                PTR(Expr) e = parse(cin);
-                string str = e->to_string();
-                cout << str << "\n";
-                break;
+            serve(type, options);
+        }
+        else if (type == do_compile) {
+            if (options.batch) {
+                throw runtime_error("--compile takes one program");
+            }
+            Arena arena;
+            PTR(Expr) e = parse_stdin(&arena, nullptr);
+            if (options.optimize) {
+                e = optimize(e);
             }
-            case do_pretty_print: {
-                PTR(Expr) e = parse(cin);
-                string str = e->to_pretty_string();
-                cout << str << "\n";
-                break;
+            if (options.resolve) {
+                e = resolve(e);
             }
+            save_program(e, options.compile_file);
+        }
+        else if (options.batch) {
+            ios::sync_with_stdio(false);
+            run_batch(cin, cout, type, options);
+        }
+        else if (type == do_profile) {
+            SourceBuffer source(0);
+            string result = profile_program(source.data, source.length, options, cerr);
+            cout << result << "\n";
+        }
+        else {
+            // the program is parsed once and dropped at exit, so its nodes share one arena
+            Arena arena;
+            ExprTable table;
+            PTR(Expr) e = options.load_file.empty() ? parse_stdin(&arena, options.intern ? &table : nullptr)
+                                                    : load_program(options.load_file, &arena);
+            write_program(type, e, options, cout);
+        }
+        if (options.memoize) {
+            unsigned long hits, misses;
+            memo_totals(hits, misses);
+            cerr << "memoize: " << hits << " hits, " << misses << " misses\n";
         }
-        
         return 0;
     }
+    catch (quota_error exn) {
+        cerr << exn.what() << "\n";
+        return quota_exit_status;
+    }
     catch (runtime_error exn) {
         cerr << exn.what() << "\n";
         return 1;
@@ -0,0 +1,297 @@
+/**
+ * \file memo.cpp
+ * \brief Implementation of the call memo.
+ */
+
+#include "memo.hpp"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include "governor.hpp"
+
+thread_local Memo *Memo::current = nullptr;
+
+// counts of every Memo destroyed so far, for reporting at exit
+static atomic<unsigned long> total_hits(0);
+static atomic<unsigned long> total_misses(0);
+
+bool MemoKey::operator==(const MemoKey &other) const{
+    if (hash != other.hash || body != other.body || captured.size() != other.captured.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < captured.size(); i++) {
+        if (!memo->value_equals(captured[i], other.captured[i])) {
+            return false;
+        }
+    }
+    return memo->value_equals(arg, other.arg);
+}
+
+Memo::Memo(size_t capacity) : hits(0), misses(0), cache(capacity) {
+}
+
+Memo::~Memo(){
+    if (hits != 0 || misses != 0) {
+        total_hits += hits;
+        total_misses += misses;
+    }
+}
+
+/**
+ * \brief The value as a FunVal, or nullptr when it is something else.
+ */
+static PTR(FunVal) as_fun(const Value &v){
+    if (v.tag != Value::boxed_tag || v.boxed == nullptr || v.boxed->kind != val_fun) {
+        return nullptr;
+    }
+    return STATIC_CAST(FunVal)(v.boxed);
+}
+
+/**
+ * \brief Calls a function from a tail position, reusing the result of an earlier
+ * identical call. On a miss the call continues in the caller's eval() loop as
+ * Val::tail_call() does, and its key waits for the loop's result.
+ * \param callee The function value.
+ * \param arg The argument.
+ * \return The result of the call, unless it set `env` and `next`.
+ */
+Value Memo::tail_call(const Value &callee, const Value &arg, PTR(Env) &env, PTR(Expr) &next){
+    PTR(FunVal) fun = as_fun(callee);
+    if (fun == nullptr) {
+        return callee.call(arg);
+    }
+    MemoKey key;
+    key.body = fun->body;
+    key.captured = captured_values(fun);
+    key.arg = arg;
+    key.memo = this;
+    size_t h = hash_mix(9, (size_t)&*fun->body);
+    for (const Value &v : key.captured) {
+        h = hash_mix(h, value_hash(v));
+    }
+    key.hash = hash_mix(h, value_hash(arg));
+
+    Value result;
+    if (cache.find(key, result)) {
+        hits++;
+        return result;
+    }
+    misses++;
+    pending.push_back(key);
+    return fun->tail_call(arg, env, next);
+}
+
+/**
+ * \brief The loop of Expr::eval() with the calls it continues with cached.
+ */
+Value Memo::eval(Expr *e, PTR(Env) env){
+    MemoLoop loop;
+    PTR(Expr) next = nullptr;
+    governor_tick();
+    Value result = e->step(env, next);
+    while (next != nullptr) {
+        PTR(Expr) current = nullptr;
+        std::swap(current, next);
+        governor_tick();
+        result = current->step(env, next);
+    }
+    return loop.done(result);
+}
+
+size_t Memo::pending_mark() const{
+    return pending.size();
+}
+
+/**
+ * \brief Caches `result` for every call that missed since `mark`.
+ */
+void Memo::settle(size_t mark, const Value &result){
+    for (size_t i = mark; i < pending.size(); i++) {
+        cache.put(pending[i], result);
+    }
+    pending.resize(mark);
+}
+
+/**
+ * \brief Forgets the calls that missed since `mark` without caching them.
+ */
+void Memo::drop(size_t mark){
+    if (pending.size() > mark) {
+        pending.resize(mark);
+    }
+}
+
+size_t Memo::size() const{
+    return cache.size();
+}
+
+/**
+ * \brief Hash for keys: a closure hashes by its code node and captured values.
+ */
+size_t Memo::value_hash(const Value &v){
+    PTR(FunVal) fun = as_fun(v);
+    if (fun == nullptr) {
+        return v.tag == Value::boxed_tag ? (size_t)&*v.boxed : v.hash();
+    }
+    size_t h = hash_mix(9, (size_t)&*fun->body);
+    for (const Value &captured : captured_values(fun)) {
+        h = hash_mix(h, value_hash(captured));
+    }
+    return h;
+}
+
+/**
+ * \brief Equality for keys: closures are equal when they run the same code node over
+ * equal captured values; other boxed values only when they are the same object.
+ */
+bool Memo::value_equals(const Value &a, const Value &b){
+    if (a.tag != b.tag) {
+        return false;
+    }
+    if (a.tag != Value::boxed_tag) {
+        return a.num == b.num;
+    }
+    if (a.boxed == b.boxed) {
+        return true;
+    }
+    PTR(FunVal) fun_a = as_fun(a);
+    PTR(FunVal) fun_b = as_fun(b);
+    if (fun_a == nullptr || fun_b == nullptr || fun_a->body != fun_b->body) {
+        return false;
+    }
+    vector<Value> captured_a = captured_values(fun_a);
+    vector<Value> captured_b = captured_values(fun_b);
+    for (size_t i = 0; i < captured_a.size(); i++) {
+        if (!value_equals(captured_a[i], captured_b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * \brief Collects the outer variables used under e.
+ * \param bound The names bound between the function and e.
+ * \param nesting The number of _fun nodes between the function and e.
+ */
+static void collect_free(PTR(Expr) e, vector<string> &bound, int nesting, FreeVars &free){
+    if (PTR(SlotVarExpr) slot_var = CAST(SlotVarExpr)(e)) {
+        if (slot_var->depth > nesting) {
+            pair<int, int> address(slot_var->depth - nesting - 1, slot_var->slot);
+            if (find(free.slots.begin(), free.slots.end(), address) == free.slots.end()) {
+                free.slots.push_back(address);
+            }
+        }
+    }
+    else if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+        if (find(bound.begin(), bound.end(), var->val) == bound.end()
+            && find(free.names.begin(), free.names.end(), var->val) == free.names.end()) {
+            free.names.push_back(var->val);
+        }
+    }
+    else if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        vector<AddExpr *> chain = rhs_chain(&*add);
+        for (AddExpr *node : chain) {
+            collect_free(node->lhs, bound, nesting, free);
+        }
+        collect_free(chain.back()->rhs, bound, nesting, free);
+    }
+    else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        vector<MultExpr *> chain = rhs_chain(&*mult);
+        for (MultExpr *node : chain) {
+            collect_free(node->lhs, bound, nesting, free);
+        }
+        collect_free(chain.back()->rhs, bound, nesting, free);
+    }
+    else if (PTR(EqExpr) eq = CAST(EqExpr)(e)) {
+        vector<EqExpr *> chain = rhs_chain(&*eq);
+        for (EqExpr *node : chain) {
+            collect_free(node->lhs, bound, nesting, free);
+        }
+        collect_free(chain.back()->rhs, bound, nesting, free);
+    }
+    else if (PTR(NaryExpr) nary = CAST(NaryExpr)(e)) {
+        for (PTR(Expr) &operand : nary->operands) {
+            collect_free(operand, bound, nesting, free);
+        }
+    }
+    else if (PTR(IfExpr) if_expr = CAST(IfExpr)(e)) {
+        collect_free(if_expr->if_, bound, nesting, free);
+        collect_free(if_expr->then_, bound, nesting, free);
+        collect_free(if_expr->else_, bound, nesting, free);
+    }
+    else if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        collect_free(call->to_be_called, bound, nesting, free);
+        collect_free(call->actual_arg, bound, nesting, free);
+    }
+    else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        collect_free(let->rhs, bound, nesting, free);
+        bound.push_back(let->lhs);
+        collect_free(let->body, bound, nesting, free);
+        bound.pop_back();
+    }
+    else if (PTR(SlotFunExpr) slot_fun = CAST(SlotFunExpr)(e)) {
+        // a resolved body uses outer variables only through its captures
+        for (pair<int, int> &capture : slot_fun->captures) {
+            if (capture.first > nesting) {
+                pair<int, int> address(capture.first - nesting - 1, capture.second);
+                if (find(free.slots.begin(), free.slots.end(), address) == free.slots.end()) {
+                    free.slots.push_back(address);
+                }
+            }
+        }
+    }
+    else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+        bound.push_back(fun->formal_arg);
+        collect_free(fun->body, bound, nesting + 1, free);
+        bound.pop_back();
+    }
+    else if (PTR(ScopeExpr) scope = CAST(ScopeExpr)(e)) {
+        collect_free(scope->body, bound, nesting, free);
+    }
+}
+
+/**
+ * \brief The free variables of a function's body, computed once per body.
+ */
+const FreeVars &Memo::free_vars_of(PTR(FunVal) fun){
+    unordered_map<PTR(Expr), FreeVars>::iterator found = free_vars.find(fun->body);
+    if (found != free_vars.end()) {
+        return found->second;
+    }
+    FreeVars &free = free_vars[fun->body];
+    vector<string> bound;
+    bound.push_back(fun->formal_arg);
+    collect_free(fun->body, bound, 0, free);
+    return free;
+}
+
+/**
+ * \brief The values of a closure's free variables. A variable that is not bound gets
+ * the empty Value; calling the function fails on it only if the body reaches it.
+ */
+vector<Value> Memo::captured_values(PTR(FunVal) fun){
+    const FreeVars &free = free_vars_of(fun);
+    vector<Value> values;
+    values.reserve(free.names.size() + free.slots.size());
+    for (const string &name : free.names) {
+        try {
+            values.push_back(fun->env->lookup(name));
+        }
+        catch (runtime_error exn) {
+            values.push_back(Value());
+        }
+    }
+    for (const pair<int, int> &address : free.slots) {
+        values.push_back(fun->env->lookup_slot(address.first, address.second));
+    }
+    return values;
+}
+
+/**
+ * \brief Hits and misses of every Memo destroyed so far.
+ */
+void memo_totals(unsigned long &hits, unsigned long &misses){
+    hits = total_hits;
+    misses = total_misses;
+}
@@ -0,0 +1,129 @@
+/**
+ * \file memo.hpp
+ * \brief Memoizing calls of pure functions in the interpreter.
+ *
+ * MSDScript has no mutation, so a call's result depends only on the function's code,
+ * the values of the variables its body uses from the closure environment, and the
+ * argument. With a Memo installed, CallExpr looks that triple up in a bounded LRU
+ * cache before evaluating the body. Closures in keys compare by their code node and,
+ * recursively, their own captured values, so two closures of one _fun over different
+ * environments never share an entry. A call that misses still runs as a tail call:
+ * its key waits until the eval() loop that continues with the body finishes, and the
+ * value of that loop is the result of every call it continued with, so a memoized
+ * loop runs in constant native stack as it does without a memo.
+ */
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "lru.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+class Memo;
+
+/**
+ * \brief The outer variables a function body reads: by name for unresolved bodies,
+ * by (depth, slot) in the captured environment for resolved ones.
+ */
+class FreeVars {
+public:
+    vector<string> names;
+    vector<pair<int, int> > slots;
+};
+
+class MemoKey {
+public:
+    PTR(Expr) body;
+    vector<Value> captured;
+    Value arg;
+    size_t hash;
+    Memo *memo;
+
+    bool operator==(const MemoKey &other) const;
+};
+
+class MemoKeyHash {
+public:
+    size_t operator()(const MemoKey &key) const { return key.hash; }
+};
+
+class Memo {
+public:
+    static thread_local Memo *current;   // the memo CallExpr uses on this thread, or nullptr
+
+    unsigned long hits;
+    unsigned long misses;
+
+    Memo(size_t capacity = 65536);
+    ~Memo();
+
+    Value tail_call(const Value &callee, const Value &arg, PTR(Env) &env, PTR(Expr) &next);
+    Value eval(Expr *e, PTR(Env) env);
+    size_t size() const;
+
+    size_t pending_mark() const;
+    void settle(size_t mark, const Value &result);
+    void drop(size_t mark);
+
+    size_t value_hash(const Value &v);
+    bool value_equals(const Value &a, const Value &b);
+
+private:
+    LruCache<MemoKey, Value, MemoKeyHash> cache;
+    vector<MemoKey> pending;   // calls that missed, waiting for the eval() loop running them
+    unordered_map<PTR(Expr), FreeVars> free_vars;
+
+    const FreeVars &free_vars_of(PTR(FunVal) fun);
+    vector<Value> captured_values(PTR(FunVal) fun);
+
+    Memo(const Memo &);
+    Memo &operator=(const Memo &);
+};
+
+/**
+ * \brief Installs a Memo for the current thread while in scope.
+ */
+class MemoScope {
+public:
+    Memo *saved;
+    MemoScope(Memo *memo){
+        saved = Memo::current;
+        Memo::current = memo;
+    }
+    ~MemoScope(){
+        Memo::current = saved;
+    }
+};
+
+/**
+ * \brief The calls an eval() loop continues with while a Memo is installed. What the
+ * loop returns goes to done(), which caches it for each of them; if the loop throws
+ * instead, none of them is cached.
+ */
+class MemoLoop {
+public:
+    Memo *memo;
+    size_t mark;
+    MemoLoop(){
+        memo = Memo::current;
+        mark = memo != nullptr ? memo->pending_mark() : 0;
+    }
+    ~MemoLoop(){
+        if (memo != nullptr) {
+            memo->drop(mark);
+        }
+    }
+    const Value &done(const Value &result){
+        if (memo != nullptr) {
+            memo->settle(mark, result);
+        }
+        return result;
+    }
+};
+
+void memo_totals(unsigned long &hits, unsigned long &misses);
@@ -0,0 +1,51 @@
+/**
+ * \file optimize.cpp
+ * \brief Shared pieces of the optimizer; the per-node rules are in Expr.cpp.
+ */
+
+#include "optimize.hpp"
+
+OptimizeScope::OptimizeScope(OptimizeScope *parent, const string &name, PTR(Expr) constant){
+    this->parent = parent;
+    this->name = name;
+    this->constant = constant;
+}
+
+/**
+ * \brief Looks up the innermost binding of a name.
+ * \return The literal bound to the name, or nullptr if it is unknown, shadowed or free.
+ */
+PTR(Expr) OptimizeScope::find(OptimizeScope *scope, const string &name){
+    for (; scope != nullptr; scope = scope->parent) {
+        if (scope->name == name) {
+            return scope->constant;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * \brief True for literals, which can be evaluated, copied or dropped freely.
+ */
+bool is_constant(PTR(Expr) e){
+    return e->kind == expr_num || e->kind == expr_bool;
+}
+
+/**
+ * \brief The literal for a number or boolean value.
+ */
+PTR(Expr) constant_expr(const Value &v){
+    if (v.is_bool()) {
+        return NEW(BoolExpr)(v.num != 0);
+    }
+    return NEW(NumExpr)(v.num);
+}
+
+/**
+ * \brief Optimizes a whole program.
+ * \param e The parsed expression.
+ * \return An equivalent expression with the constant parts evaluated.
+ */
+PTR(Expr) optimize(PTR(Expr) e){
+    return e->optimize(nullptr);
+}
@@ -0,0 +1,43 @@
+/**
+ * \file optimize.hpp
+ * \brief Constant folding and partial evaluation over parsed expressions.
+ *
+ * The pass folds arithmetic and comparisons whose operands are literals, substitutes
+ * _let variables bound to literals, turns a call of a literal _fun into a _let, and
+ * keeps only the taken branch of an _if with a literal condition. Anything that would
+ * fail when run, such as _true + 1, is left in place so it still fails at the same
+ * point with the same message. Run it before resolve() or vm_compile().
+ *
+ * Literals are substituted into _fun bodies too, so the functions a program makes can
+ * differ in how they print and compare: _let x = 5 _in _fun (y) x + y gives
+ * _fun (y) (x+y) when run as it is and _fun (y) (5+y) under --optimize, and == between
+ * two such functions goes by the optimized bodies. Every number and boolean a program
+ * computes stays the same.
+ */
+#pragma once
+
+#include <string>
+#include "Expr.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+/**
+ * \brief One variable binding visible while optimizing, innermost first.
+ */
+class OptimizeScope {
+public:
+    OptimizeScope *parent;
+    string name;
+    PTR(Expr) constant;   // the literal the name is bound to, or nullptr if not known
+
+    OptimizeScope(OptimizeScope *parent, const string &name, PTR(Expr) constant);
+
+    static PTR(Expr) find(OptimizeScope *scope, const string &name);
+};
+
+bool is_constant(PTR(Expr) e);
+
+PTR(Expr) constant_expr(const Value &v);
+
+PTR(Expr) optimize(PTR(Expr) e);
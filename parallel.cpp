@@ -0,0 +1,389 @@
+/**
+ * \file parallel.cpp
+ * \brief Implementation of fork-join evaluation.
+ */
+
+#include "parallel.hpp"
+#include <exception>
+#include <map>
+#include <memory>
+#include <thread>
+#include "governor.hpp"
+#include "memo.hpp"
+#include "resolve.hpp"
+#include "Val.hpp"
+
+/**
+ * \param workers Threads evaluating a program, counting the one that runs it.
+ */
+ParallelEval::ParallelEval(int workers) : pool(workers - 1), forks(0), stolen(0) {}
+
+/**
+ * \brief The shared pool for `workers` threads, started on first use.
+ */
+ParallelEval *ParallelEval::with_workers(int workers){
+    static mutex lock;
+    // never freed: closures returned by a run keep pointing at their pool
+    static map<int, ParallelEval *> contexts;
+    lock_guard<mutex> guard(lock);
+    ParallelEval *&context = contexts[workers];
+    if (context == nullptr) {
+        context = new ParallelEval(workers);
+    }
+    return context;
+}
+
+//======================  ForkTask  ======================//
+
+/**
+ * \brief The operand a fork offers to the pool. Whichever thread claims it first,
+ * a worker or the fork itself, evaluates it.
+ *
+ * The queued task only holds this object. The operand, its environment and its value
+ * are dropped before the task counts as done, so a task a worker takes after the fork
+ * has finished holds nothing of the program, whose nodes may be in an arena by then.
+ */
+class ForkTask {
+public:
+    static const int fork_offered = 0;
+    static const int fork_claimed = 1;
+    static const int fork_done = 2;
+
+    atomic<int> state;
+    atomic<bool> cancelled;   // set when the fork no longer needs the value
+    PTR(Expr) operand;
+    PTR(Env) env;
+    Value value;
+    exception_ptr error;
+
+    ForkTask(PTR(Expr) operand, PTR(Env) env) : state(fork_offered), cancelled(false), operand(operand), env(env) {}
+
+    bool claim(){
+        int offered = fork_offered;
+        return state.compare_exchange_strong(offered, fork_claimed);
+    }
+
+    /**
+     * \brief Evaluates the operand on a worker, keeping the value or the error, until
+     * the fork cancels it.
+     */
+    void run(){
+        try {
+            CancelScope scope(&cancelled);
+            value = operand->eval(env);
+        }
+        catch (...) {
+            error = current_exception();
+        }
+        operand = nullptr;
+        env = nullptr;
+        state = fork_done;
+    }
+
+    /**
+     * \brief Claims the operand if no worker has taken it, and otherwise waits for the
+     * worker, helping with other tasks meanwhile. When `poll` is set the wait stops
+     * with a cancelled_error if this thread's own evaluation is cancelled.
+     * \return True if the worker is done too; the value or error is then in this task.
+     */
+    bool settle(ParallelEval *context, bool poll){
+        if (claim()) {
+            return false;
+        }
+        context->stolen++;
+        while (state != fork_done) {
+            if (poll) {
+                governor_poll_cancel();
+            }
+            if (!context->pool.run_one()) {
+                this_thread::yield();
+            }
+        }
+        return true;
+    }
+
+    /**
+     * \brief The value of the operand, evaluated by whichever thread claimed it.
+     */
+    Value join(ParallelEval *context){
+        if (!settle(context, true)) {
+            PTR(Expr) offered = operand;
+            PTR(Env) offered_env = env;
+            operand = nullptr;
+            env = nullptr;
+            state = fork_done;
+            return offered->eval(offered_env);
+        }
+        if (error != nullptr) {
+            rethrow_exception(error);
+        }
+        Value result = value;
+        value = Value();
+        return result;
+    }
+
+    /**
+     * \brief Gives up the operand once the fork has failed. A worker running it is
+     * cancelled and waited for, which takes at most a chunk of its steps however
+     * long the operand would have run, so nothing of the program outlives the fork.
+     */
+    void abandon(ParallelEval *context){
+        cancelled = true;
+        if (!settle(context, false)) {
+            operand = nullptr;
+            env = nullptr;
+            state = fork_done;
+        }
+    }
+};
+
+//======================  ForkExpr  ======================//
+
+/**
+ * \param inner An AddExpr, MultExpr, EqExpr or CallExpr.
+ */
+ForkExpr::ForkExpr(PTR(Expr) inner, ParallelEval *context){
+    this->kind = expr_fork;
+    this->inner = inner;
+    this->context = context;
+    this->hash = inner->hash;
+    this->position = inner->position;
+    switch (inner->kind) {
+        case expr_add: {
+            AddExpr *add = static_cast<AddExpr *>(&*inner);
+            first = add->lhs;
+            second = add->rhs;
+            break;
+        }
+        case expr_mult: {
+            MultExpr *mult = static_cast<MultExpr *>(&*inner);
+            first = mult->lhs;
+            second = mult->rhs;
+            break;
+        }
+        case expr_eq: {
+            // == evaluates its rhs first
+            EqExpr *eq = static_cast<EqExpr *>(&*inner);
+            first = eq->rhs;
+            second = eq->lhs;
+            break;
+        }
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(&*inner);
+            first = call->to_be_called;
+            second = call->actual_arg;
+            break;
+        }
+        default:
+            throw runtime_error("cannot fork expression");
+    }
+}
+
+/**
+ * \brief Compares like the node it wraps, whether or not `e` is a fork too.
+ */
+bool ForkExpr::equals(PTR(Expr) e){
+    if(e != nullptr && e->kind == expr_fork){
+        return inner->equals(static_cast<ForkExpr *>(&*e)->inner);
+    }
+    return inner->equals(e);
+}
+
+/**
+ * \brief Evaluates both operands, the second one in parallel if the pool has room,
+ * and combines them the way the wrapped node does.
+ */
+Value ForkExpr::step(PTR(Env) &env, PTR(Expr) &next){
+    // a collected value cannot be handed to another thread, see gc.hpp
+    if (USE_GC_POINTERS || context->pool.backlog() >= context->pool.size()) {
+        return inner->step(env, next);
+    }
+    shared_ptr<ForkTask> task = make_shared<ForkTask>(second, env);
+    context->forks++;
+    context->pool.submit([task]{
+        if (task->claim()) {
+            task->run();
+        }
+    });
+    Value first_val, second_val;
+    try {
+        first_val = first->eval(env);
+        second_val = task->join(context);
+    }
+    catch (...) {
+        // sequential evaluation stops at the first error, so the other operand,
+        // which it might never have finished, is not waited for
+        task->abandon(context);
+        throw;
+    }
+    switch (inner->kind) {
+        case expr_add:
+            return first_val.add_to(second_val);
+        case expr_mult:
+            return first_val.mult_with(second_val);
+        case expr_eq:
+            return Value::boolean(first_val.equals(second_val));
+        default:
+            // a call, continued like CallExpr::step() continues it
+            if (first_val.tag == Value::boxed_tag) {
+                if (Memo::current != nullptr) {
+                    return Memo::current->tail_call(first_val, second_val, env, next);
+                }
+                return first_val.boxed->tail_call(second_val, env, next);
+            }
+            return first_val.call(second_val);
+    }
+}
+
+PTR(Expr) ForkExpr::resolve(ResolveScope *scope){
+    return inner->resolve(scope);
+}
+
+PTR(Expr) ForkExpr::optimize(OptimizeScope *scope){
+    return inner->optimize(scope);
+}
+
+void ForkExpr::print(ostream &ostream){
+    inner->print(ostream);
+}
+
+void ForkExpr::pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos){
+    inner->pretty_print_at(ostream, prec, let_parent, strmpos);
+}
+
+//======================  Placing forks  ======================//
+
+static PTR(Expr) place_forks(PTR(Expr) e, ParallelEval *context, unsigned long threshold, unsigned long &cost);
+
+/**
+ * \brief place_forks() for the chain of T at `first`, in a loop: its operands are
+ * placed in order, and the chain is rebuilt from the right with a fork at each node
+ * whose two operands are both worth one.
+ */
+template <class T> static PTR(Expr) place_chain_forks(T *first, ParallelEval *context, unsigned long threshold, unsigned long &cost){
+    vector<T *> chain = rhs_chain(first);
+    vector<PTR(Expr)> operands;
+    vector<unsigned long> costs(chain.size(), 0);
+    operands.reserve(chain.size());
+    for (size_t i = 0; i < chain.size(); i++) {
+        operands.push_back(place_forks(chain[i]->lhs, context, threshold, costs[i]));
+    }
+    unsigned long rhs_cost = 0;
+    PTR(Expr) result = place_forks(chain.back()->rhs, context, threshold, rhs_cost);
+    for (size_t i = chain.size(); i-- > 0;) {
+        PTR(T) node = NEW(T)(operands[i], result);
+        copy_marks(chain[i], &*node);
+        result = located(node, chain[i]->position);
+        if (costs[i] >= threshold && rhs_cost >= threshold) {
+            result = NEW(ForkExpr)(result, context);
+        }
+        rhs_cost = 1 + costs[i] + rhs_cost;
+    }
+    cost = rhs_cost;
+    return result;
+}
+
+/**
+ * \brief Rebuilds a resolved tree with forks, and estimates what evaluating it costs:
+ * one per node, the more expensive branch of an _if, and `threshold` for a call,
+ * whose cost cannot be told from the tree. A _fun costs one, since making the
+ * closure does not run the body; its body gets forks of its own.
+ */
+static PTR(Expr) place_forks(PTR(Expr) e, ParallelEval *context, unsigned long threshold, unsigned long &cost){
+    PTR(Expr) copy;
+    unsigned long lhs_cost = 0, rhs_cost = 0;
+    switch (e->kind) {
+        case expr_add:
+            return place_chain_forks(static_cast<AddExpr *>(&*e), context, threshold, cost);
+        case expr_mult:
+            return place_chain_forks(static_cast<MultExpr *>(&*e), context, threshold, cost);
+        case expr_eq:
+            return place_chain_forks(static_cast<EqExpr *>(&*e), context, threshold, cost);
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(&*e);
+            PTR(Expr) callee = place_forks(call->to_be_called, context, threshold, lhs_cost);
+            PTR(Expr) arg = place_forks(call->actual_arg, context, threshold, rhs_cost);
+            copy = NEW(CallExpr)(callee, arg);
+            cost = threshold;
+            break;
+        }
+        case expr_if: {
+            IfExpr *if_expr = static_cast<IfExpr *>(&*e);
+            unsigned long condition_cost = 0;
+            PTR(Expr) condition = place_forks(if_expr->if_, context, threshold, condition_cost);
+            PTR(Expr) then_ = place_forks(if_expr->then_, context, threshold, lhs_cost);
+            PTR(Expr) else_ = place_forks(if_expr->else_, context, threshold, rhs_cost);
+            cost = 1 + condition_cost + max(lhs_cost, rhs_cost);
+            PTR(IfExpr) branch = NEW(IfExpr)(condition, then_, else_);
+            branch->typed = if_expr->typed;
+            return located(branch, e->position);
+        }
+        case expr_slot_let: {
+            SlotLetExpr *let = static_cast<SlotLetExpr *>(&*e);
+            PTR(Expr) rhs = place_forks(let->rhs, context, threshold, lhs_cost);
+            PTR(Expr) body = place_forks(let->body, context, threshold, rhs_cost);
+            cost = 1 + lhs_cost + rhs_cost;
+            return located(NEW(SlotLetExpr)(let->lhs, let->slot, rhs, body), e->position);
+        }
+        case expr_slot_fun: {
+            SlotFunExpr *fun = static_cast<SlotFunExpr *>(&*e);
+            unsigned long body_cost = 0;
+            PTR(Expr) body = place_forks(fun->body, context, threshold, body_cost);
+            cost = 1;
+            return located(NEW(SlotFunExpr)(fun->formal_arg, body, fun->frame_size, fun->captures), e->position);
+        }
+        case expr_scope: {
+            ScopeExpr *scope = static_cast<ScopeExpr *>(&*e);
+            PTR(Expr) body = place_forks(scope->body, context, threshold, cost);
+            return located(NEW(ScopeExpr)(scope->frame_size, body), e->position);
+        }
+        case expr_sum:
+        case expr_product: {
+            NaryExpr *nary = static_cast<NaryExpr *>(&*e);
+            vector<PTR(Expr)> operands;
+            cost = 1;
+            for (PTR(Expr) &operand : nary->operands) {
+                unsigned long operand_cost = 0;
+                operands.push_back(place_forks(operand, context, threshold, operand_cost));
+                cost += operand_cost;
+            }
+            if (e->kind == expr_sum) {
+                return located(NEW(SumExpr)(operands), e->position);
+            }
+            return located(NEW(ProductExpr)(operands), e->position);
+        }
+        default:
+            cost = 1;
+            return e;
+    }
+    copy = located(copy, e->position);
+    cost += lhs_cost + rhs_cost;
+    if (lhs_cost >= threshold && rhs_cost >= threshold) {
+        return NEW(ForkExpr)(copy, context);
+    }
+    return copy;
+}
+
+/**
+ * \brief A copy of a resolved program with a ForkExpr at every node worth forking.
+ */
+PTR(Expr) add_forks(PTR(Expr) e, ParallelEval *context, unsigned long threshold){
+    unsigned long cost = 0;
+    return place_forks(e, context, threshold, cost);
+}
+
+/**
+ * \brief Interprets a program with fork-join parallelism.
+ * \param workers Threads to use, counting the calling one; with one the program is
+ * interpreted as usual.
+ * \param threshold Least cost of both operands of a fork.
+ */
+PTR(Val) parallel_interp(PTR(Expr) e, int workers, unsigned long threshold){
+    if (e->kind != expr_scope) {
+        e = resolve(e);
+    }
+    if (workers <= 1) {
+        return e->interp();
+    }
+    return add_forks(e, ParallelEval::with_workers(workers), threshold)->interp();
+}
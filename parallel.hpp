@@ -0,0 +1,75 @@
+/**
+ * \file parallel.hpp
+ * \brief Fork-join evaluation of one program on a work-stealing pool (--parallel).
+ *
+ * Evaluation is pure, so the two operands of +, * and == are independent, and so are
+ * the callee and argument of a call. Before the program runs, every such node whose
+ * operands both cost at least a threshold is wrapped in a ForkExpr. A call counts
+ * as that much work by itself. When the ForkExpr runs, it offers the operand that
+ * would be evaluated second to the pool and evaluates the first one itself. If no
+ * other thread has taken the offered operand by then, it evaluates that one too, so
+ * a fork nobody steals costs little more than the node it replaces. While enough
+ * work is already queued, forks run sequentially.
+ *
+ * Values and environments are shared between threads. Their reference counts are
+ * atomic, and _let writes only the slot it owns in a frame, because the resolver
+ * never reuses a slot within a frame. Errors are the ones sequential evaluation
+ * gives: when both operands fail, the error of the one evaluated first wins. When the
+ * first operand fails, the fork cancels the offered one. The thread running it notices
+ * within a chunk of steps (see governor.hpp) and gives it up, so an operand that would
+ * never finish cannot hold back an error that sequential evaluation reports. The fork
+ * still waits for that, so nothing of the program outlives it.
+ */
+#pragma once
+
+#include <atomic>
+#include "Expr.hpp"
+#include "pool.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+/**
+ * \brief The pool forks run on. There is one per number of workers, kept until the
+ * process exits, so every parallel run with that many workers shares its threads
+ * and the functions a program returns can still be called after the run.
+ */
+class ParallelEval {
+public:
+    WorkPool pool;
+    atomic<unsigned long> forks;    // operands offered to the pool
+    atomic<unsigned long> stolen;   // offered operands another thread evaluated
+
+    static ParallelEval *with_workers(int workers);
+
+private:
+    ParallelEval(int workers);
+    ParallelEval(const ParallelEval &);
+    ParallelEval &operator=(const ParallelEval &);
+};
+
+/**
+ * \brief A +, *, == or call whose operands are evaluated in parallel. Prints, hashes
+ * and compares like the node it wraps.
+ */
+class ForkExpr : public Expr {
+public:
+    PTR(Expr) inner;
+    PTR(Expr) first;     // evaluated by the thread that runs the fork
+    PTR(Expr) second;    // offered to the pool
+    ParallelEval *context;
+
+    ForkExpr(PTR(Expr) inner, ParallelEval *context);
+    virtual bool equals(PTR(Expr) e);
+    virtual Value step(PTR(Env) &env, PTR(Expr) &next);
+    virtual PTR(Expr) resolve(ResolveScope *scope);
+    virtual PTR(Expr) optimize(OptimizeScope *scope);
+    virtual void print(ostream &ostream);
+    virtual void pretty_print_at(ostream &ostream, precedence_t prec, bool let_parent, streampos &strmpos);
+};
+
+const unsigned long default_fork_threshold = 1000;
+
+PTR(Expr) add_forks(PTR(Expr) e, ParallelEval *context, unsigned long threshold = default_fork_threshold);
+
+PTR(Val) parallel_interp(PTR(Expr) e, int workers, unsigned long threshold = default_fork_threshold);
@@ -1,23 +1,91 @@
 #include "parse.hpp"
+#include "intern.hpp"
+
+// Arena for the parse in progress on this thread, or nullptr to allocate on the heap
+static thread_local Arena *parse_arena = nullptr;
+// Table the nodes of the parse in progress are interned in, or nullptr
+static thread_local ExprTable *parse_table = nullptr;
+
+/**
+ * \brief Factory behind PARSE_NEW: builds a node in the current arena, records where
+ * it starts in the source and, when a table is set, swaps it for the shared equal node.
+ */
+template <class T> class ParseNew {
+public:
+    int position;
+
+    ParseNew(int position) : position(position) {}
+
+    template <class... Args> PTR(Expr) operator()(Args&&... args){
+        PTR(Expr) node = ANEW(parse_arena, T)(std::forward<Args>(args)...);
+        node->position = position;
+        if (parse_table != nullptr) {
+            return parse_table->intern(node);
+        }
+        return node;
+    }
+};
+
+// PARSE_NEW(T, start)(args...) builds a T whose source starts at byte offset start
+#define PARSE_NEW(T, P) ParseNew<T>(P)
+
+/**
+ * \brief Sets the arena and table used by PARSE_NEW for the lifetime of one parse() call.
+ * Interned nodes outlive the parse, so they are never put in the arena.
+ */
+class ParseScope {
+public:
+    Arena *saved_arena;
+    ExprTable *saved_table;
+    ParseScope(Arena *arena, ExprTable *table){
+        saved_arena = parse_arena;
+        saved_table = parse_table;
+        parse_arena = table != nullptr ? nullptr : arena;
+        parse_table = table;
+    }
+    ~ParseScope(){
+        parse_arena = saved_arena;
+        parse_table = saved_table;
+    }
+};
 
 /**
  * Parses an expression from a string.
  *
  * \param s The string from which the expression is parsed.
+ * \param arena Arena to allocate the nodes in, or nullptr to allocate them on the heap.
+ * \param table Table to intern the nodes in, or nullptr to build a plain tree.
  * \return Pointer to the parsed expression object.
  */
-PTR(Expr) parse_str(string s){
-    istringstream in(s);
-    return parse(in);
+PTR(Expr) parse_str(string s, Arena *arena, ExprTable *table){
+    return parse_buffer(s.data(), s.size(), arena, table);
 }
 
 /**
  * Parses an expression from an input stream and verifies that the end of the file (stream) is reached.
  *
  * \param in Reference to input stream from which the expression is read.
+ * \param arena Arena to allocate the nodes in, or nullptr to allocate them on the heap.
+ * \param table Table to intern the nodes in, or nullptr to build a plain tree.
  * \return Pointer to the parsed expression object.
  */
-PTR(Expr) parse(istream &in) {
+PTR(Expr) parse(istream &in, Arena *arena, ExprTable *table) {
+    SourceBuffer source(in);
+    return parse_buffer(source.data, source.length, arena, table);
+}
+
+/**
+ * Parses an expression from a buffer holding the whole program and verifies that the end of the buffer is reached.
+ *
+ * \param data The program text; it does not need to be NUL-terminated.
+ * \param length The number of bytes in the program.
+ * \param arena Arena to allocate the nodes in, or nullptr to allocate them on the heap.
+ * \param table Table to intern the nodes in, or nullptr to build a plain tree.
+ * \return Pointer to the parsed expression object.
+ */
+PTR(Expr) parse_buffer(const char *data, size_t length, Arena *arena, ExprTable *table) {
+    ParseScope scope(arena, table);
+    Lexer in(data, length);
     PTR(Expr) e;
     e = parse_expr(in);
     skip_whitespace(in);
@@ -28,19 +96,38 @@ PTR(Expr) parse(istream &in) {
     return e;
 }
 
-PTR(Expr) parse_expr(istream &in){
+/**
+ * \brief Builds a op (b op (c op d)) from the operands of a chain, innermost first.
+ */
+template <class T> static PTR(Expr) fold_operands(const vector<PTR(Expr)> &operands){
+    PTR(Expr) e = operands.back();
+    for (size_t i = operands.size() - 1; i-- > 0;) {
+        e = PARSE_NEW(T, operands[i]->position)(operands[i], e);
+    }
+    return e;
+}
+
+// The operators are right associative: a + b + c is a + (b + c). Their operands are
+// collected in a loop rather than by recursing for each operator, so the depth of the
+// native stack does not grow with the length of a chain.
+
+PTR(Expr) parse_expr(Lexer &in){
     PTR(Expr) e = parse_comparg(in);
     skip_whitespace(in);
-    if(in.peek() == '='){
+    if(in.peek() != '='){
+        return e;
+    }
+    vector<PTR(Expr)> operands(1, e);
+    while(in.peek() == '='){
         consume(in, '=');
         if(in.peek() != '='){
             throw runtime_error("need '==' to indicate equal check") ;
         }
         consume(in, '=');
-        PTR(Expr) rhs = parse_expr(in);
-        return NEW(EqExpr)(e, rhs);
+        operands.push_back(parse_comparg(in));
+        skip_whitespace(in);
     }
-    return e;
+    return fold_operands<EqExpr>(operands);
 }
 
 /**
@@ -49,18 +136,22 @@ PTR(Expr) parse_expr(istream &in){
  * \param in Reference to input stream from which the expression is read.
  * \return Pointer to the parsed expression object.
  */
-PTR(Expr) parse_comparg(istream &in) {
+PTR(Expr) parse_comparg(Lexer &in) {
     
     PTR(Expr) e = parse_addend(in);
 
     skip_whitespace(in);
 
-    if (in.peek() == '+') {
+    if (in.peek() != '+') {
+        return e;
+    }
+    vector<PTR(Expr)> operands(1, e);
+    while (in.peek() == '+') {
         consume(in, '+');
-        PTR(Expr) rhs = parse_comparg(in);
-        return NEW( AddExpr)(e, rhs) ;
+        operands.push_back(parse_addend(in));
+        skip_whitespace(in);
     }
-    return e;
+    return fold_operands<AddExpr>(operands);
 }
 
 /**
@@ -69,47 +160,38 @@ PTR(Expr) parse_comparg(istream &in) {
  * \param in Reference to input stream from which the addend is read.
  * \return Pointer to the parsed expression object.
  */
-PTR(Expr) parse_addend(istream &in) {
+PTR(Expr) parse_addend(Lexer &in) {
     
     PTR(Expr) e = parse_multicand(in);
 
     skip_whitespace(in);
 
-    int c = in.peek();
-    if (c == '*') {
+    if (in.peek() != '*') {
+        return e;
+    }
+    vector<PTR(Expr)> operands(1, e);
+    while (in.peek() == '*') {
         consume(in, '*');
         skip_whitespace(in) ;
-        PTR(Expr) rhs = parse_addend(in);
-        return NEW( MultExpr)(e, rhs);
+        operands.push_back(parse_multicand(in));
+        skip_whitespace(in);
     }
-    
-    return e ;
+    return fold_operands<MultExpr>(operands);
 
 }
 
-static string parse_term(istream &in){
-    string term;
-    while (true) {
-         int letter = in.peek();
-         if (isalpha(letter)) {
-             consume(in, letter);
-             char c = letter;
-             term += c;
-         }
-         else
-             break;
-     }
-    return term;
+static Slice parse_term(Lexer &in){
+    return in.word();
 }
 
-PTR(Expr) parse_multicand(istream &in){
+PTR(Expr) parse_multicand(Lexer &in){
     PTR(Expr) expr = parse_inner(in);
 
     while(in.peek() == '('){
         consume(in, '(');
         PTR(Expr) actual_arg = parse_expr(in);
         consume(in, ')');
-        expr = NEW( CallExpr)(expr, actual_arg);
+        expr = PARSE_NEW(CallExpr, expr->position)(expr, actual_arg);
     }
     return expr;
 }
@@ -120,8 +202,9 @@ PTR(Expr) parse_multicand(istream &in){
  * \param in Reference to input stream from which the expression is read.
  * \return Pointer to the parsed expression object.
  */
-PTR(Expr) parse_inner(istream &in) {
+PTR(Expr) parse_inner(Lexer &in) {
     skip_whitespace(in);
+    int start = (int)in.offset();
     int c = in.peek();
     
     if ((c == '-') || isdigit(c)){
@@ -146,22 +229,22 @@ PTR(Expr) parse_inner(istream &in) {
     else if (c=='_'){
         consume(in, '_');
     
-        string term = parse_term(in);
+        Slice term = parse_term(in);
      
         if(term == "let"){
-            return parse_let(in);
+            return parse_let(in, start);
         }
         else if(term == "true"){
-            return NEW( BoolExpr)(true);
+            return PARSE_NEW(BoolExpr, start)(true);
         }
         else if(term == "false"){
-            return NEW( BoolExpr)(false);
+            return PARSE_NEW(BoolExpr, start)(false);
         }
         else if(term == "if"){
-            return parse_if(in);
+            return parse_if(in, start);
         }
         else if(term == "fun"){
-            return parse_fun(in);
+            return parse_fun(in, start);
         }
         else{
             throw runtime_error("invalid input");
@@ -179,7 +262,8 @@ PTR(Expr) parse_inner(istream &in) {
  * \param in Reference to input stream from which the number is read.
  * \return Pointer to the created Num object representing the parsed number.
  */
-PTR(Expr) parse_num(istream &in) {
+PTR(Expr) parse_num(Lexer &in) {
+    int start = (int)in.offset();
     int n = 0;
     bool negative = false;
 
@@ -206,7 +290,7 @@ PTR(Expr) parse_num(istream &in) {
 
     if (negative)
         n = n * -1;
-    return NEW( NumExpr)(n);
+    return PARSE_NEW(NumExpr, start)(n);
 }
 
 /**
@@ -215,7 +299,7 @@ PTR(Expr) parse_num(istream &in) {
  * \param in Reference to input stream from which the character is consumed.
  * \param expect The character expected to be consumed.
  */
-void consume(istream &in, int expect) {
+static void consume(Lexer &in, int expect) {
     int c = in.get();
     if (c!=expect) {
         throw runtime_error("consume mismatch");
@@ -228,13 +312,8 @@ void consume(istream &in, int expect) {
  *
  * \param in Reference to input stream from which whitespace is skipped.
  */
-static void skip_whitespace(istream &in) {
-    while (1) {
-        int c = in.peek();
-        if (!isspace(c))
-            break;
-        consume(in, c);
-    }
+static void skip_whitespace(Lexer &in) {
+    in.skip_whitespace();
 }
 
 /**
@@ -243,18 +322,9 @@ static void skip_whitespace(istream &in) {
  * \param in Reference to input stream from which the variable name is read.
  * \return Pointer to the Var object representing the parsed variable.
  */
-PTR(Expr) parse_var(istream &in) {
-    string str;
-    while (true) {
-        int c = in.peek();
-        if (isalpha(c)) {
-            consume(in, c);
-            str += static_cast<char>(c);
-        } else {
-            break;
-        }
-    }
-    return NEW( VarExpr)(str);
+PTR(Expr) parse_var(Lexer &in) {
+    int start = (int)in.offset();
+    return PARSE_NEW(VarExpr, start)(in.word().str());
 }
 
 /**
@@ -268,9 +338,9 @@ PTR(Expr) parse_var(istream &in) {
  * \param str The string to be consumed from the input stream.
  * \throws runtime_error If a character mismatch occurs during consumption.
  */
-void consume_word(istream &in, string str){
-    for(char c : str){
-        if (in.get()!=c){
+static void consume_word(Lexer &in, const char *str){
+    for(const char *c = str; *c != '\0'; c++){
+        if (in.get()!=*c){
             throw runtime_error("consume mismatch");
         }
     }
@@ -283,15 +353,14 @@ void consume_word(istream &in, string str){
  * a Let object with the parsed components.
  *
  * \param in The input stream to parse from.
+ * \param start The source offset of the _let keyword.
  * \return A pointer to the Let expression object.
  */
-PTR(Expr) parse_let(istream &in){
+PTR(Expr) parse_let(Lexer &in, int start){
     
     skip_whitespace(in);
     
-    PTR(Expr) e = parse_var(in);
-    
-    string lhs = e->to_string();
+    string lhs = in.word().str();
     
     skip_whitespace(in);
     
@@ -309,10 +378,10 @@ PTR(Expr) parse_let(istream &in){
     
     PTR(Expr) body = parse_comparg(in);
     
-    return NEW( LetExpr)(lhs, rhs, body);
+    return PARSE_NEW(LetExpr, start)(lhs, rhs, body);
 }
 
-PTR(Expr) parse_if(istream &in){
+PTR(Expr) parse_if(Lexer &in, int start){
     skip_whitespace(in);
     
     PTR(Expr) ifStatement = parse_expr(in);
@@ -333,25 +402,23 @@ PTR(Expr) parse_if(istream &in){
     
     PTR(Expr) elseStatment = parse_expr(in);
     
-    return NEW( IfExpr)(ifStatement, thenStatement, elseStatment);
+    return PARSE_NEW(IfExpr, start)(ifStatement, thenStatement, elseStatment);
 }
 
-PTR(Expr) parse_fun(istream &in){
+PTR(Expr) parse_fun(Lexer &in, int start){
     skip_whitespace(in);
     
     consume(in, '(');
     
-    PTR(Expr) e = parse_var(in);
-    
-    string var = e->to_string();
+    string var = in.word().str();
     
     consume(in, ')');
     
     skip_whitespace(in);
     
-    e = parse_expr(in);
+    PTR(Expr) e = parse_expr(in);
     
-    return NEW( FunExpr)(var, e);
+    return PARSE_NEW(FunExpr, start)(var, e);
 }
 
 
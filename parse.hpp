@@ -4,37 +4,43 @@
 #include "Expr.hpp"
 #include <iostream>
 #include "pointer.h"
+#include "arena.hpp"
+#include "lexer.hpp"
 
-PTR(Expr) parse_str(string s);
+class ExprTable;
 
-PTR(Expr) parse(istream &in);
+PTR(Expr) parse_str(string s, Arena *arena = nullptr, ExprTable *table = nullptr);
 
-PTR(Expr) parse_expr(istream &in);
+PTR(Expr) parse(istream &in, Arena *arena = nullptr, ExprTable *table = nullptr);
 
-PTR(Expr) parse_comparg(istream &in);
+PTR(Expr) parse_buffer(const char *data, size_t length, Arena *arena = nullptr, ExprTable *table = nullptr);
 
-PTR(Expr) parse_addend(istream &in);
+PTR(Expr) parse_expr(Lexer &in);
 
-static string parse_term(istream &in);
+PTR(Expr) parse_comparg(Lexer &in);
 
-PTR(Expr) parse_multicand(istream &in);
+PTR(Expr) parse_addend(Lexer &in);
 
-PTR(Expr) parse_inner(istream &in);
+static Slice parse_term(Lexer &in);
 
-PTR(Expr) parse_num(istream &in);
+PTR(Expr) parse_multicand(Lexer &in);
 
-static void consume(istream &in, int expect);
+PTR(Expr) parse_inner(Lexer &in);
 
-static void skip_whitespace(istream &in);
+PTR(Expr) parse_num(Lexer &in);
 
-PTR(Expr) parse_var(istream &in);
+static void consume(Lexer &in, int expect);
 
-static void consume_word(istream &in, string &str);
+static void skip_whitespace(Lexer &in);
 
-PTR(Expr) parse_let(istream &in);
+PTR(Expr) parse_var(Lexer &in);
 
-PTR(Expr) parse_if(istream &in);
+static void consume_word(Lexer &in, const char *str);
 
-PTR(Expr) parse_fun(istream &in);
+PTR(Expr) parse_let(Lexer &in, int start = -1);
+
+PTR(Expr) parse_if(Lexer &in, int start = -1);
+
+PTR(Expr) parse_fun(Lexer &in, int start = -1);
 
 
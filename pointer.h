@@ -10,20 +10,43 @@
 
 #include <memory>
 
+// can be set from the command line, e.g. make CFLAGS="... -DUSE_PLAIN_POINTERS=1"
+#ifndef USE_PLAIN_POINTERS
 #define USE_PLAIN_POINTERS 0
+#endif
+// or -DUSE_GC_POINTERS=1 for the tracing collector of gc.hpp
+#ifndef USE_GC_POINTERS
+#define USE_GC_POINTERS 0
+#endif
+// reference-counted std::shared_ptr, the default
+#define USE_SHARED_POINTERS (!USE_PLAIN_POINTERS && !USE_GC_POINTERS)
+
 #if USE_PLAIN_POINTERS
 
 # define NEW(T)    new T
 # define PTR(T)    T*
 # define CAST(T)   dynamic_cast<T*>
+# define STATIC_CAST(T) static_cast<T*>
 # define CLASS(T)  class T
 # define THIS      this
 
+#elif USE_GC_POINTERS
+
+#include "gc.hpp"
+
+# define NEW(T)    gc_new<T>
+# define PTR(T)    gc_ptr<T>
+# define CAST(T)   gc_dynamic_cast<T>
+# define STATIC_CAST(T) gc_static_cast<T>
+# define CLASS(T)  class T
+# define THIS      gc_this(this)
+
 #else
 
 # define NEW(T)    std::make_shared<T>
 # define PTR(T)    std::shared_ptr<T>
 # define CAST(T)   std::dynamic_pointer_cast<T>
+# define STATIC_CAST(T) std::static_pointer_cast<T>
 # define CLASS(T)  class T : public std::enable_shared_from_this<T>
 # define THIS      shared_from_this()
 
@@ -0,0 +1,145 @@
+/**
+ * \file pool.cpp
+ * \brief Implementation of the work-stealing thread pool.
+ */
+
+#include "pool.hpp"
+
+// the pool the current thread works for, and its index there
+static thread_local WorkPool *current_pool = nullptr;
+static thread_local int current_index = -1;
+
+/**
+ * \brief Starts the workers.
+ * \param workers The number of threads, at least one.
+ */
+WorkPool::WorkPool(int workers) : pending(0), next_queue(0), stopping(false) {
+    if (workers < 1) {
+        workers = 1;
+    }
+    for (int i = 0; i < workers; i++) {
+        queues.push_back(new Queue());
+    }
+    for (int i = 0; i < workers; i++) {
+        threads.push_back(thread(&WorkPool::work, this, i));
+    }
+}
+
+/**
+ * \brief Runs every task already submitted, then joins the workers.
+ */
+WorkPool::~WorkPool(){
+    {
+        lock_guard<mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread &t : threads) {
+        t.join();
+    }
+    for (Queue *q : queues) {
+        delete q;
+    }
+}
+
+/**
+ * \brief Queues a task. From a worker of this pool it goes on that worker's own deque.
+ */
+void WorkPool::submit(const function<void()> &task){
+    int index = self();
+    if (index < 0) {
+        index = next_queue++ % queues.size();
+    }
+    {
+        lock_guard<mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(task);
+    }
+    pending++;
+    {
+        // pairs with the predicate check in work(), so the wakeup cannot be lost
+        lock_guard<mutex> guard(sleep_lock);
+    }
+    wake.notify_one();
+}
+
+/**
+ * \brief Runs one queued task on the calling thread, if there is one.
+ *
+ * Lets a thread that waits for other tasks help with them instead of blocking.
+ * \return true if a task was run.
+ */
+bool WorkPool::run_one(){
+    function<void()> task;
+    if (!take(self(), task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+int WorkPool::size() const {
+    return (int)threads.size();
+}
+
+/**
+ * \brief The number of submitted tasks no thread has taken yet.
+ */
+int WorkPool::backlog() const {
+    return pending;
+}
+
+/**
+ * \brief The index of the calling thread in this pool, or -1 for other threads.
+ */
+int WorkPool::self() const {
+    return current_pool == this ? current_index : -1;
+}
+
+/**
+ * \brief Takes the newest task of worker self, or else steals the oldest task of another.
+ */
+bool WorkPool::take(int self, function<void()> &task){
+    int count = (int)queues.size();
+    if (self >= 0) {
+        Queue *own = queues[self];
+        lock_guard<mutex> guard(own->lock);
+        if (!own->tasks.empty()) {
+            task = std::move(own->tasks.back());
+            own->tasks.pop_back();
+            pending--;
+            return true;
+        }
+    }
+    int first = self >= 0 ? self + 1 : 0;
+    for (int i = 0; i < count; i++) {
+        Queue *victim = queues[(first + i) % count];
+        lock_guard<mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            task = std::move(victim->tasks.front());
+            victim->tasks.pop_front();
+            pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief The loop of one worker thread.
+ */
+void WorkPool::work(int self){
+    current_pool = this;
+    current_index = self;
+    while (true) {
+        function<void()> task;
+        if (take(self, task)) {
+            task();
+            continue;
+        }
+        unique_lock<mutex> guard(sleep_lock);
+        wake.wait(guard, [this]{ return stopping || pending > 0; });
+        if (stopping && pending <= 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * \file pool.hpp
+ * \brief Work-stealing thread pool.
+ *
+ * Every worker owns a deque of tasks. A worker takes its own newest task first and,
+ * when its deque runs dry, steals the oldest task of another worker, so tasks spawned
+ * by a task stay on the thread that spawned them while idle threads take the larger,
+ * older pieces of work. Tasks submitted from outside the pool are dealt round-robin.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class WorkPool {
+public:
+    WorkPool(int workers);
+    ~WorkPool();
+
+    void submit(const function<void()> &task);
+    bool run_one();
+    int size() const;
+    int backlog() const;
+
+private:
+    class Queue {
+    public:
+        mutex lock;
+        deque<function<void()> > tasks;
+    };
+
+    vector<Queue *> queues;
+    vector<thread> threads;
+    mutex sleep_lock;
+    condition_variable wake;
+    atomic<int> pending;          // submitted tasks not yet taken
+    atomic<unsigned> next_queue;  // round-robin position for outside submissions
+    bool stopping;
+
+    int self() const;
+    bool take(int self, function<void()> &task);
+    void work(int self);
+
+    WorkPool(const WorkPool &);
+    WorkPool &operator=(const WorkPool &);
+};
@@ -0,0 +1,52 @@
+/**
+ * \file printer.cpp
+ * \brief Implementation of the counting print buffer.
+ */
+
+#include "printer.hpp"
+
+/**
+ * \param sink Where the output goes; positions count from 0 whatever it holds already.
+ */
+PrintBuf::PrintBuf(streambuf *sink) : sink(sink), flushed(0) {
+    setp(buffer, buffer + sizeof(buffer));
+}
+
+PrintBuf::~PrintBuf(){
+    sync();
+}
+
+int PrintBuf::overflow(int c){
+    if (sync() < 0) {
+        return traits_type::eof();
+    }
+    if (c != traits_type::eof()) {
+        *pptr() = (char)c;
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+/**
+ * \brief Hands the buffered bytes to the sink, without flushing the sink itself.
+ */
+int PrintBuf::sync(){
+    streamsize pending = pptr() - pbase();
+    if (pending > 0 && sink->sputn(pbase(), pending) != pending) {
+        setp(buffer, buffer + sizeof(buffer));
+        return -1;
+    }
+    flushed += pending;
+    setp(buffer, buffer + sizeof(buffer));
+    return 0;
+}
+
+/**
+ * \brief Supports only tellp(): the number of bytes written so far.
+ */
+PrintBuf::pos_type PrintBuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which){
+    if (off != 0 || dir != ios_base::cur || !(which & ios_base::out)) {
+        return pos_type(off_type(-1));
+    }
+    return pos_type(flushed + (pptr() - pbase()));
+}
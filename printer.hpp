@@ -0,0 +1,37 @@
+/**
+ * \file printer.hpp
+ * \brief Output sink for printing large expressions without building their text.
+ *
+ * print() and pretty_print() write every node straight into one stream. The pretty
+ * printer lines up `_in` under its `_let` by remembering stream positions, which
+ * only string streams and seekable files report; a PrintBuf in front of any other
+ * sink, such as a pipe, counts the bytes itself so positions are always available.
+ */
+#pragma once
+
+#include <streambuf>
+
+using namespace std;
+
+/**
+ * \brief Buffered stream buffer that forwards to another one and reports how many
+ * bytes have gone through it as its output position.
+ */
+class PrintBuf : public streambuf {
+public:
+    PrintBuf(streambuf *sink);
+    ~PrintBuf();
+
+protected:
+    int overflow(int c);
+    int sync();
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which);
+
+private:
+    streambuf *sink;
+    streamoff flushed;     // bytes already handed to the sink
+    char buffer[16 * 1024];
+
+    PrintBuf(const PrintBuf &);
+    PrintBuf &operator=(const PrintBuf &);
+};
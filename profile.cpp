@@ -0,0 +1,379 @@
+/**
+ * \file profile.cpp
+ * \brief Implementation of the interpreter profiler.
+ */
+
+#include "profile.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include "alloc.hpp"
+#include "arena.hpp"
+#include "env.hpp"
+#include "governor.hpp"
+#include "intern.hpp"
+#include "lazy.hpp"
+#include "memo.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "typecheck.hpp"
+
+thread_local Profiler *Profiler::current = nullptr;
+
+NodeProfile::NodeProfile(string kind, string label) : kind(kind), label(label) {
+    calls = 0;
+    inclusive_ns = 0;
+    exclusive_ns = 0;
+    allocations = 0;
+    active = 0;
+}
+
+/**
+ * \brief The type name the profile reports for a node; resolved nodes report the
+ * type they were resolved from.
+ */
+static string kind_of(Expr *e){
+    switch (e->kind) {
+    case expr_add: return "AddExpr";
+    case expr_mult: return "MultExpr";
+    case expr_num: return "NumExpr";
+    case expr_var: case expr_slot_var: return "VarExpr";
+    case expr_let: case expr_slot_let: return "LetExpr";
+    case expr_bool: return "BoolExpr";
+    case expr_if: return "IfExpr";
+    case expr_eq: return "EqExpr";
+    case expr_fun: case expr_slot_fun: return "FunExpr";
+    case expr_call: return "CallExpr";
+    case expr_scope: return "ScopeExpr";
+    case expr_sum: return "SumExpr";
+    case expr_product: return "ProductExpr";
+    case expr_cached: return "CachedExpr";
+    case expr_fork: return "ForkExpr";
+    case expr_force: return "ForceExpr";
+    case expr_delay: case expr_slot_delay: return "DelayExpr";
+    case expr_lazy_call: return "CallExpr";
+    }
+    return "Expr";
+}
+
+/**
+ * \param source The program text, used to turn node positions into line:column.
+ */
+Profiler::Profiler(const char *source, size_t length){
+    line_starts.push_back(0);
+    for (size_t i = 0; i < length; i++) {
+        if (source[i] == '\n') {
+            line_starts.push_back(i + 1);
+        }
+    }
+    StackEntry root;
+    root.parent = -1;
+    root.label = -1;
+    root.self_ns = 0;
+    stacks.push_back(root);
+    pending_call = -1;
+}
+
+/**
+ * \return "line:column" (both from 1) for a source offset, or "?" for generated nodes.
+ */
+string Profiler::location(int position){
+    if (position < 0) {
+        return "?";
+    }
+    size_t line = upper_bound(line_starts.begin(), line_starts.end(), (size_t)position) - line_starts.begin();
+    size_t column = position - line_starts[line - 1] + 1;
+    return to_string(line) + ":" + to_string(column);
+}
+
+int Profiler::profile_of(Expr *e){
+    unordered_map<Expr *, int>::iterator found = node_index.find(e);
+    if (found != node_index.end()) {
+        return found->second;
+    }
+    string kind = kind_of(e);
+    nodes.push_back(NodeProfile(kind, kind + "@" + location(e->position)));
+    labels.push_back(nodes.back().label);
+    node_labels.push_back((int)labels.size() - 1);
+    int index = (int)nodes.size() - 1;
+    node_index[e] = index;
+    return index;
+}
+
+/**
+ * \brief The call tree entry for `label` directly under `parent`, created on first use.
+ */
+int Profiler::child_stack(int parent, int label){
+    uint64_t key = ((uint64_t)(uint32_t)parent << 32) | (uint32_t)label;
+    unordered_map<uint64_t, int>::iterator found = stack_children.find(key);
+    if (found != stack_children.end()) {
+        return found->second;
+    }
+    StackEntry entry;
+    entry.parent = parent;
+    entry.label = label;
+    entry.self_ns = 0;
+    stacks.push_back(entry);
+    stack_children[key] = (int)stacks.size() - 1;
+    return (int)stacks.size() - 1;
+}
+
+/**
+ * \brief Where the next frame hangs: under the closure just called, if any, otherwise
+ * where the frame it continues from did.
+ */
+int Profiler::enter_context(int parent, int context){
+    if (pending_call >= 0) {
+        context = child_stack(parent, pending_call);
+        pending_call = -1;
+    }
+    return context;
+}
+
+void Profiler::enter(Expr *e, PTR(Env) env, int context){
+    Frame frame;
+    frame.node = profile_of(e);
+    frame.stack = child_stack(context, node_labels[frame.node]);
+    frame.child_ns = 0;
+    frame.child_allocations = 0;
+    nodes[frame.node].calls++;
+    nodes[frame.node].active++;
+    count_lookup(e, env);
+    frames.push_back(frame);
+    frames.back().start_allocations = thread_allocations();
+    frames.back().start = clock::now();
+}
+
+void Profiler::leave(){
+    clock::time_point now = clock::now();
+    unsigned long allocations = thread_allocations() - frames.back().start_allocations;
+    Frame frame = frames.back();
+    frames.pop_back();
+    uint64_t elapsed = chrono::duration_cast<chrono::nanoseconds>(now - frame.start).count();
+    NodeProfile &node = nodes[frame.node];
+    node.exclusive_ns += elapsed - frame.child_ns;
+    node.allocations += allocations - frame.child_allocations;
+    if (--node.active == 0) {
+        node.inclusive_ns += elapsed;
+    }
+    stacks[frame.stack].self_ns += elapsed - frame.child_ns;
+    if (!frames.empty()) {
+        frames.back().child_ns += elapsed;
+        frames.back().child_allocations += allocations;
+    }
+}
+
+/**
+ * \brief Drops the frames above `depth` when an evaluation error propagates.
+ */
+void Profiler::unwind(size_t depth){
+    while (frames.size() > depth) {
+        leave();
+    }
+    pending_call = -1;
+}
+
+/**
+ * \brief Records how far the lookup of a variable node will walk up `env`.
+ */
+void Profiler::count_lookup(Expr *e, PTR(Env) env){
+    size_t depth = 0;
+    if (e->kind == expr_slot_var) {
+        SlotVarExpr *slot = static_cast<SlotVarExpr *>(e);
+        depth = slot->depth;
+        if (slot_depths.size() <= depth) {
+            slot_depths.resize(depth + 1, 0);
+        }
+        slot_depths[depth]++;
+        return;
+    }
+    if (e->kind != expr_var) {
+        return;
+    }
+    VarExpr *var = static_cast<VarExpr *>(e);
+    while (env != nullptr) {
+        PTR(ExtendedEnv) binding = CAST(ExtendedEnv)(env);
+        PTR(FrameEnv) frame = CAST(FrameEnv)(env);
+        if (binding != nullptr) {
+            if (binding->name == var->val) {
+                break;
+            }
+            env = binding->rest;
+        }
+        else if (frame != nullptr) {
+            env = frame->rest;
+        }
+        else {
+            break;
+        }
+        depth++;
+    }
+    if (name_depths.size() <= depth) {
+        name_depths.resize(depth + 1, 0);
+    }
+    name_depths[depth]++;
+}
+
+/**
+ * \brief The instrumented counterpart of Expr::eval().
+ */
+Value Profiler::eval(Expr *e, PTR(Env) env){
+    size_t depth = frames.size();
+    int parent = frames.empty() ? 0 : frames.back().stack;
+    int context = parent;
+    PTR(Expr) next = nullptr;
+    MemoLoop memo_loop;
+    try {
+        context = enter_context(parent, context);
+        enter(e, env, context);
+        governor_tick();
+        Value result = e->step(env, next);
+        leave();
+        while (next != nullptr) {
+            PTR(Expr) current = nullptr;
+            std::swap(current, next);
+            context = enter_context(parent, context);
+            enter(&*current, env, context);
+            governor_tick();
+            result = current->step(env, next);
+            leave();
+        }
+        return memo_loop.done(result);
+    }
+    catch (...) {
+        unwind(depth);
+        throw;
+    }
+}
+
+/**
+ * \brief Counts a call of a closure; called by FunVal::tail_call() just before the
+ * body is entered, so the body's frames hang under the closure in the call tree.
+ */
+void Profiler::count_call(FunVal *callee){
+    Expr *body = &*callee->body;
+    unordered_map<Expr *, Closure>::iterator found = closures.find(body);
+    if (found == closures.end()) {
+        Closure closure;
+        labels.push_back("_fun (" + callee->formal_arg + ")@" + location(body->position));
+        closure.label = (int)labels.size() - 1;
+        closure.calls = 0;
+        found = closures.insert(make_pair(body, closure)).first;
+    }
+    found->second.calls++;
+    pending_call = found->second.label;
+}
+
+unsigned long Profiler::total_allocations(){
+    unsigned long total = 0;
+    for (NodeProfile &node : nodes) {
+        total += node.allocations;
+    }
+    return total;
+}
+
+/**
+ * \brief Writes the call tree as collapsed stacks, weighted by exclusive nanoseconds.
+ */
+void Profiler::print_collapsed(ostream &out){
+    for (size_t i = 1; i < stacks.size(); i++) {
+        if (stacks[i].self_ns == 0) {
+            continue;
+        }
+        vector<int> path;
+        for (int s = (int)i; s > 0; s = stacks[s].parent) {
+            path.push_back(stacks[s].label);
+        }
+        for (size_t j = path.size(); j-- > 0;) {
+            out << labels[path[j]] << (j > 0 ? ";" : " ");
+        }
+        out << stacks[i].self_ns << "\n";
+    }
+}
+
+static bool by_exclusive_time(const NodeProfile *a, const NodeProfile *b){
+    return a->exclusive_ns > b->exclusive_ns;
+}
+
+/**
+ * \brief Writes human-readable tables: nodes and node types by exclusive time,
+ * closures by calls, and the lookup depth histograms.
+ */
+void Profiler::print_summary(ostream &out){
+    vector<const NodeProfile *> sorted;
+    map<string, NodeProfile> kinds;
+    for (NodeProfile &node : nodes) {
+        sorted.push_back(&node);
+        map<string, NodeProfile>::iterator kind = kinds.insert(make_pair(node.kind, NodeProfile(node.kind, node.kind))).first;
+        kind->second.calls += node.calls;
+        kind->second.exclusive_ns += node.exclusive_ns;
+        kind->second.allocations += node.allocations;
+    }
+    sort(sorted.begin(), sorted.end(), by_exclusive_time);
+
+    out << "nodes:\n";
+    out << setw(12) << "calls" << setw(14) << "incl us" << setw(14) << "excl us" << setw(12) << "allocs" << "  node\n";
+    for (const NodeProfile *node : sorted) {
+        out << setw(12) << node->calls << setw(14) << node->inclusive_ns / 1000 << setw(14) << node->exclusive_ns / 1000
+            << setw(12) << node->allocations << "  " << node->label << "\n";
+    }
+
+    out << "node types:\n";
+    out << setw(12) << "calls" << setw(14) << "excl us" << setw(12) << "allocs" << "  type\n";
+    for (map<string, NodeProfile>::iterator kind = kinds.begin(); kind != kinds.end(); kind++) {
+        out << setw(12) << kind->second.calls << setw(14) << kind->second.exclusive_ns / 1000
+            << setw(12) << kind->second.allocations << "  " << kind->first << "\n";
+    }
+
+    out << "closures:\n";
+    out << setw(12) << "calls" << "  closure\n";
+    for (unordered_map<Expr *, Closure>::iterator closure = closures.begin(); closure != closures.end(); closure++) {
+        out << setw(12) << closure->second.calls << "  " << labels[closure->second.label] << "\n";
+    }
+
+    out << "lookup depth by name:\n";
+    for (size_t depth = 0; depth < name_depths.size(); depth++) {
+        out << setw(12) << depth << setw(12) << name_depths[depth] << "\n";
+    }
+    out << "lookup depth by slot:\n";
+    for (size_t depth = 0; depth < slot_depths.size(); depth++) {
+        out << setw(12) << depth << setw(12) << slot_depths[depth] << "\n";
+    }
+    out << "allocations: " << total_allocations() << "\n";
+}
+
+/**
+ * \brief Parses, resolves and interprets one program under the profiler.
+ * \param report Receives the collapsed stacks, or the summary with --profile-summary.
+ * \return The program's value as --interp prints it.
+ */
+string profile_program(const char *source, size_t length, const run_options_t &options, ostream &report){
+    Arena arena;
+    ExprTable table;
+    PTR(Expr) e = parse_buffer(source, length, &arena, options.intern ? &table : nullptr);
+    if (options.optimize) {
+        e = optimize(e);
+    }
+    if (options.typecheck) {
+        e = typecheck(e);
+    }
+    e = resolve(options.lazy ? make_lazy(e) : e);
+    Profiler profiler(source, length);
+    string result;
+    {
+        Memo memo;
+        MemoScope memo_scope(options.memoize ? &memo : nullptr);
+        Governor governor(options.quota);
+        GovernorScope governed(options.quota.limited() ? &governor : nullptr);
+        ProfileScope scope(&profiler);
+        result = e->interp()->to_string();
+    }
+    if (options.profile_summary) {
+        profiler.print_summary(report);
+    }
+    else {
+        profiler.print_collapsed(report);
+    }
+    return result;
+}
@@ -0,0 +1,127 @@
+/**
+ * \file profile.hpp
+ * \brief Sampling-free profiler for the tree-walking interpreter (--profile).
+ *
+ * With a Profiler installed, Expr::eval() runs an instrumented copy of its trampoline
+ * loop that times every step() and counts the heap allocations made inside it. Time
+ * and allocations are kept per node, where a node is labelled by its type and the
+ * line:column it was parsed from, and are split into inclusive (with the nodes it
+ * evaluated) and exclusive (itself only). On top of that the profiler counts calls
+ * per closure body, records how far each variable lookup walks up the environment
+ * chain, and builds the call tree that is written out in the collapsed-stack format
+ * read by flamegraph.pl: one "outer;inner;innermost nanoseconds" line per stack.
+ *
+ * Tail continuations replace the frame they continue from, so a loop written as tail
+ * calls shows up flat instead of growing the stack, as it does when it runs.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cmdline.hpp"
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+/**
+ * \brief What the profiler measured for one node of the program.
+ */
+class NodeProfile {
+public:
+    string kind;             // the node type, e.g. "CallExpr"
+    string label;            // kind@line:column
+    unsigned long calls;
+    uint64_t inclusive_ns;   // recursive activations are counted once, at the outermost
+    uint64_t exclusive_ns;
+    unsigned long allocations;  // exclusive
+    int active;              // activations currently on the stack
+
+    NodeProfile(string kind, string label);
+};
+
+class Profiler {
+public:
+    static thread_local Profiler *current;
+
+    unordered_map<Expr *, int> node_index;
+    vector<NodeProfile> nodes;
+    vector<unsigned long> name_depths;   // by-name lookups: bindings skipped
+    vector<unsigned long> slot_depths;   // frame slot lookups: frames walked up
+
+    Profiler(const char *source, size_t length);
+
+    Value eval(Expr *e, PTR(Env) env);
+    void count_call(FunVal *callee);
+
+    string location(int position);
+    unsigned long total_allocations();
+    void print_collapsed(ostream &out);
+    void print_summary(ostream &out);
+
+private:
+    typedef chrono::steady_clock clock;
+
+    class Frame {
+    public:
+        int node;           // index into nodes
+        int stack;          // call tree entry of this frame
+        clock::time_point start;
+        uint64_t child_ns;
+        unsigned long start_allocations;
+        unsigned long child_allocations;
+    };
+
+    class StackEntry {
+    public:
+        int parent;
+        int label;          // index into labels
+        uint64_t self_ns;
+    };
+
+    class Closure {
+    public:
+        int label;
+        unsigned long calls;
+    };
+
+    vector<size_t> line_starts;
+    vector<Frame> frames;
+    vector<StackEntry> stacks;
+    unordered_map<uint64_t, int> stack_children;
+    vector<string> labels;
+    vector<int> node_labels;  // label of each entry of nodes
+    unordered_map<Expr *, Closure> closures;
+    int pending_call;       // label of the closure whose body is entered next, or -1
+
+    int profile_of(Expr *e);
+    int child_stack(int parent, int label);
+    int enter_context(int parent, int context);
+    void enter(Expr *e, PTR(Env) env, int context);
+    void leave();
+    void unwind(size_t depth);
+    void count_lookup(Expr *e, PTR(Env) env);
+};
+
+/**
+ * \brief Installs a profiler on the calling thread for the lifetime of the scope.
+ */
+class ProfileScope {
+public:
+    Profiler *saved;
+    ProfileScope(Profiler *profiler){
+        saved = Profiler::current;
+        Profiler::current = profiler;
+    }
+    ~ProfileScope(){
+        Profiler::current = saved;
+    }
+};
+
+string profile_program(const char *source, size_t length, const run_options_t &options, ostream &report);
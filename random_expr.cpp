@@ -0,0 +1,55 @@
+//
+//  random_expr.cpp
+//  MSDScript
+//
+//  Random program generator shared by test_msdscript and the benchmarks.
+//
+
+#include <stdlib.h>
+#include "random_expr.hpp"
+
+/**
+ * Generates a random expression as a string.
+ *
+ * \param depth The current depth of the expression tree. Used to limit recursion and ensure termination.
+ * \return A string representing a randomly generated expression.
+ */
+string random_expr_string(int depth) {
+
+    // Limit recursion depth to prevent stack overflow
+    if (depth > 10) {
+      if (rand() % 2) {
+        // Return a random character from a to z
+        return string(1, static_cast<char>('a' + (rand() % 26)));
+      }
+      else {
+        // Return a random number as a string
+        return to_string(rand() % 100);
+      }
+    }
+    
+    int choice = rand() % 5;
+    switch(choice) {
+      case 0:
+        // Random number case
+        return to_string(rand() % 100);
+      case 1:
+        // Addition case
+        return random_expr_string(depth + 1) + " + " + random_expr_string(depth + 1);
+      case 2:
+        // Multiplication case
+        return random_expr_string(depth + 1) + " * " + random_expr_string(depth + 1);
+      case 3:
+        // Random character case
+        return string(1, static_cast<char>('a' + (rand() % 26)));
+      case 4: {
+        // Let expression case
+        string var = string(1, static_cast<char>('a' + (rand() % 26)));
+        string val = random_expr_string(depth + 1);
+        string body = random_expr_string(depth + 1);
+        return "_let " + var + "=" + val + " _in " + body;
+      }
+      default:
+        return to_string(rand() % 100);
+    }
+}
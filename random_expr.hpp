@@ -0,0 +1,14 @@
+//
+//  random_expr.hpp
+//  MSDScript
+//
+//  Random program generator shared by test_msdscript and the benchmarks.
+//
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+string random_expr_string(int depth=0);
@@ -0,0 +1,75 @@
+/**
+ * \file resolve.cpp
+ * \brief Implementation of the lexical addressing pass.
+ *
+ * Every function body (and the top level) gets one frame. Slot 0 of a function frame
+ * is the argument and each _let in the body gets its own slot, so slots are never
+ * reused within a frame. A variable bound outside the function is captured: it gets
+ * an index in the function's captures, and a function nested deeper captures it
+ * from the function around it, which captures it in turn.
+ */
+
+#include "resolve.hpp"
+
+ResolveScope::ResolveScope(ResolveScope *parent){
+    this->parent = parent;
+    this->frame_size = 0;
+}
+
+/**
+ * \brief Reserves a fresh slot in this frame.
+ * \return The index of the new slot.
+ */
+int ResolveScope::new_slot(){
+    return frame_size++;
+}
+
+void ResolveScope::bind(const string &name, int slot){
+    names.push_back(make_pair(name, slot));
+}
+
+void ResolveScope::unbind(){
+    names.pop_back();
+}
+
+/**
+ * \brief Finds the innermost binding of a name, capturing it if it is outside this frame.
+ * \param name The variable name.
+ * \param depth Set to 0 for a binding in this frame, 1 for a captured one.
+ * \param slot Set to the slot of the binding, or the index of the capture.
+ * \return False if the name is free.
+ */
+bool ResolveScope::find(const string &name, int &depth, int &slot){
+    for (int i = (int)names.size() - 1; i >= 0; i--) {
+        if (names[i].first == name) {
+            depth = 0;
+            slot = names[i].second;
+            return true;
+        }
+    }
+    if (parent == nullptr || !parent->find(name, depth, slot)) {
+        return false;
+    }
+    pair<int, int> address(depth, slot);
+    depth = 1;
+    for (size_t i = 0; i < captures.size(); i++) {
+        if (captures[i] == address) {
+            slot = (int)i;
+            return true;
+        }
+    }
+    captures.push_back(address);
+    slot = (int)captures.size() - 1;
+    return true;
+}
+
+/**
+ * \brief Resolves a whole program.
+ * \param e The parsed expression.
+ * \return An equivalent expression whose bound variables are addressed by slot.
+ */
+PTR(Expr) resolve(PTR(Expr) e){
+    ResolveScope scope(nullptr);
+    PTR(Expr) body = e->resolve(&scope);
+    return located(NEW(ScopeExpr)(scope.frame_size, body), body->position);
+}
@@ -0,0 +1,37 @@
+/**
+ * \file resolve.hpp
+ * \brief Lexical addressing pass run between parse() and interp().
+ *
+ * Rewrites variables, _let and _fun into resolved forms that address their bindings by
+ * (depth, slot) in array-backed frames instead of searching environments by name.
+ * Closures are flat: each _fun lists the outer variables its body uses, and a call
+ * sees exactly two frames, its own (depth 0) and the closure's captures (depth 1).
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Expr.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+/**
+ * \brief The names visible in one frame while it is being resolved, and for a
+ * function body, the outer variables it has captured so far.
+ */
+class ResolveScope {
+public:
+    ResolveScope *parent;
+    vector<pair<string, int> > names;
+    int frame_size;
+    vector<pair<int, int> > captures;   // addresses in the parent's frames
+    
+    ResolveScope(ResolveScope *parent);
+    int new_slot();
+    void bind(const string &name, int slot);
+    void unbind();
+    bool find(const string &name, int &depth, int &slot);
+};
+
+PTR(Expr) resolve(PTR(Expr) e);
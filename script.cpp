@@ -0,0 +1,149 @@
+/**
+ * \file script.cpp
+ * \brief Implementation of compiled scripts and their contexts.
+ */
+
+#include "script.hpp"
+#include <stdexcept>
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "typecheck.hpp"
+
+//======================  Script  ======================//
+
+Script::Script(const vector<string> &inputs, PTR(Expr) tree, PTR(CompiledFunction) program, const Quota &quota){
+    this->inputs = inputs;
+    this->tree = tree;
+    this->program = program;
+    this->quota = quota;
+}
+
+/**
+ * \brief The position of an input in the values run() takes, to look up once and
+ * use for every run.
+ * \throws runtime_error if the script has no input of that name.
+ */
+size_t Script::input(const string &name) const{
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i] == name) {
+            return i;
+        }
+    }
+    throw runtime_error("no input named " + name);
+}
+
+/**
+ * \brief Compiles a script whose free variables `inputs` are given values by each run.
+ * \param options --optimize and --typecheck apply, and every run gets the quota.
+ * Under --typecheck, nothing that uses an input is proven, since the values come
+ * from the host unchecked.
+ * \throws runtime_error from the parser or for an input named twice, and type_error
+ * from typecheck().
+ */
+PTR(Script) compile_script(const string &source, const vector<string> &inputs, const run_options_t &options){
+    PTR(Expr) e = parse_str(source);
+    if (options.optimize) {
+        e = optimize(e);
+    }
+    if (options.typecheck) {
+        e = typecheck(e, inputs);
+    }
+    ResolveScope scope(nullptr);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (inputs[j] == inputs[i]) {
+                throw runtime_error("duplicate input " + inputs[i]);
+            }
+        }
+        scope.bind(inputs[i], scope.new_slot());
+    }
+    PTR(Expr) body = e->resolve(&scope);
+    PTR(Expr) tree = located(NEW(ScopeExpr)(scope.frame_size, body), body->position);
+    return NEW(Script)(inputs, tree, closure_compile(tree), options.quota);
+}
+
+//======================  ScriptContext  ======================//
+
+ScriptContext::ScriptContext(){
+    this->runs = 0;
+}
+
+/**
+ * \brief The calling thread's context, made on first use.
+ */
+ScriptContext &ScriptContext::local(){
+    static thread_local ScriptContext context;
+    return context;
+}
+
+/**
+ * \brief Runs the compiled program in a top-level frame over `slots`, and every call
+ * it left in tail position.
+ */
+static Value execute(PTR(CompiledFunction) program, Value *slots){
+    ClosureFrame frame(slots, program->frame_size);
+    Value result = program->code(frame);
+    if (frame.tail_fun != nullptr) {
+        result = frame.tail_fun->apply(frame.tail_arg);
+    }
+    return result;
+}
+
+/**
+ * \brief Lets go of what the last run left in the first `count` slots, keeping
+ * the storage.
+ */
+void ScriptContext::clear(size_t count){
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = Value();
+    }
+}
+
+/**
+ * \brief Runs a script on values for its inputs, in the order of script.inputs.
+ * \return The value of the script.
+ * \throws runtime_error if `count` is not the number of inputs or one of them is a
+ * default Value, or from the program; quota_error when the run goes over the
+ * script's quota.
+ */
+Value ScriptContext::run(const Script &script, const Value *inputs, size_t count){
+    if (count != script.inputs.size()) {
+        throw runtime_error("script takes " + to_string(script.inputs.size()) + " inputs, not " + to_string(count));
+    }
+    for (size_t i = 0; i < count; i++) {
+        // a default Value is an empty box, not a value the program can use
+        if (inputs[i].tag == Value::boxed_tag && inputs[i].boxed == nullptr) {
+            throw runtime_error("no value for input " + script.inputs[i]);
+        }
+    }
+    size_t frame_size = script.program->frame_size;
+    if (slots.size() < frame_size) {
+        slots.resize(frame_size);
+    }
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = inputs[i];
+    }
+    runs++;
+    try {
+        Value result;
+        if (script.quota.limited()) {
+            Governor governor(script.quota);
+            GovernorScope governed(&governor);
+            result = execute(script.program, slots.data());
+        }
+        else {
+            result = execute(script.program, slots.data());
+        }
+        clear(frame_size);
+        return result;
+    }
+    catch (...) {
+        clear(frame_size);
+        throw;
+    }
+}
+
+Value ScriptContext::run(const Script &script, const vector<Value> &inputs){
+    return run(script, inputs.data(), inputs.size());
+}
@@ -0,0 +1,79 @@
+/**
+ * \file script.hpp
+ * \brief Embedding API: a script is compiled once with named inputs, then run many
+ * times on positional input values in a reusable, thread-local context.
+ *
+ * compile_script() parses the source, optimizes and typechecks it if asked to, and
+ * resolves it with its inputs bound to the first slots of the top-level frame, and
+ * then compiles it with the closure compiler. None of that is repeated per run. A
+ * script reads an input as it reads a _let variable, straight from its slot, so a
+ * run builds no environment and looks up no names.
+ *
+ * A run goes through a ScriptContext, normally the calling thread's own from
+ * ScriptContext::local(). The context keeps the storage of the top-level frame from
+ * one run to the next and clears it after each run, so the values of one request are
+ * not kept alive into the next. The frames of the calls a script makes come from the
+ * thread's frame pool, which recycles them from run to run as well. A Script holds
+ * no state of its own runs, so one compiled script can run on many threads at once,
+ * each in its own context.
+ *
+ *     PTR(Script) rule = compile_script("_if age == 0 _then limit _else limit * 2", {"age", "limit"});
+ *     vector<Value> inputs(rule->inputs.size());
+ *     inputs[rule->input("age")] = Value::number(3);
+ *     inputs[rule->input("limit")] = Value::number(100);
+ *     Value result = ScriptContext::local().run(*rule, inputs);
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "closure_compile.hpp"
+#include "cmdline.hpp"
+#include "Expr.hpp"
+#include "governor.hpp"
+#include "pointer.h"
+#include "value.hpp"
+
+using namespace std;
+
+/**
+ * \brief A compiled script and the names of its inputs.
+ */
+class Script {
+public:
+    vector<string> inputs;            // in the order run() takes their values
+    PTR(Expr) tree;                   // resolved, with input i in slot i of the top-level frame
+    PTR(CompiledFunction) program;
+    Quota quota;                      // of every run
+
+    Script(const vector<string> &inputs, PTR(Expr) tree, PTR(CompiledFunction) program, const Quota &quota);
+
+    size_t input(const string &name) const;
+};
+
+/**
+ * \brief Where scripts run: the storage of the top-level frame, kept between runs.
+ * Not for use by two threads at once.
+ */
+class ScriptContext {
+public:
+    unsigned long runs;   // made in this context so far
+
+    ScriptContext();
+
+    static ScriptContext &local();
+
+    Value run(const Script &script, const Value *inputs, size_t count);
+    Value run(const Script &script, const vector<Value> &inputs);
+
+private:
+    // a plain vector, whose Values are roots of their own in the collected build
+    vector<Value> slots;
+
+    void clear(size_t count);
+
+    ScriptContext(const ScriptContext &);
+    ScriptContext &operator=(const ScriptContext &);
+};
+
+PTR(Script) compile_script(const string &source, const vector<string> &inputs, const run_options_t &options = run_options_t());
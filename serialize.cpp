@@ -0,0 +1,494 @@
+/**
+ * \file serialize.cpp
+ * \brief Implementation of the binary program format.
+ */
+
+#include "serialize.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "arena.hpp"
+#include "lexer.hpp"
+
+static const char msdb_magic[4] = {'M', 'S', 'D', 'B'};
+
+//======================  Writing  ======================//
+
+/**
+ * \brief Collects the nodes into a byte string and the names into a table, so the
+ * table can be written ahead of the nodes that refer to it.
+ */
+class MsdbWriter {
+public:
+    string nodes;
+    vector<string> strings;
+    unordered_map<string, uint64_t> string_index;
+
+    void varint(uint64_t v){
+        while (v >= 0x80) {
+            nodes += (char)(v | 0x80);
+            v >>= 7;
+        }
+        nodes += (char)v;
+    }
+
+    void signed_varint(int v){
+        // zigzag, so that small negative numbers stay short
+        uint32_t u = (uint32_t)v;
+        varint((uint32_t)(u << 1) ^ (v < 0 ? 0xffffffffu : 0u));
+    }
+
+    void name(const string &s){
+        unordered_map<string, uint64_t>::iterator found = string_index.find(s);
+        if (found == string_index.end()) {
+            strings.push_back(s);
+            found = string_index.insert(make_pair(s, (uint64_t)strings.size() - 1)).first;
+        }
+        varint(found->second);
+    }
+
+    void node(PTR(Expr) e);
+
+    template <class T> void chain(T *first);
+};
+
+/**
+ * \brief Writes a chain of T as its operands in source order.
+ */
+template <class T> void MsdbWriter::chain(T *first){
+    vector<T *> links = rhs_chain(first);
+    nodes += (char)first->kind;
+    varint(links.size() + 1);
+    for (T *link : links) {
+        node(link->lhs);
+    }
+    node(links.back()->rhs);
+}
+
+void MsdbWriter::node(PTR(Expr) e){
+    switch (e->kind) {
+        case expr_add:
+            chain(static_cast<AddExpr *>(&*e));
+            return;
+        case expr_mult:
+            chain(static_cast<MultExpr *>(&*e));
+            return;
+        case expr_eq:
+            chain(static_cast<EqExpr *>(&*e));
+            return;
+        default:
+            break;
+    }
+    nodes += (char)e->kind;
+    switch (e->kind) {
+        case expr_num:
+            signed_varint(static_cast<NumExpr *>(&*e)->val);
+            break;
+        case expr_bool:
+            varint(static_cast<BoolExpr *>(&*e)->val);
+            break;
+        case expr_var:
+            name(static_cast<VarExpr *>(&*e)->val);
+            break;
+        case expr_slot_var: {
+            SlotVarExpr *var = static_cast<SlotVarExpr *>(&*e);
+            name(var->val);
+            varint(var->depth);
+            varint(var->slot);
+            break;
+        }
+        case expr_let:
+        case expr_slot_let: {
+            LetExpr *let = static_cast<LetExpr *>(&*e);
+            name(let->lhs);
+            if (e->kind == expr_slot_let) {
+                varint(static_cast<SlotLetExpr *>(let)->slot);
+            }
+            node(let->rhs);
+            node(let->body);
+            break;
+        }
+        case expr_if: {
+            IfExpr *if_expr = static_cast<IfExpr *>(&*e);
+            node(if_expr->if_);
+            node(if_expr->then_);
+            node(if_expr->else_);
+            break;
+        }
+        case expr_fun:
+        case expr_slot_fun: {
+            FunExpr *fun = static_cast<FunExpr *>(&*e);
+            name(fun->formal_arg);
+            if (e->kind == expr_slot_fun) {
+                SlotFunExpr *slot_fun = static_cast<SlotFunExpr *>(fun);
+                varint(slot_fun->frame_size);
+                varint(slot_fun->captures.size());
+                for (pair<int, int> &capture : slot_fun->captures) {
+                    varint(capture.first);
+                    varint(capture.second);
+                }
+            }
+            node(fun->body);
+            break;
+        }
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(&*e);
+            node(call->to_be_called);
+            node(call->actual_arg);
+            break;
+        }
+        case expr_scope: {
+            ScopeExpr *scope = static_cast<ScopeExpr *>(&*e);
+            varint(scope->frame_size);
+            node(scope->body);
+            break;
+        }
+        case expr_sum:
+        case expr_product: {
+            NaryExpr *nary = static_cast<NaryExpr *>(&*e);
+            varint(nary->operands.size());
+            for (PTR(Expr) &operand : nary->operands) {
+                node(operand);
+            }
+            break;
+        }
+        default:
+            throw runtime_error("cannot serialize expression");
+    }
+}
+
+static void put_u32(ostream &out, uint32_t v){
+    char bytes[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+    out.write(bytes, 4);
+}
+
+static void put_varint(ostream &out, uint64_t v){
+    while (v >= 0x80) {
+        out.put((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.put((char)v);
+}
+
+/**
+ * \brief Writes a program, parsed or resolved, in the MSDB format.
+ */
+void write_msdb(PTR(Expr) e, ostream &out){
+    MsdbWriter writer;
+    writer.node(e);
+    out.write(msdb_magic, sizeof(msdb_magic));
+    put_u32(out, msdb_version);
+    put_varint(out, writer.strings.size());
+    for (const string &s : writer.strings) {
+        put_varint(out, s.size());
+        out.write(s.data(), s.size());
+    }
+    out.write(writer.nodes.data(), writer.nodes.size());
+}
+
+//======================  Reading  ======================//
+
+/**
+ * \brief Rebuilds a tree from the bytes of an MSDB file, checking every read against
+ * the end of the buffer.
+ */
+class MsdbReader {
+public:
+    const char *pos;
+    const char *end;
+    Arena *arena;
+    vector<string> strings;
+    vector<pair<int, int> > frames;   // sizes of the enclosing frames and of their depth 1, innermost last
+
+    MsdbReader(const char *data, size_t length, Arena *arena) : pos(data), end(data + length), arena(arena) {}
+
+    void fail(){
+        throw runtime_error("malformed msdb file");
+    }
+
+    unsigned char byte(){
+        if (pos >= end) {
+            fail();
+        }
+        return (unsigned char)*pos++;
+    }
+
+    uint64_t varint(){
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char b = byte();
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return v;
+            }
+        }
+        fail();
+        return 0;
+    }
+
+    int signed_varint(){
+        uint32_t u = (uint32_t)varint();
+        return (int)((u >> 1) ^ (0u - (u & 1)));
+    }
+
+    /**
+     * \brief A count or index, which this format never writes above INT_MAX.
+     */
+    int small(){
+        uint64_t v = varint();
+        if (v > 0x7fffffff) {
+            fail();
+        }
+        return (int)v;
+    }
+
+    const string &name(){
+        uint64_t index = varint();
+        if (index >= strings.size()) {
+            fail();
+        }
+        return strings[index];
+    }
+
+    /**
+     * \brief A frame size. Every slot but a function's argument is a _let in the frame,
+     * which takes more than a byte, so the size is bounded by what is left to read.
+     */
+    int frame_size(){
+        int size = small();
+        if (size > end - pos + 1) {
+            fail();
+        }
+        return size;
+    }
+
+    /**
+     * \brief Checks that (depth, slot) names a slot of the innermost enclosing frame.
+     */
+    void check_address(int depth, int slot){
+        if (frames.empty() || depth > 1) {
+            fail();
+        }
+        int size = depth == 0 ? frames.back().first : frames.back().second;
+        if (slot >= size) {
+            fail();
+        }
+    }
+
+    PTR(Expr) node();
+    PTR(Expr) body(int frame_size, int outer);
+    vector<PTR(Expr)> operands();
+};
+
+/**
+ * \brief Reads the body of a frame of `frame_size` slots whose depth 1 has `outer`.
+ */
+PTR(Expr) MsdbReader::body(int frame_size, int outer){
+    frames.push_back(make_pair(frame_size, outer));
+    PTR(Expr) e = node();
+    frames.pop_back();
+    return e;
+}
+
+/**
+ * \brief Reads an operand count and that many nodes.
+ */
+vector<PTR(Expr)> MsdbReader::operands(){
+    uint64_t count = varint();
+    // every node takes at least one byte, which bounds the count before reserving
+    if (count > (uint64_t)(end - pos)) {
+        fail();
+    }
+    vector<PTR(Expr)> result;
+    result.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        result.push_back(node());
+    }
+    return result;
+}
+
+PTR(Expr) MsdbReader::node(){
+    unsigned char kind = byte();
+    switch (kind) {
+        case expr_add:
+        case expr_mult:
+        case expr_eq: {
+            vector<PTR(Expr)> list = operands();
+            if (list.size() < 2) {
+                fail();
+            }
+            PTR(Expr) e = list.back();
+            for (size_t i = list.size() - 1; i-- > 0;) {
+                if (kind == expr_add) {
+                    e = ANEW(arena, AddExpr)(list[i], e);
+                }
+                else if (kind == expr_mult) {
+                    e = ANEW(arena, MultExpr)(list[i], e);
+                }
+                else {
+                    e = ANEW(arena, EqExpr)(list[i], e);
+                }
+            }
+            return e;
+        }
+        case expr_num:
+            return ANEW(arena, NumExpr)(signed_varint());
+        case expr_bool:
+            return ANEW(arena, BoolExpr)(varint() != 0);
+        case expr_var:
+            return ANEW(arena, VarExpr)(name());
+        case expr_slot_var: {
+            string val = name();
+            int depth = small();
+            int slot = small();
+            check_address(depth, slot);
+            return ANEW(arena, SlotVarExpr)(val, depth, slot);
+        }
+        case expr_let: {
+            string lhs = name();
+            PTR(Expr) rhs = node();
+            PTR(Expr) body = node();
+            return ANEW(arena, LetExpr)(lhs, rhs, body);
+        }
+        case expr_slot_let: {
+            string lhs = name();
+            int slot = small();
+            check_address(0, slot);
+            PTR(Expr) rhs = node();
+            PTR(Expr) body = node();
+            return ANEW(arena, SlotLetExpr)(lhs, slot, rhs, body);
+        }
+        case expr_if: {
+            PTR(Expr) if_ = node();
+            PTR(Expr) then_ = node();
+            PTR(Expr) else_ = node();
+            return ANEW(arena, IfExpr)(if_, then_, else_);
+        }
+        case expr_fun: {
+            string formal_arg = name();
+            return ANEW(arena, FunExpr)(formal_arg, node());
+        }
+        case expr_slot_fun: {
+            string formal_arg = name();
+            int frame_size = this->frame_size();
+            int count = small();
+            // slot 0 is the argument
+            if (frame_size < 1) {
+                fail();
+            }
+            // every capture takes at least two bytes
+            if (count > (end - pos) / 2) {
+                fail();
+            }
+            vector<pair<int, int> > captures(count);
+            for (pair<int, int> &capture : captures) {
+                capture.first = small();
+                capture.second = small();
+                check_address(capture.first, capture.second);
+            }
+            return ANEW(arena, SlotFunExpr)(formal_arg, body(frame_size, count), frame_size, captures);
+        }
+        case expr_call: {
+            PTR(Expr) to_be_called = node();
+            PTR(Expr) actual_arg = node();
+            return ANEW(arena, CallExpr)(to_be_called, actual_arg);
+        }
+        case expr_scope: {
+            int frame_size = this->frame_size();
+            // the frame of a scope is pushed onto the one around it, if any
+            int outer = frames.empty() ? 0 : frames.back().first;
+            return ANEW(arena, ScopeExpr)(frame_size, body(frame_size, outer));
+        }
+        case expr_sum:
+        case expr_product: {
+            vector<PTR(Expr)> list = operands();
+            if (list.empty()) {
+                fail();
+            }
+            if (kind == expr_sum) {
+                return ANEW(arena, SumExpr)(list);
+            }
+            return ANEW(arena, ProductExpr)(list);
+        }
+        default:
+            fail();
+            return nullptr;
+    }
+}
+
+/**
+ * \brief Rebuilds a program written by write_msdb().
+ * \param arena Where to allocate the nodes, as for parse(); nullptr for the heap.
+ * \throws runtime_error if the bytes are not an MSDB file of this version.
+ */
+PTR(Expr) read_msdb(const char *data, size_t length, Arena *arena){
+    if (length < 8 || memcmp(data, msdb_magic, sizeof(msdb_magic)) != 0) {
+        throw runtime_error("not an msdb file");
+    }
+    const unsigned char *v = (const unsigned char *)data + 4;
+    uint32_t version = v[0] | (v[1] << 8) | (v[2] << 16) | ((uint32_t)v[3] << 24);
+    if (version != msdb_version) {
+        throw runtime_error("unsupported msdb version " + to_string(version));
+    }
+    MsdbReader reader(data + 8, length - 8, arena);
+    uint64_t count = reader.varint();
+    if (count > (uint64_t)(reader.end - reader.pos)) {
+        reader.fail();
+    }
+    reader.strings.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t size = reader.varint();
+        if (size > (uint64_t)(reader.end - reader.pos)) {
+            reader.fail();
+        }
+        reader.strings.push_back(string(reader.pos, size));
+        reader.pos += size;
+    }
+    PTR(Expr) e = reader.node();
+    if (reader.pos != reader.end) {
+        reader.fail();
+    }
+    return e;
+}
+
+/**
+ * \brief Writes a program to an MSDB file (--compile).
+ */
+void save_program(PTR(Expr) e, const string &path){
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    if (!out) {
+        throw runtime_error("cannot write " + path);
+    }
+    write_msdb(e, out);
+    out.close();
+    if (!out) {
+        throw runtime_error("cannot write " + path);
+    }
+}
+
+/**
+ * \brief Maps an MSDB file into memory and rebuilds its program (--load).
+ */
+PTR(Expr) load_program(const string &path, Arena *arena){
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("cannot open " + path);
+    }
+    try {
+        // the mapping outlives the descriptor
+        SourceBuffer file(fd);
+        close(fd);
+        fd = -1;
+        return read_msdb(file.data, file.length, arena);
+    }
+    catch (...) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw;
+    }
+}
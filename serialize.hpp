@@ -0,0 +1,41 @@
+/**
+ * \file serialize.hpp
+ * \brief Compact binary form of a program, written by --compile and run by --load.
+ *
+ * A precompiled program is read straight out of the mmap'd file into a tree, without
+ * the lexer or parser. The layout is
+ *
+ *     "MSDB"          magic
+ *     u32             format version, little-endian
+ *     varint          number of strings, then each as a varint length and its bytes
+ *     node            the root
+ *
+ * A node is its expr_kind_t as one byte followed by its fields: integers as
+ * (zigzag) LEB128 varints, names as indices into the string table, children as
+ * nodes. Chains of +, * and == are written as one node with an operand count, so
+ * neither writing nor reading takes a native stack frame per operator. Both parsed
+ * and resolved trees can be stored. Source positions are not kept.
+ */
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "Expr.hpp"
+#include "pointer.h"
+
+using namespace std;
+class Arena;
+
+/**
+ * \brief Bumped whenever the layout changes, including new kinds.
+ */
+const uint32_t msdb_version = 2;
+
+void write_msdb(PTR(Expr) e, ostream &out);
+
+PTR(Expr) read_msdb(const char *data, size_t length, Arena *arena = nullptr);
+
+void save_program(PTR(Expr) e, const string &path);
+
+PTR(Expr) load_program(const string &path, Arena *arena = nullptr);
@@ -0,0 +1,343 @@
+/**
+ * \file serve.cpp
+ * \brief Implementation of the server mode and its program cache.
+ */
+
+#include "serve.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "batch.hpp"
+#include "memo.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "typecheck.hpp"
+#include "Val.hpp"
+
+ServedProgram::ServedProgram(const string &source, PTR(Expr) tree) : source(source), tree(tree) {
+    resolved = resolve(tree);
+}
+
+/**
+ * \brief The program compiled for the VM, compiled once however many threads ask.
+ */
+PTR(VmFunction) ServedProgram::bytecode(){
+    call_once(compiled, [this]{ code = vm_compile(tree); });
+    return code;
+}
+
+/**
+ * \brief The program compiled to closures, from its resolved form, once.
+ */
+PTR(CompiledFunction) ServedProgram::closure_code(){
+    call_once(closures_compiled, [this]{ closures = closure_compile(resolved); });
+    return closures;
+}
+
+/**
+ * \param capacity The most programs kept at once.
+ * \param optimize True to cache programs optimized, as --optimize runs them.
+ * \param typecheck True to cache programs checked and typed, as --typecheck runs them.
+ */
+ProgramCache::ProgramCache(size_t capacity, bool optimize, bool typecheck) : programs(capacity) {
+    this->optimize = optimize;
+    this->typecheck = typecheck;
+    hits = 0;
+    misses = 0;
+}
+
+/**
+ * \brief The cached program for a source text, parsed and added on a miss.
+ * \param hit Set to whether the program was already cached.
+ * \throws runtime_error from the parser, or type_error with --typecheck; programs that
+ * fail to parse or check are not cached.
+ */
+PTR(ServedProgram) ProgramCache::get(const string &source, bool &hit){
+    size_t key = std::hash<string>()(source);
+    PTR(ServedProgram) program;
+    {
+        lock_guard<mutex> guard(lock);
+        // a hash collision replaces the other program, like an eviction
+        if (programs.find(key, program) && program->source == source) {
+            hits++;
+            hit = true;
+            return program;
+        }
+        misses++;
+    }
+    hit = false;
+    // parsed outside the lock, so one large program does not hold up the others
+    PTR(Expr) tree = parse_buffer(source.data(), source.size());
+    if (optimize) {
+        tree = ::optimize(tree);
+    }
+    if (typecheck) {
+        tree = ::typecheck(tree);
+    }
+    program = NEW(ServedProgram)(source, tree);
+    lock_guard<mutex> guard(lock);
+    programs.put(key, program);
+    return program;
+}
+
+size_t ProgramCache::size(){
+    lock_guard<mutex> guard(lock);
+    return programs.size();
+}
+
+size_t ProgramCache::capacity(){
+    return programs.capacity();
+}
+
+void ProgramCache::counts(unsigned long &hits, unsigned long &misses){
+    lock_guard<mutex> guard(lock);
+    hits = this->hits;
+    misses = this->misses;
+}
+
+/**
+ * \brief Runs a cached program the way run_program() runs a parsed one.
+ */
+static string run_served(run_mode_t mode, PTR(ServedProgram) program, const run_options_t &options){
+    Governor governor(options.quota);
+    GovernorScope governed(options.quota.limited() ? &governor : nullptr);
+    switch (mode) {
+        case do_interp: {
+            Memo memo;
+            MemoScope scope(options.memoize ? &memo : nullptr);
+            return program->resolved->interp()->to_string();
+        }
+        case do_print:
+            return program->tree->to_string();
+        case do_pretty_print:
+            return program->tree->to_pretty_string();
+        case do_vm:
+            return vm_run(program->bytecode())->to_string();
+        case do_closures:
+            return closure_run(program->closure_code())->to_string();
+        default:
+            return "";
+    }
+}
+
+/**
+ * \brief Answers one request line.
+ * \param quit Set when the request ends the session.
+ * \return The response, without the newline.
+ */
+static string respond(const string &line, run_mode_t mode, const run_options_t &options, ProgramCache &cache, bool &quit){
+    typedef chrono::steady_clock clock;
+    string program = line;
+    if (!line.empty() && line[0] == ':') {
+        size_t space = line.find(' ');
+        string command = line.substr(0, space);
+        program = space == string::npos ? "" : line.substr(space + 1);
+        if (command == ":quit") {
+            quit = true;
+            return "ok";
+        }
+        else if (command == ":stats") {
+            unsigned long hits, misses;
+            cache.counts(hits, misses);
+            return "stats entries=" + to_string(cache.size()) + " capacity=" + to_string(cache.capacity())
+                + " hits=" + to_string(hits) + " misses=" + to_string(misses);
+        }
+        else if (command == ":interp") {
+            mode = do_interp;
+        }
+        else if (command == ":vm") {
+            mode = do_vm;
+        }
+        else if (command == ":closures") {
+            mode = do_closures;
+        }
+        else if (command == ":print") {
+            mode = do_print;
+        }
+        else if (command == ":pretty-print") {
+            mode = do_pretty_print;
+        }
+        else {
+            return "error miss 0 0 " + escape_line("unknown command " + command);
+        }
+    }
+    bool hit = false;
+    clock::time_point start = clock::now();
+    clock::time_point parsed = start;
+    string status = "ok";
+    string text;
+    try {
+        PTR(ServedProgram) served = cache.get(program, hit);
+        parsed = clock::now();
+        text = run_served(mode, served, options);
+    }
+    catch (quota_error exn) {
+        status = "quota";
+        text = exn.what();
+    }
+    catch (runtime_error exn) {
+        status = "error";
+        text = exn.what();
+    }
+    clock::time_point done = clock::now();
+    if (parsed == start) {
+        parsed = done;
+    }
+    long long parse_ns = chrono::duration_cast<chrono::nanoseconds>(parsed - start).count();
+    long long run_ns = chrono::duration_cast<chrono::nanoseconds>(done - parsed).count();
+    return status + (hit ? " hit " : " miss ") + to_string(parse_ns) + " " + to_string(run_ns) + " " + escape_line(text);
+}
+
+/**
+ * \brief Answers requests until the end of the input or a :quit. Output is flushed
+ * whenever no more input is already buffered, as in batch mode.
+ */
+void serve_stream(istream &in, ostream &out, run_mode_t mode, const run_options_t &options, ProgramCache &cache){
+    string line;
+    while (getline(in, line)) {
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+        bool quit = false;
+        out << respond(line, mode, options, cache, quit) << "\n";
+        if (quit) {
+            break;
+        }
+        if (in.rdbuf()->in_avail() <= 0) {
+            out.flush();
+        }
+    }
+    out.flush();
+}
+
+/**
+ * \brief Buffered stream over a connected socket.
+ */
+class SocketBuf : public streambuf {
+public:
+    SocketBuf(int fd) : fd(fd) {
+        setg(input, input, input);
+        setp(output, output + sizeof(output));
+    }
+
+    ~SocketBuf(){
+        sync();
+    }
+
+protected:
+    int underflow(){
+        ssize_t n;
+        do {
+            n = read(fd, input, sizeof(input));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return traits_type::eof();
+        }
+        setg(input, input, input + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int overflow(int c){
+        if (sync() < 0) {
+            return traits_type::eof();
+        }
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync(){
+        const char *p = pbase();
+        while (p < pptr()) {
+            // MSG_NOSIGNAL: a client that hung up ends its session, not the server
+            ssize_t n = send(fd, p, pptr() - p, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                setp(output, output + sizeof(output));
+                return -1;
+            }
+            p += n;
+        }
+        setp(output, output + sizeof(output));
+        return 0;
+    }
+
+private:
+    int fd;
+    char input[64 * 1024];
+    char output[64 * 1024];
+};
+
+/**
+ * \brief Listens on a Unix socket until the process is killed, serving every
+ * connection on a thread of its own.
+ */
+static void serve_socket(const string &path, run_mode_t mode, const run_options_t &options, ProgramCache &cache){
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw runtime_error("socket path too long: " + path);
+    }
+    strcpy(address.sun_path, path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw runtime_error("cannot create socket");
+    }
+    unlink(path.c_str());
+    if (::bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+        close(listener);
+        throw runtime_error("cannot listen on " + path);
+    }
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            close(listener);
+            throw runtime_error("accept failed");
+        }
+        thread([fd, mode, &options, &cache]{
+            {
+                SocketBuf buffer(fd);
+                iostream connection(&buffer);
+                try {
+                    serve_stream(connection, connection, mode, options, cache);
+                }
+                catch (...) {
+                    // a broken connection only ends its own session
+                }
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+/**
+ * \brief Runs the server: on stdin/stdout, or with --socket on a Unix socket.
+ * \param mode How programs without a prefix are run.
+ */
+void serve(run_mode_t mode, const run_options_t &options){
+    ProgramCache cache(options.cache_size, options.optimize, options.typecheck);
+    if (options.socket_path.empty()) {
+        ios::sync_with_stdio(false);
+        serve_stream(cin, cout, mode, options, cache);
+    }
+    else {
+        serve_socket(options.socket_path, mode, options, cache);
+    }
+}
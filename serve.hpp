@@ -0,0 +1,78 @@
+/**
+ * \file serve.hpp
+ * \brief Long-running server mode (--serve) with a cache of parsed programs.
+ *
+ * The server reads one request per line and writes exactly one response line for it,
+ * on stdin/stdout or, with --socket PATH, on every connection to a Unix socket. A
+ * request is a program, run in the mode given on the command line, or a program
+ * behind one of the prefixes :interp, :vm, :closures, :print and :pretty-print. :stats reports
+ * the cache and :quit ends the session. Responses are
+ *
+ *     ok <hit|miss> <parse ns> <run ns> <result>
+ *     error <hit|miss> <parse ns> <run ns> <message>
+ *     quota <hit|miss> <parse ns> <run ns> <limit exceeded>
+ *     stats entries=<n> capacity=<n> hits=<n> misses=<n>
+ *
+ * with results and messages escaped like batch output. Parsed programs, optimized
+ * with --optimize and checked with --typecheck, are kept in an LRU cache keyed by a hash of their source text
+ * together with their resolved and compiled forms, so a repeated request skips the
+ * parser altogether and its parse time is only the lookup. Connections are served
+ * on threads of their own and share the cache.
+ */
+#pragma once
+
+#include <cstddef>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include "closure_compile.hpp"
+#include "cmdline.hpp"
+#include "Expr.hpp"
+#include "lru.hpp"
+#include "pointer.h"
+#include "vm.hpp"
+
+using namespace std;
+
+/**
+ * \brief One cached program in the forms the run modes need. The tree and its
+ * resolved form are built on a miss; the bytecode the first time --vm runs it,
+ * and the closures the first time --compile-closures does.
+ */
+class ServedProgram {
+public:
+    string source;
+    PTR(Expr) tree;
+    PTR(Expr) resolved;
+    PTR(VmFunction) code;
+    once_flag compiled;
+    PTR(CompiledFunction) closures;
+    once_flag closures_compiled;
+
+    ServedProgram(const string &source, PTR(Expr) tree);
+    PTR(VmFunction) bytecode();
+    PTR(CompiledFunction) closure_code();
+};
+
+class ProgramCache {
+public:
+    ProgramCache(size_t capacity, bool optimize, bool typecheck = false);
+
+    PTR(ServedProgram) get(const string &source, bool &hit);
+    size_t size();
+    size_t capacity();
+    void counts(unsigned long &hits, unsigned long &misses);
+
+private:
+    LruCache<size_t, PTR(ServedProgram)> programs;
+    bool optimize;
+    bool typecheck;
+    unsigned long hits;
+    unsigned long misses;
+    mutex lock;
+};
+
+void serve_stream(istream &in, ostream &out, run_mode_t mode, const run_options_t &options, ProgramCache &cache);
+
+void serve(run_mode_t mode, const run_options_t &options);
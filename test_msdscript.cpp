@@ -1,164 +1,372 @@
+/**
+ * \file test_msdscript.cpp
+ * \brief Parallel differential fuzzer for msdscript executables.
+ *
+ *     test_msdscript [--seed N] [--iterations N] [--jobs N] [--chunk N] [--per-program]
+ *                    <msdscript_path> [<msdscript_path_2>]
+ *
+ * Random programs are generated in chunks from one seeded generator, so a seed always
+ * yields the same programs whatever the number of jobs. Each of --jobs workers takes
+ * the next chunk and runs it through one `--batch` child per mode, which pays fork
+ * and exec once per chunk instead of once per program. With --per-program every
+ * program gets its own child instead, for executables without --batch.
+ *
+ * With one executable, --vm, --compile-closures and interpreting the --print and
+ * --pretty-print output again must agree with --interp. With two, both must give the same --interp, --print
+ * and --pretty-print output. Mismatches are reported as they are found and the run
+ * ends with its throughput; the exit code is 1 if anything mismatched.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
 #include <iostream>
-#include <time.h>
-#include <random>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 #include "exec.hpp"
+#include "random_expr.hpp"
 using namespace std;
 
 /**
- * Generates a random expression as a string.
- *
- * \param depth The current depth of the expression tree. Used to limit recursion and ensure termination.
- * \return A string representing a randomly generated expression.
+ * \brief The command line of a fuzzing run.
+ */
+class FuzzOptions {
+public:
+    unsigned long seed;
+    unsigned long iterations;
+    unsigned jobs;
+    unsigned long chunk;
+    bool per_program;
+    vector<string> paths;
+
+    FuzzOptions() {
+        seed = (unsigned long)time(nullptr);
+        iterations = 1000;
+        jobs = thread::hardware_concurrency() == 0 ? 4 : thread::hardware_concurrency();
+        chunk = 500;
+        per_program = false;
+    }
+};
+
+/**
+ * \brief Hands out chunks of random programs in a fixed order.
+ */
+class ProgramSource {
+public:
+    ProgramSource(const FuzzOptions &options) : options(options), produced(0) {
+        srand((unsigned)options.seed);
+    }
+
+    /**
+     * \brief Generates the next chunk.
+     * \param first Set to the index of the chunk's first program in the run.
+     * \return False once the run has all its programs.
+     */
+    bool next(vector<string> &programs, unsigned long &first){
+        // random_expr_string() draws from rand(), so chunks are generated one at a time
+        lock_guard<mutex> guard(lock);
+        programs.clear();
+        first = produced;
+        while (programs.size() < options.chunk && produced < options.iterations) {
+            programs.push_back(random_expr_string(0));
+            produced++;
+        }
+        return !programs.empty();
+    }
+
+private:
+    const FuzzOptions &options;
+    unsigned long produced;
+    mutex lock;
+};
+
+/**
+ * \brief Counts comparisons and prints mismatches for all workers.
+ */
+class FuzzReport {
+public:
+    atomic<unsigned long> programs;
+    atomic<unsigned long> checks;
+    atomic<unsigned long> mismatches;
+
+    FuzzReport() : programs(0), checks(0), mismatches(0) {}
+
+    void check(bool same, unsigned long index, const string &what, const string &program,
+               const string &expected, const string &actual){
+        checks++;
+        if (same) {
+            return;
+        }
+        // only the first few are printed in full, so a broken build does not flood the log
+        if (mismatches++ < 20) {
+            lock_guard<mutex> guard(lock);
+            cout << "MISMATCH " << what << " on program " << index << ": " << program << "\n"
+                 << "  expected: " << expected << "\n"
+                 << "  actual:   " << actual << "\n";
+            cout.flush();
+        }
+    }
+
+    void failure(const string &message){
+        mismatches++;
+        lock_guard<mutex> guard(lock);
+        cout << "FAILURE " << message << "\n";
+        cout.flush();
+    }
+
+private:
+    mutex lock;
+};
+
+/**
+ * \brief One output line the way --batch writes it: newlines as "\n", errors prefixed.
  */
-string random_expr_string(int depth=0) {
-
-    // Limit recursion depth to prevent stack overflow
-    if (depth > 10) {
-      if (rand() % 2) {
-        // Return a random character from a to z
-        return string(1, static_cast<char>('a' + (rand() % 26)));
-      }
-      else {
-        // Return a random number as a string
-        return to_string(rand() % 100);
-      }
-    }
-    
-    int choice = rand() % 5;
-    switch(choice) {
-      case 0:
-        // Random number case
-        return to_string(rand() % 100);
-      case 1:
-        // Addition case
-        return random_expr_string(depth + 1) + " + " + random_expr_string(depth + 1);
-      case 2:
-        // Multiplication case
-        return random_expr_string(depth + 1) + " * " + random_expr_string(depth + 1);
-      case 3:
-        // Random character case
-        return string(1, static_cast<char>('a' + (rand() % 26)));
-      case 4: {
-        // Let expression case
-        string var = string(1, static_cast<char>('a' + (rand() % 26)));
-        string val = random_expr_string(depth + 1);
-        string body = random_expr_string(depth + 1);
-        return "_let " + var + "=" + val + " _in " + body;
-      }
-      default:
-        return to_string(rand() % 100);
+static string batch_line(const ExecResult &result){
+    const string &text = result.exit_code == 0 ? result.out : result.err;
+    size_t end = text.size();
+    if (end > 0 && text[end - 1] == '\n') {
+        end--;
+    }
+    string line = result.exit_code == 0 ? "" : "error: ";
+    for (size_t i = 0; i < end; i++) {
+        if (text[i] == '\\') {
+            line += "\\\\";
+        }
+        else if (text[i] == '\n') {
+            line += "\\n";
+        }
+        else {
+            line += text[i];
+        }
     }
+    return line;
 }
 
 /**
- * Tests the implementation of a given msdscript executable using a single path.
- *
- * \param path The path to the msdscript executable.
+ * \brief Undoes the escaping of a result line and joins its lines, so printed
+ * output can be fed back as one program of a batch.
  */
-void testSingleImpl(string path){
-    
-    // Define command line arguments for different modes of operation
-    const char *interp[] = { path.c_str(), "--interp" };
-    const char *print[] = { path.c_str(), "--print" };
-    const char *pprint[] = { path.c_str(), "--pretty_print" };
-    
-    for (int i = 0; i < 100; i++) {
-        string str = random_expr_string(0);
-        cout << "Trying: " << str << "\n";
-        
-        // Execute the msdscript program in different modes and compare outputs
-        ExecResult interpResult = exec_program(2, interp, str);
-        ExecResult printResult = exec_program(2, print, str);
-        ExecResult pprintResult = exec_program(2, pprint, str);
-        
-        // Check if interpreting the printed output matches the original interpretation
-        ExecResult interpAgain = exec_program(2, interp, printResult.out);
-        
-        if(interpAgain.out != interpResult.out){
-            cout << "Different results";
-        }
-    }
-    exit(0);
+static string program_from_line(const string &line){
+    string program;
+    for (size_t i = 0; i < line.size(); i++) {
+        if (line[i] == '\\' && i + 1 < line.size()) {
+            i++;
+            program += line[i] == 'n' ? ' ' : line[i];
+        }
+        else {
+            program += line[i];
+        }
+    }
+    return program;
+}
+
+static bool is_error(const string &line){
+    return line.compare(0, 7, "error: ") == 0;
 }
 
 /**
- * Tests the implementation of msdscript executable using two different paths.
- *
- * \param path1 The path to the first msdscript executable.
- * \param path2 The path to the second msdscript executable.
+ * \brief Runs every program in one mode.
+ * \param lines Set to one output line per program.
+ * \return False, after reporting it, if the executable did not answer every program.
+ */
+static bool run_mode(const FuzzOptions &options, FuzzReport &report, const string &path, const char *mode,
+                     const vector<string> &programs, vector<string> &lines){
+    lines.clear();
+    if (options.per_program) {
+        const char *argv[] = { path.c_str(), mode };
+        for (const string &program : programs) {
+            lines.push_back(batch_line(exec_program(2, argv, program + "\n")));
+        }
+        return true;
+    }
+    string input;
+    for (const string &program : programs) {
+        input += program;
+        input += "\n";
+    }
+    const char *argv[] = { path.c_str(), "--batch", mode };
+    ExecResult result = exec_program(3, argv, input);
+    size_t start = 0;
+    while (start < result.out.size()) {
+        size_t stop = result.out.find('\n', start);
+        if (stop == string::npos) {
+            stop = result.out.size();
+        }
+        lines.push_back(result.out.substr(start, stop - start));
+        start = stop + 1;
+    }
+    if (lines.size() != programs.size()) {
+        report.failure(path + " --batch " + mode + " answered " + to_string(lines.size()) + " of "
+                       + to_string(programs.size()) + " programs (exit code " + to_string(result.exit_code)
+                       + "): " + result.err);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Checks one executable against itself: --vm, --compile-closures and
+ * reinterpreting its printed output have to give what --interp gives.
+ */
+static void check_single(const FuzzOptions &options, FuzzReport &report, const vector<string> &programs, unsigned long first){
+    const string &path = options.paths[0];
+    vector<string> interp, vm, closures, print, pretty;
+    if (!run_mode(options, report, path, "--interp", programs, interp)
+        || !run_mode(options, report, path, "--vm", programs, vm)
+        || !run_mode(options, report, path, "--compile-closures", programs, closures)
+        || !run_mode(options, report, path, "--print", programs, print)
+        || !run_mode(options, report, path, "--pretty-print", programs, pretty)) {
+        return;
+    }
+    // the printed forms are interpreted again as one batch per kind
+    vector<string> printed, pretty_printed;
+    vector<size_t> printed_index, pretty_index;
+    for (size_t i = 0; i < programs.size(); i++) {
+        report.check(vm[i] == interp[i], first + i, "--vm", programs[i], interp[i], vm[i]);
+        report.check(closures[i] == interp[i], first + i, "--compile-closures", programs[i], interp[i], closures[i]);
+        if (is_error(print[i])) {
+            // a program that does not parse fails the same way in every mode
+            report.check(print[i] == interp[i], first + i, "--print error", programs[i], interp[i], print[i]);
+        }
+        else {
+            printed.push_back(program_from_line(print[i]));
+            printed_index.push_back(i);
+        }
+        if (is_error(pretty[i])) {
+            report.check(pretty[i] == interp[i], first + i, "--pretty-print error", programs[i], interp[i], pretty[i]);
+        }
+        else {
+            pretty_printed.push_back(program_from_line(pretty[i]));
+            pretty_index.push_back(i);
+        }
+    }
+    vector<string> again;
+    if (run_mode(options, report, path, "--interp", printed, again)) {
+        for (size_t k = 0; k < printed.size(); k++) {
+            size_t i = printed_index[k];
+            report.check(again[k] == interp[i], first + i, "--interp of --print", programs[i], interp[i], again[k]);
+        }
+    }
+    if (run_mode(options, report, path, "--interp", pretty_printed, again)) {
+        for (size_t k = 0; k < pretty_printed.size(); k++) {
+            size_t i = pretty_index[k];
+            report.check(again[k] == interp[i], first + i, "--interp of --pretty-print", programs[i], interp[i], again[k]);
+        }
+    }
+}
+
+/**
+ * \brief Checks two executables against each other mode by mode.
  */
-void testDualImpl(string path1, string path2){
-    
-    // Define command line arguments for both executables in different modes
-    const char *interp1[] = { path1.c_str(), "--interp" };
-    const char *print1[] = { path1.c_str(), "--print" };
-    const char *pprint1[] = { path1.c_str(), "--pretty-print" };
-           
-    const char *interp2[] = { path2.c_str(), "--interp" };
-    const char *print2[] = { path2.c_str(), "--print" };
-    const char *pprint2[] = { path2.c_str(), "--pretty-print" };
-           
-           for (int i = 0; i < 100; i++) {
-               string str = random_expr_string(0);
-               cout << "Trying: " << str << "\n";
-               
-               // Test and compare outputs for interp, print, and pretty print between two implementations
-               ExecResult interp1Result = exec_program(2, interp1, str);
-               ExecResult interp2Result = exec_program(2, interp2, str);
-               if (interp1Result.out != interp2Result.out){
-                   cout << "msdscript interp: " << interp1Result.out;
-                   cout << "tester interp: " << interp2Result.out << "\n";
-                   throw runtime_error("INTERP - different results\n");
-               }
-               
-               ExecResult print1Result = exec_program(2, print1, str);
-               ExecResult print2Result = exec_program(2, print2, str);
-               if (print1Result.out != print2Result.out){
-                   cout << "msdscript print: " << print1Result.out;
-                   cout << "tester print: " << print2Result.out;
-                   throw runtime_error("PRINT - different results\n");
-               }
-               
-               ExecResult pprint1Result = exec_program(2, pprint1, str);
-               ExecResult pprint2Result = exec_program(2, pprint2, str);
-               if (pprint1Result.out != pprint2Result.out){
-                   cout << "msdscript pretty print: " << pprint1Result.out;
-                   cout << "tester pretty print: " << pprint2Result.out;
-                   throw runtime_error("PPRINT - different results\n");
-               }
-           }
-           exit(0);
+static void check_dual(const FuzzOptions &options, FuzzReport &report, const vector<string> &programs, unsigned long first){
+    const char *modes[] = { "--interp", "--print", "--pretty-print" };
+    for (const char *mode : modes) {
+        vector<string> expected, actual;
+        if (!run_mode(options, report, options.paths[0], mode, programs, expected)
+            || !run_mode(options, report, options.paths[1], mode, programs, actual)) {
+            continue;
+        }
+        for (size_t i = 0; i < programs.size(); i++) {
+            report.check(actual[i] == expected[i], first + i, mode, programs[i], expected[i], actual[i]);
+        }
+    }
+}
+
+static void usage(){
+    cout << "Please input one of the following: \n";
+    cout << "test_msdscript [options] <msdscript_path>\n";
+    cout << "test_msdscript [options] <msdscript_path_1> <msdscript_path_2>\n";
+    cout << "options: --seed N  --iterations N  --jobs N  --chunk N  --per-program\n";
+    exit(2);
+}
+
+static unsigned long number_argument(int argc, char **argv, int &i){
+    if (i + 1 >= argc) {
+        usage();
+    }
+    char *end;
+    unsigned long n = strtoul(argv[++i], &end, 10);
+    if (*end != '\0' || argv[i][0] == '\0') {
+        usage();
+    }
+    return n;
 }
 
 /**
- * Main function. Parses command line arguments and runs tests accordingly.
+ * Main function. Parses command line arguments and runs the fuzzer.
  *
  * \param argc Number of command line arguments.
  * \param argv Array of command line argument strings.
- * \return Returns 0 on successful completion.
+ * \return 0 if no mismatches were found, 1 otherwise.
  */
 int main(int argc, char **argv) {
-    
-    // Initialize random seed
-    srand (clock());
-    
-    // Parse command line arguments and run appropriate test implementation
-    if(argc==2){
-        const char * path = argv[1];
-        testSingleImpl(path);
-    }
-    else if(argc==3){
-        string path1 = argv[1];
-        string path2 = argv[2];
-        testDualImpl(path1, path2);
-    }
-    else {
-        cout << "Please input one of the following: \n";
-        cout << "test_msdscript <msdscript_path>\n";
-        cout << "test_msdscript <msdscript_path_1> <msdscript_path_2>\n";
-        exit(1);
-    }
-
-    return 0;
-}
+    typedef chrono::steady_clock clock;
+    FuzzOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--seed") {
+            options.seed = number_argument(argc, argv, i);
+        }
+        else if (arg == "--iterations") {
+            options.iterations = number_argument(argc, argv, i);
+        }
+        else if (arg == "--jobs") {
+            options.jobs = (unsigned)number_argument(argc, argv, i);
+        }
+        else if (arg == "--chunk") {
+            options.chunk = number_argument(argc, argv, i);
+        }
+        else if (arg == "--per-program") {
+            options.per_program = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            usage();
+        }
+        else {
+            options.paths.push_back(arg);
+        }
+    }
+    if (options.paths.empty() || options.paths.size() > 2 || options.jobs == 0 || options.chunk == 0) {
+        usage();
+    }
 
+    cout << "seed " << options.seed << ", " << options.iterations << " programs, "
+         << options.jobs << " jobs\n";
+    cout.flush();
+    ProgramSource source(options);
+    FuzzReport report;
+    clock::time_point start = clock::now();
+    vector<thread> workers;
+    for (unsigned j = 0; j < options.jobs; j++) {
+        workers.push_back(thread([&options, &source, &report]{
+            vector<string> programs;
+            unsigned long first;
+            while (source.next(programs, first)) {
+                try {
+                    if (options.paths.size() == 1) {
+                        check_single(options, report, programs, first);
+                    }
+                    else {
+                        check_dual(options, report, programs, first);
+                    }
+                }
+                catch (runtime_error exn) {
+                    report.failure(string("running chunk at program ") + to_string(first) + ": " + exn.what());
+                }
+                report.programs += programs.size();
+            }
+        }));
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration_cast<chrono::duration<double> >(clock::now() - start).count();
+    cout << report.programs << " programs, " << report.checks << " checks in " << seconds << " s ("
+         << (unsigned long)(report.programs / (seconds > 0 ? seconds : 1)) << " programs/s), "
+         << report.mismatches << " mismatches\n";
+    return report.mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,569 @@
+/**
+ * \file typecheck.cpp
+ * \brief Implementation of type inference.
+ *
+ * Types are nodes of a union-find forest kept in one vector and unified in place,
+ * without an occurs check, so a variable can stand for a type that contains it. A
+ * node is `tainted` when a dynamic value may flow into it. Unifying merges taint, and
+ * a tainted function taints its argument and result, so a proof only rests on nodes
+ * no dynamic value reaches. Each variable records the _let depth it was made at.
+ * Once the right-hand side of a _let is done, the variables deeper than the _let are
+ * generalized, as in the level-based formulation of Hindley-Milner.
+ */
+
+#include "typecheck.hpp"
+#include <climits>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+typedef enum {
+    type_var,
+    type_num,
+    type_bool,
+    type_fun,
+    type_dynamic
+} type_kind_t;
+
+class TypeNode {
+public:
+    type_kind_t kind;
+    int link;        // the node this one was unified into, or -1 for a representative
+    int arg;         // of a type_fun
+    int result;
+    int level;       // the _let depth a variable was made at
+    bool tainted;    // a dynamic value may flow here
+    unsigned walk;   // the last walk that reached the node
+
+    TypeNode(type_kind_t kind, int arg, int result, int level)
+        : kind(kind), link(-1), arg(arg), result(result), level(level), tainted(kind == type_dynamic), walk(0) {}
+};
+
+const int never_generic = INT_MAX;
+
+/**
+ * \brief A variable in scope. The variables of its type deeper than `generic_level`
+ * are generalized; it is never_generic for the argument of a _fun.
+ */
+class TypeBinding {
+public:
+    string name;
+    int type;
+    int generic_level;
+
+    TypeBinding(const string &name, int type, int generic_level) : name(name), type(type), generic_level(generic_level) {}
+};
+
+/**
+ * \brief A rebuilt + or * and the types of its operands, or an _if and the type of
+ * its condition, decided once every constraint is in.
+ */
+class TypedNode {
+public:
+    Expr *node;
+    int lhs;
+    int rhs;
+
+    TypedNode(Expr *node, int lhs, int rhs) : node(node), lhs(lhs), rhs(rhs) {}
+};
+
+class TypeInference {
+public:
+    vector<TypeNode> nodes;
+    vector<TypeBinding> scope;
+    vector<TypedNode> typed;
+    int level;
+
+    TypeInference() : level(0), walks(0), trailing(false), clash_found(-1), clash_expected(-1) {}
+
+    void bind_dynamic(const string &name);
+    PTR(Expr) infer(PTR(Expr) e, int &type);
+    void mark_typed();
+    void print(int t, ostream &out, unordered_map<int, string> &names, vector<int> &path);
+
+private:
+    unsigned walks;
+    bool trailing;                          // while joining the branches of an _if
+    vector<pair<int, TypeNode> > trail;     // nodes as they were before the join changed them
+    int clash_found;                        // the two nodes the last failed unify() met
+    int clash_expected;
+
+    int make(type_kind_t kind, int arg = -1, int result = -1);
+    TypeNode &edit(int t);
+    int find(int t);
+    void taint(int t);
+    void lower_levels(int t, int level, unsigned walk);
+    bool unify(int found, int expected);
+    bool join(int then_type, int else_type);
+    void require(int found, int expected, const char *prefix, Expr *at);
+    int instantiate(const TypeBinding &binding);
+    int copy(int t, int generic_level, unordered_map<int, int> &copies);
+    bool proven(int t, type_kind_t kind);
+    string describe(int t);
+    template <class T> PTR(Expr) numeric_chain(const vector<PTR(Expr)> &operands, const vector<int> &types, const vector<Expr *> &at, int &type);
+    template <class T> PTR(Expr) infer_chain(T *first, int &type);
+    template <class T> PTR(Expr) infer_nary(NaryExpr *e, int &type);
+    PTR(Expr) infer_eq(EqExpr *first, int &type);
+};
+
+int TypeInference::make(type_kind_t kind, int arg, int result){
+    nodes.push_back(TypeNode(kind, arg, result, level));
+    return (int)nodes.size() - 1;
+}
+
+/**
+ * \brief Binds a name, around everything inferred after, to a value of unknown type.
+ */
+void TypeInference::bind_dynamic(const string &name){
+    scope.push_back(TypeBinding(name, make(type_dynamic), never_generic));
+}
+
+/**
+ * \brief A node about to change, saved first while joining so the join can be undone.
+ */
+TypeNode &TypeInference::edit(int t){
+    if (trailing) {
+        trail.push_back(make_pair(t, nodes[t]));
+    }
+    return nodes[t];
+}
+
+int TypeInference::find(int t){
+    int root = t;
+    while (nodes[root].link >= 0) {
+        root = nodes[root].link;
+    }
+    while (nodes[t].link >= 0 && nodes[t].link != root) {
+        int next = nodes[t].link;
+        edit(t).link = root;
+        t = next;
+    }
+    return root;
+}
+
+void TypeInference::taint(int t){
+    t = find(t);
+    if (nodes[t].tainted) {
+        return;
+    }
+    edit(t).tainted = true;
+    if (nodes[t].kind == type_fun) {
+        taint(nodes[t].arg);
+        taint(nodes[t].result);
+    }
+}
+
+/**
+ * \brief Lowers the variables of `t` to `level`: a type reachable from an outer
+ * binding is not generalized by an inner _let.
+ */
+void TypeInference::lower_levels(int t, int level, unsigned walk){
+    t = find(t);
+    if (nodes[t].walk == walk) {
+        return;
+    }
+    nodes[t].walk = walk;
+    if (nodes[t].level > level) {
+        edit(t).level = level;
+    }
+    if (nodes[t].kind == type_fun) {
+        lower_levels(nodes[t].arg, level, walk);
+        lower_levels(nodes[t].result, level, walk);
+    }
+}
+
+/**
+ * \brief Unifies the type a node has with the one it is used at.
+ * \return False when they cannot be unified; clash_found and clash_expected are then
+ * the parts that differ.
+ */
+bool TypeInference::unify(int found, int expected){
+    int a = find(found);
+    int b = find(expected);
+    if (a == b) {
+        return true;
+    }
+    if (nodes[a].kind == type_var || nodes[b].kind == type_var) {
+        int var = nodes[a].kind == type_var ? a : b;
+        int other = var == a ? b : a;
+        lower_levels(other, nodes[var].level, ++walks);
+        edit(var).link = other;
+        if (nodes[var].tainted) {
+            taint(other);
+        }
+        return true;
+    }
+    if (nodes[a].kind == type_dynamic || nodes[b].kind == type_dynamic) {
+        taint(a);
+        taint(b);
+        return true;
+    }
+    if (nodes[a].kind != nodes[b].kind) {
+        clash_found = a;
+        clash_expected = b;
+        return false;
+    }
+    bool tainted = nodes[a].tainted || nodes[b].tainted;
+    // linked before the parts are unified, so a recursive type unifies in finite time
+    edit(a).link = b;
+    if (nodes[b].kind == type_fun) {
+        if (!unify(nodes[a].arg, nodes[b].arg) || !unify(nodes[a].result, nodes[b].result)) {
+            return false;
+        }
+    }
+    if (tainted) {
+        taint(b);
+    }
+    return true;
+}
+
+/**
+ * \brief Unifies the types of the two branches of an _if. When they differ the
+ * attempt is undone and both are tainted, since the value can be either.
+ */
+bool TypeInference::join(int then_type, int else_type){
+    trailing = true;
+    bool joined = unify(else_type, then_type);
+    trailing = false;
+    if (!joined) {
+        for (size_t i = trail.size(); i-- > 0;) {
+            nodes[trail[i].first] = trail[i].second;
+        }
+        taint(then_type);
+        taint(else_type);
+    }
+    trail.clear();
+    return joined;
+}
+
+string TypeInference::describe(int t){
+    switch (nodes[find(t)].kind) {
+        case type_num:
+            return "number";
+        case type_bool:
+            return "boolean";
+        default:
+            return "function";
+    }
+}
+
+/**
+ * \throws type_error naming the node `at`, after `prefix`, when the types differ.
+ */
+void TypeInference::require(int found, int expected, const char *prefix, Expr *at){
+    if (!unify(found, expected)) {
+        throw type_error("type error: " + describe(clash_found) + " used as " + describe(clash_expected)
+                         + " in " + prefix + at->to_string());
+    }
+}
+
+/**
+ * \brief The type of a variable at one of its uses: a fresh copy of the generalized
+ * variables of a _let, and the type itself otherwise.
+ */
+int TypeInference::instantiate(const TypeBinding &binding){
+    if (binding.generic_level == never_generic) {
+        return binding.type;
+    }
+    unordered_map<int, int> copies;
+    return copy(binding.type, binding.generic_level, copies);
+}
+
+/**
+ * \brief Copies the functions of `t` and the variables deeper than `generic_level`,
+ * sharing everything else. A tainted variable is shared too, so what flows into a use
+ * reaches the binding.
+ */
+int TypeInference::copy(int t, int generic_level, unordered_map<int, int> &copies){
+    t = find(t);
+    if (nodes[t].kind == type_var && (nodes[t].level <= generic_level || nodes[t].tainted)) {
+        return t;
+    }
+    if (nodes[t].kind != type_var && nodes[t].kind != type_fun) {
+        return t;
+    }
+    unordered_map<int, int>::iterator found = copies.find(t);
+    if (found != copies.end()) {
+        return found->second;
+    }
+    if (nodes[t].kind == type_var) {
+        int fresh = make(type_var);
+        copies[t] = fresh;
+        return fresh;
+    }
+    int fun = make(type_fun);
+    copies[t] = fun;
+    int arg = copy(nodes[t].arg, generic_level, copies);
+    int result = copy(nodes[t].result, generic_level, copies);
+    nodes[fun].arg = arg;
+    nodes[fun].result = result;
+    nodes[fun].tainted = nodes[t].tainted;
+    return fun;
+}
+
+bool TypeInference::proven(int t, type_kind_t kind){
+    t = find(t);
+    return nodes[t].kind == kind && !nodes[t].tainted;
+}
+
+/**
+ * \brief Requires each operand to be a number and builds operands[0] op (operands[1]
+ * op ...) as a chain of T. `at` names the node to blame for each operand.
+ */
+template <class T> PTR(Expr) TypeInference::numeric_chain(const vector<PTR(Expr)> &operands, const vector<int> &types, const vector<Expr *> &at, int &type){
+    for (size_t i = 0; i < operands.size(); i++) {
+        require(types[i], make(type_num), "", at[i]);
+    }
+    PTR(Expr) result = operands.back();
+    int rhs_type = types.back();
+    for (size_t i = operands.size() - 1; i-- > 0;) {
+        PTR(Expr) node = located(NEW(T)(operands[i], result), at[i]->position);
+        typed.push_back(TypedNode(&*node, types[i], rhs_type));
+        result = node;
+        rhs_type = make(type_num);
+    }
+    type = rhs_type;
+    return result;
+}
+
+template <class T> PTR(Expr) TypeInference::infer_chain(T *first, int &type){
+    vector<T *> chain = rhs_chain(first);
+    vector<PTR(Expr)> operands;
+    vector<int> types(chain.size() + 1);
+    vector<Expr *> at;
+    for (size_t i = 0; i < chain.size(); i++) {
+        operands.push_back(infer(chain[i]->lhs, types[i]));
+        at.push_back(chain[i]);
+    }
+    operands.push_back(infer(chain.back()->rhs, types.back()));
+    at.push_back(chain.back());
+    return numeric_chain<T>(operands, types, at, type);
+}
+
+/**
+ * \brief A SumExpr or ProductExpr, as the chain of T it was resolved from.
+ */
+template <class T> PTR(Expr) TypeInference::infer_nary(NaryExpr *e, int &type){
+    vector<PTR(Expr)> operands;
+    vector<int> types(e->operands.size());
+    for (size_t i = 0; i < e->operands.size(); i++) {
+        operands.push_back(infer(e->operands[i], types[i]));
+    }
+    return numeric_chain<T>(operands, types, vector<Expr *>(operands.size(), e), type);
+}
+
+/**
+ * \brief A chain of ==, from its last operand back like EqExpr::step(). The operands
+ * can have any types.
+ */
+PTR(Expr) TypeInference::infer_eq(EqExpr *first, int &type){
+    vector<EqExpr *> chain = rhs_chain(first);
+    int operand_type;
+    PTR(Expr) result = infer(chain.back()->rhs, operand_type);
+    for (size_t i = chain.size(); i-- > 0;) {
+        PTR(Expr) lhs = infer(chain[i]->lhs, operand_type);
+        result = located(NEW(EqExpr)(lhs, result), chain[i]->position);
+    }
+    type = make(type_bool);
+    return result;
+}
+
+/**
+ * \brief Infers the type of `e` in the current scope.
+ * \return The unresolved copy of `e`, whose typed nodes are marked later by mark_typed().
+ * \throws type_error when `e` is not well typed.
+ */
+PTR(Expr) TypeInference::infer(PTR(Expr) e, int &type){
+    switch (base_kind(e->kind)) {
+        case expr_num:
+            type = make(type_num);
+            return e;
+        case expr_bool:
+            type = make(type_bool);
+            return e;
+        case expr_var: {
+            const string &name = static_cast<VarExpr *>(&*e)->val;
+            type = -1;
+            for (size_t i = scope.size(); i-- > 0;) {
+                if (scope[i].name == name) {
+                    type = instantiate(scope[i]);
+                    break;
+                }
+            }
+            if (type < 0) {
+                // free: reading it fails, so it can stand for anything
+                type = make(type_var);
+            }
+            return e->kind == expr_var ? e : located(NEW(VarExpr)(name), e->position);
+        }
+        case expr_add:
+            if (e->kind == expr_sum) {
+                return infer_nary<AddExpr>(static_cast<NaryExpr *>(&*e), type);
+            }
+            return infer_chain(static_cast<AddExpr *>(&*e), type);
+        case expr_mult:
+            if (e->kind == expr_product) {
+                return infer_nary<MultExpr>(static_cast<NaryExpr *>(&*e), type);
+            }
+            return infer_chain(static_cast<MultExpr *>(&*e), type);
+        case expr_eq:
+            return infer_eq(static_cast<EqExpr *>(&*e), type);
+        case expr_let: {
+            LetExpr *let = static_cast<LetExpr *>(&*e);
+            int rhs_type;
+            level++;
+            PTR(Expr) rhs = infer(let->rhs, rhs_type);
+            level--;
+            scope.push_back(TypeBinding(let->lhs, rhs_type, level));
+            PTR(Expr) body = infer(let->body, type);
+            scope.pop_back();
+            return located(NEW(LetExpr)(let->lhs, rhs, body), e->position);
+        }
+        case expr_if: {
+            IfExpr *if_expr = static_cast<IfExpr *>(&*e);
+            int condition_type, then_type, else_type;
+            // the condition is not required to be a boolean, since one that is not
+            // picks the else branch when run; the _if is typed only if it is proven one
+            PTR(Expr) condition = infer(if_expr->if_, condition_type);
+            PTR(Expr) then_ = infer(if_expr->then_, then_type);
+            PTR(Expr) else_ = infer(if_expr->else_, else_type);
+            type = join(then_type, else_type) ? then_type : make(type_dynamic);
+            PTR(IfExpr) copy = NEW(IfExpr)(condition, then_, else_);
+            typed.push_back(TypedNode(&*copy, condition_type, -1));
+            return located(copy, e->position);
+        }
+        case expr_fun: {
+            FunExpr *fun = static_cast<FunExpr *>(&*e);
+            int arg_type = make(type_var);
+            int body_type;
+            scope.push_back(TypeBinding(fun->formal_arg, arg_type, never_generic));
+            PTR(Expr) body = infer(fun->body, body_type);
+            scope.pop_back();
+            type = make(type_fun, arg_type, body_type);
+            PTR(FunExpr) copy = NEW(FunExpr)(fun->formal_arg, body);
+            copy->arg_used = fun->arg_used;
+            return located(copy, e->position);
+        }
+        case expr_call: {
+            CallExpr *call = static_cast<CallExpr *>(&*e);
+            int callee_type, arg_type;
+            PTR(Expr) callee = infer(call->to_be_called, callee_type);
+            PTR(Expr) arg = infer(call->actual_arg, arg_type);
+            type = make(type_var);
+            int kind = nodes[find(callee_type)].kind;
+            if (kind == type_num || kind == type_bool) {
+                throw type_error("type error: " + describe(callee_type) + " used as function in " + e->to_string());
+            }
+            require(make(type_fun, arg_type, type), callee_type, "", &*e);
+            return located(NEW(CallExpr)(callee, arg), e->position);
+        }
+        case expr_scope:
+            return infer(static_cast<ScopeExpr *>(&*e)->body, type);
+        default:
+            throw runtime_error("cannot typecheck expression: " + e->to_string());
+    }
+}
+
+/**
+ * \brief Marks the + and * whose operands are untainted numbers and the _if whose
+ * condition is an untainted boolean.
+ */
+void TypeInference::mark_typed(){
+    for (TypedNode &pending : typed) {
+        switch (pending.node->kind) {
+            case expr_add:
+                static_cast<AddExpr *>(pending.node)->typed = proven(pending.lhs, type_num) && proven(pending.rhs, type_num);
+                break;
+            case expr_mult:
+                static_cast<MultExpr *>(pending.node)->typed = proven(pending.lhs, type_num) && proven(pending.rhs, type_num);
+                break;
+            default:
+                static_cast<IfExpr *>(pending.node)->typed = proven(pending.lhs, type_bool);
+                break;
+        }
+    }
+}
+
+/**
+ * \brief Prints a type as number, boolean, (a -> b) or ? for a dynamic value. Type
+ * variables are lettered in order, and a function inside itself prints as ...
+ */
+void TypeInference::print(int t, ostream &out, unordered_map<int, string> &names, vector<int> &path){
+    t = find(t);
+    switch (nodes[t].kind) {
+        case type_num:
+            out << "number";
+            return;
+        case type_bool:
+            out << "boolean";
+            return;
+        case type_dynamic:
+            out << "?";
+            return;
+        case type_var: {
+            unordered_map<int, string>::iterator found = names.find(t);
+            if (found == names.end()) {
+                size_t n = names.size();
+                found = names.insert(make_pair(t, n < 26 ? string(1, (char)('a' + n)) : "t" + std::to_string(n))).first;
+            }
+            out << found->second;
+            return;
+        }
+        case type_fun:
+            for (int outer : path) {
+                if (outer == t) {
+                    out << "...";
+                    return;
+                }
+            }
+            path.push_back(t);
+            out << "(";
+            print(nodes[t].arg, out, names, path);
+            out << " -> ";
+            print(nodes[t].result, out, names, path);
+            out << ")";
+            path.pop_back();
+            return;
+    }
+}
+
+}
+
+/**
+ * \brief Checks the types of a program and proves what it can of them.
+ * \param e A parsed, optimized or resolved program.
+ * \param inputs Free variables that will hold values of any type when the program
+ * runs, like the inputs of a Script, rather than fail when read. Nothing that uses
+ * them is proven.
+ * \return An unresolved copy in which the +, * and _if nodes with proven operands are
+ * marked typed; resolve() it to run it in frames.
+ * \throws type_error when the program is not well typed.
+ */
+PTR(Expr) typecheck(PTR(Expr) e, const vector<string> &inputs){
+    TypeInference inference;
+    for (const string &name : inputs) {
+        inference.bind_dynamic(name);
+    }
+    int type;
+    PTR(Expr) checked = inference.infer(e, type);
+    inference.mark_typed();
+    return checked;
+}
+
+/**
+ * \brief The type of a program, such as "number" or "(number -> number)".
+ * \throws type_error when the program is not well typed.
+ */
+string type_of(PTR(Expr) e){
+    TypeInference inference;
+    int type;
+    inference.infer(e, type);
+    ostringstream out;
+    unordered_map<int, string> names;
+    vector<int> path;
+    inference.print(type, out, names, path);
+    return out.str();
+}
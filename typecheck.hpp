@@ -0,0 +1,48 @@
+/**
+ * \file typecheck.hpp
+ * \brief Static type inference (--typecheck): proves the operands of +, * and _if so
+ * the evaluators can skip checking them, and reports type errors before a program runs.
+ *
+ * Types are numbers, booleans and functions from one type to another, inferred in the
+ * Hindley-Milner way. The argument of each _fun starts as a type variable that its
+ * uses constrain, and the type of a _let variable is generalized, so a function bound
+ * by _let can be used at several types. Types may be recursive, so the
+ * self-application that stands in for recursion, fib(fib), has a type like any other
+ * call.
+ *
+ * A program is rejected with a type_error when a value is used at a type it does not
+ * have: added or multiplied when it is not a number, or called when it is not a
+ * function. That happens before the program runs, even when the failing node would
+ * only run late or not at all. _if does not require its condition to be a boolean,
+ * since one that is not picks the else branch when run, so an _if is typed only when
+ * its condition is proven a boolean by the rest of the program, such as by ==. The two branches of an _if
+ * may still have different types. The value of such an _if is dynamic, and nothing it
+ * flows into is proven, so the nodes it reaches keep their checks. == compares values of
+ * any two types, as it does when run, and a free variable can have any type, since
+ * reading it fails.
+ *
+ * typecheck() returns an unresolved copy of the program in which the AddExpr, MultExpr
+ * and IfExpr nodes with proven operands are marked `typed`. resolve(), the VM and the
+ * closure compiler keep the marks, and those nodes run without checking their operands.
+ */
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Expr.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+/**
+ * \brief The error of a program that is not well typed.
+ */
+class type_error : public runtime_error {
+public:
+    type_error(const string &what) : runtime_error(what) {}
+};
+
+PTR(Expr) typecheck(PTR(Expr) e, const vector<string> &inputs = vector<string>());
+
+string type_of(PTR(Expr) e);
@@ -0,0 +1,60 @@
+/**
+ * \file value.hpp
+ * \brief Tagged value representation used by the interpreter.
+ *
+ * Numbers and booleans are stored inline as immediates, so arithmetic and comparisons
+ * never allocate. Only functions are boxed as a Val. Conversions to and from PTR(Val)
+ * keep the Val classes usable as the public result type of Expr::interp().
+ */
+#pragma once
+
+#include <string>
+#include <ostream>
+#include "pointer.h"
+
+using namespace std;
+class Val;
+
+class Value {
+public:
+    typedef enum {
+        num_tag,
+        bool_tag,
+        boxed_tag
+    } tag_t;
+
+    tag_t tag;
+    int num;          // the number, or 0/1 for a boolean
+    PTR(Val) boxed;   // set only for boxed_tag
+
+    Value();
+    Value(PTR(Val) v);
+    template <class T> Value(PTR(T) v) : Value(static_cast<PTR(Val)>(v)) {}
+
+    static Value number(int n){
+        Value v;
+        v.tag = num_tag;
+        v.num = n;
+        return v;
+    }
+
+    static Value boolean(bool b){
+        Value v;
+        v.tag = bool_tag;
+        v.num = b;
+        return v;
+    }
+
+    bool is_num() const { return tag == num_tag; }
+    bool is_bool() const { return tag == bool_tag; }
+
+    PTR(Val) to_val() const;
+    bool equals(const Value &other) const;
+    size_t hash() const;
+    Value add_to(const Value &other) const;
+    Value mult_with(const Value &other) const;
+    bool is_true() const;
+    Value call(const Value &actual_arg) const;
+    void print(ostream &ostream) const;
+    string to_string() const;
+};
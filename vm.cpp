@@ -0,0 +1,459 @@
+/**
+ * \file vm.cpp
+ * \brief Implementation of the bytecode compiler and stack virtual machine.
+ *
+ * Each function body gets its own frame of local slots on a shared value stack: slot 0
+ * holds the argument and every _let in the body gets a fresh slot. Variables bound
+ * outside the function are copied into the closure when it is created.
+ */
+
+#include "vm.hpp"
+#include "governor.hpp"
+
+Instr::Instr(opcode_t op, int arg){
+    this->op = op;
+    this->arg = arg;
+}
+
+VmCapture::VmCapture(bool from_local, int index){
+    this->from_local = from_local;
+    this->index = index;
+}
+
+VmFunction::VmFunction(string formal_arg, PTR(Expr) body){
+    this->formal_arg = formal_arg;
+    this->body = body;
+    this->frame_size = 0;
+}
+
+//======================  Compiler  ======================//
+
+/**
+ * \brief Compile-time view of one function being compiled: which names live in which
+ * slots and which names have been captured from enclosing functions.
+ */
+class VmScope {
+public:
+    PTR(VmFunction) function;
+    VmScope *parent;
+    vector<pair<string, int> > locals;
+    vector<string> capture_names;
+
+    VmScope(PTR(VmFunction) function, VmScope *parent){
+        this->function = function;
+        this->parent = parent;
+    }
+
+    int new_slot(){
+        return function->frame_size++;
+    }
+
+    void emit(opcode_t op, int arg = 0){
+        function->code.push_back(Instr(op, arg));
+    }
+
+    void emit_const(Value v){
+        function->constants.push_back(v);
+        emit(op_const, (int)function->constants.size() - 1);
+    }
+};
+
+/**
+ * \brief Finds `name` as a local or capture of `scope`, capturing it from enclosing
+ * scopes when needed.
+ * \return False if the name is not bound by any enclosing scope.
+ */
+static bool resolve_name(VmScope *scope, const string &name, bool &from_local, int &index){
+    for (int i = (int)scope->locals.size() - 1; i >= 0; i--) {
+        if (scope->locals[i].first == name) {
+            from_local = true;
+            index = scope->locals[i].second;
+            return true;
+        }
+    }
+    for (size_t i = 0; i < scope->capture_names.size(); i++) {
+        if (scope->capture_names[i] == name) {
+            from_local = false;
+            index = (int)i;
+            return true;
+        }
+    }
+    bool outer_local;
+    int outer_index;
+    if (scope->parent != nullptr && resolve_name(scope->parent, name, outer_local, outer_index)) {
+        scope->function->captures.push_back(VmCapture(outer_local, outer_index));
+        scope->capture_names.push_back(name);
+        from_local = false;
+        index = (int)scope->capture_names.size() - 1;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * \brief Emits code that leaves the value of `e` on the stack.
+ * \param tail True when `e` is in tail position, so a call can reuse the current frame.
+ */
+static void compile_expr(VmScope *scope, PTR(Expr) e, bool tail){
+    if (PTR(NumExpr) num = CAST(NumExpr)(e)) {
+        scope->emit_const(Value::number(num->val));
+    }
+    else if (PTR(BoolExpr) b = CAST(BoolExpr)(e)) {
+        scope->emit_const(Value::boolean(b->val));
+    }
+    else if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+        bool from_local;
+        int index;
+        if (resolve_name(scope, var->val, from_local, index)) {
+            scope->emit(from_local ? op_local : op_capture, index);
+        }
+        else {
+            scope->function->names.push_back(var->val);
+            scope->emit(op_free, (int)scope->function->names.size() - 1);
+        }
+    }
+    else if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        // a chain a + (b + c) pushes a, b, c and then adds twice, b + c first
+        vector<AddExpr *> chain = rhs_chain(&*add);
+        for (AddExpr *node : chain) {
+            compile_expr(scope, node->lhs, false);
+        }
+        compile_expr(scope, chain.back()->rhs, false);
+        for (size_t i = chain.size(); i-- > 0;) {
+            scope->emit(chain[i]->typed ? op_add_num : op_add);
+        }
+    }
+    else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        vector<MultExpr *> chain = rhs_chain(&*mult);
+        for (MultExpr *node : chain) {
+            compile_expr(scope, node->lhs, false);
+        }
+        compile_expr(scope, chain.back()->rhs, false);
+        for (size_t i = chain.size(); i-- > 0;) {
+            scope->emit(chain[i]->typed ? op_mult_num : op_mult);
+        }
+    }
+    else if (PTR(EqExpr) eq = CAST(EqExpr)(e)) {
+        // EqExpr::interp evaluates rhs before lhs, so a chain runs from its last operand
+        vector<EqExpr *> chain = rhs_chain(&*eq);
+        compile_expr(scope, chain.back()->rhs, false);
+        for (size_t i = chain.size(); i-- > 0;) {
+            compile_expr(scope, chain[i]->lhs, false);
+            scope->emit(op_eq);
+        }
+    }
+    else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        // a _let whose body is a _let, and so on, is compiled in a loop, so the depth of
+        // the native stack does not grow with the number of nested bindings
+        size_t bound = scope->locals.size();
+        PTR(Expr) body = e;
+        while (PTR(LetExpr) inner = CAST(LetExpr)(body)) {
+            compile_expr(scope, inner->rhs, false);
+            int slot = scope->new_slot();
+            scope->emit(op_store, slot);
+            scope->locals.push_back(make_pair(inner->lhs, slot));
+            body = inner->body;
+        }
+        compile_expr(scope, body, tail);
+        scope->locals.resize(bound);
+    }
+    else if (PTR(IfExpr) ifExpr = CAST(IfExpr)(e)) {
+        compile_expr(scope, ifExpr->if_, false);
+        size_t jump_else = scope->function->code.size();
+        scope->emit(ifExpr->typed ? op_jump_false : op_jump_unless);
+        compile_expr(scope, ifExpr->then_, tail);
+        size_t jump_end = scope->function->code.size();
+        scope->emit(op_jump);
+        scope->function->code[jump_else].arg = (int)scope->function->code.size();
+        compile_expr(scope, ifExpr->else_, tail);
+        scope->function->code[jump_end].arg = (int)scope->function->code.size();
+    }
+    else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+        PTR(VmFunction) function = NEW(VmFunction)(fun->formal_arg, fun->body);
+        VmScope inner(function, scope);
+        inner.locals.push_back(make_pair(fun->formal_arg, inner.new_slot()));
+        compile_expr(&inner, fun->body, true);
+        inner.emit(op_return);
+        scope->function->functions.push_back(function);
+        scope->emit(op_closure, (int)scope->function->functions.size() - 1);
+    }
+    else if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        compile_expr(scope, call->to_be_called, false);
+        compile_expr(scope, call->actual_arg, false);
+        scope->emit(tail ? op_tail_call : op_call);
+    }
+    else if (PTR(ScopeExpr) resolved = CAST(ScopeExpr)(e)) {
+        // a resolved program, e.g. from --load; its slot forms compile by name
+        compile_expr(scope, resolved->body, tail);
+    }
+    else if (PTR(NaryExpr) nary = CAST(NaryExpr)(e)) {
+        for (PTR(Expr) &operand : nary->operands) {
+            compile_expr(scope, operand, false);
+        }
+        for (size_t i = 1; i < nary->operands.size(); i++) {
+            scope->emit(e->kind == expr_sum ? op_add : op_mult);
+        }
+    }
+    else {
+        throw runtime_error("vm cannot compile expression");
+    }
+}
+
+/**
+ * \brief Compiles a whole program into bytecode.
+ * \param e The parsed expression.
+ * \return The top-level function; run it with vm_run().
+ */
+PTR(VmFunction) vm_compile(PTR(Expr) e){
+    PTR(VmFunction) program = NEW(VmFunction)("", e);
+    VmScope scope(program, nullptr);
+    compile_expr(&scope, e, true);
+    scope.emit(op_return);
+    return program;
+}
+
+//======================  Machine  ======================//
+
+class VmFrame {
+public:
+    PTR(VmFunction) function;
+    PTR(ClosureVal) closure;
+    size_t pc;
+    size_t base;
+
+    VmFrame(PTR(VmFunction) function, PTR(ClosureVal) closure, size_t base){
+        this->function = function;
+        this->closure = closure;
+        this->pc = 0;
+        this->base = base;
+    }
+};
+
+// from the frame pool, like the frames of the tree walker
+typedef vector<Value, FrameAllocator<Value> > VmStack;
+
+static Value pop(VmStack &stack){
+    Value v = stack.back();
+    stack.pop_back();
+    return v;
+}
+
+/**
+ * \brief Runs compiled code until the entry function returns.
+ * \param entry The function to run.
+ * \param closure The closure being called, or nullptr for the top-level program.
+ * \param arg The argument placed in slot 0 when calling a closure.
+ */
+static Value vm_execute(PTR(VmFunction) entry, PTR(ClosureVal) closure, const Value &arg){
+    VmStack stack;
+    vector<VmFrame, FrameAllocator<VmFrame> > frames;
+
+    frames.push_back(VmFrame(entry, closure, 0));
+    stack.resize(entry->frame_size);
+    if (closure != nullptr) {
+        stack[0] = arg;
+    }
+
+    while (true) {
+        VmFrame &frame = frames.back();
+        const Instr &in = frame.function->code[frame.pc++];
+
+        switch (in.op) {
+            case op_const:
+                stack.push_back(frame.function->constants[in.arg]);
+                break;
+            case op_local:
+                stack.push_back(stack[frame.base + in.arg]);
+                break;
+            case op_capture:
+                stack.push_back(frame.closure->captures[in.arg]);
+                break;
+            case op_free:
+                throw runtime_error("free variable: " + frame.function->names[in.arg]);
+            case op_store:
+                stack[frame.base + in.arg] = pop(stack);
+                break;
+            case op_add: {
+                Value rhs = pop(stack);
+                Value &lhs = stack.back();
+                if (lhs.is_num() && rhs.is_num()) {
+                    lhs.num = (unsigned)lhs.num + (unsigned)rhs.num;
+                }
+                else {
+                    lhs = lhs.add_to(rhs);
+                }
+                break;
+            }
+            case op_mult: {
+                Value rhs = pop(stack);
+                Value &lhs = stack.back();
+                if (lhs.is_num() && rhs.is_num()) {
+                    lhs.num = (unsigned)lhs.num * (unsigned)rhs.num;
+                }
+                else {
+                    lhs = lhs.mult_with(rhs);
+                }
+                break;
+            }
+            case op_add_num: {
+                int rhs = stack.back().num;
+                stack.pop_back();
+                stack.back().num = (unsigned)stack.back().num + (unsigned)rhs;
+                break;
+            }
+            case op_mult_num: {
+                int rhs = stack.back().num;
+                stack.pop_back();
+                stack.back().num = (unsigned)stack.back().num * (unsigned)rhs;
+                break;
+            }
+            case op_eq: {
+                Value lhs = pop(stack);
+                Value rhs = pop(stack);
+                stack.push_back(Value::boolean(rhs.equals(lhs)));
+                break;
+            }
+            case op_jump:
+                frame.pc = in.arg;
+                break;
+            case op_jump_unless: {
+                Value cond = pop(stack);
+                if (!cond.is_bool() || !cond.num) {
+                    frame.pc = in.arg;
+                }
+                break;
+            }
+            case op_jump_false: {
+                bool cond = stack.back().num;
+                stack.pop_back();
+                if (!cond) {
+                    frame.pc = in.arg;
+                }
+                break;
+            }
+            case op_closure: {
+                PTR(VmFunction) function = frame.function->functions[in.arg];
+                PTR(ClosureVal) c = NEW(ClosureVal)(function);
+                for (const VmCapture &capture : function->captures) {
+                    c->captures.push_back(capture.from_local
+                                          ? stack[frame.base + capture.index]
+                                          : frame.closure->captures[capture.index]);
+                }
+                stack.push_back(Value(c));
+                break;
+            }
+            case op_call:
+            case op_tail_call: {
+                governor_tick();
+                Value actual_arg = pop(stack);
+                Value callee = pop(stack);
+                PTR(ClosureVal) c = callee.tag == Value::boxed_tag && callee.boxed->kind == val_closure
+                                    ? STATIC_CAST(ClosureVal)(callee.boxed) : nullptr;
+                if (c == nullptr) {
+                    // values from outside the VM, or a type error
+                    stack.push_back(callee.call(actual_arg));
+                    if (in.op == op_tail_call) {
+                        frame.pc = frame.function->code.size() - 1;
+                    }
+                    break;
+                }
+                size_t base;
+                if (in.op == op_tail_call) {
+                    base = frame.base;
+                    frames.pop_back();
+                }
+                else {
+                    base = stack.size();
+                }
+                stack.resize(base);
+                stack.resize(base + c->function->frame_size);
+                stack[base] = actual_arg;
+                frames.push_back(VmFrame(c->function, c, base));
+                break;
+            }
+            case op_return: {
+                Value result = pop(stack);
+                stack.resize(frame.base);
+                frames.pop_back();
+                if (frames.empty()) {
+                    return result;
+                }
+                stack.push_back(result);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Runs a program produced by vm_compile().
+ * \return The value of the program.
+ */
+PTR(Val) vm_run(PTR(VmFunction) program){
+    return vm_execute(program, nullptr, Value()).to_val();
+}
+
+//======================  ClosureVal  ======================//
+
+ClosureVal::ClosureVal(PTR(VmFunction) function){
+    this->kind = val_closure;
+    this->function = function;
+}
+
+/**
+ * \brief Lets go of the captured values through a DeferredRelease, so a long chain of
+ * closures is freed in a loop.
+ */
+ClosureVal::~ClosureVal(){
+    DeferredRelease release;
+    for (Value &captured : captures) {
+        release.value(captured);
+    }
+}
+
+PTR(Expr) ClosureVal::to_expr(){
+    return NEW(FunExpr)(function->formal_arg, function->body);
+}
+
+bool ClosureVal::equals (PTR(Val) v){
+    if (v == nullptr) {
+        return false;
+    }
+    if (v->kind == val_closure) {
+        ClosureVal *closurePtr = static_cast<ClosureVal *>(&*v);
+        return function->formal_arg == closurePtr->function->formal_arg && function->body->equals(closurePtr->function->body);
+    }
+    return function_equals(this, v);
+}
+
+/**
+ * \brief Hashes like the equal FunVal.
+ */
+size_t ClosureVal::hash(){
+    return hash_mix(hash_mix(9, std::hash<string>()(function->formal_arg)), function->body->hash);
+}
+
+PTR(Val) ClosureVal::add_to(PTR(Val) other_val){
+    throw runtime_error("Function cannot be added");
+}
+
+PTR(Val) ClosureVal::mult_with(PTR(Val) other_val){
+    throw runtime_error("Function cannot be multiplied");
+}
+
+void ClosureVal::print(ostream &ostream){
+    ostream << "_fun (" << function->formal_arg << ") ";
+    function->body->print(ostream);
+}
+
+bool ClosureVal::is_true(){
+    throw runtime_error("function cannot be boolean");
+}
+
+PTR(Val) ClosureVal::call(PTR(Val) actual_arg){
+    return apply(Value(actual_arg)).to_val();
+}
+
+Value ClosureVal::apply(const Value &actual_arg){
+    return vm_execute(function, STATIC_CAST(ClosureVal)(THIS), actual_arg);
+}
@@ -0,0 +1,111 @@
+/**
+ * \file vm.hpp
+ * \brief Bytecode compiler and stack virtual machine for MSDScript.
+ *
+ * An Expr tree is compiled once into flat instruction arrays, one per function body,
+ * and then executed by a stack machine. Variables are resolved at compile time to frame
+ * slots or closure captures, so running the code needs no name lookups and no per-node
+ * virtual dispatch. Closures capture exactly the free variables their body uses.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "env.hpp"
+#include "Expr.hpp"
+#include "Val.hpp"
+#include "pointer.h"
+
+using namespace std;
+
+typedef enum {
+    op_const,        // push constants[arg]
+    op_local,        // push frame slot arg
+    op_capture,      // push closure capture arg
+    op_free,         // unbound variable names[arg]: throws
+    op_store,        // pop into frame slot arg
+    op_add,
+    op_mult,
+    op_add_num,      // op_add of operands typecheck() proved numbers, unchecked
+    op_mult_num,
+    op_eq,
+    op_jump,         // continue at arg
+    op_jump_unless,  // pop; continue at arg unless the value is _true
+    op_jump_false,   // op_jump_unless of a proven boolean, unchecked
+    op_closure,      // push a closure over functions[arg]
+    op_call,
+    op_tail_call,
+    op_return
+} opcode_t;
+
+class Instr {
+public:
+    opcode_t op;
+    int arg;
+
+    Instr(opcode_t op, int arg = 0);
+};
+
+//======================  VmCapture  ======================//
+
+/**
+ * \brief Describes where a closure capture comes from in the frame that creates the closure.
+ */
+class VmCapture {
+public:
+    bool from_local;
+    int index;
+
+    VmCapture(bool from_local, int index);
+};
+
+//======================  VmFunction  ======================//
+
+/**
+ * \brief Compiled code for one function body (or the top-level program).
+ */
+class VmFunction {
+public:
+    string formal_arg;
+    PTR(Expr) body;
+    vector<Instr> code;
+    vector<Value> constants;
+    vector<string> names;
+    vector<VmCapture> captures;
+    vector<PTR(VmFunction)> functions;
+    int frame_size;
+
+    VmFunction(string formal_arg, PTR(Expr) body);
+};
+
+//======================  ClosureVal  ======================//
+
+/**
+ * \brief A function value produced by the VM: compiled code plus captured values.
+ *
+ * Behaves like FunVal for printing and equality, so results look the same whichever
+ * evaluator produced them.
+ */
+class ClosureVal : public Val {
+public:
+    PTR(VmFunction) function;
+    vector<Value, FrameAllocator<Value> > captures;
+
+    ClosureVal(PTR(VmFunction) function);
+    ~ClosureVal();
+
+    virtual PTR(Expr) to_expr();
+    virtual bool equals (PTR(Val) v);
+    virtual size_t hash();
+    virtual PTR(Val) add_to(PTR(Val) other_val);
+    virtual PTR(Val) mult_with(PTR(Val) other_val);
+    virtual void print(ostream &ostream);
+    virtual bool is_true();
+
+    virtual PTR(Val) call(PTR(Val) actual_arg);
+    virtual Value apply(const Value &actual_arg);
+};
+
+PTR(VmFunction) vm_compile(PTR(Expr) e);
+
+PTR(Val) vm_run(PTR(VmFunction) program);